@@ -33,6 +33,18 @@
 
 #include "replace.h"
 #include "aes.h"
+#include "aes_ni.h"
+
+#ifndef HAVE_AESNI_INTRINSICS
+bool samba_aesni_available(void)
+{
+    return false;
+}
+
+void samba_aesni_disable(bool disable)
+{
+}
+#endif /* HAVE_AESNI_INTRINSICS */
 
 #ifdef SAMBA_RIJNDAEL
 #include "rijndael-alg-fst.h"
@@ -40,6 +52,13 @@
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef HAVE_AESNI_INTRINSICS
+    if (bits == 128 && samba_aesni_available()) {
+	samba_aesni_set_encrypt_key_128(userkey, key);
+	return 0;
+    }
+#endif
+    key->aesni = 0;
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -49,6 +68,7 @@ AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 int
 AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+    key->aesni = 0;
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -58,6 +78,12 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AESNI_INTRINSICS
+    if (key->aesni) {
+	samba_aesni_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
@@ -62,6 +62,7 @@
 typedef struct aes_key {
     uint32_t key[(AES_MAXNR+1)*4];
     int rounds;
+    int aesni; /* key[] holds an AES-NI key schedule */
 } AES_KEY;
 
 #ifdef __cplusplus
@@ -0,0 +1,169 @@
+/*
+   Benchmark for the AES based primitives used by SMB2/3
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reports the throughput of the portable and (if the CPU supports it)
+ * the AES-NI/PCLMULQDQ code for each primitive:
+ *
+ *   aes_bench [buffer size in KiB] [total MiB per run]
+ */
+
+#include "replace.h"
+#include "system/time.h"
+#include "lib/util/time.h"
+#include "../lib/crypto/crypto.h"
+#include "../lib/crypto/aes_ni.h"
+
+static const uint8_t bench_key[AES_BLOCK_SIZE] = {
+	0x8B, 0xF9, 0xFB, 0xC2, 0xB8, 0x14, 0x94, 0x84,
+	0xFF, 0x11, 0xAB, 0x1F, 0x3A, 0x54, 0x4F, 0xF6,
+};
+
+static const uint8_t bench_nonce[AES_BLOCK_SIZE] = {
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x77, 0xF7, 0xA8, 0xFF, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void bench_aes_ecb(uint8_t *buf, size_t len)
+{
+	AES_KEY key;
+	size_t i;
+
+	AES_set_encrypt_key(bench_key, 128, &key);
+	for (i = 0; i + AES_BLOCK_SIZE <= len; i += AES_BLOCK_SIZE) {
+		AES_encrypt(buf + i, buf + i, &key);
+	}
+}
+
+static void bench_aes_cmac_128(uint8_t *buf, size_t len)
+{
+	struct aes_cmac_128_context ctx;
+	uint8_t T[AES_BLOCK_SIZE];
+
+	aes_cmac_128_init(&ctx, bench_key);
+	aes_cmac_128_update(&ctx, buf, len);
+	aes_cmac_128_final(&ctx, T);
+}
+
+static void bench_aes_ccm_128(uint8_t *buf, size_t len)
+{
+	struct aes_ccm_128_context ctx;
+	uint8_t T[AES_BLOCK_SIZE];
+
+	aes_ccm_128_init(&ctx, bench_key, bench_nonce, 0, len);
+	aes_ccm_128_update(&ctx, buf, len);
+	aes_ccm_128_crypt(&ctx, buf, len);
+	aes_ccm_128_digest(&ctx, T);
+}
+
+static void bench_aes_gcm_128(uint8_t *buf, size_t len)
+{
+	struct aes_gcm_128_context ctx;
+	uint8_t T[AES_BLOCK_SIZE];
+
+	aes_gcm_128_init(&ctx, bench_key, bench_nonce);
+	aes_gcm_128_crypt(&ctx, buf, len);
+	aes_gcm_128_updateC(&ctx, buf, len);
+	aes_gcm_128_digest(&ctx, T);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(uint8_t *buf, size_t len);
+} benchmarks[] = {
+	{ "aes_ecb", bench_aes_ecb },
+	{ "aes_cmac_128", bench_aes_cmac_128 },
+	{ "aes_ccm_128", bench_aes_ccm_128 },
+	{ "aes_gcm_128", bench_aes_gcm_128 },
+};
+
+static double run_one(void (*fn)(uint8_t *buf, size_t len),
+		      uint8_t *buf, size_t buflen, size_t total)
+{
+	struct timeval start;
+	size_t done = 0;
+	double secs;
+
+	start = timeval_current();
+	while (done < total) {
+		fn(buf, buflen);
+		done += buflen;
+	}
+	secs = timeval_elapsed(&start);
+	if (secs <= 0) {
+		return 0;
+	}
+
+	return (done / secs) / (1000.0 * 1000.0 * 1000.0);
+}
+
+int main(int argc, const char *argv[])
+{
+	size_t buflen = 64 * 1024;
+	size_t total = 256 * 1024 * 1024;
+	bool have_aesni = samba_aesni_available();
+	uint8_t *buf = NULL;
+	size_t i;
+
+	if (argc > 1) {
+		buflen = strtoul(argv[1], NULL, 10) * 1024;
+	}
+	if (argc > 2) {
+		total = strtoul(argv[2], NULL, 10) * 1024 * 1024;
+	}
+	if (buflen == 0 || total == 0) {
+		fprintf(stderr, "Usage: %s [buffer KiB] [total MiB]\n",
+			argv[0]);
+		return 1;
+	}
+
+	buf = malloc(buflen);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc(%zu) failed\n", buflen);
+		return 1;
+	}
+	memset(buf, 0x5a, buflen);
+
+	printf("buffer size %zu KiB, %zu MiB per run, AES-NI %s\n",
+	       buflen / 1024, total / (1024 * 1024),
+	       have_aesni ? "available" : "not available");
+	printf("%-14s %14s %14s\n", "primitive", "portable GB/s",
+	       "AES-NI GB/s");
+
+	for (i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+		double portable;
+		double accel = 0;
+
+		samba_aesni_disable(true);
+		portable = run_one(benchmarks[i].fn, buf, buflen, total);
+		samba_aesni_disable(false);
+
+		if (have_aesni) {
+			accel = run_one(benchmarks[i].fn, buf, buflen, total);
+			printf("%-14s %14.3f %14.3f\n",
+			       benchmarks[i].name, portable, accel);
+		} else {
+			printf("%-14s %14.3f %14s\n",
+			       benchmarks[i].name, portable, "-");
+		}
+	}
+
+	free(buf);
+	return 0;
+}
@@ -20,19 +20,179 @@
 #include "../lib/util/samba_util.h"
 #include "../lib/crypto/crypto.h"
 #include "../lib/crypto/aes_test.h"
+#include "../lib/crypto/aes_ni.h"
 
 #ifndef AES_CCM_128_ONLY_TESTVECTORS
 struct torture_context;
 bool torture_local_crypto_aes_ccm_128(struct torture_context *torture);
 
+static bool aes_ccm_128_check_testvectors(
+	struct torture_context *tctx,
+	const struct aes_mode_testvector *testarray,
+	size_t num_tests)
+{
+	bool ret = true;
+	size_t i;
+
+	for (i=0; i < num_tests; i++) {
+		struct aes_ccm_128_context ctx;
+		uint8_t T[AES_BLOCK_SIZE];
+		DATA_BLOB _T = data_blob_const(T, sizeof(T));
+		DATA_BLOB C;
+		int e;
+
+		C = data_blob_dup_talloc(tctx, testarray[i].P);
+
+		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
+				 testarray[i].A.length, testarray[i].P.length);
+		aes_ccm_128_update(&ctx,
+				   testarray[i].A.data,
+				   testarray[i].A.length);
+		aes_ccm_128_update(&ctx, C.data, C.length);
+		aes_ccm_128_crypt(&ctx, C.data, C.length);
+		aes_ccm_128_digest(&ctx, T);
+
+		e = memcmp(testarray[i].T.data, T, sizeof(T));
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
+			ret = false;
+			goto fail;
+		}
+
+		e = memcmp(testarray[i].C.data, C.data, C.length);
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
+			ret = false;
+			goto fail;
+		}
+	}
+
+	for (i=0; i < num_tests; i++) {
+		struct aes_ccm_128_context ctx;
+		uint8_t T[AES_BLOCK_SIZE];
+		DATA_BLOB _T = data_blob_const(T, sizeof(T));
+		DATA_BLOB C;
+		int e;
+		size_t j;
+
+		C = data_blob_dup_talloc(tctx, testarray[i].P);
+
+		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
+				 testarray[i].A.length, testarray[i].P.length);
+		for (j=0; j < testarray[i].A.length; j++) {
+			aes_ccm_128_update(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, &testarray[i].A.data[j], 1);
+			aes_ccm_128_update(&ctx, NULL, 0);
+		}
+		for (j=0; j < C.length; j++) {
+			aes_ccm_128_crypt(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, &C.data[j], 1);
+			aes_ccm_128_crypt(&ctx, &C.data[j], 1);
+			aes_ccm_128_crypt(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, NULL, 0);
+		}
+		aes_ccm_128_digest(&ctx, T);
+
+		e = memcmp(testarray[i].T.data, T, sizeof(T));
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
+			ret = false;
+			goto fail;
+		}
+
+		e = memcmp(testarray[i].C.data, C.data, C.length);
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
+			ret = false;
+			goto fail;
+		}
+	}
+
+	for (i=0; i < num_tests; i++) {
+		struct aes_ccm_128_context ctx;
+		uint8_t T[AES_BLOCK_SIZE];
+		DATA_BLOB _T = data_blob_const(T, sizeof(T));
+		DATA_BLOB P;
+		int e;
+		size_t j;
+
+		P = data_blob_dup_talloc(tctx, testarray[i].C);
+
+		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
+				 testarray[i].A.length, testarray[i].P.length);
+		for (j=0; j < testarray[i].A.length; j++) {
+			aes_ccm_128_update(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, &testarray[i].A.data[j], 1);
+			aes_ccm_128_update(&ctx, NULL, 0);
+		}
+		for (j=0; j < P.length; j++) {
+			aes_ccm_128_crypt(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, NULL, 0);
+			aes_ccm_128_crypt(&ctx, &P.data[j], 1);
+			aes_ccm_128_update(&ctx, &P.data[j], 1);
+			aes_ccm_128_crypt(&ctx, NULL, 0);
+			aes_ccm_128_update(&ctx, NULL, 0);
+		}
+		aes_ccm_128_digest(&ctx, T);
+
+		e = memcmp(testarray[i].T.data, T, sizeof(T));
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
+			ret = false;
+			goto fail;
+		}
+
+		e = memcmp(testarray[i].P.data, P.data, P.length);
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
+			ret = false;
+			goto fail;
+		}
+	}
+
+	for (i=0; i < num_tests; i++) {
+		struct aes_ccm_128_context ctx;
+		uint8_t T[AES_BLOCK_SIZE];
+		DATA_BLOB _T = data_blob_const(T, sizeof(T));
+		DATA_BLOB P;
+		int e;
+
+		P = data_blob_dup_talloc(tctx, testarray[i].C);
+
+		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
+				 testarray[i].A.length, testarray[i].P.length);
+		aes_ccm_128_update(&ctx, testarray[i].A.data, testarray[i].A.length);
+		aes_ccm_128_crypt(&ctx, P.data, P.length);
+		aes_ccm_128_update(&ctx, P.data, P.length);
+		aes_ccm_128_digest(&ctx, T);
+
+		e = memcmp(testarray[i].T.data, T, sizeof(T));
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
+			ret = false;
+			goto fail;
+		}
+
+		e = memcmp(testarray[i].P.data, P.data, P.length);
+		if (e != 0) {
+			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
+			ret = false;
+			goto fail;
+		}
+	}
+
+ fail:
+	return ret;
+}
+
 /*
  This uses our own test values as we rely on a 11 byte nonce
  and the values from rfc rfc3610 use 13 byte nonce.
 */
 bool torture_local_crypto_aes_ccm_128(struct torture_context *tctx)
 {
-	bool ret = true;
-	uint32_t i;
+	bool ret;
 	struct aes_mode_testvector testarray[] = {
 #endif /* AES_CCM_128_ONLY_TESTVECTORS */
 #define AES_CCM_128_TESTVECTOR(_k, _n, _a, _p, _c, _t) \
@@ -221,155 +381,21 @@ bool torture_local_crypto_aes_ccm_128(struct torture_context *tctx)
 #ifndef AES_CCM_128_ONLY_TESTVECTORS
 	};
 
-	for (i=0; i < ARRAY_SIZE(testarray); i++) {
-		struct aes_ccm_128_context ctx;
-		uint8_t T[AES_BLOCK_SIZE];
-		DATA_BLOB _T = data_blob_const(T, sizeof(T));
-		DATA_BLOB C;
-		int e;
-
-		C = data_blob_dup_talloc(tctx, testarray[i].P);
-
-		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
-				 testarray[i].A.length, testarray[i].P.length);
-		aes_ccm_128_update(&ctx,
-				   testarray[i].A.data,
-				   testarray[i].A.length);
-		aes_ccm_128_update(&ctx, C.data, C.length);
-		aes_ccm_128_crypt(&ctx, C.data, C.length);
-		aes_ccm_128_digest(&ctx, T);
-
-		e = memcmp(testarray[i].T.data, T, sizeof(T));
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
-			ret = false;
-			goto fail;
-		}
-
-		e = memcmp(testarray[i].C.data, C.data, C.length);
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
-			ret = false;
-			goto fail;
-		}
+	/*
+	 * Once with the portable code and once with AES-NI, if the
+	 * CPU has it.
+	 */
+	samba_aesni_disable(true);
+	ret = aes_ccm_128_check_testvectors(tctx,
+					      testarray,
+					      ARRAY_SIZE(testarray));
+	samba_aesni_disable(false);
+	if (ret) {
+		ret = aes_ccm_128_check_testvectors(tctx,
+						      testarray,
+						      ARRAY_SIZE(testarray));
 	}
 
-	for (i=0; i < ARRAY_SIZE(testarray); i++) {
-		struct aes_ccm_128_context ctx;
-		uint8_t T[AES_BLOCK_SIZE];
-		DATA_BLOB _T = data_blob_const(T, sizeof(T));
-		DATA_BLOB C;
-		int e;
-		size_t j;
-
-		C = data_blob_dup_talloc(tctx, testarray[i].P);
-
-		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
-				 testarray[i].A.length, testarray[i].P.length);
-		for (j=0; j < testarray[i].A.length; j++) {
-			aes_ccm_128_update(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, &testarray[i].A.data[j], 1);
-			aes_ccm_128_update(&ctx, NULL, 0);
-		}
-		for (j=0; j < C.length; j++) {
-			aes_ccm_128_crypt(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, &C.data[j], 1);
-			aes_ccm_128_crypt(&ctx, &C.data[j], 1);
-			aes_ccm_128_crypt(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, NULL, 0);
-		}
-		aes_ccm_128_digest(&ctx, T);
-
-		e = memcmp(testarray[i].T.data, T, sizeof(T));
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
-			ret = false;
-			goto fail;
-		}
-
-		e = memcmp(testarray[i].C.data, C.data, C.length);
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], NULL, &C, &_T);
-			ret = false;
-			goto fail;
-		}
-	}
-
-	for (i=0; i < ARRAY_SIZE(testarray); i++) {
-		struct aes_ccm_128_context ctx;
-		uint8_t T[AES_BLOCK_SIZE];
-		DATA_BLOB _T = data_blob_const(T, sizeof(T));
-		DATA_BLOB P;
-		int e;
-		size_t j;
-
-		P = data_blob_dup_talloc(tctx, testarray[i].C);
-
-		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
-				 testarray[i].A.length, testarray[i].P.length);
-		for (j=0; j < testarray[i].A.length; j++) {
-			aes_ccm_128_update(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, &testarray[i].A.data[j], 1);
-			aes_ccm_128_update(&ctx, NULL, 0);
-		}
-		for (j=0; j < P.length; j++) {
-			aes_ccm_128_crypt(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, NULL, 0);
-			aes_ccm_128_crypt(&ctx, &P.data[j], 1);
-			aes_ccm_128_update(&ctx, &P.data[j], 1);
-			aes_ccm_128_crypt(&ctx, NULL, 0);
-			aes_ccm_128_update(&ctx, NULL, 0);
-		}
-		aes_ccm_128_digest(&ctx, T);
-
-		e = memcmp(testarray[i].T.data, T, sizeof(T));
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
-			ret = false;
-			goto fail;
-		}
-
-		e = memcmp(testarray[i].P.data, P.data, P.length);
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
-			ret = false;
-			goto fail;
-		}
-	}
-
-	for (i=0; i < ARRAY_SIZE(testarray); i++) {
-		struct aes_ccm_128_context ctx;
-		uint8_t T[AES_BLOCK_SIZE];
-		DATA_BLOB _T = data_blob_const(T, sizeof(T));
-		DATA_BLOB P;
-		int e;
-
-		P = data_blob_dup_talloc(tctx, testarray[i].C);
-
-		aes_ccm_128_init(&ctx, testarray[i].K.data, testarray[i].N.data,
-				 testarray[i].A.length, testarray[i].P.length);
-		aes_ccm_128_update(&ctx, testarray[i].A.data, testarray[i].A.length);
-		aes_ccm_128_crypt(&ctx, P.data, P.length);
-		aes_ccm_128_update(&ctx, P.data, P.length);
-		aes_ccm_128_digest(&ctx, T);
-
-		e = memcmp(testarray[i].T.data, T, sizeof(T));
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
-			ret = false;
-			goto fail;
-		}
-
-		e = memcmp(testarray[i].P.data, P.data, P.length);
-		if (e != 0) {
-			aes_mode_testvector_debug(&testarray[i], &P, NULL, &_T);
-			ret = false;
-			goto fail;
-		}
-	}
-
- fail:
 	return ret;
 }
 
@@ -20,6 +20,7 @@
 #include "replace.h"
 #include "../lib/crypto/crypto.h"
 #include "lib/util/byteorder.h"
+#include "../lib/crypto/aes_ni.h"
 
 static inline void aes_gcm_128_inc32(uint8_t inout[AES_BLOCK_SIZE])
 {
@@ -30,44 +31,98 @@ static inline void aes_gcm_128_inc32(uint8_t inout[AES_BLOCK_SIZE])
 	RSIVAL(inout, AES_BLOCK_SIZE - 4, v);
 }
 
-static inline void aes_gcm_128_mul(const uint8_t x[AES_BLOCK_SIZE],
-				   const uint8_t y[AES_BLOCK_SIZE],
-				   uint8_t v[AES_BLOCK_SIZE],
+/*
+ * GHASH multiplication with 4-bit tables, see
+ * "The Galois/Counter Mode of Operation (GCM)", section 4.1
+ * (Shoup's method). The table holds the products of H with all
+ * 4-bit values, the reduction of the shifted out bits is
+ * precomputed in aes_gcm_128_last4.
+ */
+static const uint64_t aes_gcm_128_last4[16] = {
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void aes_gcm_128_gen_table(struct aes_gcm_128_context *ctx)
+{
+	uint64_t vh, vl;
+	int i, j;
+
+	vh = RBVAL(ctx->H, 0);
+	vl = RBVAL(ctx->H, 8);
+
+	ctx->HL[8] = vl;
+	ctx->HH[8] = vh;
+	ctx->HL[0] = 0;
+	ctx->HH[0] = 0;
+
+	for (i = 4; i > 0; i >>= 1) {
+		uint64_t T = (vl & 1) * 0xe1000000U;
+
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ (T << 32);
+		ctx->HL[i] = vl;
+		ctx->HH[i] = vh;
+	}
+
+	for (i = 2; i <= 8; i *= 2) {
+		vh = ctx->HH[i];
+		vl = ctx->HL[i];
+		for (j = 1; j < i; j++) {
+			ctx->HH[i + j] = vh ^ ctx->HH[j];
+			ctx->HL[i + j] = vl ^ ctx->HL[j];
+		}
+	}
+}
+
+static inline void aes_gcm_128_mul(const struct aes_gcm_128_context *ctx,
+				   const uint8_t x[AES_BLOCK_SIZE],
 				   uint8_t z[AES_BLOCK_SIZE])
 {
-	uint8_t i;
-	/* 11100001 || 0^120 */
-	static const uint8_t r[AES_BLOCK_SIZE] = {
-		0xE1, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,
-	};
-
-	memset(z, 0, AES_BLOCK_SIZE);
-	memcpy(v, y, AES_BLOCK_SIZE);
-
-	for (i = 0; i < AES_BLOCK_SIZE; i++) {
-		uint8_t mask;
-		for (mask = 0x80; mask != 0 ; mask >>= 1) {
-			uint8_t v_lsb = v[AES_BLOCK_SIZE-1] & 1;
-			if (x[i] & mask) {
-				aes_block_xor(z, v, z);
-			}
-
-			aes_block_rshift(v, v);
-			if (v_lsb != 0) {
-				aes_block_xor(v, r, v);
-			}
+	uint64_t zh, zl;
+	uint8_t lo, hi, rem;
+	int i;
+
+	lo = x[AES_BLOCK_SIZE-1] & 0xf;
+	zh = ctx->HH[lo];
+	zl = ctx->HL[lo];
+
+	for (i = AES_BLOCK_SIZE-1; i >= 0; i--) {
+		lo = x[i] & 0xf;
+		hi = (x[i] >> 4) & 0xf;
+
+		if (i != AES_BLOCK_SIZE-1) {
+			rem = zl & 0xf;
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4);
+			zh ^= aes_gcm_128_last4[rem] << 48;
+			zh ^= ctx->HH[lo];
+			zl ^= ctx->HL[lo];
 		}
+
+		rem = zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4);
+		zh ^= aes_gcm_128_last4[rem] << 48;
+		zh ^= ctx->HH[hi];
+		zl ^= ctx->HL[hi];
 	}
+
+	RSBVAL(z, 0, zh);
+	RSBVAL(z, 8, zl);
 }
 
 static inline void aes_gcm_128_ghash_block(struct aes_gcm_128_context *ctx,
 					   const uint8_t in[AES_BLOCK_SIZE])
 {
 	aes_block_xor(ctx->Y, in, ctx->y.block);
-	aes_gcm_128_mul(ctx->y.block, ctx->H, ctx->v.block, ctx->Y);
+#ifdef HAVE_AESNI_INTRINSICS
+	if (ctx->aesni) {
+		samba_aesni_gcm_gfmul(ctx->y.block, ctx->H, ctx->Y);
+		return;
+	}
+#endif
+	aes_gcm_128_mul(ctx, ctx->y.block, ctx->Y);
 }
 
 void aes_gcm_128_init(struct aes_gcm_128_context *ctx,
@@ -83,6 +138,11 @@ void aes_gcm_128_init(struct aes_gcm_128_context *ctx,
 	 */
 	AES_encrypt(ctx->Y, ctx->H, &ctx->aes_key);
 
+	ctx->aesni = (ctx->aes_key.aesni != 0);
+	if (!ctx->aesni) {
+		aes_gcm_128_gen_table(ctx);
+	}
+
 	/*
 	 * Step 2: generate J0
 	 */
@@ -155,6 +215,32 @@ static inline void aes_gcm_128_crypt_tmp(struct aes_gcm_128_context *ctx,
 	tmp->total += m_len;
 
 	while (m_len > 0) {
+#ifdef HAVE_AESNI_INTRINSICS
+		if (ctx->aesni && tmp->ofs == 0 &&
+		    m_len >= 2 * AES_BLOCK_SIZE) {
+			size_t nblocks;
+
+			/*
+			 * tmp->block holds the key stream for the
+			 * current CB, the following blocks are done
+			 * in bulk.
+			 */
+			aes_block_xor(m, tmp->block, m);
+			m += AES_BLOCK_SIZE;
+			m_len -= AES_BLOCK_SIZE;
+
+			nblocks = m_len / AES_BLOCK_SIZE;
+			samba_aesni_ctr32_crypt_blocks(&ctx->aes_key,
+						       ctx->CB,
+						       m, nblocks);
+			m += nblocks * AES_BLOCK_SIZE;
+			m_len -= nblocks * AES_BLOCK_SIZE;
+
+			aes_gcm_128_inc32(ctx->CB);
+			AES_encrypt(ctx->CB, tmp->block, &ctx->aes_key);
+			continue;
+		}
+#endif
 		if (tmp->ofs == AES_BLOCK_SIZE) {
 			aes_gcm_128_inc32(ctx->CB);
 			AES_encrypt(ctx->CB, tmp->block, &ctx->aes_key);
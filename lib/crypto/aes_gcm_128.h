@@ -38,6 +38,10 @@ struct aes_gcm_128_context {
 	uint8_t CB[AES_BLOCK_SIZE];
 	uint8_t Y[AES_BLOCK_SIZE];
 	uint8_t AC[AES_BLOCK_SIZE];
+	/* multiples of H for the 4-bit table GHASH */
+	uint64_t HL[16];
+	uint64_t HH[16];
+	bool aesni;
 };
 
 void aes_gcm_128_init(struct aes_gcm_128_context *ctx,
@@ -0,0 +1,286 @@
+/*
+   AES-NI and PCLMULQDQ accelerated AES primitives
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * This file is compiled with -maes -mpclmul -mssse3, nothing in here
+ * may be called without checking samba_aesni_available() first.
+ */
+
+#include "replace.h"
+#include "../lib/crypto/aes.h"
+#include "../lib/crypto/aes_ni.h"
+#include "lib/util/byteorder.h"
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+static bool samba_aesni_disabled;
+
+bool samba_aesni_available(void)
+{
+	static int available = -1;
+
+	if (samba_aesni_disabled) {
+		return false;
+	}
+
+	if (available == -1) {
+		unsigned int eax, ebx, ecx, edx;
+
+		available = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		    (ecx & bit_AES) && (ecx & bit_PCLMUL) && (ecx & bit_SSSE3)) {
+			available = 1;
+		}
+	}
+
+	return (available == 1);
+}
+
+void samba_aesni_disable(bool disable)
+{
+	samba_aesni_disabled = disable;
+}
+
+static inline __m128i aesni_128_expand(__m128i key, __m128i keygened)
+{
+	keygened = _mm_shuffle_epi32(keygened, _MM_SHUFFLE(3,3,3,3));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, keygened);
+}
+
+#define AESNI_128_EXPAND(k, rcon) \
+	aesni_128_expand(k, _mm_aeskeygenassist_si128(k, rcon))
+
+/*
+ * The round keys are stored in AES_KEY.key in the byte order the
+ * aesenc instruction wants, so AES_KEY.aesni must be checked by
+ * anyone looking at them.
+ */
+void samba_aesni_set_encrypt_key_128(const uint8_t userkey[AES_BLOCK_SIZE],
+				     AES_KEY *key)
+{
+	__m128i *rk = (__m128i *)key->key;
+	__m128i k;
+
+	k = _mm_loadu_si128((const __m128i *)userkey);
+	_mm_storeu_si128(&rk[0], k);
+	k = AESNI_128_EXPAND(k, 0x01); _mm_storeu_si128(&rk[1], k);
+	k = AESNI_128_EXPAND(k, 0x02); _mm_storeu_si128(&rk[2], k);
+	k = AESNI_128_EXPAND(k, 0x04); _mm_storeu_si128(&rk[3], k);
+	k = AESNI_128_EXPAND(k, 0x08); _mm_storeu_si128(&rk[4], k);
+	k = AESNI_128_EXPAND(k, 0x10); _mm_storeu_si128(&rk[5], k);
+	k = AESNI_128_EXPAND(k, 0x20); _mm_storeu_si128(&rk[6], k);
+	k = AESNI_128_EXPAND(k, 0x40); _mm_storeu_si128(&rk[7], k);
+	k = AESNI_128_EXPAND(k, 0x80); _mm_storeu_si128(&rk[8], k);
+	k = AESNI_128_EXPAND(k, 0x1b); _mm_storeu_si128(&rk[9], k);
+	k = AESNI_128_EXPAND(k, 0x36); _mm_storeu_si128(&rk[10], k);
+
+	key->rounds = 10;
+	key->aesni = 1;
+}
+
+struct aesni_128_schedule {
+	__m128i k[11];
+};
+
+static inline void aesni_128_load_schedule(const AES_KEY *key,
+					   struct aesni_128_schedule *s)
+{
+	const __m128i *rk = (const __m128i *)key->key;
+	int i;
+
+	for (i = 0; i < 11; i++) {
+		s->k[i] = _mm_loadu_si128(&rk[i]);
+	}
+}
+
+static inline __m128i aesni_128_encrypt_block(const struct aesni_128_schedule *s,
+					      __m128i m)
+{
+	int i;
+
+	m = _mm_xor_si128(m, s->k[0]);
+	for (i = 1; i < 10; i++) {
+		m = _mm_aesenc_si128(m, s->k[i]);
+	}
+	return _mm_aesenclast_si128(m, s->k[10]);
+}
+
+void samba_aesni_encrypt(const uint8_t in[AES_BLOCK_SIZE],
+			 uint8_t out[AES_BLOCK_SIZE],
+			 const AES_KEY *key)
+{
+	struct aesni_128_schedule s;
+	__m128i m;
+
+	aesni_128_load_schedule(key, &s);
+
+	m = _mm_loadu_si128((const __m128i *)in);
+	m = aesni_128_encrypt_block(&s, m);
+	_mm_storeu_si128((__m128i *)out, m);
+}
+
+static inline void aesni_inc32(uint8_t CB[AES_BLOCK_SIZE])
+{
+	uint32_t v;
+
+	v = RIVAL(CB, AES_BLOCK_SIZE - 4);
+	v += 1;
+	RSIVAL(CB, AES_BLOCK_SIZE - 4, v);
+}
+
+void samba_aesni_ctr32_crypt_blocks(const AES_KEY *key,
+				    uint8_t CB[AES_BLOCK_SIZE],
+				    uint8_t *m,
+				    size_t nblocks)
+{
+	struct aesni_128_schedule s;
+
+	aesni_128_load_schedule(key, &s);
+
+	/*
+	 * Four blocks at a time keeps the AES unit busy, the
+	 * aesenc latency is hidden behind the independent blocks.
+	 */
+	while (nblocks >= 4) {
+		__m128i c0, c1, c2, c3;
+		__m128i *p = (__m128i *)m;
+		int i;
+
+		aesni_inc32(CB); c0 = _mm_loadu_si128((const __m128i *)CB);
+		aesni_inc32(CB); c1 = _mm_loadu_si128((const __m128i *)CB);
+		aesni_inc32(CB); c2 = _mm_loadu_si128((const __m128i *)CB);
+		aesni_inc32(CB); c3 = _mm_loadu_si128((const __m128i *)CB);
+
+		c0 = _mm_xor_si128(c0, s.k[0]);
+		c1 = _mm_xor_si128(c1, s.k[0]);
+		c2 = _mm_xor_si128(c2, s.k[0]);
+		c3 = _mm_xor_si128(c3, s.k[0]);
+		for (i = 1; i < 10; i++) {
+			c0 = _mm_aesenc_si128(c0, s.k[i]);
+			c1 = _mm_aesenc_si128(c1, s.k[i]);
+			c2 = _mm_aesenc_si128(c2, s.k[i]);
+			c3 = _mm_aesenc_si128(c3, s.k[i]);
+		}
+		c0 = _mm_aesenclast_si128(c0, s.k[10]);
+		c1 = _mm_aesenclast_si128(c1, s.k[10]);
+		c2 = _mm_aesenclast_si128(c2, s.k[10]);
+		c3 = _mm_aesenclast_si128(c3, s.k[10]);
+
+		_mm_storeu_si128(&p[0],
+			_mm_xor_si128(_mm_loadu_si128(&p[0]), c0));
+		_mm_storeu_si128(&p[1],
+			_mm_xor_si128(_mm_loadu_si128(&p[1]), c1));
+		_mm_storeu_si128(&p[2],
+			_mm_xor_si128(_mm_loadu_si128(&p[2]), c2));
+		_mm_storeu_si128(&p[3],
+			_mm_xor_si128(_mm_loadu_si128(&p[3]), c3));
+
+		m += 4 * AES_BLOCK_SIZE;
+		nblocks -= 4;
+	}
+
+	while (nblocks > 0) {
+		__m128i c;
+		__m128i *p = (__m128i *)m;
+
+		aesni_inc32(CB);
+		c = _mm_loadu_si128((const __m128i *)CB);
+		c = aesni_128_encrypt_block(&s, c);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), c));
+
+		m += AES_BLOCK_SIZE;
+		nblocks -= 1;
+	}
+}
+
+/*
+ * Carry-less multiplication and reduction modulo
+ * x^128 + x^7 + x^2 + x + 1 on bit reflected operands, see
+ * "Intel Carry-Less Multiplication Instruction and its Usage for
+ * Computing the GCM Mode", algorithms 1 and 5.
+ */
+static inline __m128i aesni_gfmul(__m128i a, __m128i b)
+{
+	__m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+	t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+	t4 = _mm_xor_si128(t4, t5);
+	t5 = _mm_slli_si128(t4, 8);
+	t4 = _mm_srli_si128(t4, 8);
+	t3 = _mm_xor_si128(t3, t5);
+	t6 = _mm_xor_si128(t6, t4);
+
+	/* shift the 256-bit product left by one bit */
+	t7 = _mm_srli_epi32(t3, 31);
+	t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+
+	/* reduction, first phase */
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+
+	/* reduction, second phase */
+	t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+
+	return _mm_xor_si128(t6, t3);
+}
+
+void samba_aesni_gcm_gfmul(const uint8_t x[AES_BLOCK_SIZE],
+			   const uint8_t y[AES_BLOCK_SIZE],
+			   uint8_t z[AES_BLOCK_SIZE])
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i a, b, r;
+
+	a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)x), bswap);
+	b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+
+	r = aesni_gfmul(a, b);
+
+	_mm_storeu_si128((__m128i *)z, _mm_shuffle_epi8(r, bswap));
+}
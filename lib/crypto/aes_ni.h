@@ -0,0 +1,62 @@
+/*
+   AES-NI and PCLMULQDQ accelerated AES primitives
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIB_CRYPTO_AES_NI_H
+#define LIB_CRYPTO_AES_NI_H
+
+/*
+ * Runtime CPU dispatch: returns true if the build has the
+ * accelerated code and the CPU supports both AES-NI and PCLMULQDQ.
+ */
+bool samba_aesni_available(void);
+
+/*
+ * Used by the benchmark to compare the accelerated code with the
+ * portable one. Only affects keys and contexts set up afterwards.
+ */
+void samba_aesni_disable(bool disable);
+
+#ifdef HAVE_AESNI_INTRINSICS
+
+void samba_aesni_set_encrypt_key_128(const uint8_t userkey[AES_BLOCK_SIZE],
+				     AES_KEY *key);
+void samba_aesni_encrypt(const uint8_t in[AES_BLOCK_SIZE],
+			 uint8_t out[AES_BLOCK_SIZE],
+			 const AES_KEY *key);
+
+/*
+ * CTR mode with a 32-bit big-endian counter (as used by GCM):
+ * for each of the nblocks blocks the counter in CB is incremented
+ * first and the encrypted counter is xor'ed into m.
+ */
+void samba_aesni_ctr32_crypt_blocks(const AES_KEY *key,
+				    uint8_t CB[AES_BLOCK_SIZE],
+				    uint8_t *m,
+				    size_t nblocks);
+
+/*
+ * z = x * y in GF(2^128), using the bit order of GCM
+ */
+void samba_aesni_gcm_gfmul(const uint8_t x[AES_BLOCK_SIZE],
+			   const uint8_t y[AES_BLOCK_SIZE],
+			   uint8_t z[AES_BLOCK_SIZE]);
+
+#endif /* HAVE_AESNI_INTRINSICS */
+
+#endif /* LIB_CRYPTO_AES_NI_H */
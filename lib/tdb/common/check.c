@@ -309,6 +309,37 @@ static bool tdb_check_free_record(struct tdb_context *tdb,
 	return true;
 }
 
+/* Record the bucket heads of a resized hash table. */
+static bool tdb_check_hash_table(struct tdb_context *tdb,
+				 tdb_off_t table, uint32_t factor,
+				 unsigned char **hashes)
+{
+	struct tdb_record rec;
+	uint32_t b;
+
+	if (tdb->methods->tdb_read(tdb, table, &rec, sizeof(rec),
+				   DOCONV()) == -1)
+		return false;
+	if (rec.magic != TDB_HASHTABLE_MAGIC ||
+	    rec.data_len / sizeof(tdb_off_t) / factor < tdb->hash_size) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR,
+			 "Bad hash table at offset %u\n", table));
+		return false;
+	}
+
+	for (b = 0; b < tdb->hash_size * factor; b++) {
+		tdb_off_t off;
+
+		if (tdb_ofs_read(tdb, table + sizeof(rec)
+				 + b*sizeof(tdb_off_t), &off) == -1)
+			return false;
+		if (off)
+			record_offset(hashes[b % tdb->hash_size + 1], off);
+	}
+	return true;
+}
+
 /* Slow, but should be very rare. */
 size_t tdb_dead_space(struct tdb_context *tdb, tdb_off_t off)
 {
@@ -335,6 +366,7 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 	bool found_recovery = false;
 	tdb_len_t dead;
 	bool locked;
+	struct tdb_hash_resize resize;
 
 	/* Read-only databases use no locking at all: it's best-effort.
 	 * We may have a write lock already, so skip that case too. */
@@ -383,6 +415,25 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 			record_offset(hashes[h], off);
 	}
 
+	/* The other freelists share the bitmap of the first one. */
+	for (h = 1; h < TDB_NUM_FREELISTS(tdb); h++) {
+		if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(h), &off) == -1)
+			goto free;
+		if (off)
+			record_offset(hashes[0], off);
+	}
+
+	/* Buckets of resized hash tables belong to their lock chain. */
+	if (tdb_hash_resize_read(tdb, &resize) == -1)
+		goto free;
+	if (resize.table != 0 &&
+	    !tdb_check_hash_table(tdb, resize.table, resize.factor, hashes))
+		goto free;
+	if (resize.new_table != 0 &&
+	    !tdb_check_hash_table(tdb, resize.new_table, resize.new_factor,
+				  hashes))
+		goto free;
+
 	/* For each record, read it in and check it's ok. */
 	for (off = TDB_DATA_START(tdb->hash_size);
 	     off < tdb->map_size;
@@ -401,6 +452,16 @@ _PUBLIC_ int tdb_check(struct tdb_context *tdb,
 			if (!tdb_check_free_record(tdb, off, &rec, hashes))
 				goto free;
 			break;
+		case TDB_HASHTABLE_MAGIC:
+			if (off != resize.table && off != resize.new_table) {
+				TDB_LOG((tdb, TDB_DEBUG_ERROR,
+					 "Unexpected hash table at offset %u\n",
+					 off));
+				goto free;
+			}
+			if (!tdb_check_record(tdb, off, &rec))
+				goto free;
+			break;
 		/* If we crash after ftruncate, we can get zeroes or fill. */
 		case TDB_RECOVERY_INVALID_MAGIC:
 		case 0x42424242:
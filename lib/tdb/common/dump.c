@@ -60,26 +60,58 @@ static tdb_off_t tdb_dump_record(struct tdb_context *tdb, int hash,
 
 static int tdb_dump_chain(struct tdb_context *tdb, int i)
 {
+	struct tdb_hash_table table;
 	tdb_off_t rec_ptr, top;
-
-	top = TDB_HASH_TOP(i);
+	uint32_t sub;
 
 	if (tdb_lock(tdb, i, F_WRLCK) != 0)
 		return -1;
 
-	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+	/* the freelist is -1, it never moves */
+	table.ofs = 0;
+	table.factor = 1;
+	if (i != -1 && tdb_hash_table_read(tdb, i, &table) == -1)
 		return tdb_unlock(tdb, i, F_WRLCK);
 
-	if (rec_ptr)
-		printf("hash=%d\n", i);
+	for (sub = 0; sub < table.factor; sub++) {
+		top = (i == -1) ? TDB_HASH_TOP(i) :
+			tdb_hash_table_top(tdb, &table, i, sub);
 
-	while (rec_ptr) {
-		rec_ptr = tdb_dump_record(tdb, i, rec_ptr);
+		if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+			break;
+
+		if (rec_ptr) {
+			if (table.factor > 1)
+				printf("hash=%d bucket=%u\n", i, sub);
+			else
+				printf("hash=%d\n", i);
+		}
+
+		while (rec_ptr) {
+			rec_ptr = tdb_dump_record(tdb, i, rec_ptr);
+		}
 	}
 
 	return tdb_unlock(tdb, i, F_WRLCK);
 }
 
+static int tdb_dump_freelist_class(struct tdb_context *tdb, unsigned int fclass)
+{
+	tdb_off_t rec_ptr;
+
+	if (tdb_lock(tdb, -1, F_WRLCK) != 0)
+		return -1;
+
+	if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(fclass), &rec_ptr) == -1)
+		return tdb_unlock(tdb, -1, F_WRLCK);
+
+	while (rec_ptr) {
+		rec_ptr = tdb_dump_record(tdb, -1, rec_ptr);
+	}
+
+	return tdb_unlock(tdb, -1, F_WRLCK);
+}
+
 _PUBLIC_ void tdb_dump_all(struct tdb_context *tdb)
 {
 	int i;
@@ -88,49 +120,74 @@ _PUBLIC_ void tdb_dump_all(struct tdb_context *tdb)
 	}
 	printf("freelist:\n");
 	tdb_dump_chain(tdb, -1);
+	for (i=1;i<TDB_NUM_FREELISTS(tdb);i++) {
+		printf("freelist class %d:\n", i);
+		tdb_dump_freelist_class(tdb, i);
+	}
 }
 
-_PUBLIC_ int tdb_printfreelist(struct tdb_context *tdb)
+static int tdb_print_freelist_class(struct tdb_context *tdb,
+				    unsigned int fclass, long *total_free)
 {
-	int ret;
-	long total_free = 0;
-	tdb_off_t offset, rec_ptr;
+	tdb_off_t rec_ptr;
 	struct tdb_record rec;
-
-	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
-		return ret;
-
-	offset = FREELIST_TOP;
+	long class_free = 0;
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+	if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(fclass), &rec_ptr) == -1) {
 		return 0;
 	}
 
-	printf("freelist top=[0x%08x]\n", rec_ptr );
+	if (TDB_NUM_FREELISTS(tdb) == 1) {
+		printf("freelist top=[0x%08x]\n", rec_ptr );
+	} else {
+		printf("freelist class %u (rec_len >= %u) top=[0x%08x]\n",
+		       fclass, tdb_freelist_class_min(fclass), rec_ptr);
+	}
 	while (rec_ptr) {
 		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec,
 					   sizeof(rec), DOCONV()) == -1) {
-			tdb_unlock(tdb, -1, F_WRLCK);
 			return -1;
 		}
 
 		if (rec.magic != TDB_FREE_MAGIC) {
 			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
 			return -1;
 		}
 
 		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%u)] (end = 0x%08x)\n",
 		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
+		class_free += rec.rec_len;
 
 		/* move to the next record */
 		rec_ptr = rec.next;
 	}
+	if (TDB_NUM_FREELISTS(tdb) != 1) {
+		printf("class %u rec_len = [0x%08lx (%lu)]\n",
+		       fclass, class_free, class_free);
+	}
+
+	*total_free += class_free;
+	return 0;
+}
+
+_PUBLIC_ int tdb_printfreelist(struct tdb_context *tdb)
+{
+	int ret;
+	long total_free = 0;
+	unsigned int fclass;
+
+	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
+		return ret;
+
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		ret = tdb_print_freelist_class(tdb, fclass, &total_free);
+		if (ret == -1) {
+			tdb_unlock(tdb, -1, F_WRLCK);
+			return -1;
+		}
+	}
 	printf("total rec_len = [0x%08lx (%lu)]\n", total_free, total_free);
 
 	return tdb_unlock(tdb, -1, F_WRLCK);
 }
-
@@ -61,22 +61,52 @@ int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct tdb_record
 	return 0;
 }
 
+/*
+ * With TDB_FEATURE_FLAG_FREELIST_CLASSES free records are kept on
+ * TDB_FREELIST_CLASS_COUNT lists by size: list 0 takes everything below
+ * TDB_FREELIST_CLASS_BASE bytes and every further list starts at
+ * twice the size of the one before. A record on list c is never
+ * smaller than tdb_freelist_class_min(c), but it can be larger: a
+ * merge grows the left neighbour in place without moving it.
+ */
+tdb_len_t tdb_freelist_class_min(unsigned int fclass)
+{
+	if (fclass == 0) {
+		return 0;
+	}
+	return TDB_FREELIST_CLASS_BASE << (fclass - 1);
+}
+
+unsigned int tdb_freelist_class(struct tdb_context *tdb, tdb_len_t rec_len)
+{
+	unsigned int fclass = 0;
+
+	while ((fclass + 1 < TDB_NUM_FREELISTS(tdb)) &&
+	       (rec_len >= tdb_freelist_class_min(fclass + 1))) {
+		fclass++;
+	}
+	return fclass;
+}
+
 
 #if USE_RIGHT_MERGES
 /* Remove an element from the freelist.  Must have alloc lock. */
 static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off, tdb_off_t next)
 {
 	tdb_off_t last_ptr, i;
-
-	/* read in the freelist top */
-	last_ptr = FREELIST_TOP;
-	while (tdb_ofs_read(tdb, last_ptr, &i) != -1 && i != 0) {
-		if (i == off) {
-			/* We've found it! */
-			return tdb_ofs_write(tdb, last_ptr, &next);
+	unsigned int fclass;
+
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		/* read in the freelist top */
+		last_ptr = FREELIST_CLASS_TOP(fclass);
+		while (tdb_ofs_read(tdb, last_ptr, &i) != -1 && i != 0) {
+			if (i == off) {
+				/* We've found it! */
+				return tdb_ofs_write(tdb, last_ptr, &next);
+			}
+			/* Follow chain (next offset is at start of record) */
+			last_ptr = i;
 		}
-		/* Follow chain (next offset is at start of record) */
-		last_ptr = i;
 	}
 	tdb->ecode = TDB_ERR_CORRUPT;
 	TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%u\n", off));
@@ -306,6 +336,7 @@ static int check_merge_ptr_with_left_record(struct tdb_context *tdb,
  */
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec)
 {
+	tdb_off_t top;
 	int ret;
 
 	/* Allocation and tailer lock */
@@ -354,13 +385,14 @@ left:
 		goto done;
 	}
 
-	/* Nothing to merge, prepend to free list */
+	/* Nothing to merge, prepend to the free list for its size */
 
 	rec->magic = TDB_FREE_MAGIC;
+	top = FREELIST_CLASS_TOP(tdb_freelist_class(tdb, rec->rec_len));
 
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec->next) == -1 ||
+	if (tdb_ofs_read(tdb, top, &rec->next) == -1 ||
 	    tdb_rec_write(tdb, offset, rec) == -1 ||
-	    tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
+	    tdb_ofs_write(tdb, top, &offset) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%u\n", offset));
 		goto fail;
 	}
@@ -384,12 +416,17 @@ done:
    Note that we try to allocate by grabbing data from the end of an existing record,
    not the beginning. This is so the left merge in a free is more likely to be
    able to free up the record without fragmentation
+
+   If what is left of the record is too small for free list fclass
+   it is moved to the list it belongs to now.
  */
 static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 				  tdb_len_t length, tdb_off_t rec_ptr,
-				  struct tdb_record *rec, tdb_off_t last_ptr)
+				  struct tdb_record *rec, tdb_off_t last_ptr,
+				  unsigned int fclass)
 {
 #define MIN_REC_SIZE (sizeof(struct tdb_record) + sizeof(tdb_off_t) + 8)
+	tdb_off_t top = 0;
 
 	if (rec->rec_len < length + MIN_REC_SIZE) {
 		/* we have to grab the whole record */
@@ -409,12 +446,26 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 
 	/* we're going to just shorten the existing record */
 	rec->rec_len -= (length + sizeof(*rec));
+	if (rec->rec_len < tdb_freelist_class_min(fclass)) {
+		top = FREELIST_CLASS_TOP(tdb_freelist_class(tdb, rec->rec_len));
+
+		/* unlink it here, it is prepended to top below */
+		if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1) {
+			return 0;
+		}
+		if (tdb_ofs_read(tdb, top, &rec->next) == -1) {
+			return 0;
+		}
+	}
 	if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
 		return 0;
 	}
 	if (update_tailer(tdb, rec_ptr, rec) == -1) {
 		return 0;
 	}
+	if ((top != 0) && (tdb_ofs_write(tdb, top, &rec_ptr) == -1)) {
+		return 0;
+	}
 
 	/* and setup the new record */
 	rec_ptr += sizeof(*rec) + rec->rec_len;
@@ -434,41 +485,29 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 	return rec_ptr;
 }
 
-/* allocate some space from the free list. The offset returned points
-   to a unconnected tdb_record within the database with room for at
-   least length bytes of total data
+struct tdb_bestfit {
+	tdb_off_t rec_ptr, last_ptr;
+	tdb_len_t rec_len;
+};
 
-   0 is returned if the space could not be allocated
+/*
+   best fit search of the free list starting at top for a record with
+   room for length bytes. Neighbouring free records are merged on the
+   way.
  */
-static tdb_off_t tdb_allocate_from_freelist(
-	struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+static int tdb_freelist_bestfit(struct tdb_context *tdb, tdb_off_t top,
+				tdb_len_t length, struct tdb_record *rec,
+				struct tdb_bestfit *bestfit,
+				bool *merge_created_candidate)
 {
-	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
-	struct {
-		tdb_off_t rec_ptr, last_ptr;
-		tdb_len_t rec_len;
-	} bestfit;
+	tdb_off_t rec_ptr, last_ptr;
 	float multiplier = 1.0;
-	bool merge_created_candidate;
 
-	/* over-allocate to reduce fragmentation */
-	length *= 1.25;
-
-	/* Extra bytes required for tailer */
-	length += sizeof(tdb_off_t);
-	length = TDB_ALIGN(length, TDB_ALIGNMENT);
-
- again:
-	merge_created_candidate = false;
-	last_ptr = FREELIST_TOP;
+	last_ptr = top;
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1)
-		return 0;
-
-	bestfit.rec_ptr = 0;
-	bestfit.last_ptr = 0;
-	bestfit.rec_len = 0;
+	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+		return -1;
 
 	/*
 	   this is a best fit allocation strategy. Originally we used
@@ -481,20 +520,20 @@ static tdb_off_t tdb_allocate_from_freelist(
 		struct tdb_record left_rec;
 
 		if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1) {
-			return 0;
+			return -1;
 		}
 
 		ret = check_merge_with_left_record(tdb, rec_ptr, rec,
 						   &left_ptr, &left_rec);
 		if (ret == -1) {
-			return 0;
+			return -1;
 		}
 		if (ret == 1) {
 			/* merged */
 			rec_ptr = rec->next;
 			ret = tdb_ofs_write(tdb, last_ptr, &rec->next);
 			if (ret == -1) {
-				return 0;
+				return -1;
 			}
 
 			/*
@@ -518,23 +557,23 @@ static tdb_off_t tdb_allocate_from_freelist(
 			 * This way we can avoid expanding the database.
 			 */
 
-			if (bestfit.rec_ptr == left_ptr) {
-				bestfit.rec_len = left_rec.rec_len;
+			if (bestfit->rec_ptr == left_ptr) {
+				bestfit->rec_len = left_rec.rec_len;
 			}
 
 			if (left_rec.rec_len > length) {
-				merge_created_candidate = true;
+				*merge_created_candidate = true;
 			}
 
 			continue;
 		}
 
 		if (rec->rec_len >= length) {
-			if (bestfit.rec_ptr == 0 ||
-			    rec->rec_len < bestfit.rec_len) {
-				bestfit.rec_len = rec->rec_len;
-				bestfit.rec_ptr = rec_ptr;
-				bestfit.last_ptr = last_ptr;
+			if (bestfit->rec_ptr == 0 ||
+			    rec->rec_len < bestfit->rec_len) {
+				bestfit->rec_len = rec->rec_len;
+				bestfit->rec_ptr = rec_ptr;
+				bestfit->last_ptr = last_ptr;
 			}
 		}
 
@@ -546,8 +585,8 @@ static tdb_off_t tdb_allocate_from_freelist(
 		   stop searching if its also not too big. The
 		   definition of 'too big' changes as we scan
 		   through */
-		if (bestfit.rec_len > 0 &&
-		    bestfit.rec_len < length * multiplier) {
+		if (bestfit->rec_len > 0 &&
+		    bestfit->rec_len < length * multiplier) {
 			break;
 		}
 
@@ -558,13 +597,113 @@ static tdb_off_t tdb_allocate_from_freelist(
 		multiplier *= 1.05;
 	}
 
+	return 0;
+}
+
+/*
+   merges grow the left neighbour in place, so a record can be on a
+   list below its size class. Move the records on list fclass that
+   belong further up to their own list. found is set if one of them
+   has room for length bytes.
+ */
+static int tdb_freelist_refile(struct tdb_context *tdb, unsigned int fclass,
+			       tdb_len_t length, bool *found)
+{
+	tdb_off_t rec_ptr, last_ptr, next, top;
+	struct tdb_record rec;
+	unsigned int new_class;
+
+	last_ptr = FREELIST_CLASS_TOP(fclass);
+
+	if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1)
+		return -1;
+
+	while (rec_ptr) {
+		if (tdb_rec_free_read(tdb, rec_ptr, &rec) == -1) {
+			return -1;
+		}
+		next = rec.next;
+
+		new_class = tdb_freelist_class(tdb, rec.rec_len);
+		if (new_class <= fclass) {
+			last_ptr = rec_ptr;
+			rec_ptr = next;
+			continue;
+		}
+
+		top = FREELIST_CLASS_TOP(new_class);
+		if (tdb_ofs_write(tdb, last_ptr, &next) == -1 ||
+		    tdb_ofs_read(tdb, top, &rec.next) == -1 ||
+		    tdb_rec_write(tdb, rec_ptr, &rec) == -1 ||
+		    tdb_ofs_write(tdb, top, &rec_ptr) == -1) {
+			return -1;
+		}
+		if (rec.rec_len >= length) {
+			*found = true;
+		}
+		rec_ptr = next;
+	}
+
+	return 0;
+}
+
+/* allocate some space from the free list. The offset returned points
+   to a unconnected tdb_record within the database with room for at
+   least length bytes of total data
+
+   0 is returned if the space could not be allocated
+ */
+static tdb_off_t tdb_allocate_from_freelist(
+	struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+{
+	tdb_off_t newrec_ptr;
+	struct tdb_bestfit bestfit;
+	unsigned int fclass;
+	bool merge_created_candidate;
+	bool refiled;
+
+	/* over-allocate to reduce fragmentation */
+	length *= 1.25;
+
+	/* Extra bytes required for tailer */
+	length += sizeof(tdb_off_t);
+	length = TDB_ALIGN(length, TDB_ALIGNMENT);
+
+ again:
+	merge_created_candidate = false;
+
+	bestfit.rec_ptr = 0;
+	bestfit.last_ptr = 0;
+	bestfit.rec_len = 0;
+
+	/*
+	 * Start with the list for our size class. Every record on the
+	 * lists above it is large enough, so we only go up if that
+	 * list had nothing for us.
+	 */
+	for (fclass = tdb_freelist_class(tdb, length);
+	     fclass < TDB_NUM_FREELISTS(tdb);
+	     fclass++) {
+		int ret;
+
+		ret = tdb_freelist_bestfit(tdb, FREELIST_CLASS_TOP(fclass),
+					   length, rec, &bestfit,
+					   &merge_created_candidate);
+		if (ret == -1) {
+			return 0;
+		}
+		if (bestfit.rec_ptr != 0) {
+			break;
+		}
+	}
+
 	if (bestfit.rec_ptr != 0) {
 		if (tdb_rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
 			return 0;
 		}
 
 		newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit.rec_ptr,
-					      rec, bestfit.last_ptr);
+					      rec, bestfit.last_ptr, fclass);
 		return newrec_ptr;
 	}
 
@@ -572,6 +711,21 @@ static tdb_off_t tdb_allocate_from_freelist(
 		goto again;
 	}
 
+	/*
+	 * A merge (e.g. the one in tdb_expand) may have left a record
+	 * with enough room on a list below our class. Look there
+	 * before we expand the file.
+	 */
+	refiled = false;
+	for (fclass = 0; fclass < tdb_freelist_class(tdb, length); fclass++) {
+		if (tdb_freelist_refile(tdb, fclass, length, &refiled) == -1) {
+			return 0;
+		}
+	}
+	if (refiled) {
+		goto again;
+	}
+
 	/* we didn't find enough space. See if we can expand the
 	   database and if we can then try again */
 	if (tdb_expand(tdb, length + sizeof(*rec)) == 0)
@@ -673,6 +827,7 @@ static int tdb_freelist_merge_adjacent(struct tdb_context *tdb,
 				       int *count_records, int *count_merged)
 {
 	tdb_off_t cur, next;
+	unsigned int fclass;
 	int count = 0;
 	int merged = 0;
 	int ret;
@@ -682,32 +837,36 @@ static int tdb_freelist_merge_adjacent(struct tdb_context *tdb,
 		return -1;
 	}
 
-	cur = FREELIST_TOP;
-	while (tdb_ofs_read(tdb, cur, &next) == 0 && next != 0) {
-		tdb_off_t next2;
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		cur = FREELIST_CLASS_TOP(fclass);
+		while (tdb_ofs_read(tdb, cur, &next) == 0 && next != 0) {
+			tdb_off_t next2;
 
-		count++;
-
-		ret = check_merge_ptr_with_left_record(tdb, next, &next2);
-		if (ret == -1) {
-			goto done;
-		}
-		if (ret == 1) {
-			/*
-			 * merged:
-			 * now let cur->next point to next2 instead of next
-			 */
+			count++;
 
-			ret = tdb_ofs_write(tdb, cur, &next2);
-			if (ret != 0) {
+			ret = check_merge_ptr_with_left_record(tdb, next,
+							       &next2);
+			if (ret == -1) {
 				goto done;
 			}
+			if (ret == 1) {
+				/*
+				 * merged:
+				 * now let cur->next point to next2
+				 * instead of next
+				 */
+
+				ret = tdb_ofs_write(tdb, cur, &next2);
+				if (ret != 0) {
+					goto done;
+				}
+
+				next = next2;
+				merged++;
+			}
 
-			next = next2;
-			merged++;
+			cur = next;
 		}
-
-		cur = next;
 	}
 
 	if (count_records != NULL) {
@@ -731,15 +890,18 @@ done:
 static int tdb_freelist_size_no_merge(struct tdb_context *tdb)
 {
 	tdb_off_t ptr;
+	unsigned int fclass;
 	int count=0;
 
 	if (tdb_lock(tdb, -1, F_RDLCK) == -1) {
 		return -1;
 	}
 
-	ptr = FREELIST_TOP;
-	while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
-		count++;
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		ptr = FREELIST_CLASS_TOP(fclass);
+		while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
+			count++;
+		}
 	}
 
 	tdb_unlock(tdb, -1, F_RDLCK);
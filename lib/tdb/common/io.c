@@ -177,6 +177,17 @@ static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 		return -1;
 	}
 
+	/* replaying the log would undo this write */
+	if (tdb->wal != NULL && tdb_wal_before_write(tdb) == -1) {
+		return -1;
+	}
+
+	/* so would rolling back a group commit that is not synced yet */
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) &&
+	    tdb_group_commit_before_write(tdb, off) == -1) {
+		return -1;
+	}
+
 	if (tdb->methods->tdb_oob(tdb, off, len, 0) != 0)
 		return -1;
 
@@ -286,6 +286,7 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 	if (ret == 0) {
 		tdb->allrecord_lock.ltype = F_WRLCK;
 		tdb->allrecord_lock.off = 0;
+		tdb_seqlock_allrecord_write_begin(tdb);
 		return 0;
 	}
 fail:
@@ -338,6 +339,7 @@ int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 				}
 			}
 			new_lck->ltype = F_WRLCK;
+			tdb_seqlock_chain_write_begin(tdb, offset);
 		}
 		/*
 		 * Just increment the in-memory struct, posix locks
@@ -372,6 +374,10 @@ int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	new_lck->ltype = ltype;
 	tdb->num_lockrecs++;
 
+	if (ltype == F_WRLCK) {
+		tdb_seqlock_chain_write_begin(tdb, offset);
+	}
+
 	return 0;
 }
 
@@ -519,6 +525,10 @@ int tdb_nest_unlock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	 * anyway.
 	 */
 
+	if (lck->ltype == F_WRLCK) {
+		tdb_seqlock_chain_write_end(tdb, offset);
+	}
+
 	if (mark_lock) {
 		ret = 0;
 	} else {
@@ -690,6 +700,15 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 	tdb->allrecord_lock.ltype = upgradable ? F_WRLCK : ltype;
 	tdb->allrecord_lock.off = upgradable;
 
+	/*
+	 * An upgradable lock is only a read lock on disk until
+	 * tdb_allrecord_upgrade(), the transaction code does not
+	 * write before that.
+	 */
+	if ((ltype == F_WRLCK) && !upgradable) {
+		tdb_seqlock_allrecord_write_begin(tdb);
+	}
+
 	if (tdb_needs_recovery(tdb)) {
 		bool mark = flags & TDB_LOCK_MARK_ONLY;
 		tdb_allrecord_unlock(tdb, ltype, mark);
@@ -736,6 +755,11 @@ int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock)
 		return 0;
 	}
 
+	if ((tdb->allrecord_lock.ltype == F_WRLCK) &&
+	    (tdb->allrecord_lock.off == 0)) {
+		tdb_seqlock_allrecord_write_end(tdb);
+	}
+
 	if (!mark_lock) {
 		int ret;
 
@@ -84,6 +84,21 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 	if (tdb->flags & TDB_MUTEX_LOCKING) {
 		newdb->feature_flags |= TDB_FEATURE_FLAG_MUTEX;
 	}
+	if (tdb->flags & TDB_SEQLOCK) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_SEQLOCK;
+	}
+	if (tdb->flags & TDB_FREELIST_CLASSES) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_FREELIST_CLASSES;
+	}
+	if (tdb->flags & TDB_RESIZABLE_HASH) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_HASH_RESIZE;
+	}
+	if (tdb->flags & TDB_GROUP_COMMIT) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_GROUP_COMMIT;
+	}
+	if (tdb->flags & TDB_WAL) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_WAL;
+	}
 
 	/*
 	 * If we have any features we add the FEATURE_FLAG_MAGIC, overwriting the
@@ -97,7 +112,7 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 	 * It's required for some following code pathes
 	 * to have the fields on 'tdb' up-to-date.
 	 *
-	 * E.g. tdb_mutex_size() requires it
+	 * E.g. tdb_mutex_size() and tdb_seqlock_size() require it
 	 */
 	tdb->feature_flags = newdb->feature_flags;
 	tdb->hash_size = newdb->hash_size;
@@ -118,8 +133,12 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 
 	if (newdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
 		newdb->mutex_size = tdb_mutex_size(tdb);
-		tdb->hdr_ofs = newdb->mutex_size;
 	}
+	if (newdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+		newdb->seqlock_size = tdb_seqlock_size(tdb);
+		tdb->seqlock_size = newdb->seqlock_size;
+	}
+	tdb->hdr_ofs = newdb->mutex_size + newdb->seqlock_size;
 
 	/* This creates an endian-converted header, as if read from disk */
 	CONVERT(*newdb);
@@ -130,7 +149,7 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 	if (!tdb_write_all(tdb->fd, newdb, size))
 		goto fail;
 
-	if (newdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
 
 		/*
 		 * Now we init the mutex area
@@ -139,7 +158,7 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 
 		ret = ftruncate(
 			tdb->fd,
-			newdb->mutex_size + sizeof(struct tdb_header));
+			tdb_mutex_size(tdb) + sizeof(struct tdb_header));
 		if (ret == -1) {
 			goto fail;
 		}
@@ -147,12 +166,15 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 		if (ret == -1) {
 			goto fail;
 		}
+	}
 
+	if (tdb->hdr_ofs != 0) {
 		/*
-		 * Write a second header behind the mutexes. That's the area
-		 * that will be mmapp'ed.
+		 * Write a second header behind the mutexes and the
+		 * sequence counters. That's the area that will be
+		 * mmapp'ed. The counters start out as zero.
 		 */
-		ret = lseek(tdb->fd, newdb->mutex_size, SEEK_SET);
+		ret = lseek(tdb->fd, tdb->hdr_ofs, SEEK_SET);
 		if (ret == -1) {
 			goto fail;
 		}
@@ -301,6 +323,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	struct tdb_context *tdb;
 	struct stat st;
 	int rev = 0, locked = 0;
+	bool created = false;
 	unsigned char *vp;
 	uint32_t vertest;
 	unsigned v;
@@ -469,6 +492,70 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		}
 	}
 
+	if (tdb->flags & TDB_SEQLOCK) {
+		if (tdb->flags & TDB_INTERNAL) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				"invalid flags for %s - TDB_SEQLOCK and "
+				"TDB_INTERNAL are not allowed together\n", name));
+			errno = EINVAL;
+			goto fail;
+		}
+
+#ifndef USE_TDB_SEQLOCK
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			"invalid flags for %s - TDB_SEQLOCK is not "
+			"supported on this platform\n", name));
+		errno = ENOSYS;
+		goto fail;
+#endif
+	}
+
+	if ((tdb->flags & TDB_RESIZABLE_HASH) && (tdb->flags & TDB_INTERNAL)) {
+		/*
+		 * Resizing is done in transactions, which internal
+		 * databases don't have.
+		 */
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			"invalid flags for %s - TDB_RESIZABLE_HASH and "
+			"TDB_INTERNAL are not allowed together\n", name));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if ((tdb->flags & TDB_GROUP_COMMIT) && (tdb->flags & TDB_INTERNAL)) {
+		/*
+		 * There is nothing to sync for internal databases.
+		 */
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			"invalid flags for %s - TDB_GROUP_COMMIT and "
+			"TDB_INTERNAL are not allowed together\n", name));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if (tdb->flags & TDB_WAL) {
+		/*
+		 * The log is in a file of its own and replaces the
+		 * recovery area group commits rely on.
+		 */
+		if (tdb->flags & TDB_INTERNAL) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				"invalid flags for %s - TDB_WAL and "
+				"TDB_INTERNAL are not allowed together\n", name));
+			errno = EINVAL;
+			goto fail;
+		}
+
+		if (tdb->flags & TDB_GROUP_COMMIT) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+				"invalid flags for %s - TDB_WAL and "
+				"TDB_GROUP_COMMIT are not allowed together\n",
+				name));
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
 	if (getenv("TDB_NO_FSYNC")) {
 		tdb->flags |= TDB_NOSYNC;
 	}
@@ -530,6 +617,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 			tdb_unlockall(tdb);
 			goto fail;
 		}
+		created = true;
 		ret = tdb_brunlock(tdb, F_WRLCK, FREELIST_TOP, 0);
 		if (ret == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_open_ex: "
@@ -556,6 +644,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 			}
 			goto fail;
 		}
+		created = true;
 		rev = (tdb->flags & TDB_CONVERT);
 	} else if (header.version != TDB_VERSION
 		   && !(rev = (header.version==TDB_BYTEREV(TDB_VERSION)))) {
@@ -630,6 +719,22 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		tdb->hdr_ofs = header.mutex_size;
 	}
 
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+		if (!tdb_seqlock_open_ok(tdb, &header)) {
+			errno = EINVAL;
+			goto fail;
+		}
+
+		/*
+		 * The sequence counters follow the mutex area.
+		 */
+		tdb->seqlock_size = header.seqlock_size;
+		tdb->hdr_ofs = header.seqlock_size;
+		if (tdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+			tdb->hdr_ofs += header.mutex_size;
+		}
+	}
+
 	if ((header.magic1_hash == 0) && (header.magic2_hash == 0)) {
 		/* older TDB without magic hash references */
 		tdb->hash_fn = tdb_old_hash;
@@ -681,6 +786,22 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		}
 	}
 
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+		if (!(tdb->flags & TDB_NOLOCK)) {
+			ret = tdb_seqlock_mmap(tdb);
+			if (ret != 0) {
+				goto fail;
+			}
+		}
+	}
+
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_WAL) {
+		/* This replays the log if we're the first one */
+		if (tdb_wal_open(tdb, created, mode) == -1) {
+			goto fail;
+		}
+	}
+
 	if (locked) {
 		if (tdb_nest_unlock(tdb, ACTIVE_LOCK, F_WRLCK, false) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
@@ -750,6 +871,8 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_seqlock_munmap(tdb);
+	tdb_wal_free(tdb);
 	if (tdb->fd != -1)
 		if (close(tdb->fd) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: failed to close tdb->fd on error!\n"));
@@ -785,6 +908,8 @@ _PUBLIC_ int tdb_close(struct tdb_context *tdb)
 	}
 	tdb_trace(tdb, "tdb_close");
 
+	tdb_wal_close(tdb);
+
 	if (tdb->map_ptr) {
 		if (tdb->flags & TDB_INTERNAL)
 			SAFE_FREE(tdb->map_ptr);
@@ -793,6 +918,7 @@ _PUBLIC_ int tdb_close(struct tdb_context *tdb)
 	}
 
 	tdb_mutex_munmap(tdb);
+	tdb_seqlock_munmap(tdb);
 
 	SAFE_FREE(tdb->name);
 	if (tdb->fd != -1) {
@@ -902,6 +1028,11 @@ static int tdb_reopen_internal(struct tdb_context *tdb, bool active_lock)
 		goto fail;
 	}
 
+	if (tdb_wal_reopen(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: failed to obtain wal active lock\n"));
+		goto fail;
+	}
+
 	return 0;
 
 fail:
@@ -0,0 +1,519 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   trivial database library
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tdb_private.h"
+
+/*
+ * The hash size of a tdb is fixed when it is created, so a tdb that
+ * holds many more records than anticipated ends up with long hash
+ * chains. With TDB_FEATURE_FLAG_HASH_RESIZE the hash chains can move
+ * into a larger table that is stored as a TDB_HASHTABLE_MAGIC record.
+ *
+ * The larger table has hash_size * factor buckets. Lock chain l =
+ * h % hash_size owns the buckets l, l + hash_size, l + 2 * hash_size
+ * ... and the upper bits of h multiplied by a large odd constant
+ * pick one of them. Anything based on h % (hash_size * factor) would
+ * only look at the low bits, which tdb_old_hash() doesn't spread
+ * well. All locks, mutexes and sequence counters stay exactly as they
+ * are.
+ *
+ * A resize moves the lock chains over to the new table in small
+ * steps, each of which is a transaction. Chains below
+ * hash_resize.progress already are in the new table. A step is done
+ * every TDB_REHASH_INTERVAL stores by whoever happens to store, and
+ * only if the transaction lock is free: the store itself never has
+ * to wait for a resize.
+ *
+ * Whether the table is too small is decided by every process on its
+ * own: tdb_find() reports the length of the chains it walked without
+ * finding the key, and if their moving average gets too long a
+ * resize is started.
+ */
+
+/* a resize starts when misses walk this many records on average */
+#define TDB_REHASH_CHAIN_LEN 8
+/* the new table has this many times the buckets of the old one */
+#define TDB_REHASH_GROWTH 4
+/* ... but never more buckets than this */
+#define TDB_REHASH_MAX_BUCKETS (1U<<20)
+/* a resize is done in this many steps */
+#define TDB_REHASH_STEPS 16
+/* stores between two looks at the table */
+#define TDB_REHASH_INTERVAL 8
+
+static bool tdb_hash_factor_valid(struct tdb_context *tdb, uint32_t factor)
+{
+	return (factor != 0) && (factor <= TDB_REHASH_MAX_BUCKETS) &&
+		(factor <= UINT32_MAX / tdb->hash_size);
+}
+
+/* Don't divide by garbage from a corrupt or half written header */
+bool tdb_hash_resize_valid(struct tdb_context *tdb,
+			   const struct tdb_hash_resize *r)
+{
+	if (r->table != 0 && !tdb_hash_factor_valid(tdb, r->factor)) {
+		return false;
+	}
+	if (r->new_table != 0 &&
+	    (!tdb_hash_factor_valid(tdb, r->new_factor) ||
+	     r->progress > tdb->hash_size)) {
+		return false;
+	}
+	return true;
+}
+
+int tdb_hash_resize_read(struct tdb_context *tdb, struct tdb_hash_resize *r)
+{
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE)) {
+		memset(r, 0, sizeof(*r));
+		return 0;
+	}
+
+	if (tdb->methods->tdb_read(tdb, TDB_HASH_RESIZE_OFS, r, sizeof(*r),
+				   DOCONV()) == -1) {
+		return -1;
+	}
+
+	if (!tdb_hash_resize_valid(tdb, r)) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_hash_resize_read: "
+			 "invalid hash table %u/%u %u/%u/%u\n",
+			 r->table, r->factor, r->new_table, r->new_factor,
+			 r->progress));
+		return -1;
+	}
+	return 0;
+}
+
+static int tdb_hash_resize_write(struct tdb_context *tdb,
+				 const struct tdb_hash_resize *r)
+{
+	struct tdb_hash_resize tmp = *r;
+
+	return tdb->methods->tdb_write(tdb, TDB_HASH_RESIZE_OFS,
+				       CONVERT(tmp), sizeof(tmp));
+}
+
+/* Go back to the table behind the header, for tdb_wipe_all() */
+int tdb_hash_resize_reset(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE)) {
+		return 0;
+	}
+	memset(&r, 0, sizeof(r));
+	return tdb_hash_resize_write(tdb, &r);
+}
+
+/* The table lock chain "list" currently lives in */
+void tdb_hash_chain_table(struct tdb_context *tdb,
+			  const struct tdb_hash_resize *r, uint32_t list,
+			  struct tdb_hash_table *t)
+{
+	if (r->new_table != 0 && list < r->progress) {
+		t->ofs = r->new_table;
+		t->factor = r->new_factor;
+	} else if (r->table != 0) {
+		t->ofs = r->table;
+		t->factor = r->factor;
+	} else {
+		t->ofs = 0;
+		t->factor = 1;
+	}
+}
+
+int tdb_hash_table_read(struct tdb_context *tdb, uint32_t list,
+			struct tdb_hash_table *t)
+{
+	struct tdb_hash_resize r;
+
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		return -1;
+	}
+	tdb_hash_chain_table(tdb, &r, list, t);
+	return 0;
+}
+
+/* Offset of the head of bucket "sub" of lock chain "list" */
+tdb_off_t tdb_hash_table_top(struct tdb_context *tdb,
+			     const struct tdb_hash_table *t,
+			     uint32_t list, uint32_t sub)
+{
+	if (t->ofs == 0) {
+		return TDB_HASH_TOP(list);
+	}
+	return t->ofs + sizeof(struct tdb_record)
+		+ (list + sub * tdb->hash_size) * sizeof(tdb_off_t);
+}
+
+/* Which of the buckets of its lock chain a hash goes to */
+uint32_t tdb_hash_table_sub(struct tdb_context *tdb,
+			    const struct tdb_hash_table *t, uint32_t hash)
+{
+	if (t->ofs == 0) {
+		return 0;
+	}
+	return ((uint64_t)(hash * 2654435761U) * t->factor) >> 32;
+}
+
+tdb_off_t tdb_hash_resize_top(struct tdb_context *tdb,
+			      const struct tdb_hash_resize *r, uint32_t hash)
+{
+	struct tdb_hash_table t;
+
+	tdb_hash_chain_table(tdb, r, BUCKET(hash), &t);
+	return tdb_hash_table_top(tdb, &t, BUCKET(hash),
+				  tdb_hash_table_sub(tdb, &t, hash));
+}
+
+/*
+ * Replacement for TDB_HASH_TOP(hash) that knows about resized
+ * tables. Returns 0 on error.
+ */
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, uint32_t hash)
+{
+	struct tdb_hash_resize r;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE)) {
+		return TDB_HASH_TOP(hash);
+	}
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		return 0;
+	}
+	return tdb_hash_resize_top(tdb, &r, hash);
+}
+
+/* Are any chains outside the table behind the header? */
+bool tdb_hash_resized(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE)) {
+		return false;
+	}
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		return true;
+	}
+	return (r.table != 0) || (r.new_table != 0);
+}
+
+static uint32_t tdb_hash_resize_buckets(struct tdb_context *tdb,
+					const struct tdb_hash_resize *r)
+{
+	if (r->new_table != 0) {
+		return tdb->hash_size * r->new_factor;
+	}
+	if (r->table != 0) {
+		return tdb->hash_size * r->factor;
+	}
+	return tdb->hash_size;
+}
+
+/*
+ * tdb_find() walked a whole chain of chain_len records without
+ * finding its key.
+ */
+void tdb_rehash_sample(struct tdb_context *tdb, uint32_t chain_len)
+{
+	if (chain_len > UINT16_MAX) {
+		chain_len = UINT16_MAX;
+	}
+	tdb->rehash_chain_avg -= tdb->rehash_chain_avg / 16;
+	tdb->rehash_chain_avg += chain_len;
+}
+
+static bool tdb_rehash_wanted(struct tdb_context *tdb,
+			      const struct tdb_hash_resize *r)
+{
+	uint32_t buckets;
+
+	if (r->new_table != 0) {
+		/* someone started, help to finish */
+		return true;
+	}
+
+	buckets = tdb_hash_resize_buckets(tdb, r);
+	if (buckets != tdb->rehash_buckets) {
+		/* our samples are from a different table */
+		return false;
+	}
+	if (tdb->rehash_chain_avg < TDB_REHASH_CHAIN_LEN * 16) {
+		return false;
+	}
+	return buckets <= TDB_REHASH_MAX_BUCKETS / TDB_REHASH_GROWTH;
+}
+
+static int tdb_rehash_start(struct tdb_context *tdb,
+			    struct tdb_hash_resize *r)
+{
+	uint32_t factor = (r->table != 0 ? r->factor : 1) * TDB_REHASH_GROWTH;
+	tdb_len_t len = tdb->hash_size * factor * sizeof(tdb_off_t);
+	struct tdb_record rec;
+	tdb_off_t ofs, i;
+	char buf[1024];
+
+	ofs = tdb_allocate(tdb, 0, len, &rec);
+	if (ofs == 0) {
+		return -1;
+	}
+
+	rec.magic = TDB_HASHTABLE_MAGIC;
+	rec.next = 0;
+	rec.key_len = 0;
+	rec.data_len = len;
+	rec.full_hash = 0;
+	if (tdb_rec_write(tdb, ofs, &rec) == -1) {
+		return -1;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < len; i += sizeof(buf)) {
+		tdb_len_t n = len - i;
+
+		if (n > sizeof(buf)) {
+			n = sizeof(buf);
+		}
+		if (tdb->methods->tdb_write(tdb, ofs + sizeof(rec) + i,
+					    buf, n) == -1) {
+			return -1;
+		}
+	}
+
+	r->new_table = ofs;
+	r->new_factor = factor;
+	r->progress = 0;
+	return 0;
+}
+
+static int tdb_hash_table_free(struct tdb_context *tdb, tdb_off_t ofs)
+{
+	struct tdb_record rec;
+	int ret;
+
+	if (tdb->methods->tdb_read(tdb, ofs, &rec, sizeof(rec),
+				   DOCONV()) == -1) {
+		return -1;
+	}
+	if (rec.magic != TDB_HASHTABLE_MAGIC) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_hash_table_free: "
+			 "bad magic 0x%x at offset %u\n", rec.magic, ofs));
+		return -1;
+	}
+
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+		return -1;
+	}
+	ret = tdb_free(tdb, ofs, &rec);
+	tdb_unlock(tdb, -1, F_WRLCK);
+	return ret;
+}
+
+/*
+ * Move all records of lock chain "list" from one table to the
+ * other. The records stay where they are, only the next pointers
+ * change, so we don't even have to look at the keys.
+ */
+static int tdb_rehash_chain(struct tdb_context *tdb,
+			    const struct tdb_hash_table *from,
+			    const struct tdb_hash_table *to,
+			    uint32_t list)
+{
+	uint32_t sub;
+
+	for (sub = 0; sub < from->factor; sub++) {
+		tdb_off_t top = tdb_hash_table_top(tdb, from, list, sub);
+		tdb_off_t rec_ptr, zero = 0;
+
+		if (tdb_ofs_read(tdb, top, &rec_ptr) == -1) {
+			return -1;
+		}
+
+		while (rec_ptr != 0) {
+			struct tdb_record rec;
+			tdb_off_t new_top, head;
+
+			if (tdb_rec_read(tdb, rec_ptr, &rec) == -1) {
+				return -1;
+			}
+			if (BUCKET(rec.full_hash) != list ||
+			    rec.next == rec_ptr) {
+				tdb->ecode = TDB_ERR_CORRUPT;
+				TDB_LOG((tdb, TDB_DEBUG_FATAL,
+					 "tdb_rehash_chain: bad record at "
+					 "offset %u in chain %u\n",
+					 rec_ptr, list));
+				return -1;
+			}
+
+			new_top = tdb_hash_table_top(
+				tdb, to, list,
+				tdb_hash_table_sub(tdb, to, rec.full_hash));
+
+			/* next ptr is at start of record. */
+			if (tdb_ofs_read(tdb, new_top, &head) == -1 ||
+			    tdb_ofs_write(tdb, rec_ptr, &head) == -1 ||
+			    tdb_ofs_write(tdb, new_top, &rec_ptr) == -1) {
+				return -1;
+			}
+			rec_ptr = rec.next;
+		}
+
+		if (tdb_ofs_write(tdb, top, &zero) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do one step of a resize, starting one if none is in progress and
+ * our chain statistics ask for it. Returns 0 if there was nothing to
+ * do or the step is committed.
+ */
+int tdb_rehash_step(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r;
+	struct tdb_hash_table from, to;
+	uint32_t list, end, chains;
+
+	if (tdb->transaction != NULL) {
+		/* this would nest into the caller's transaction */
+		tdb->ecode = TDB_ERR_NESTING;
+		return -1;
+	}
+
+	if (tdb_transaction_start_nonblock(tdb) == -1) {
+		return -1;
+	}
+
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		goto fail;
+	}
+	if (!tdb_rehash_wanted(tdb, &r)) {
+		tdb_transaction_cancel(tdb);
+		return 0;
+	}
+
+	if (r.new_table == 0) {
+		if (tdb_rehash_start(tdb, &r) == -1) {
+			goto fail;
+		}
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_rehash_step: "
+			 "growing the hash table of %s to %u buckets\n",
+			 tdb->name, tdb->hash_size * r.new_factor));
+	}
+
+	chains = (tdb->hash_size + TDB_REHASH_STEPS - 1) / TDB_REHASH_STEPS;
+	end = r.progress + chains;
+	if (end > tdb->hash_size) {
+		end = tdb->hash_size;
+	}
+
+	to.ofs = r.new_table;
+	to.factor = r.new_factor;
+
+	for (list = r.progress; list < end; list++) {
+		tdb_hash_chain_table(tdb, &r, list, &from);
+		if (tdb_rehash_chain(tdb, &from, &to, list) == -1) {
+			goto fail;
+		}
+	}
+	r.progress = end;
+
+	if (r.progress == tdb->hash_size) {
+		if (r.table != 0 && tdb_hash_table_free(tdb, r.table) == -1) {
+			goto fail;
+		}
+		r.table = r.new_table;
+		r.factor = r.new_factor;
+		r.new_table = 0;
+		r.new_factor = 0;
+		r.progress = 0;
+	}
+
+	if (tdb_hash_resize_write(tdb, &r) == -1) {
+		goto fail;
+	}
+
+	return tdb_transaction_commit(tdb);
+
+fail:
+	tdb_transaction_cancel(tdb);
+	return -1;
+}
+
+/*
+ * Called after a store with the chain unlocked: every
+ * TDB_REHASH_INTERVAL stores see whether the hash table needs to
+ * grow, or help with a resize in progress.
+ */
+void tdb_rehash_check(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r;
+	enum TDB_ERROR ecode;
+	uint32_t buckets;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE)) {
+		return;
+	}
+	if (tdb->rehash_countdown > 0) {
+		tdb->rehash_countdown--;
+		return;
+	}
+	tdb->rehash_countdown = TDB_REHASH_INTERVAL;
+
+	/*
+	 * A step is a transaction of its own, so don't try inside a
+	 * transaction, traverse or with locks held.
+	 */
+	if (tdb->read_only || tdb->traverse_read || tdb->traverse_write ||
+	    tdb->transaction != NULL || tdb->travlocks.off != 0 ||
+	    tdb->travlocks.next != NULL || tdb_have_extra_locks(tdb)) {
+		return;
+	}
+
+	/* The store worked, whatever happens here */
+	ecode = tdb->ecode;
+
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		goto done;
+	}
+
+	buckets = tdb_hash_resize_buckets(tdb, &r);
+	if (r.new_table != 0) {
+		/* chains are half moved: samples tell nothing */
+		tdb->rehash_chain_avg = 0;
+		tdb->rehash_buckets = 0;
+	} else if (buckets != tdb->rehash_buckets) {
+		tdb->rehash_chain_avg = 0;
+		tdb->rehash_buckets = buckets;
+	}
+
+	if (tdb_rehash_wanted(tdb, &r)) {
+		tdb_rehash_step(tdb);
+	}
+
+done:
+	tdb->ecode = ecode;
+}
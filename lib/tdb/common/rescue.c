@@ -201,6 +201,64 @@ static void free_table(struct found_table *found)
 	free(found->arr);
 }
 
+static void walk_chain(struct tdb_context *tdb, struct found_table *found,
+		       tdb_off_t slow_off, bool is_free)
+{
+	bool slow_chase = false;
+	struct tdb_record rec;
+	tdb_off_t off;
+
+	if (tdb_ofs_read(tdb, slow_off, &off) == -1)
+		return;
+
+	while (off && off != slow_off) {
+		if (tdb->methods->tdb_read(tdb, off, &rec, sizeof(rec),
+					   DOCONV()) != 0) {
+			break;
+		}
+
+		if (is_free) {
+			/* Don't mark garbage as free. */
+			if (rec.magic != TDB_FREE_MAGIC) {
+				break;
+			}
+			mark_free_area(found, off,
+				       sizeof(rec) + rec.rec_len);
+		} else {
+			found_in_hashchain(found, off);
+		}
+
+		off = rec.next;
+
+		/* Loop detection using second pointer at half-speed */
+		if (slow_chase) {
+			/* First entry happens to be next ptr */
+			tdb_ofs_read(tdb, slow_off, &slow_off);
+		}
+		slow_chase = !slow_chase;
+	}
+}
+
+static void walk_hash_table(struct tdb_context *tdb,
+			    struct found_table *found,
+			    tdb_off_t table, uint32_t factor)
+{
+	struct tdb_record rec;
+	uint32_t b;
+
+	if (tdb->methods->tdb_read(tdb, table, &rec, sizeof(rec),
+				   DOCONV()) != 0 ||
+	    rec.magic != TDB_HASHTABLE_MAGIC ||
+	    rec.data_len / sizeof(tdb_off_t) / factor < tdb->hash_size) {
+		return;
+	}
+
+	for (b = 0; b < tdb->hash_size * factor; b++) {
+		walk_chain(tdb, found,
+			   table + sizeof(rec) + b*sizeof(tdb_off_t), false);
+	}
+}
+
 static void logging_suppressed(struct tdb_context *tdb,
 			       enum tdb_debug_level level, const char *fmt, ...)
 {
@@ -216,6 +274,7 @@ _PUBLIC_ int tdb_rescue(struct tdb_context *tdb,
 	struct tdb_record rec;
 	TDB_DATA key;
 	bool locked;
+	struct tdb_hash_resize resize;
 
 	/* Read-only databases use no locking at all: it's best-effort.
 	 * We may have a write lock already, so skip that case too. */
@@ -249,40 +308,31 @@ _PUBLIC_ int tdb_rescue(struct tdb_context *tdb,
 	}
 
 	/* Walk hash chains to positive vet. */
-	for (h = 0; h < 1+tdb->hash_size; h++) {
-		bool slow_chase = false;
-		tdb_off_t slow_off = FREELIST_TOP + h*sizeof(tdb_off_t);
-
-		if (tdb_ofs_read(tdb, FREELIST_TOP + h*sizeof(tdb_off_t),
-				 &off) == -1)
-			continue;
-
-		while (off && off != slow_off) {
-			if (tdb->methods->tdb_read(tdb, off, &rec, sizeof(rec),
-						   DOCONV()) != 0) {
-				break;
-			}
-
-			/* 0 is the free list, rest are hash chains. */
-			if (h == 0) {
-				/* Don't mark garbage as free. */
-				if (rec.magic != TDB_FREE_MAGIC) {
-					break;
-				}
-				mark_free_area(&found, off,
-					       sizeof(rec) + rec.rec_len);
-			} else {
-				found_in_hashchain(&found, off);
-			}
-
-			off = rec.next;
+	for (h = 0; h < tdb->hash_size + TDB_NUM_FREELISTS(tdb); h++) {
+		/*
+		 * 0 is the free list, then come the hash chains and the
+		 * other freelists if the free space is split by size.
+		 */
+		if (h <= tdb->hash_size) {
+			walk_chain(tdb, &found,
+				   FREELIST_TOP + h*sizeof(tdb_off_t),
+				   h == 0);
+		} else {
+			walk_chain(tdb, &found,
+				   FREELIST_CLASS_TOP(h - tdb->hash_size),
+				   true);
+		}
+	}
 
-			/* Loop detection using second pointer at half-speed */
-			if (slow_chase) {
-				/* First entry happens to be next ptr */
-				tdb_ofs_read(tdb, slow_off, &slow_off);
-			}
-			slow_chase = !slow_chase;
+	/* And the buckets of resized hash tables, if we can trust them */
+	if (tdb_hash_resize_read(tdb, &resize) == 0) {
+		if (resize.table != 0) {
+			walk_hash_table(tdb, &found, resize.table,
+					resize.factor);
+		}
+		if (resize.new_table != 0) {
+			walk_hash_table(tdb, &found, resize.new_table,
+					resize.new_factor);
 		}
 	}
 
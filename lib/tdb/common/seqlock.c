@@ -0,0 +1,448 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   trivial database library
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tdb_private.h"
+
+#ifdef USE_TDB_SEQLOCK
+
+/*
+ * With TDB_FEATURE_FLAG_SEQLOCK every hash chain gets a sequence
+ * counter. Whoever holds a chain write lock makes the counter odd
+ * before touching the chain and even again before dropping the
+ * lock. Index 0 does the same for the allrecord write lock, which is
+ * what transaction commits and tdb_wipe_all() run under.
+ *
+ * Readers of a mmap'ed tdb can then walk a chain without locking:
+ * sample both counters, walk the chain copying out the record, and
+ * check that none of the counters moved. If a counter is odd or has
+ * changed, a writer was active and the lookup is retried or done with
+ * the chain lock held as before.
+ *
+ * The counters live in a separate page aligned area in front of the
+ * tdb data, behind the mutex area if there is one. Like the mutex
+ * area it starts with a copy of the tdb header, so that the file
+ * still starts with a valid header without mutexes. tdb->hdr_ofs
+ * skips both areas, so the normal read and write path is unchanged.
+ *
+ * A writer that dies inside a write section leaves its counter odd.
+ * Readers of that chain then just take the locked path until the
+ * next writer on the chain moves the counter on.
+ */
+
+struct tdb_seqlocks {
+	struct tdb_header hdr;
+
+	/*
+	 * Index 0 is the allrecord counter, followed by
+	 * one counter per hashchain.
+	 */
+	uint32_t seqnums[1];
+};
+
+/*
+ * A lookup racing with writers is retried this often before we give
+ * up and take the chain lock.
+ */
+#define TDB_SEQLOCK_RETRIES 3
+
+size_t tdb_seqlock_size(struct tdb_context *tdb)
+{
+	size_t seqlock_size;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK)) {
+		return 0;
+	}
+
+	seqlock_size = sizeof(struct tdb_seqlocks);
+	seqlock_size += tdb->hash_size * sizeof(uint32_t);
+
+	return TDB_ALIGN(seqlock_size, tdb->page_size);
+}
+
+bool tdb_seqlock_open_ok(struct tdb_context *tdb,
+			 const struct tdb_header *header)
+{
+	size_t needed;
+	tdb_off_t hdr_ofs;
+
+	needed = sizeof(struct tdb_seqlocks);
+	needed += tdb->hash_size * sizeof(uint32_t);
+
+	if (header->seqlock_size < needed) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_seqlock_open_ok[%s]: "
+			 "seqlock area of %u bytes too small for %u "
+			 "chains\n", tdb->name,
+			 (unsigned int)header->seqlock_size,
+			 (unsigned int)tdb->hash_size));
+		return false;
+	}
+
+	hdr_ofs = 0;
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+		hdr_ofs = header->mutex_size;
+	}
+	if (!tdb_add_off_t(hdr_ofs, header->seqlock_size, &hdr_ofs)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_seqlock_open_ok[%s]: "
+			 "invalid seqlock size %u\n", tdb->name,
+			 (unsigned int)header->seqlock_size));
+		return false;
+	}
+
+	return true;
+}
+
+int tdb_seqlock_mmap(struct tdb_context *tdb)
+{
+	void *ptr;
+
+	if (tdb->seqlock_size == 0) {
+		return 0;
+	}
+
+	if (tdb->seqlocks != NULL) {
+		return 0;
+	}
+
+	ptr = mmap(NULL, tdb->seqlock_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_FILE, tdb->fd,
+		   tdb->hdr_ofs - tdb->seqlock_size);
+	if (ptr == MAP_FAILED) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_seqlock_mmap[%s]: "
+			 "mmap of %u bytes failed: %s\n", tdb->name,
+			 (unsigned int)tdb->seqlock_size, strerror(errno)));
+		return -1;
+	}
+	tdb->seqlocks = (struct tdb_seqlocks *)ptr;
+
+	return 0;
+}
+
+int tdb_seqlock_munmap(struct tdb_context *tdb)
+{
+	int ret;
+
+	if (tdb->seqlocks == NULL) {
+		return 0;
+	}
+
+	ret = munmap(tdb->seqlocks, tdb->seqlock_size);
+	if (ret == -1) {
+		return -1;
+	}
+	tdb->seqlocks = NULL;
+
+	return 0;
+}
+
+static void tdb_seqlock_write_begin(struct tdb_context *tdb, uint32_t idx)
+{
+	volatile uint32_t *seqnum = &tdb->seqlocks->seqnums[idx];
+
+	/*
+	 * An odd counter here was left behind by a writer that died
+	 * in its write section. Move it on anyway, readers that
+	 * sampled the old value must not validate.
+	 */
+	*seqnum = (*seqnum + 1) | 1;
+	__sync_synchronize();
+}
+
+static void tdb_seqlock_write_end(struct tdb_context *tdb, uint32_t idx)
+{
+	volatile uint32_t *seqnum = &tdb->seqlocks->seqnums[idx];
+
+	__sync_synchronize();
+	*seqnum += 1;
+}
+
+/*
+ * Map a chain lock offset as used in lock.c to a counter index. The
+ * freelist and the special locks below it are not covered.
+ */
+static bool tdb_seqlock_chain_index(struct tdb_context *tdb,
+				    uint32_t offset, uint32_t *idx)
+{
+	if (tdb->seqlocks == NULL) {
+		return false;
+	}
+	if (offset < FREELIST_TOP) {
+		return false;
+	}
+	offset = (offset - FREELIST_TOP) / sizeof(tdb_off_t);
+	if (offset >= tdb->hash_size) {
+		return false;
+	}
+	*idx = offset + 1;
+	return true;
+}
+
+void tdb_seqlock_chain_write_begin(struct tdb_context *tdb, uint32_t offset)
+{
+	uint32_t idx;
+
+	if (tdb_seqlock_chain_index(tdb, offset, &idx)) {
+		tdb_seqlock_write_begin(tdb, idx);
+	}
+}
+
+void tdb_seqlock_chain_write_end(struct tdb_context *tdb, uint32_t offset)
+{
+	uint32_t idx;
+
+	if (tdb_seqlock_chain_index(tdb, offset, &idx)) {
+		tdb_seqlock_write_end(tdb, idx);
+	}
+}
+
+void tdb_seqlock_allrecord_write_begin(struct tdb_context *tdb)
+{
+	if (tdb->seqlocks != NULL) {
+		tdb_seqlock_write_begin(tdb, 0);
+	}
+}
+
+void tdb_seqlock_allrecord_write_end(struct tdb_context *tdb)
+{
+	if (tdb->seqlocks != NULL) {
+		tdb_seqlock_write_end(tdb, 0);
+	}
+}
+
+/*
+ * Walk a hash chain directly in the mmap area without any locks. We
+ * don't trust anything we read: every offset is checked against the
+ * map size and the number of steps is bounded, as a writer might
+ * change the chain under our feet.
+ *
+ * Returns 0 if the record was found with data copied out, 1 if it
+ * does not exist and -1 if we ran into something inconsistent.
+ */
+static int tdb_seqlock_walk(struct tdb_context *tdb, TDB_DATA key,
+			    uint32_t hash, tdb_len_t map_size,
+			    TDB_DATA *data)
+{
+	const unsigned char *map = (const unsigned char *)tdb->map_ptr;
+	struct tdb_record rec;
+	tdb_off_t rec_ptr, end;
+	tdb_len_t max_steps = map_size / sizeof(rec);
+	tdb_len_t steps;
+	tdb_off_t top = TDB_HASH_TOP(hash);
+
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE) {
+		struct tdb_hash_resize r;
+
+		/*
+		 * Resize steps are commits, the allrecord counter
+		 * covers the table we find here.
+		 */
+		memcpy(&r, map + TDB_HASH_RESIZE_OFS, sizeof(r));
+		if (DOCONV()) {
+			tdb_convert(&r, sizeof(r));
+		}
+		if (!tdb_hash_resize_valid(tdb, &r)) {
+			return -1;
+		}
+		top = tdb_hash_resize_top(tdb, &r, hash);
+	}
+
+	if (!tdb_add_off_t(top, sizeof(rec_ptr), &end) || end > map_size) {
+		return -1;
+	}
+	memcpy(&rec_ptr, map + top, sizeof(rec_ptr));
+	if (DOCONV()) {
+		tdb_convert(&rec_ptr, sizeof(rec_ptr));
+	}
+
+	for (steps = 0; rec_ptr != 0; steps++) {
+		tdb_off_t key_ofs, data_ofs;
+
+		if (steps > max_steps) {
+			return -1;
+		}
+		if (!tdb_add_off_t(rec_ptr, sizeof(rec), &key_ofs) ||
+		    key_ofs > map_size) {
+			return -1;
+		}
+		memcpy(&rec, map + rec_ptr, sizeof(rec));
+		if (DOCONV()) {
+			tdb_convert(&rec, sizeof(rec));
+		}
+		if (TDB_BAD_MAGIC(&rec)) {
+			return -1;
+		}
+
+		if (TDB_DEAD(&rec) || (rec.full_hash != hash) ||
+		    (rec.key_len != key.dsize)) {
+			rec_ptr = rec.next;
+			continue;
+		}
+
+		if (!tdb_add_off_t(key_ofs, rec.key_len, &data_ofs) ||
+		    !tdb_add_off_t(data_ofs, rec.data_len, &end) ||
+		    end > map_size) {
+			return -1;
+		}
+		if (memcmp(map + key_ofs, key.dptr, key.dsize) != 0) {
+			rec_ptr = rec.next;
+			continue;
+		}
+
+		data->dptr = (unsigned char *)malloc(
+			rec.data_len ? rec.data_len : 1);
+		if (data->dptr == NULL) {
+			return -1;
+		}
+		memcpy(data->dptr, map + data_ofs, rec.data_len);
+		data->dsize = rec.data_len;
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Try to look up a key without taking the chain lock.
+ *
+ * Returns true if the result could be validated. data->dptr is NULL
+ * if the key does not exist, otherwise a malloc'ed copy of the
+ * record data. Returns false if the caller has to do the lookup under
+ * the chain lock.
+ */
+bool tdb_seqlock_fetch(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
+		       TDB_DATA *data)
+{
+	volatile const uint32_t *seqnums;
+	uint32_t idx;
+	int i;
+
+	if (tdb->seqlocks == NULL) {
+		return false;
+	}
+	if ((tdb->map_ptr == NULL) || (tdb->transaction != NULL)) {
+		return false;
+	}
+
+	seqnums = tdb->seqlocks->seqnums;
+	idx = BUCKET(hash) + 1;
+
+	for (i = 0; i < TDB_SEQLOCK_RETRIES; i++) {
+		uint32_t allrecord, chain;
+		TDB_DATA result = tdb_null;
+		int ret;
+
+		allrecord = seqnums[0];
+		chain = seqnums[idx];
+		if ((allrecord | chain) & 1) {
+			/*
+			 * Someone is writing, we would just spin.
+			 */
+			return false;
+		}
+		__sync_synchronize();
+
+		ret = tdb_seqlock_walk(tdb, key, hash, tdb->map_size,
+				       &result);
+
+		__sync_synchronize();
+		if ((seqnums[0] != allrecord) || (seqnums[idx] != chain)) {
+			SAFE_FREE(result.dptr);
+			continue;
+		}
+
+		if (ret == -1) {
+			/*
+			 * Consistent, but not something we can deal
+			 * with. Most likely the file was expanded by
+			 * someone else, the locked path will remap.
+			 */
+			return false;
+		}
+
+		*data = result;
+		return true;
+	}
+
+	return false;
+}
+
+#else
+
+size_t tdb_seqlock_size(struct tdb_context *tdb)
+{
+	return 0;
+}
+
+bool tdb_seqlock_open_ok(struct tdb_context *tdb,
+			 const struct tdb_header *header)
+{
+	if (tdb->flags & TDB_NOLOCK) {
+		/*
+		 * We don't look at locks, so we don't need to
+		 * maintain the sequence counters either.
+		 */
+		return true;
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_seqlock_open_ok[%s]: "
+		 "seqlock tdbs can only be opened with TDB_NOLOCK "
+		 "on this platform\n", tdb->name));
+	return false;
+}
+
+int tdb_seqlock_mmap(struct tdb_context *tdb)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int tdb_seqlock_munmap(struct tdb_context *tdb)
+{
+	return 0;
+}
+
+void tdb_seqlock_chain_write_begin(struct tdb_context *tdb, uint32_t offset)
+{
+	return;
+}
+
+void tdb_seqlock_chain_write_end(struct tdb_context *tdb, uint32_t offset)
+{
+	return;
+}
+
+void tdb_seqlock_allrecord_write_begin(struct tdb_context *tdb)
+{
+	return;
+}
+
+void tdb_seqlock_allrecord_write_end(struct tdb_context *tdb)
+{
+	return;
+}
+
+bool tdb_seqlock_fetch(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
+		       TDB_DATA *data)
+{
+	return false;
+}
+
+#endif
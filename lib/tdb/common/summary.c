@@ -35,7 +35,16 @@
 	"Smallest/average/largest hash chains: %zu/%zu/%zu\n" \
 	"Number of uncoalesced records: %zu\n" \
 	"Smallest/average/largest uncoalesced runs: %zu/%zu/%zu\n" \
-	"Percentage keys/data/padding/free/dead/rechdrs&tailers/hashes: %.0f/%.0f/%.0f/%.0f/%.0f/%.0f/%.0f\n"
+	"Percentage keys/data/padding/free/dead/rechdrs&tailers/hashes: %.0f/%.0f/%.0f/%.0f/%.0f/%.0f/%.0f\n" \
+	"Hash buckets/lock chains: %zu/%u\n" \
+	"Hash chain lengths 0/1/2/3-4/5-8/9-16/17-32/33-64/65+: " \
+	"%zu/%zu/%zu/%zu/%zu/%zu/%zu/%zu/%zu\n"
+
+#define REHASH_FORMAT \
+	"Hash table resize: %u/%u lock chains moved to %zu buckets\n"
+
+#define FREELIST_FORMAT \
+	"Free list %u (records >= %zu): %zu records, %zu bytes, largest %zu, fragmentation %.0f%%\n"
 
 /* We don't use tally module, to keep upstream happy. */
 struct tally {
@@ -69,12 +78,12 @@ static size_t tally_mean(const struct tally *tally)
 	return tally->total / tally->num;
 }
 
-static size_t get_hash_length(struct tdb_context *tdb, unsigned int i)
+static size_t get_hash_length(struct tdb_context *tdb, tdb_off_t top)
 {
 	tdb_off_t rec_ptr;
 	size_t count = 0;
 
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(i), &rec_ptr) == -1)
+	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
 		return 0;
 
 	/* keep looking until we find the right record */
@@ -88,6 +97,60 @@ static size_t get_hash_length(struct tdb_context *tdb, unsigned int i)
 	return count;
 }
 
+/* Histogram bin of a chain length: 0, 1, 2, 3-4, 5-8, ... 65+ */
+#define NUM_CHAIN_BINS 9
+
+static unsigned int chain_bin(size_t len)
+{
+	unsigned int bin = 0;
+
+	if (len <= 2)
+		return len;
+	len -= 1;
+	while (len > 1 && bin < NUM_CHAIN_BINS - 3) {
+		len >>= 1;
+		bin++;
+	}
+	return bin + 2;
+}
+
+/* We don't use tdb_rec_free_read(), it fixes up records. */
+static bool get_freelist_tally(struct tdb_context *tdb, unsigned int fclass,
+			       struct tally *tally)
+{
+	tdb_off_t rec_ptr;
+	size_t count = 0;
+
+	if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(fclass), &rec_ptr) == -1)
+		return false;
+
+	while (rec_ptr) {
+		struct tdb_record r;
+		if (tdb->methods->tdb_read(tdb, rec_ptr, &r, sizeof(r),
+					   DOCONV()) == -1)
+			return false;
+		if (r.magic != TDB_FREE_MAGIC)
+			return false;
+		/* A loop in the list. */
+		if (++count > tdb->map_size / sizeof(r))
+			return false;
+		tally_add(tally, r.rec_len);
+		rec_ptr = r.next;
+	}
+	return true;
+}
+
+/*
+ * Fragmentation of a freelist: how much of its free space is not in
+ * its largest record.
+ */
+static double tally_fragmentation(const struct tally *tally)
+{
+	if (!tally->total)
+		return 0.0;
+	return (tally->total - tally->max) * 100.0 / tally->total;
+}
+
 _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 {
 	off_t file_size;
@@ -99,6 +162,11 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	size_t unc = 0;
 	int len;
 	struct tdb_record recovery;
+	unsigned int fclass;
+	struct tdb_hash_resize resize;
+	size_t chain_bins[NUM_CHAIN_BINS];
+	size_t hashtables;
+	unsigned int h;
 
 	/* Read-only databases use no locking at all: it's best-effort.
 	 * We may have a write lock already, so skip that case too. */
@@ -121,6 +189,12 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	tally_init(&extra);
 	tally_init(&hashval);
 	tally_init(&uncoal);
+	memset(chain_bins, 0, sizeof(chain_bins));
+	hashtables = tdb->hash_size * sizeof(tdb_off_t);
+
+	if (tdb_hash_resize_read(tdb, &resize) == -1) {
+		goto unlock;
+	}
 
 	for (off = TDB_DATA_START(tdb->hash_size);
 	     off < tdb->map_size - 1;
@@ -142,6 +216,12 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 			tally_add(&freet, rec.rec_len);
 			unc++;
 			break;
+		case TDB_HASHTABLE_MAGIC:
+			hashtables += sizeof(rec) + rec.rec_len;
+			if (unc > 1)
+				tally_add(&uncoal, unc - 1);
+			unc = 0;
+			break;
 		/* If we crash after ftruncate, we can get zeroes or fill. */
 		case TDB_RECOVERY_INVALID_MAGIC:
 		case 0x42424242:
@@ -165,8 +245,19 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 	if (unc > 1)
 		tally_add(&uncoal, unc - 1);
 
-	for (off = 0; off < tdb->hash_size; off++)
-		tally_add(&hashval, get_hash_length(tdb, off));
+	for (h = 0; h < tdb->hash_size; h++) {
+		struct tdb_hash_table table;
+		uint32_t sub;
+
+		tdb_hash_chain_table(tdb, &resize, h, &table);
+		for (sub = 0; sub < table.factor; sub++) {
+			size_t chain_len = get_hash_length(
+				tdb, tdb_hash_table_top(tdb, &table, h, sub));
+
+			tally_add(&hashval, chain_len);
+			chain_bins[chain_bin(chain_len)]++;
+		}
+	}
 
 	file_size = tdb->hdr_ofs + tdb->map_size;
 
@@ -196,12 +287,53 @@ _PUBLIC_ char *tdb_summary(struct tdb_context *tdb)
 		 (keys.num + freet.num + dead.num)
 		 * (sizeof(struct tdb_record) + sizeof(uint32_t))
 		 * 100.0 / file_size,
-		 tdb->hash_size * sizeof(tdb_off_t)
-		 * 100.0 / file_size);
+		 hashtables * 100.0 / file_size,
+		 hashval.num, (unsigned)tdb->hash_size,
+		 chain_bins[0], chain_bins[1], chain_bins[2],
+		 chain_bins[3], chain_bins[4], chain_bins[5],
+		 chain_bins[6], chain_bins[7], chain_bins[8]);
 	if (len == -1) {
+		ret = NULL;
 		goto unlock;
 	}
 
+	if (resize.new_table != 0) {
+		char *tmp;
+
+		len = asprintf(&tmp, "%s" REHASH_FORMAT, ret,
+			       (unsigned)resize.progress,
+			       (unsigned)tdb->hash_size,
+			       (size_t)tdb->hash_size * resize.new_factor);
+		free(ret);
+		if (len == -1) {
+			ret = NULL;
+			goto unlock;
+		}
+		ret = tmp;
+	}
+
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		struct tally freelist;
+		char *tmp;
+
+		tally_init(&freelist);
+		if (!get_freelist_tally(tdb, fclass, &freelist)) {
+			SAFE_FREE(ret);
+			goto unlock;
+		}
+
+		len = asprintf(&tmp, "%s" FREELIST_FORMAT, ret, fclass,
+			       (size_t)tdb_freelist_class_min(fclass),
+			       freelist.num, freelist.total, freelist.max,
+			       tally_fragmentation(&freelist));
+		free(ret);
+		if (len == -1) {
+			ret = NULL;
+			goto unlock;
+		}
+		ret = tmp;
+	}
+
 unlock:
 	if (locked) {
 		tdb_unlockall_read(tdb);
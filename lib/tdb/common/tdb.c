@@ -84,16 +84,19 @@ static int tdb_key_compare(TDB_DATA key, TDB_DATA data, void *private_data)
 static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 			struct tdb_record *r)
 {
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
+	uint32_t chain_len = 0;
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec_ptr) == -1)
 		return 0;
 
 	/* keep looking until we find the right record */
 	while (rec_ptr) {
 		if (tdb_rec_read(tdb, rec_ptr, r) == -1)
 			return 0;
+		chain_len++;
 
 		if (!TDB_DEAD(r) && hash==r->full_hash
 		    && key.dsize==r->key_len
@@ -110,6 +113,9 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 		}
 		rec_ptr = r->next;
 	}
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE) {
+		tdb_rehash_sample(tdb, chain_len);
+	}
 	tdb->ecode = TDB_ERR_NOEXIST;
 	return 0;
 }
@@ -233,6 +239,14 @@ static TDB_DATA _tdb_fetch(struct tdb_context *tdb, TDB_DATA key)
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
+
+	if (tdb_seqlock_fetch(tdb, key, hash, &ret)) {
+		if (ret.dptr == NULL) {
+			tdb->ecode = TDB_ERR_NOEXIST;
+		}
+		return ret;
+	}
+
 	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec)))
 		return tdb_null;
 
@@ -266,6 +280,9 @@ _PUBLIC_ TDB_DATA tdb_fetch(struct tdb_context *tdb, TDB_DATA key)
  * This is interesting for all readers of potentially large data structures in
  * the tdb records, ldb indexes being one example.
  *
+ * With TDB_SEQLOCK the record is copied out without taking the chain lock
+ * and the parser runs on that copy.
+ *
  * Return -1 if the record was not found.
  */
 
@@ -276,12 +293,25 @@ _PUBLIC_ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 {
 	tdb_off_t rec_ptr;
 	struct tdb_record rec;
+	TDB_DATA data;
 	int ret;
 	uint32_t hash;
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
 
+	if (tdb_seqlock_fetch(tdb, key, hash, &data)) {
+		if (data.dptr == NULL) {
+			tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, -1);
+			tdb->ecode = TDB_ERR_NOEXIST;
+			return -1;
+		}
+		tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, 0);
+		ret = parser(key, data, private_data);
+		free(data.dptr);
+		return ret;
+	}
+
 	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec))) {
 		/* record not found */
 		tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, -1);
@@ -307,6 +337,16 @@ _PUBLIC_ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 static int tdb_exists_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 {
 	struct tdb_record rec;
+	TDB_DATA data;
+
+	if (tdb_seqlock_fetch(tdb, key, hash, &data)) {
+		if (data.dptr == NULL) {
+			tdb->ecode = TDB_ERR_NOEXIST;
+			return 0;
+		}
+		free(data.dptr);
+		return 1;
+	}
 
 	if (tdb_find_lock_hash(tdb, key, hash, F_RDLCK, &rec) == 0)
 		return 0;
@@ -327,7 +367,7 @@ _PUBLIC_ int tdb_exists(struct tdb_context *tdb, TDB_DATA key)
 /* actually delete an entry in the database given the offset */
 int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record *rec)
 {
-	tdb_off_t last_ptr, i;
+	tdb_off_t last_ptr, i, top;
 	struct tdb_record lastrec;
 
 	if (tdb->read_only || tdb->traverse_read) return -1;
@@ -342,7 +382,8 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 		return -1;
 
 	/* find previous record in hash chain */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(rec->full_hash), &i) == -1)
+	top = tdb_hash_top(tdb, rec->full_hash);
+	if (top == 0 || tdb_ofs_read(tdb, top, &i) == -1)
 		return -1;
 	for (last_ptr = 0; i != rec_ptr; last_ptr = i, i = lastrec.next)
 		if (tdb_rec_read(tdb, i, &lastrec) == -1)
@@ -350,7 +391,7 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 
 	/* unlink it: next ptr is at start of record. */
 	if (last_ptr == 0)
-		last_ptr = TDB_HASH_TOP(rec->full_hash);
+		last_ptr = top;
 	if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1)
 		return -1;
 
@@ -363,11 +404,12 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 static int tdb_count_dead(struct tdb_context *tdb, uint32_t hash)
 {
 	int res = 0;
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 	struct tdb_record rec;
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec_ptr) == -1)
 		return 0;
 
 	while (rec_ptr) {
@@ -389,7 +431,7 @@ int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 {
 	int res = -1;
 	struct tdb_record rec;
-	tdb_off_t rec_ptr;
+	tdb_off_t rec_ptr, top;
 
 	if (tdb_lock_nonblock(tdb, -1, F_WRLCK) == -1) {
 		/*
@@ -399,7 +441,8 @@ int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 	}
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec_ptr) == -1)
 		goto fail;
 
 	while (rec_ptr) {
@@ -496,10 +539,10 @@ tdb_off_t tdb_find_dead(struct tdb_context *tdb, uint32_t hash,
 
 	length += sizeof(tdb_off_t); /* tailer */
 
-	last_ptr = TDB_HASH_TOP(hash);
+	last_ptr = tdb_hash_top(tdb, hash);
 
 	/* read in the hash top */
-	if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1)
+	if (last_ptr == 0 || tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1)
 		return 0;
 
 	/* keep looking until we find the right record */
@@ -531,7 +574,7 @@ static int _tdb_storev(struct tdb_context *tdb, TDB_DATA key,
 		       int flag, uint32_t hash)
 {
 	struct tdb_record rec;
-	tdb_off_t rec_ptr, ofs;
+	tdb_off_t rec_ptr, ofs, top;
 	tdb_len_t rec_len, dbufs_len;
 	int i;
 	int ret = -1;
@@ -590,7 +633,8 @@ static int _tdb_storev(struct tdb_context *tdb, TDB_DATA key,
 	}
 
 	/* Read hash top into next ptr */
-	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec.next) == -1)
+	top = tdb_hash_top(tdb, hash);
+	if (top == 0 || tdb_ofs_read(tdb, top, &rec.next) == -1)
 		goto fail;
 
 	rec.key_len = key.dsize;
@@ -622,7 +666,7 @@ static int _tdb_storev(struct tdb_context *tdb, TDB_DATA key,
 		ofs += dbufs[i].dsize;
 	}
 
-	ret = tdb_ofs_write(tdb, TDB_HASH_TOP(hash), &rec_ptr);
+	ret = tdb_ofs_write(tdb, top, &rec_ptr);
 	if (ret == -1) {
 		/* Need to tdb_unallocate() here */
 		goto fail;
@@ -667,6 +711,9 @@ _PUBLIC_ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int
 	ret = _tdb_store(tdb, key, dbuf, flag, hash);
 	tdb_trace_2rec_flag_ret(tdb, "tdb_store", key, dbuf, flag, ret);
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	if (ret == 0) {
+		tdb_rehash_check(tdb);
+	}
 	return ret;
 }
 
@@ -692,6 +739,9 @@ _PUBLIC_ int tdb_storev(struct tdb_context *tdb, TDB_DATA key,
 	tdb_trace_1plusn_rec_flag_ret(tdb, "tdb_storev", key,
 				      dbufs, num_dbufs, flag, -1);
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	if (ret == 0) {
+		tdb_rehash_check(tdb);
+	}
 	return ret;
 }
 
@@ -715,6 +765,9 @@ _PUBLIC_ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf
 
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
 	SAFE_FREE(dbufs[0].dptr);
+	if (ret == 0) {
+		tdb_rehash_check(tdb);
+	}
 	return ret;
 }
 
@@ -911,12 +964,20 @@ _PUBLIC_ int tdb_wipe_all(struct tdb_context *tdb)
 		}
 	}
 
-	/* wipe the freelist */
-	if (tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist\n"));
+	/* a resized hash table is freed below */
+	if (tdb_hash_resize_reset(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to reset hash table\n"));
 		goto failed;
 	}
 
+	/* wipe the freelists */
+	for (i=0;i<TDB_NUM_FREELISTS(tdb);i++) {
+		if (tdb_ofs_write(tdb, FREELIST_CLASS_TOP(i), &offset) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist %d\n", i));
+			goto failed;
+		}
+	}
+
 	/* add all the rest of the file to the freelist, possibly leaving a gap
 	   for the recovery area */
 	if (recovery_size == 0) {
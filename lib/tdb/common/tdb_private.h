@@ -54,6 +54,7 @@ typedef uint32_t tdb_off_t;
 #define TDB_RECOVERY_INVALID_MAGIC (0x0)
 #define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
 #define TDB_FEATURE_FLAG_MAGIC (0xbad1a52U)
+#define TDB_HASHTABLE_MAGIC (0xbad1a53U)
 #define TDB_ALIGNMENT 4
 #define DEFAULT_HASH_SIZE 131
 #define FREELIST_TOP (sizeof(struct tdb_header))
@@ -66,13 +67,34 @@ typedef uint32_t tdb_off_t;
 #define TDB_DATA_START(hash_size) (TDB_HASH_TOP(hash_size-1) + sizeof(tdb_off_t))
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
+#define TDB_HASH_RESIZE_OFS offsetof(struct tdb_header, hash_resize)
+#define TDB_COMMIT_GEN_OFS offsetof(struct tdb_header, commit_gen)
+#define TDB_SYNC_GEN_OFS  offsetof(struct tdb_header, sync_gen)
+#define TDB_FREELIST_CLASS_COUNT 8
+#define TDB_FREELIST_CLASS_BASE 128
+#define TDB_NUM_FREELISTS(tdb) \
+	(((tdb)->feature_flags & TDB_FEATURE_FLAG_FREELIST_CLASSES) ? \
+	 TDB_FREELIST_CLASS_COUNT : 1)
+#define FREELIST_CLASS_TOP(c) ((c) == 0 ? FREELIST_TOP : \
+	offsetof(struct tdb_header, freelist_class_tops) + \
+	((c)-1)*sizeof(tdb_off_t))
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
 
 #define TDB_FEATURE_FLAG_MUTEX 0x00000001
+#define TDB_FEATURE_FLAG_SEQLOCK 0x00000002
+#define TDB_FEATURE_FLAG_FREELIST_CLASSES 0x00000004
+#define TDB_FEATURE_FLAG_HASH_RESIZE 0x00000008
+#define TDB_FEATURE_FLAG_GROUP_COMMIT 0x00000010
+#define TDB_FEATURE_FLAG_WAL 0x00000020
 
 #define TDB_SUPPORTED_FEATURE_FLAGS ( \
 	TDB_FEATURE_FLAG_MUTEX | \
+	TDB_FEATURE_FLAG_SEQLOCK | \
+	TDB_FEATURE_FLAG_FREELIST_CLASSES | \
+	TDB_FEATURE_FLAG_HASH_RESIZE | \
+	TDB_FEATURE_FLAG_GROUP_COMMIT | \
+	TDB_FEATURE_FLAG_WAL | \
 	0)
 
 /* NB assumes there is a local variable called "tdb" that is the
@@ -120,6 +142,9 @@ void tdb_trace_2rec_retrec(struct tdb_context *tdb, const char *op,
 #define OPEN_LOCK        0
 #define ACTIVE_LOCK      4
 #define TRANSACTION_LOCK 8
+#define GROUP_COMMIT_LOCK 12
+#define WAL_LOCK         16
+#define WAL_ACTIVE_LOCK  20
 
 /* free memory if the pointer is valid and zero the pointer */
 #ifndef SAFE_FREE
@@ -155,6 +180,23 @@ struct tdb_record {
 
 
 /* this is stored at the front of every database */
+/*
+ * Where the hash chains live once the table behind the header got too
+ * small, see rehash.c. The locks stay per chain of the original table.
+ */
+struct tdb_hash_resize {
+	tdb_off_t table; /* 0: the hash_size heads behind the header */
+	uint32_t factor; /* buckets per lock chain in table */
+	tdb_off_t new_table; /* table a resize moves the chains to, or 0 */
+	uint32_t new_factor; /* buckets per lock chain in new_table */
+	uint32_t progress; /* lock chains already moved to new_table */
+};
+
+struct tdb_hash_table {
+	tdb_off_t ofs; /* TDB_HASHTABLE_MAGIC record, 0 for the header one */
+	uint32_t factor;
+};
+
 struct tdb_header {
 	char magic_food[32]; /* for /etc/magic */
 	uint32_t version; /* version of the code */
@@ -166,7 +208,15 @@ struct tdb_header {
 	uint32_t magic2_hash; /* hash of TDB_MAGIC. */
 	uint32_t feature_flags;
 	tdb_len_t mutex_size; /* set if TDB_FEATURE_FLAG_MUTEX is set */
-	tdb_off_t reserved[25];
+	tdb_len_t seqlock_size; /* set if TDB_FEATURE_FLAG_SEQLOCK is set */
+	/* freelists 1..7 if TDB_FEATURE_FLAG_FREELIST_CLASSES is set */
+	tdb_off_t freelist_class_tops[TDB_FREELIST_CLASS_COUNT-1];
+	/* set if TDB_FEATURE_FLAG_HASH_RESIZE is set */
+	struct tdb_hash_resize hash_resize;
+	/* set if TDB_FEATURE_FLAG_GROUP_COMMIT is set */
+	uint32_t commit_gen; /* bumped by every commit */
+	uint32_t sync_gen; /* commit_gen covered by the last fsync */
+	tdb_off_t reserved[10];
 };
 
 struct tdb_lock_type {
@@ -201,6 +251,8 @@ struct tdb_methods {
 };
 
 struct tdb_mutexes;
+struct tdb_seqlocks;
+struct tdb_wal;
 
 struct tdb_context {
 	char *name; /* the name of the database */
@@ -215,8 +267,11 @@ struct tdb_context {
 	struct tdb_lock_type *lockrecs; /* only real locks, all with count>0 */
 	int lockrecs_array_length;
 
-	tdb_off_t hdr_ofs; /* this is 0 or header.mutex_size */
+	tdb_off_t hdr_ofs; /* header.mutex_size + header.seqlock_size */
 	struct tdb_mutexes *mutexes; /* mmap of the mutex area */
+	tdb_len_t seqlock_size; /* 0 or header.seqlock_size */
+	struct tdb_seqlocks *seqlocks; /* mmap of the chain sequence counters */
+	struct tdb_wal *wal; /* set if TDB_FEATURE_FLAG_WAL is set */
 
 	enum TDB_ERROR ecode; /* error code for last tdb error */
 	uint32_t hash_size;
@@ -233,6 +288,10 @@ struct tdb_context {
 	struct tdb_transaction *transaction;
 	int page_size;
 	int max_dead_records;
+	uint32_t rehash_chain_avg; /* average missed chain length * 16 */
+	uint32_t rehash_buckets; /* table size rehash_chain_avg refers to */
+	uint32_t rehash_countdown; /* stores until the next rehash check */
+	struct tdb_commit_stats commit_stats; /* see tdb_commit_stats() */
 #ifdef TDB_TRACE
 	int tracefd;
 #endif
@@ -276,6 +335,8 @@ int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 void *tdb_convert(void *buf, uint32_t size);
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
+unsigned int tdb_freelist_class(struct tdb_context *tdb, tdb_len_t rec_len);
+tdb_len_t tdb_freelist_class_min(unsigned int fclass);
 tdb_off_t tdb_allocate(struct tdb_context *tdb, int hash, tdb_len_t length,
 		       struct tdb_record *rec);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
@@ -305,6 +366,7 @@ int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off,
 		      struct tdb_record *rec);
 bool tdb_write_all(int fd, const void *buf, size_t count);
 int tdb_transaction_recover(struct tdb_context *tdb);
+int tdb_group_commit_before_write(struct tdb_context *tdb, tdb_off_t off);
 void tdb_header_hash(struct tdb_context *tdb,
 		     uint32_t *magic1_hash, uint32_t *magic2_hash);
 unsigned int tdb_old_hash(TDB_DATA *key);
@@ -329,4 +391,53 @@ int tdb_mutex_allrecord_unlock(struct tdb_context *tdb);
 int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb);
 void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb);
 
+size_t tdb_seqlock_size(struct tdb_context *tdb);
+bool tdb_seqlock_open_ok(struct tdb_context *tdb,
+			 const struct tdb_header *header);
+int tdb_seqlock_mmap(struct tdb_context *tdb);
+int tdb_seqlock_munmap(struct tdb_context *tdb);
+void tdb_seqlock_chain_write_begin(struct tdb_context *tdb, uint32_t offset);
+void tdb_seqlock_chain_write_end(struct tdb_context *tdb, uint32_t offset);
+void tdb_seqlock_allrecord_write_begin(struct tdb_context *tdb);
+void tdb_seqlock_allrecord_write_end(struct tdb_context *tdb);
+bool tdb_seqlock_fetch(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
+		       TDB_DATA *data);
+
+bool tdb_hash_resize_valid(struct tdb_context *tdb,
+			   const struct tdb_hash_resize *r);
+int tdb_hash_resize_read(struct tdb_context *tdb, struct tdb_hash_resize *r);
+int tdb_hash_resize_reset(struct tdb_context *tdb);
+void tdb_hash_chain_table(struct tdb_context *tdb,
+			  const struct tdb_hash_resize *r, uint32_t list,
+			  struct tdb_hash_table *t);
+int tdb_hash_table_read(struct tdb_context *tdb, uint32_t list,
+			struct tdb_hash_table *t);
+tdb_off_t tdb_hash_table_top(struct tdb_context *tdb,
+			     const struct tdb_hash_table *t,
+			     uint32_t list, uint32_t sub);
+uint32_t tdb_hash_table_sub(struct tdb_context *tdb,
+			    const struct tdb_hash_table *t, uint32_t hash);
+tdb_off_t tdb_hash_resize_top(struct tdb_context *tdb,
+			      const struct tdb_hash_resize *r, uint32_t hash);
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, uint32_t hash);
+bool tdb_hash_resized(struct tdb_context *tdb);
+void tdb_rehash_sample(struct tdb_context *tdb, uint32_t chain_len);
+int tdb_rehash_step(struct tdb_context *tdb);
+void tdb_rehash_check(struct tdb_context *tdb);
+
+int tdb_wal_open(struct tdb_context *tdb, bool created, mode_t mode);
+int tdb_wal_reopen(struct tdb_context *tdb);
+void tdb_wal_free(struct tdb_context *tdb);
+void tdb_wal_close(struct tdb_context *tdb);
+int tdb_wal_append(struct tdb_context *tdb, const unsigned char *data,
+		   uint32_t data_len, uint32_t map_size, bool commit,
+		   uint32_t *ofs);
+int tdb_wal_commit_prepared(struct tdb_context *tdb, uint32_t ofs);
+int tdb_wal_discard(struct tdb_context *tdb, uint32_t ofs);
+void tdb_wal_apply_begin(struct tdb_context *tdb, uint32_t ofs);
+int tdb_wal_apply_end(struct tdb_context *tdb);
+bool tdb_wal_needs_recovery(struct tdb_context *tdb);
+int tdb_wal_recover(struct tdb_context *tdb);
+int tdb_wal_before_write(struct tdb_context *tdb);
+
 #endif /* TDB_PRIVATE_H */
@@ -75,6 +75,24 @@
     needed per commit to prevent race conditions. It might be possible
     to reduce this to 3 or even 2 with some more work.
 
+  - if the database was created with TDB_GROUP_COMMIT, the recovery
+    record carries a checksum and is written with a valid magic right
+    away, so a single sync makes it usable. A torn record fails the
+    checksum and is ignored, which is safe as the data has not been
+    touched before that sync. The recovery magic is then cleared
+    without a sync after the commit, and the locks are released before
+    waiting for the next sync of the file. Commit and sync generations
+    in the header tell whether someone else, the next committer or
+    another waiter, has already done that sync. This leaves 2 syncs
+    under the locks and at most one shared sync per commit. Writes
+    outside a transaction wait for that sync as well, otherwise a
+    crash could replay the recovery record over them.
+
+  - if the database was created with TDB_WAL, there is no recovery
+    record. The new data goes to a log next to the database instead,
+    and a single sync of that log before the allrecord lock is upgraded
+    makes the commit durable, see wal.c.
+
   - check for a valid recovery record on open of the tdb, while the
     open lock is held. Automatically recover from the transaction
     recovery area if needed, then continue with the open as
@@ -136,6 +154,12 @@ struct tdb_transaction {
 	bool prepared;
 	tdb_off_t magic_offset;
 
+	/*
+	 * where the log record of a TDB_WAL commit went, 0 once it
+	 * is being written into the database
+	 */
+	uint32_t wal_offset;
+
 	/* old file size before transaction */
 	tdb_len_t old_map_size;
 
@@ -540,15 +564,95 @@ _PUBLIC_ int tdb_transaction_start_nonblock(struct tdb_context *tdb)
 	return _tdb_transaction_start(tdb, TDB_LOCK_NOWAIT|TDB_LOCK_PROBE);
 }
 
+/*
+  read and write the group commit generations. They are not part of
+  any transaction, so they always go directly to the file
+*/
+static int transaction_gen_read(struct tdb_context *tdb,
+				const struct tdb_methods *methods,
+				tdb_off_t offset, uint32_t *gen)
+{
+	if (methods->tdb_read(tdb, offset, gen, sizeof(*gen), DOCONV()) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+static int transaction_gen_write(struct tdb_context *tdb,
+				 const struct tdb_methods *methods,
+				 tdb_off_t offset, uint32_t gen)
+{
+	CONVERT(gen);
+	if (methods->tdb_write(tdb, offset, &gen, sizeof(gen)) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	/* don't let the commit write back an older header */
+	if (tdb->transaction != NULL) {
+		return transaction_write_existing(tdb, offset, &gen,
+						  sizeof(gen));
+	}
+	return 0;
+}
+
+/*
+  write a block of a transaction into the database. With group commit
+  the sync generation is left out: waiters in transaction_group_sync()
+  bump it without the transaction lock, so our copy of the header may
+  hold an older one
+*/
+static int transaction_write_block(struct tdb_context *tdb,
+				   const struct tdb_methods *methods,
+				   tdb_off_t offset, const unsigned char *buf,
+				   tdb_len_t length)
+{
+	tdb_off_t gen_start = TDB_SYNC_GEN_OFS;
+	tdb_off_t gen_end = gen_start + sizeof(uint32_t);
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) ||
+	    offset > gen_start || offset + length < gen_end) {
+		return methods->tdb_write(tdb, offset, buf, length);
+	}
+
+	if (methods->tdb_write(tdb, offset, buf, gen_start - offset) == -1) {
+		return -1;
+	}
+	return methods->tdb_write(tdb, gen_end, buf + (gen_end - offset),
+				  offset + length - gen_end);
+}
+
 /*
   sync to disk
 */
 static int transaction_sync(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t length)
 {
+	const struct tdb_methods *methods = tdb->methods;
+	bool group_commit =
+		(tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT);
+	uint32_t gen = 0, synced;
+
 	if (tdb->flags & TDB_NOSYNC) {
 		return 0;
 	}
 
+	if (group_commit) {
+		/*
+		 * Every commit up to this generation has cleared its
+		 * recovery magic, and we may have to sync that for them
+		 */
+		if (tdb->transaction != NULL &&
+		    tdb->transaction->io_methods != NULL) {
+			methods = tdb->transaction->io_methods;
+		}
+		if (transaction_gen_read(tdb, methods, TDB_COMMIT_GEN_OFS,
+					 &gen) == -1) {
+			return -1;
+		}
+		offset = 0;
+		length = tdb->map_size;
+	}
+
 #ifdef HAVE_FDATASYNC
 	if (fdatasync(tdb->fd) != 0) {
 #else
@@ -570,9 +674,127 @@ static int transaction_sync(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t
 		}
 	}
 #endif
+	tdb->commit_stats.syncs++;
+
+	if (group_commit) {
+		if (transaction_gen_read(tdb, methods, TDB_SYNC_GEN_OFS,
+					 &synced) == -1) {
+			return -1;
+		}
+		if ((int32_t)(gen - synced) > 0 &&
+		    transaction_gen_write(tdb, methods, TDB_SYNC_GEN_OFS,
+					  gen) == -1) {
+			return -1;
+		}
+	}
 	return 0;
 }
 
+/*
+  see whether a sync of the commit with generation gen has finished
+*/
+static bool transaction_gen_synced(struct tdb_context *tdb, uint32_t gen)
+{
+	uint32_t synced;
+
+	if (transaction_gen_read(tdb, tdb->methods, TDB_SYNC_GEN_OFS,
+				 &synced) == -1) {
+		return false;
+	}
+	return (int32_t)(synced - gen) >= 0;
+}
+
+/*
+  wait for a group commit to be on disk. Any sync that started after
+  the commit bumped the generation will do, so of all the committers
+  waiting here only the first one syncs, and if the next commit got
+  there first none of them has to.
+*/
+static int transaction_group_sync(struct tdb_context *tdb, uint32_t gen)
+{
+	int ret = 0;
+
+	if (tdb->flags & TDB_NOSYNC) {
+		return 0;
+	}
+
+	if (transaction_gen_synced(tdb, gen)) {
+		tdb->commit_stats.shared_syncs++;
+		return 0;
+	}
+
+	if (tdb_nest_lock(tdb, GROUP_COMMIT_LOCK, F_WRLCK,
+			  TDB_LOCK_WAIT) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: "
+			 "failed to get group commit lock\n"));
+		return -1;
+	}
+
+	if (transaction_gen_synced(tdb, gen)) {
+		tdb->commit_stats.shared_syncs++;
+	} else {
+		ret = transaction_sync(tdb, 0, tdb->map_size);
+	}
+
+	tdb_nest_unlock(tdb, GROUP_COMMIT_LOCK, F_WRLCK, false);
+	return ret;
+}
+
+/*
+  called before writing to the database outside a transaction. The
+  last committer may have dropped its locks before its recovery magic
+  was cleared on disk. A crash then replays the recovery record over
+  whatever we write now, so wait for that sync first. The caller holds
+  a chain or freelist lock, so no other commit can start meanwhile.
+*/
+int tdb_group_commit_before_write(struct tdb_context *tdb, tdb_off_t off)
+{
+	uint32_t gen;
+	int ret = 0;
+
+	/* the sync itself has to update the sync generation */
+	if (tdb->transaction != NULL || (tdb->flags & TDB_NOSYNC) ||
+	    off == TDB_SYNC_GEN_OFS) {
+		return 0;
+	}
+
+	if (transaction_gen_read(tdb, tdb->methods, TDB_COMMIT_GEN_OFS,
+				 &gen) == -1) {
+		return -1;
+	}
+	if (transaction_gen_synced(tdb, gen)) {
+		return 0;
+	}
+
+	if (tdb_nest_lock(tdb, GROUP_COMMIT_LOCK, F_WRLCK,
+			  TDB_LOCK_WAIT) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_write: "
+			 "failed to get group commit lock\n"));
+		return -1;
+	}
+	if (!transaction_gen_synced(tdb, gen)) {
+		ret = transaction_sync(tdb, 0, tdb->map_size);
+	}
+	tdb_nest_unlock(tdb, GROUP_COMMIT_LOCK, F_WRLCK, false);
+
+	return ret;
+}
+
+/*
+  checksum of a group commit recovery record. The data is in file byte
+  order already, the old map size is mixed in as a number
+*/
+static uint32_t transaction_recovery_checksum(const struct tdb_record *rec,
+					      const unsigned char *data)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(unsigned char, data);
+	d.dsize = rec->data_len;
+
+	return tdb_jenkins_hash(&d) ^ (rec->key_len * 2654435761U);
+}
+
 
 static int _tdb_transaction_cancel(struct tdb_context *tdb)
 {
@@ -611,6 +833,14 @@ static int _tdb_transaction_cancel(struct tdb_context *tdb)
 		}
 	}
 
+	if (tdb->transaction->wal_offset) {
+		/* the log record must not be replayed */
+		if (tdb_wal_discard(tdb, tdb->transaction->wal_offset) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_cancel: failed to remove log record\n"));
+			ret = -1;
+		}
+	}
+
 	/* This also removes the OPEN_LOCK, if we have it. */
 	tdb_release_transaction_locks(tdb);
 
@@ -841,7 +1071,6 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	rec->data_len = recovery_size;
 	rec->rec_len  = recovery_max_size;
 	rec->key_len  = old_map_size;
-	CONVERT(*rec);
 
 	/* build the recovery data into a single blob to allow us to do a single
 	   large write, which should be more efficient */
@@ -892,6 +1121,14 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 		tdb_convert(p, 4);
 	}
 
+	/* with a checksum the record is usable after the first sync */
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) {
+		rec->magic = TDB_RECOVERY_MAGIC;
+		rec->full_hash = transaction_recovery_checksum(
+			rec, data + sizeof(*rec));
+	}
+	CONVERT(*rec);
+
 	/* write the recovery data to the recovery area */
 	if (methods->tdb_write(tdb, recovery_offset, data, sizeof(*rec) + recovery_size) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: failed to write recovery data\n"));
@@ -916,11 +1153,15 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 
 	free(data);
 
+	*magic_offset = recovery_offset + offsetof(struct tdb_record, magic);
+
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) {
+		return 0;
+	}
+
 	magic = TDB_RECOVERY_MAGIC;
 	CONVERT(magic);
 
-	*magic_offset = recovery_offset + offsetof(struct tdb_record, magic);
-
 	if (methods->tdb_write(tdb, *magic_offset, &magic, sizeof(magic)) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: failed to write recovery magic\n"));
 		tdb->ecode = TDB_ERR_IO;
@@ -940,7 +1181,58 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	return 0;
 }
 
-static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
+/*
+  write the new data of all blocks to the log of a TDB_WAL database
+*/
+static int transaction_wal_append(struct tdb_context *tdb, bool commit)
+{
+	struct tdb_transaction *t = tdb->transaction;
+	unsigned char *data, *p;
+	tdb_len_t data_len = 0;
+	int i, ret;
+
+	for (i=0;i<t->num_blocks;i++) {
+		if (t->blocks[i] == NULL) {
+			continue;
+		}
+		data_len += 8 + ((i == t->num_blocks-1) ?
+				 t->last_block_size : t->block_size);
+	}
+
+	data = (unsigned char *)malloc(data_len ? data_len : 1);
+	if (data == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+
+	p = data;
+	for (i=0;i<t->num_blocks;i++) {
+		uint32_t offset, length;
+
+		if (t->blocks[i] == NULL) {
+			continue;
+		}
+
+		offset = i * t->block_size;
+		length = t->block_size;
+		if (i == t->num_blocks-1) {
+			length = t->last_block_size;
+		}
+
+		memcpy(p, &offset, 4);
+		memcpy(p+4, &length, 4);
+		memcpy(p+8, t->blocks[i], length);
+		p += 8 + length;
+	}
+
+	ret = tdb_wal_append(tdb, data, data_len, tdb->map_size, commit,
+			     &t->wal_offset);
+	free(data);
+	return ret;
+}
+
+static int _tdb_transaction_prepare_commit(struct tdb_context *tdb,
+					   bool commit)
 {
 	const struct tdb_methods *methods;
 
@@ -984,6 +1276,13 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
+	/* with TDB_WAL this is all of the syncing, readers still get in */
+	if (tdb->wal != NULL && transaction_wal_append(tdb, commit) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to write log record\n"));
+		_tdb_transaction_cancel(tdb);
+		return -1;
+	}
+
 	/* upgrade the main transaction lock region to a write lock */
 	if (tdb_allrecord_upgrade(tdb) == -1) {
 		if (tdb->ecode == TDB_ERR_RDONLY && tdb->read_only) {
@@ -1016,7 +1315,8 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 	}
 
 	/* write the recovery data to the end of the file */
-	if (transaction_setup_recovery(tdb, &tdb->transaction->magic_offset) == -1) {
+	if (tdb->wal == NULL &&
+	    transaction_setup_recovery(tdb, &tdb->transaction->magic_offset) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to setup recovery data\n"));
 		_tdb_transaction_cancel(tdb);
 		return -1;
@@ -1049,7 +1349,7 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 _PUBLIC_ int tdb_transaction_prepare_commit(struct tdb_context *tdb)
 {
 	tdb_trace(tdb, "tdb_transaction_prepare_commit");
-	return _tdb_transaction_prepare_commit(tdb);
+	return _tdb_transaction_prepare_commit(tdb, false);
 }
 
 /* A repack is worthwhile if the largest is less than half total free. */
@@ -1058,22 +1358,75 @@ static bool repack_worthwhile(struct tdb_context *tdb)
 	tdb_off_t ptr;
 	struct tdb_record rec;
 	tdb_len_t total = 0, largest = 0;
+	unsigned int fclass;
 
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &ptr) == -1) {
-		return false;
-	}
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(fclass), &ptr) == -1) {
+			return false;
+		}
 
-	while (ptr != 0 && tdb_rec_free_read(tdb, ptr, &rec) == 0) {
-		total += rec.rec_len;
-		if (rec.rec_len > largest) {
-			largest = rec.rec_len;
+		while (ptr != 0 && tdb_rec_free_read(tdb, ptr, &rec) == 0) {
+			total += rec.rec_len;
+			if (rec.rec_len > largest) {
+				largest = rec.rec_len;
+			}
+			ptr = rec.next;
 		}
-		ptr = rec.next;
 	}
 
 	return total > largest * 2;
 }
 
+/*
+  clear the recovery magic of a group commit without a sync and bump
+  the commit generation, the caller syncs once the locks are gone
+*/
+static int transaction_group_commit(struct tdb_context *tdb, uint32_t *gen)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	const uint32_t invalid = TDB_RECOVERY_INVALID_MAGIC;
+
+	if (methods->tdb_write(tdb, tdb->transaction->magic_offset,
+			       &invalid, 4) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: "
+			 "failed to remove recovery magic\n"));
+		return -1;
+	}
+
+	if (transaction_gen_read(tdb, methods, TDB_COMMIT_GEN_OFS,
+				 gen) == -1 ||
+	    transaction_gen_write(tdb, methods, TDB_COMMIT_GEN_OFS,
+				  *gen + 1) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: "
+			 "failed to update commit generation\n"));
+		return -1;
+	}
+	*gen += 1;
+
+	tdb->transaction->magic_offset = 0;
+	return 0;
+}
+
+static void transaction_commit_stats(struct tdb_context *tdb,
+				     const struct timeval *start)
+{
+	struct timeval now;
+	int64_t usecs;
+	unsigned int bucket = 0;
+
+	gettimeofday(&now, NULL);
+	usecs = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+
+	while (usecs > 0 && bucket < TDB_COMMIT_LATENCY_BUCKETS-1) {
+		usecs >>= 1;
+		bucket++;
+	}
+
+	tdb->commit_stats.commits++;
+	tdb->commit_stats.latency[bucket]++;
+}
+
 /*
   commit the current transaction
 */
@@ -1082,6 +1435,11 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	const struct tdb_methods *methods;
 	int i;
 	bool need_repack = false;
+	bool group_commit = false;
+	uint32_t gen = 0;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
 
 	if (tdb->transaction == NULL) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: no transaction\n"));
@@ -1110,13 +1468,24 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	}
 
 	if (!tdb->transaction->prepared) {
-		int ret = _tdb_transaction_prepare_commit(tdb);
+		int ret = _tdb_transaction_prepare_commit(tdb, true);
 		if (ret)
 			return ret;
+	} else if (tdb->wal != NULL &&
+		   tdb_wal_commit_prepared(tdb, tdb->transaction->wal_offset) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to commit log record\n"));
+		_tdb_transaction_cancel(tdb);
+		return -1;
 	}
 
 	methods = tdb->transaction->io_methods;
 
+	if (tdb->wal != NULL) {
+		/* from here on recovery finishes the record, if needed */
+		tdb_wal_apply_begin(tdb, tdb->transaction->wal_offset);
+		tdb->transaction->wal_offset = 0;
+	}
+
 	/* perform all the writes */
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
 		tdb_off_t offset;
@@ -1132,14 +1501,21 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 			length = tdb->transaction->last_block_size;
 		}
 
-		if (methods->tdb_write(tdb, offset, tdb->transaction->blocks[i], length) == -1) {
+		if (transaction_write_block(tdb, methods, offset, tdb->transaction->blocks[i], length) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed during commit\n"));
 
 			/* we've overwritten part of the data and
 			   possibly expanded the file, so we need to
-			   run the crash recovery code */
+			   run the crash recovery code, with TDB_WAL
+			   that means trying the log record again */
 			tdb->methods = methods;
-			tdb_transaction_recover(tdb);
+			if (tdb_transaction_recover(tdb) == 0 &&
+			    tdb->wal != NULL) {
+				/* the record is in, so is the transaction */
+				_tdb_transaction_cancel(tdb);
+				transaction_commit_stats(tdb, &start);
+				return 0;
+			}
 
 			_tdb_transaction_cancel(tdb);
 
@@ -1157,8 +1533,12 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	SAFE_FREE(tdb->transaction->blocks);
 	tdb->transaction->num_blocks = 0;
 
-	/* ensure the new data is on disk */
-	if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+	/* ensure the new data is on disk, or in the log */
+	if (tdb->wal != NULL) {
+		if (tdb_wal_apply_end(tdb) == -1) {
+			return -1;
+		}
+	} else if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
 		return -1;
 	}
 
@@ -1177,10 +1557,21 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	utime(tdb->name, NULL);
 #endif
 
+	/* if this fails, the cancel below clears the magic with a sync */
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) {
+		group_commit = (transaction_group_commit(tdb, &gen) == 0);
+	}
+
 	/* use a transaction cancel to free memory and remove the
 	   transaction locks */
 	_tdb_transaction_cancel(tdb);
 
+	if (group_commit && transaction_group_sync(tdb, gen) == -1) {
+		return -1;
+	}
+
+	transaction_commit_stats(tdb, &start);
+
 	if (need_repack) {
 		return tdb_repack(tdb);
 	}
@@ -1189,6 +1580,37 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 }
 
 
+/*
+  get the transaction commit statistics of this context
+*/
+_PUBLIC_ void tdb_commit_stats(struct tdb_context *tdb,
+			       struct tdb_commit_stats *stats)
+{
+	*stats = tdb->commit_stats;
+}
+
+/*
+  a group commit recovery record that was not completely synced: the
+  commit never got to write its data, so there is nothing to undo
+*/
+static int transaction_recovery_torn(struct tdb_context *tdb,
+				     tdb_off_t recovery_head)
+{
+	uint32_t zero = 0;
+
+	TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_transaction_recover: "
+		 "ignoring incomplete recovery record\n"));
+
+	if (tdb_ofs_write(tdb, recovery_head + offsetof(struct tdb_record, magic),
+			  &zero) == -1 ||
+	    transaction_sync(tdb, recovery_head, sizeof(struct tdb_record)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to remove recovery magic\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
 /*
   recover from an aborted transaction. Must be called with exclusive
   database write access already established (including the open
@@ -1200,6 +1622,11 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	unsigned char *data, *p;
 	uint32_t zero = 0;
 	struct tdb_record rec;
+	bool bump_seqlock;
+
+	if (tdb->wal != NULL) {
+		return tdb_wal_recover(tdb);
+	}
 
 	/* find the recovery area */
 	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
@@ -1234,6 +1661,11 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 
 	recovery_eof = rec.key_len;
 
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) &&
+	    rec.data_len > tdb->map_size - recovery_head - sizeof(rec)) {
+		return transaction_recovery_torn(tdb, recovery_head);
+	}
+
 	data = (unsigned char *)malloc(rec.data_len);
 	if (data == NULL) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to allocate recovery data\n"));
@@ -1249,7 +1681,24 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 		return -1;
 	}
 
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT) &&
+	    rec.full_hash != transaction_recovery_checksum(&rec, data)) {
+		free(data);
+		return transaction_recovery_torn(tdb, recovery_head);
+	}
+
+	/*
+	 * Lockless readers have to see this like a commit. If we come
+	 * from a failed commit, we're still inside its write section.
+	 */
+	bump_seqlock = !((tdb->allrecord_lock.count != 0) &&
+			 (tdb->allrecord_lock.ltype == F_WRLCK) &&
+			 (tdb->allrecord_lock.off == 0));
+
 	/* recover the file data */
+	if (bump_seqlock) {
+		tdb_seqlock_allrecord_write_begin(tdb);
+	}
 	p = data;
 	while (p+8 < data + rec.data_len) {
 		uint32_t ofs, len;
@@ -1260,6 +1709,9 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 		memcpy(&len, p+4, 4);
 
 		if (tdb->methods->tdb_write(tdb, ofs, p+8, len) == -1) {
+			if (bump_seqlock) {
+				tdb_seqlock_allrecord_write_end(tdb);
+			}
 			free(data);
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to recover %u bytes at offset %u\n", len, ofs));
 			tdb->ecode = TDB_ERR_IO;
@@ -1267,6 +1719,9 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 		}
 		p += 8 + len;
 	}
+	if (bump_seqlock) {
+		tdb_seqlock_allrecord_write_end(tdb);
+	}
 
 	free(data);
 
@@ -1312,6 +1767,10 @@ bool tdb_needs_recovery(struct tdb_context *tdb)
 	tdb_off_t recovery_head;
 	struct tdb_record rec;
 
+	if (tdb->wal != NULL) {
+		return tdb_wal_needs_recovery(tdb);
+	}
+
 	/* find the recovery area */
 	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
 		return true;
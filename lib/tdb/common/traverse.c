@@ -35,10 +35,14 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			 struct tdb_record *rec)
 {
 	int want_next = (tlock->off != 0);
+	bool resized = tdb_hash_resized(tdb);
 
 	/* Lock each chain from the start one. */
 	for (; tlock->hash < tdb->hash_size; tlock->hash++) {
-		if (!tlock->off && tlock->hash != 0) {
+		struct tdb_hash_table table;
+		uint32_t sub = 0;
+
+		if (!tlock->off && tlock->hash != 0 && !resized) {
 			/* this is an optimisation for the common case where
 			   the hash chain is empty, which is particularly
 			   common for the use of tdb with ldb, where large
@@ -66,6 +70,9 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			   With a non-indexed ldb search this trick gains us a
 			   factor of around 80 in speed on a linux 2.6.x
 			   system (testing using ldbtest).
+
+			   The scan only knows the table behind the header,
+			   so it is not done once the hash table was resized.
 			*/
 			tdb->methods->next_hash_chain(tdb, &tlock->hash);
 			if (tlock->hash == tdb->hash_size) {
@@ -76,9 +83,13 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 		if (tdb_lock(tdb, tlock->hash, tlock->lock_rw) == -1)
 			return TDB_NEXT_LOCK_ERR;
 
+		if (tdb_hash_table_read(tdb, tlock->hash, &table) == -1)
+			goto fail;
+
 		/* No previous record?  Start at top of chain. */
 		if (!tlock->off) {
-			if (tdb_ofs_read(tdb, TDB_HASH_TOP(tlock->hash),
+			if (tdb_ofs_read(tdb, tdb_hash_table_top(tdb, &table,
+								 tlock->hash, 0),
 				     &tlock->off) == -1)
 				goto fail;
 		} else {
@@ -91,12 +102,26 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			/* We have offset of old record: grab next */
 			if (tdb_rec_read(tdb, tlock->off, rec) == -1)
 				goto fail;
+			sub = tdb_hash_table_sub(tdb, &table, rec->full_hash);
 			tlock->off = rec->next;
 		}
 
 		/* Iterate through chain */
-		while( tlock->off) {
+		while (1) {
 			tdb_off_t current;
+
+			if (!tlock->off) {
+				/* A resized chain has more than one bucket */
+				if (++sub >= table.factor)
+					break;
+				if (tdb_ofs_read(tdb, tdb_hash_table_top(
+							 tdb, &table,
+							 tlock->hash, sub),
+						 &tlock->off) == -1)
+					goto fail;
+				continue;
+			}
+
 			if (tdb_rec_read(tdb, tlock->off, rec) == -1)
 				goto fail;
 
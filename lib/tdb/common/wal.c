@@ -0,0 +1,770 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   trivial database library
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tdb_private.h"
+
+/*
+ * With TDB_FEATURE_FLAG_WAL a transaction commit does not save the
+ * old data in the recovery area. Instead the new data of all blocks
+ * the transaction wrote is appended as one redo record to a write
+ * ahead log next to the database, "<name>.wal". Once that record is
+ * synced, the commit is durable, and the blocks are written in place
+ * without a sync of the database.
+ *
+ * The log record is written and synced before the allrecord lock is
+ * upgraded, so readers of the database only wait for the in place
+ * writes, and a commit syncs once instead of four times.
+ *
+ * The log is checkpointed lazily: when it grows beyond
+ * TDB_WAL_CHECKPOINT_SIZE, when the last process closes the database,
+ * or on tdb_checkpoint(), the database is synced and the log is
+ * emptied. A new log generation makes old records invalid.
+ *
+ * Writes outside transactions are not logged. As replaying the log
+ * would undo them, they checkpoint first if the log is not empty.
+ * WAL mode is therefore meant for databases mostly written in
+ * transactions.
+ *
+ * Recovery:
+ *
+ * - if a committer dies while writing in place, the header points
+ *   at its record in "applying". The next locker replays that record,
+ *   like the recovery area is replayed without WAL.
+ *
+ * - the first opener replays all committed records of the current
+ *   generation, as after a crash the database may miss any of them,
+ *   and then checkpoints. WAL_ACTIVE_LOCK tells whether others have
+ *   the database open.
+ *
+ * - a record written by tdb_transaction_prepare_commit() is only
+ *   marked committed by tdb_transaction_commit(), so a crash between
+ *   the two leaves the transaction out, as without WAL.
+ *
+ * - a commit without a prepare writes a committed record right away,
+ *   to get away with one sync. If the commit fails before the record
+ *   is written into the database, the cancel invalidates the record.
+ *
+ * The log is in host byte order and not meant to be moved to other
+ * hosts, it is empty after the last close anyway.
+ */
+
+#define TDB_WAL_MAGIC (0x57a1f11eU)
+#define TDB_WAL_COMMIT_MAGIC (0x57a1c0deU)
+#define TDB_WAL_PREPARED_MAGIC (0x57a1d00dU)
+#define TDB_WAL_INVALID_MAGIC (0xffffffffU)
+
+/* Checkpoint once the log grows beyond this */
+#define TDB_WAL_CHECKPOINT_SIZE (4*1024*1024)
+
+struct tdb_wal_header {
+	uint32_t magic;
+	uint32_t generation; /* only records of this generation are valid */
+	uint32_t end; /* where the next record goes */
+	uint32_t applying; /* record being written into the database, or 0 */
+};
+
+/*
+ * Followed by data_len bytes of [offset, length, data] entries with
+ * the new contents of the database.
+ */
+struct tdb_wal_record {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t map_size; /* database size after the transaction */
+	uint32_t data_len;
+	uint32_t checksum;
+};
+
+struct tdb_wal {
+	int fd;
+	struct tdb_wal_header *hdr; /* shared mmap of the log header */
+	uint32_t record_end; /* end of the record we appended last */
+	bool replaying;
+};
+
+static char *tdb_wal_name(struct tdb_context *tdb)
+{
+	size_t len = strlen(tdb->name) + sizeof(".wal");
+	char *name;
+
+	name = (char *)malloc(len);
+	if (name == NULL) {
+		return NULL;
+	}
+	snprintf(name, len, "%s.wal", tdb->name);
+	return name;
+}
+
+static uint32_t tdb_wal_checksum(const struct tdb_wal_record *rec,
+				 const unsigned char *data)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(unsigned char, data);
+	d.dsize = rec->data_len;
+
+	return tdb_jenkins_hash(&d) ^ (rec->map_size * 2654435761U);
+}
+
+static int tdb_wal_fsync(struct tdb_context *tdb, int fd)
+{
+	if (tdb->flags & TDB_NOSYNC) {
+		return 0;
+	}
+
+#ifdef HAVE_FDATASYNC
+	if (fdatasync(fd) != 0) {
+#else
+	if (fsync(fd) != 0) {
+#endif
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_fsync[%s]: "
+			 "fsync failed: %s\n", tdb->name, strerror(errno)));
+		return -1;
+	}
+	tdb->commit_stats.syncs++;
+	return 0;
+}
+
+/*
+ * Does any other process have the database open in WAL mode? Read
+ * only openers don't lock, so just ask who holds WAL_ACTIVE_LOCK.
+ */
+static bool tdb_wal_in_use(struct tdb_context *tdb)
+{
+	struct flock fl;
+
+	if ((tdb->flags & TDB_NOLOCK) && !tdb->read_only) {
+		return false;
+	}
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = WAL_ACTIVE_LOCK;
+	fl.l_len = 1;
+	fl.l_pid = 0;
+
+	if (fcntl(tdb->fd, F_GETLK, &fl) == -1) {
+		/* Better replay once too often */
+		return false;
+	}
+	return fl.l_type != F_UNLCK;
+}
+
+/* Start a new log generation without records */
+static int tdb_wal_reset(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (ftruncate(wal->fd, sizeof(struct tdb_wal_header)) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_reset[%s]: "
+			 "ftruncate failed: %s\n", tdb->name,
+			 strerror(errno)));
+		return -1;
+	}
+
+	wal->hdr->generation += 1;
+	wal->hdr->end = sizeof(struct tdb_wal_header);
+	wal->hdr->applying = 0;
+
+	return 0;
+}
+
+/*
+ * Sync the database and empty the log, if there is anything in it or
+ * force is set. The caller excludes committers and other checkpoints.
+ */
+static int tdb_wal_checkpoint_locked(struct tdb_context *tdb, bool force)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (!force && wal->hdr->end == sizeof(struct tdb_wal_header) &&
+	    wal->hdr->applying == 0) {
+		return 0;
+	}
+
+	if (tdb_wal_fsync(tdb, tdb->fd) == -1) {
+		return -1;
+	}
+#ifdef HAVE_MMAP
+	if (!(tdb->flags & TDB_NOSYNC) && tdb->map_ptr != NULL &&
+	    msync(tdb->map_ptr, tdb->map_size, MS_SYNC) != 0) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_checkpoint[%s]: "
+			 "msync failed: %s\n", tdb->name, strerror(errno)));
+		return -1;
+	}
+#endif
+
+	if (tdb_wal_reset(tdb) == -1) {
+		return -1;
+	}
+
+	/* Without this a crash could replay old records over newer data */
+#ifdef HAVE_MMAP
+	if (!(tdb->flags & TDB_NOSYNC) &&
+	    msync(wal->hdr, sizeof(struct tdb_wal_header), MS_SYNC) != 0) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_checkpoint[%s]: "
+			 "msync failed: %s\n", tdb->name, strerror(errno)));
+		return -1;
+	}
+#endif
+	return tdb_wal_fsync(tdb, wal->fd);
+}
+
+/*
+ * Read the record at ofs, NULL if there is no valid committed record
+ * of the current generation
+ */
+static unsigned char *tdb_wal_read_record(struct tdb_context *tdb,
+					  uint32_t ofs, uint32_t wal_size,
+					  struct tdb_wal_record *rec)
+{
+	struct tdb_wal *wal = tdb->wal;
+	unsigned char *data;
+
+	if (wal_size < sizeof(*rec) || ofs > wal_size - sizeof(*rec)) {
+		return NULL;
+	}
+	if (pread(wal->fd, rec, sizeof(*rec), ofs) != sizeof(*rec)) {
+		return NULL;
+	}
+	if (rec->magic != TDB_WAL_COMMIT_MAGIC ||
+	    rec->generation != wal->hdr->generation ||
+	    rec->data_len > wal_size - ofs - sizeof(*rec)) {
+		return NULL;
+	}
+
+	data = (unsigned char *)malloc(rec->data_len ? rec->data_len : 1);
+	if (data == NULL) {
+		return NULL;
+	}
+	if (pread(wal->fd, data, rec->data_len, ofs + sizeof(*rec)) !=
+	    (ssize_t)rec->data_len ||
+	    rec->checksum != tdb_wal_checksum(rec, data)) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* Write the new data of a record into the database */
+static int tdb_wal_apply(struct tdb_context *tdb,
+			 const struct tdb_wal_record *rec,
+			 const unsigned char *data)
+{
+	const unsigned char *p = data;
+	bool bump_seqlock;
+	int ret = 0;
+
+	if (rec->map_size > tdb->map_size) {
+		if (tdb->methods->tdb_expand_file(tdb, tdb->map_size,
+						  rec->map_size -
+						  tdb->map_size) == -1 ||
+		    tdb->methods->tdb_oob(tdb, tdb->map_size, 1, 1) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_apply[%s]: "
+				 "failed to expand to %u bytes\n", tdb->name,
+				 (unsigned)rec->map_size));
+			return -1;
+		}
+	}
+
+	/* Lockless readers have to see this like a commit */
+	bump_seqlock = !((tdb->allrecord_lock.count != 0) &&
+			 (tdb->allrecord_lock.ltype == F_WRLCK) &&
+			 (tdb->allrecord_lock.off == 0));
+	if (bump_seqlock) {
+		tdb_seqlock_allrecord_write_begin(tdb);
+	}
+
+	while (p + 8 <= data + rec->data_len) {
+		uint32_t ofs, len;
+
+		memcpy(&ofs, p, 4);
+		memcpy(&len, p+4, 4);
+		if (len > data + rec->data_len - (p + 8)) {
+			tdb->ecode = TDB_ERR_CORRUPT;
+			ret = -1;
+			break;
+		}
+		if (tdb->methods->tdb_write(tdb, ofs, p+8, len) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_apply[%s]: "
+				 "failed to write %u bytes at offset %u\n",
+				 tdb->name, len, ofs));
+			ret = -1;
+			break;
+		}
+		p += 8 + len;
+	}
+
+	if (bump_seqlock) {
+		tdb_seqlock_allrecord_write_end(tdb);
+	}
+	return ret;
+}
+
+/*
+ * Replay the committed records starting at ofs, all of them or just
+ * one. Returns where the last one ended.
+ */
+static int tdb_wal_replay(struct tdb_context *tdb, uint32_t ofs, bool all,
+			  uint32_t *end)
+{
+	struct tdb_wal *wal = tdb->wal;
+	struct tdb_wal_record rec;
+	unsigned char *data;
+	struct stat st;
+	int ret = 0;
+
+	if (fstat(wal->fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	*end = ofs;
+	wal->replaying = true;
+
+	while ((data = tdb_wal_read_record(tdb, ofs, st.st_size,
+					   &rec)) != NULL) {
+		if (tdb->read_only) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_replay[%s]: "
+				 "attempt to recover read only database\n",
+				 tdb->name));
+			tdb->ecode = TDB_ERR_CORRUPT;
+			ret = -1;
+		} else {
+			ret = tdb_wal_apply(tdb, &rec, data);
+		}
+		free(data);
+		if (ret == -1) {
+			break;
+		}
+
+		ofs += sizeof(rec) + rec.data_len;
+		*end = ofs;
+		if (!all) {
+			break;
+		}
+	}
+
+	wal->replaying = false;
+	return ret;
+}
+
+/*
+ * Open the log. With the open lock held, so nobody else can start
+ * using the database meanwhile. created says the database was just
+ * initialised, so the log has nothing to say about it.
+ */
+int tdb_wal_open(struct tdb_context *tdb, bool created, mode_t mode)
+{
+	struct tdb_wal *wal;
+	struct tdb_wal_header hdr;
+	struct stat st;
+	char *name;
+	uint32_t end;
+	void *ptr;
+	int v;
+
+	name = tdb_wal_name(tdb);
+	wal = (struct tdb_wal *)calloc(1, sizeof(struct tdb_wal));
+	if (name == NULL || wal == NULL) {
+		free(name);
+		free(wal);
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+
+	wal->fd = open(name, tdb->read_only ? O_RDONLY : O_RDWR|O_CREAT,
+		       mode);
+	if (wal->fd == -1) {
+		if (tdb->read_only && errno == ENOENT) {
+			/* Never written in WAL mode */
+			free(name);
+			free(wal);
+			return 0;
+		}
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: "
+			 "could not open %s: %s\n", name, strerror(errno)));
+		goto fail;
+	}
+	v = fcntl(wal->fd, F_GETFD, 0);
+	fcntl(wal->fd, F_SETFD, v | FD_CLOEXEC);
+
+	if (fstat(wal->fd, &st) == -1) {
+		goto fail;
+	}
+
+	ZERO_STRUCT(hdr);
+	if (st.st_size >= sizeof(hdr) &&
+	    pread(wal->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		goto fail;
+	}
+
+	if (hdr.magic != TDB_WAL_MAGIC) {
+		if (st.st_size >= sizeof(hdr) && !created) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: "
+				 "%s is not a tdb log\n", name));
+			errno = EIO;
+			goto fail;
+		}
+		if (tdb->read_only) {
+			close(wal->fd);
+			free(name);
+			free(wal);
+			return 0;
+		}
+		hdr.magic = TDB_WAL_MAGIC;
+		hdr.end = sizeof(hdr);
+		if (pwrite(wal->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: "
+				 "could not write %s: %s\n", name,
+				 strerror(errno)));
+			goto fail;
+		}
+	}
+
+#ifdef HAVE_MMAP
+	ptr = mmap(NULL, sizeof(struct tdb_wal_header),
+		   tdb->read_only ? PROT_READ : PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_FILE, wal->fd, 0);
+	if (ptr == MAP_FAILED) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: "
+			 "mmap of %s failed: %s\n", name, strerror(errno)));
+		goto fail;
+	}
+#else
+	/* Other processes have to see our header updates right away */
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: "
+		 "%s needs mmap support\n", name));
+	errno = ENOSYS;
+	goto fail;
+#endif
+	wal->hdr = (struct tdb_wal_header *)ptr;
+	tdb->wal = wal;
+	free(name);
+	name = NULL;
+
+	if (created) {
+		if (tdb_wal_reset(tdb) == -1) {
+			goto fail;
+		}
+	} else if (!tdb_wal_in_use(tdb)) {
+		/*
+		 * We may come after a crash, bring in what the
+		 * database might have missed.
+		 */
+		if (tdb_wal_replay(tdb, sizeof(struct tdb_wal_header), true,
+				   &end) == -1) {
+			goto fail;
+		}
+		if (!tdb->read_only) {
+			/*
+			 * Whatever follows the last valid record is
+			 * garbage, don't append behind it in the same
+			 * generation.
+			 */
+			wal->hdr->end = end;
+			if (tdb_wal_checkpoint_locked(
+				    tdb, st.st_size > sizeof(hdr)) == -1) {
+				goto fail;
+			}
+		}
+	}
+
+	/* Leave this in place to tell later openers we're here */
+	if (tdb_brlock(tdb, F_RDLCK, WAL_ACTIVE_LOCK, 1,
+		       TDB_LOCK_WAIT) == -1) {
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	free(name);
+	tdb->wal = wal;
+	tdb_wal_free(tdb);
+	return -1;
+}
+
+/* Re-establish the active lock after a fork */
+int tdb_wal_reopen(struct tdb_context *tdb)
+{
+	if (tdb->wal == NULL) {
+		return 0;
+	}
+	return tdb_brlock(tdb, F_RDLCK, WAL_ACTIVE_LOCK, 1, TDB_LOCK_WAIT);
+}
+
+void tdb_wal_free(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (wal == NULL) {
+		return;
+	}
+#ifdef HAVE_MMAP
+	if (wal->hdr != NULL) {
+		munmap(wal->hdr, sizeof(struct tdb_wal_header));
+	}
+#endif
+	if (wal->fd != -1) {
+		close(wal->fd);
+	}
+	SAFE_FREE(tdb->wal);
+}
+
+/*
+ * The last one to close the database empties the log, so that read
+ * only openers find nothing to replay unless we crashed.
+ */
+void tdb_wal_close(struct tdb_context *tdb)
+{
+	if (tdb->wal == NULL) {
+		return;
+	}
+
+	if (!tdb->read_only &&
+	    tdb_brlock(tdb, F_WRLCK, WAL_ACTIVE_LOCK, 1,
+		       TDB_LOCK_NOWAIT|TDB_LOCK_PROBE) == 0) {
+		if (tdb_allrecord_lock(tdb, F_WRLCK, TDB_LOCK_WAIT,
+				       false) == 0) {
+			tdb_wal_checkpoint_locked(tdb, false);
+			tdb_allrecord_unlock(tdb, F_WRLCK, false);
+		}
+	}
+
+	tdb_wal_free(tdb);
+}
+
+/*
+ * Append a record with the new data of a transaction and sync it.
+ * Only a committed record is replayed, a prepared one needs
+ * tdb_wal_commit_prepared() first.
+ */
+int tdb_wal_append(struct tdb_context *tdb, const unsigned char *data,
+		   uint32_t data_len, uint32_t map_size, bool commit,
+		   uint32_t *ofs)
+{
+	struct tdb_wal *wal = tdb->wal;
+	struct tdb_wal_record rec;
+	uint32_t end;
+
+	rec.magic = commit ? TDB_WAL_COMMIT_MAGIC : TDB_WAL_PREPARED_MAGIC;
+	rec.generation = wal->hdr->generation;
+	rec.map_size = map_size;
+	rec.data_len = data_len;
+	rec.checksum = tdb_wal_checksum(&rec, data);
+
+	*ofs = wal->hdr->end;
+	if (!tdb_add_off_t(*ofs, sizeof(rec), &end) ||
+	    !tdb_add_off_t(end, data_len, &end)) {
+		tdb->ecode = TDB_ERR_OOM;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_append[%s]: "
+			 "log too large\n", tdb->name));
+		return -1;
+	}
+
+	if (pwrite(wal->fd, &rec, sizeof(rec), *ofs) != sizeof(rec) ||
+	    pwrite(wal->fd, data, data_len, *ofs + sizeof(rec)) !=
+	    (ssize_t)data_len) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_append[%s]: "
+			 "failed to write %u bytes: %s\n", tdb->name,
+			 (unsigned)(end - *ofs), strerror(errno)));
+		return -1;
+	}
+
+	if (tdb_wal_fsync(tdb, wal->fd) == -1) {
+		return -1;
+	}
+
+	wal->record_end = end;
+	return 0;
+}
+
+/* Overwrite the magic of the record at ofs and sync it */
+static int tdb_wal_set_magic(struct tdb_context *tdb, uint32_t ofs,
+			     uint32_t magic)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (pwrite(wal->fd, &magic, sizeof(magic),
+		   ofs + offsetof(struct tdb_wal_record, magic)) !=
+	    sizeof(magic)) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return tdb_wal_fsync(tdb, wal->fd);
+}
+
+/* Mark the record written by a prepare as committed */
+int tdb_wal_commit_prepared(struct tdb_context *tdb, uint32_t ofs)
+{
+	if (tdb_wal_set_magic(tdb, ofs, TDB_WAL_COMMIT_MAGIC) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_commit_prepared[%s]: "
+			 "failed to write commit magic: %s\n", tdb->name,
+			 strerror(errno)));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The transaction of the record at ofs is cancelled before it was
+ * written into the database. An implicit prepare writes a committed
+ * record, so make sure a later replay does not bring it in anyway.
+ * The end of the log was not moved on, the next record overwrites it.
+ */
+int tdb_wal_discard(struct tdb_context *tdb, uint32_t ofs)
+{
+	if (tdb_wal_set_magic(tdb, ofs, TDB_WAL_INVALID_MAGIC) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_discard[%s]: "
+			 "failed to invalidate log record at %u: %s\n",
+			 tdb->name, (unsigned)ofs, strerror(errno)));
+		return -1;
+	}
+	return 0;
+}
+
+/* The record at ofs is about to be written into the database */
+void tdb_wal_apply_begin(struct tdb_context *tdb, uint32_t ofs)
+{
+	tdb->wal->hdr->applying = ofs;
+}
+
+/*
+ * The record is in the database. Move on the end before clearing
+ * applying, a record is never in neither. Checkpoint if the log got
+ * too large, we still hold the allrecord lock for that.
+ */
+int tdb_wal_apply_end(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	wal->hdr->end = wal->record_end;
+	wal->hdr->applying = 0;
+
+	if (wal->hdr->end < TDB_WAL_CHECKPOINT_SIZE) {
+		return 0;
+	}
+	return tdb_wal_checkpoint_locked(tdb, false);
+}
+
+bool tdb_wal_needs_recovery(struct tdb_context *tdb)
+{
+	return tdb->wal->hdr->applying != 0;
+}
+
+/*
+ * A committer died while writing its record into the database, do
+ * it for it. Called with exclusive database write access like
+ * tdb_transaction_recover().
+ */
+int tdb_wal_recover(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+	uint32_t ofs = wal->hdr->applying;
+	uint32_t end;
+
+	if (ofs == 0) {
+		return 0;
+	}
+
+	if (tdb->read_only) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_recover[%s]: "
+			 "attempt to recover read only database\n",
+			 tdb->name));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+
+	if (tdb_wal_replay(tdb, ofs, false, &end) == -1) {
+		return -1;
+	}
+	if (end == ofs) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_recover[%s]: "
+			 "invalid log record at %u\n", tdb->name,
+			 (unsigned)ofs));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+
+	if (end > wal->hdr->end) {
+		wal->hdr->end = end;
+	}
+	wal->hdr->applying = 0;
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_wal_recover[%s]: "
+		 "replayed log record at %u\n", tdb->name, (unsigned)ofs));
+	return 0;
+}
+
+/*
+ * Called before writing to the database outside a transaction. The
+ * caller holds a chain or freelist lock, so there is no committer,
+ * but others may come here for other chains.
+ */
+int tdb_wal_before_write(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+	int ret;
+
+	if (wal->replaying || tdb->transaction != NULL ||
+	    wal->hdr->end == sizeof(struct tdb_wal_header)) {
+		return 0;
+	}
+
+	if (tdb_brlock(tdb, F_WRLCK, WAL_LOCK, 1, TDB_LOCK_WAIT) == -1) {
+		return -1;
+	}
+	ret = tdb_wal_checkpoint_locked(tdb, false);
+	tdb_brunlock(tdb, F_WRLCK, WAL_LOCK, 1);
+
+	return ret;
+}
+
+_PUBLIC_ int tdb_checkpoint(struct tdb_context *tdb)
+{
+	int ret;
+
+	if (tdb->wal == NULL) {
+		return 0;
+	}
+
+	if (tdb->transaction != NULL) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_checkpoint[%s]: "
+			 "not allowed inside a transaction\n", tdb->name));
+		return -1;
+	}
+
+	if (tdb_allrecord_lock(tdb, F_WRLCK, TDB_LOCK_WAIT, false) == -1) {
+		return -1;
+	}
+	ret = tdb_wal_checkpoint_locked(tdb, false);
+	tdb_allrecord_unlock(tdb, F_WRLCK, false);
+
+	return ret;
+}
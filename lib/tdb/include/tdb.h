@@ -32,6 +32,7 @@ extern "C" {
 
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * @defgroup tdb The tdb API
@@ -84,6 +85,16 @@ extern "C" {
 #define TDB_MUTEX_LOCKING 4096 /** optimized locking using robust mutexes if supported,
                                    only with tdb >= 1.3.0 and TDB_CLEAR_IF_FIRST
                                    after checking tdb_runtime_check_for_robust_mutexes() */
+#define TDB_SEQLOCK 8192 /** readers validate hash chains with sequence counters
+                             instead of locking them, only with tdb >= 1.3.14 */
+#define TDB_FREELIST_CLASSES 16384 /** keep free records on separate lists by size,
+                                       only with tdb >= 1.3.15 */
+#define TDB_RESIZABLE_HASH 32768 /** grow the hash table when the chains get long,
+                                     only with tdb >= 1.3.16 */
+#define TDB_GROUP_COMMIT 65536 /** commits share the final fsync,
+                                   only with tdb >= 1.3.17 */
+#define TDB_WAL 131072 /** log commits to a separate file,
+                           only with tdb >= 1.3.18 */
 
 /** The tdb error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -152,6 +163,36 @@ struct tdb_logging_context {
  *                                             can't be opened by tdb < 1.3.0.
  *                                             Only valid in combination with TDB_CLEAR_IF_FIRST
  *                                             after checking tdb_runtime_check_for_robust_mutexes()\n
+ *                         TDB_SEQLOCK - Keep a sequence counter per hash chain, so that
+ *                                       tdb_fetch(), tdb_parse_record() and tdb_exists()
+ *                                       don't need to lock the chain. Can't be opened
+ *                                       by tdb < 1.3.14.\n
+ *                         TDB_FREELIST_CLASSES - Keep free space on separate lists
+ *                                                by record size, so allocations
+ *                                                scan less. Can't be opened by
+ *                                                tdb < 1.3.15.\n
+ *                         TDB_RESIZABLE_HASH - Move the hash chains to a larger
+ *                                              table in the background when
+ *                                              they get long. Not valid with
+ *                                              TDB_INTERNAL. Can't be opened
+ *                                              by tdb < 1.3.16.\n
+ *                         TDB_GROUP_COMMIT - Sync transaction commits less
+ *                                            often while the database is
+ *                                            locked and let concurrent
+ *                                            committers share the final
+ *                                            sync. Not valid with
+ *                                            TDB_INTERNAL. Can't be opened
+ *                                            by tdb < 1.3.17.\n
+ *                         TDB_WAL - Commit transactions by appending the
+ *                                   new data to a log file next to the
+ *                                   database, "<name>.wal", with a single
+ *                                   sync that does not block readers.
+ *                                   The database itself is only synced
+ *                                   when the log is checkpointed. Meant
+ *                                   for databases mostly written in
+ *                                   transactions. Not valid with
+ *                                   TDB_INTERNAL or TDB_GROUP_COMMIT.
+ *                                   Can't be opened by tdb < 1.3.18.\n
  *
  * @param[in]  open_flags Flags for the open(2) function.
  *
@@ -193,6 +234,36 @@ struct tdb_context *tdb_open(const char *name, int hash_size, int tdb_flags,
  *                                             can't be opened by tdb < 1.3.0.
  *                                             Only valid in combination with TDB_CLEAR_IF_FIRST
  *                                             after checking tdb_runtime_check_for_robust_mutexes()\n
+ *                         TDB_SEQLOCK - Keep a sequence counter per hash chain, so that
+ *                                       tdb_fetch(), tdb_parse_record() and tdb_exists()
+ *                                       don't need to lock the chain. Can't be opened
+ *                                       by tdb < 1.3.14.\n
+ *                         TDB_FREELIST_CLASSES - Keep free space on separate lists
+ *                                                by record size, so allocations
+ *                                                scan less. Can't be opened by
+ *                                                tdb < 1.3.15.\n
+ *                         TDB_RESIZABLE_HASH - Move the hash chains to a larger
+ *                                              table in the background when
+ *                                              they get long. Not valid with
+ *                                              TDB_INTERNAL. Can't be opened
+ *                                              by tdb < 1.3.16.\n
+ *                         TDB_GROUP_COMMIT - Sync transaction commits less
+ *                                            often while the database is
+ *                                            locked and let concurrent
+ *                                            committers share the final
+ *                                            sync. Not valid with
+ *                                            TDB_INTERNAL. Can't be opened
+ *                                            by tdb < 1.3.17.\n
+ *                         TDB_WAL - Commit transactions by appending the
+ *                                   new data to a log file next to the
+ *                                   database, "<name>.wal", with a single
+ *                                   sync that does not block readers.
+ *                                   The database itself is only synced
+ *                                   when the log is checkpointed. Meant
+ *                                   for databases mostly written in
+ *                                   transactions. Not valid with
+ *                                   TDB_INTERNAL or TDB_GROUP_COMMIT.
+ *                                   Can't be opened by tdb < 1.3.18.\n
  *
  * @param[in]  open_flags Flags for the open(2) function.
  *
@@ -715,6 +786,16 @@ int tdb_transaction_prepare_commit(struct tdb_context *tdb);
  *
  * This updates the database and releases the current transaction locks.
  *
+ * With TDB_GROUP_COMMIT the locks are released before the last sync,
+ * which other committers may do for us. Other users can see the changes
+ * before this returns, and a crash before that can still roll them back.
+ * Stores outside transactions wait for that sync, so a rollback can't
+ * undo them.
+ *
+ * With TDB_WAL the commit is durable once its log record is synced,
+ * readers only wait while the data is copied into the database. A
+ * commit that fails is not replayed from the log later.
+ *
  * @param[in]  tdb      The database to commit the transaction.
  *
  * @return              0 on success, -1 on error with error code set.
@@ -724,6 +805,50 @@ int tdb_transaction_prepare_commit(struct tdb_context *tdb);
  */
 int tdb_transaction_commit(struct tdb_context *tdb);
 
+#define TDB_COMMIT_LATENCY_BUCKETS 24
+
+/** Transaction commit statistics of one tdb context */
+struct tdb_commit_stats {
+	uint64_t commits; /** successful commits */
+	uint64_t syncs; /** fsync calls made */
+	uint64_t shared_syncs; /** commits made durable by another fsync */
+	/** latency[i] counts the commits that took less than 2^i
+	    microseconds, but at least 2^(i-1). The last bucket takes
+	    all slower commits. */
+	uint64_t latency[TDB_COMMIT_LATENCY_BUCKETS];
+};
+
+/**
+ * @brief Get the transaction commit statistics of a tdb context.
+ *
+ * The counters cover the commits made through this context since it
+ * was opened. A commit only counts as shared with TDB_GROUP_COMMIT,
+ * when it found its changes already synced by another committer.
+ *
+ * @param[in]  tdb      The database to get the statistics for.
+ *
+ * @param[out] stats    The statistics.
+ *
+ * @see tdb_transaction_commit()
+ */
+void tdb_commit_stats(struct tdb_context *tdb, struct tdb_commit_stats *stats);
+
+/**
+ * @brief Write the transaction log of a TDB_WAL database back.
+ *
+ * This syncs the database and empties the log. It happens anyway when
+ * the log gets large and when the last user closes the database, but
+ * callers may want to do it after large transactions.
+ *
+ * @param[in]  tdb      The database to checkpoint.
+ *
+ * @return              0 on success or without TDB_WAL, -1 on error with
+ *                      error code set.
+ *
+ * @see tdb_transaction_commit()
+ */
+int tdb_checkpoint(struct tdb_context *tdb);
+
 /**
  * @brief Cancel a current transaction.
  *
@@ -20,6 +20,9 @@ static int ftruncate_check(int fd, off_t length);
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
 #include "tap-interface.h"
 #include <stdlib.h>
 #include <stdbool.h>
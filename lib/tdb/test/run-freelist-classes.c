@@ -0,0 +1,177 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/summary.c"
+#include "../common/freelistcheck.c"
+#include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include "logging.h"
+
+#define NUM_RECORDS 50
+
+static const size_t sizes[] = { 50, 300, 1000, 3000, 10000 };
+
+static TDB_DATA mkkey(char *buf, const char *prefix, int i)
+{
+	TDB_DATA key;
+
+	snprintf(buf, 16, "%s%d", prefix, i);
+	key.dptr = (uint8_t *)buf;
+	key.dsize = strlen(buf);
+	return key;
+}
+
+/*
+ * Store records of all sizes, each followed by a small one that
+ * keeps deleted neighbours from being merged.
+ */
+static bool store_records(struct tdb_context *tdb, TDB_DATA data)
+{
+	char buf[16];
+	int i;
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		data.dsize = sizes[i % ARRAY_SIZE(sizes)];
+		if (tdb_store(tdb, mkkey(buf, "rec", i), data,
+			      TDB_REPLACE) != 0) {
+			return false;
+		}
+		data.dsize = 1;
+		if (tdb_store(tdb, mkkey(buf, "pin", i), data,
+			      TDB_REPLACE) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool delete_records(struct tdb_context *tdb)
+{
+	char buf[16];
+	int i;
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		if (tdb_delete(tdb, mkkey(buf, "rec", i)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Walk all freelists, make sure no record is below the minimum size
+ * of its list and count the lists in use.
+ */
+static int used_freelists(struct tdb_context *tdb)
+{
+	unsigned int fclass;
+	int used = 0;
+
+	for (fclass = 0; fclass < TDB_NUM_FREELISTS(tdb); fclass++) {
+		tdb_off_t rec_ptr;
+		struct tdb_record rec;
+
+		if (tdb_ofs_read(tdb, FREELIST_CLASS_TOP(fclass),
+				 &rec_ptr) == -1) {
+			return -1;
+		}
+		if (rec_ptr != 0) {
+			used++;
+		}
+		while (rec_ptr != 0) {
+			if (tdb_rec_free_read(tdb, rec_ptr, &rec) == -1) {
+				return -1;
+			}
+			if (rec.rec_len < tdb_freelist_class_min(fclass)) {
+				diag("record at %u (%u) on freelist %u",
+				     rec_ptr, rec.rec_len, fclass);
+				return -1;
+			}
+			rec_ptr = rec.next;
+		}
+	}
+	return used;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	TDB_DATA data;
+	tdb_len_t map_size;
+	char *summary;
+	int num_entries;
+
+	plan_tests(29);
+
+	data.dptr = calloc(1, sizes[ARRAY_SIZE(sizes)-1]);
+	data.dsize = 0;
+
+	/* Without the feature everything is on the one freelist */
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1, TDB_CLEAR_IF_FIRST,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(TDB_NUM_FREELISTS(tdb) == 1);
+	ok1(tdb_freelist_class(tdb, 100000) == 0);
+	ok1(store_records(tdb, data) && delete_records(tdb));
+	ok1(used_freelists(tdb) == 1);
+	tdb_close(tdb);
+
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1,
+			  TDB_CLEAR_IF_FIRST|TDB_FREELIST_CLASSES,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_FREELIST_CLASSES);
+	ok1(TDB_NUM_FREELISTS(tdb) == TDB_FREELIST_CLASS_COUNT);
+	ok1(tdb_freelist_class(tdb, 0) == 0);
+	ok1(tdb_freelist_class(tdb, TDB_FREELIST_CLASS_BASE-1) == 0);
+	ok1(tdb_freelist_class(tdb, TDB_FREELIST_CLASS_BASE) == 1);
+	ok1(tdb_freelist_class(tdb, TDB_FREELIST_CLASS_BASE*2) == 2);
+	ok1(tdb_freelist_class(tdb, 100000) == TDB_FREELIST_CLASS_COUNT-1);
+
+	/* Deleted records end up on the list for their size */
+	ok1(store_records(tdb, data));
+	ok1(delete_records(tdb));
+	ok1(used_freelists(tdb) >= (int)ARRAY_SIZE(sizes));
+	ok1(tdb_validate_freelist(tdb, &num_entries) == 0);
+	ok1(num_entries >= NUM_RECORDS);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	/* ... and are found there again without growing the file */
+	map_size = tdb->map_size;
+	ok1(store_records(tdb, data));
+	ok1(tdb->map_size == map_size);
+	ok1(used_freelists(tdb) >= 0);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	/* Transactions and wipe_all keep the lists consistent */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(delete_records(tdb));
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(tdb_wipe_all(tdb) == 0 && tdb_check(tdb, NULL, NULL) == 0);
+
+	summary = tdb_summary(tdb);
+	ok1(summary && strstr(summary, "Free list 7 (records >= 8192)"));
+	free(summary);
+	tdb_close(tdb);
+
+	/* Other openers pick up the feature from the header */
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 0, TDB_DEFAULT,
+			  O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb && TDB_NUM_FREELISTS(tdb) == TDB_FREELIST_CLASS_COUNT);
+	tdb_close(tdb);
+
+	free(data.dptr);
+	return exit_status();
+}
@@ -0,0 +1,277 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include "logging.h"
+
+static TDB_DATA mkdata(const char *str)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = strlen(str);
+	return d;
+}
+
+static bool fetch_matches(struct tdb_context *tdb, TDB_DATA key,
+			  const char *expected)
+{
+	TDB_DATA d;
+	bool ret;
+
+	d = tdb_fetch(tdb, key);
+	ret = (d.dsize == strlen(expected)) &&
+		(memcmp(d.dptr, expected, d.dsize) == 0);
+	free(d.dptr);
+	return ret;
+}
+
+static bool commit_one(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data)
+{
+	return tdb_transaction_start(tdb) == 0 &&
+		tdb_store(tdb, key, data, TDB_REPLACE) == 0 &&
+		tdb_transaction_commit(tdb) == 0;
+}
+
+static uint32_t read_gen(struct tdb_context *tdb, tdb_off_t ofs)
+{
+	tdb_off_t gen;
+
+	if (tdb_ofs_read(tdb, ofs, &gen) == -1) {
+		return UINT32_MAX;
+	}
+	return gen;
+}
+
+/*
+ * Write what is on disk now to a new file, as if we crashed, but with
+ * the old value of the record replaced. If torn, also damage the
+ * recovery data.
+ */
+static bool crash_image(struct tdb_context *tdb, const char *name, bool torn)
+{
+	tdb_off_t head;
+	struct stat st;
+	unsigned char *buf, *p;
+	bool ret = false;
+	int fd;
+
+	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &head) == -1 ||
+	    fstat(tdb->fd, &st) == -1) {
+		return false;
+	}
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		return false;
+	}
+	if (pread(tdb->fd, buf, st.st_size, 0) != st.st_size) {
+		goto out;
+	}
+
+	p = memmem(buf, head, "old-value", strlen("old-value"));
+	if (p == NULL) {
+		goto out;
+	}
+	memcpy(p, "XXX", 3);
+	if (torn) {
+		buf[head + sizeof(struct tdb_record) + 8] ^= 0xff;
+	}
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		goto out;
+	}
+	ret = (write(fd, buf, st.st_size) == st.st_size);
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Write what is on disk now to a new file, as if we crashed before the
+ * last commit was synced, and its recovery magic was still there.
+ */
+static bool unsynced_image(struct tdb_context *tdb, const char *name)
+{
+	tdb_off_t head;
+	uint32_t magic = TDB_RECOVERY_MAGIC;
+	struct stat st;
+	unsigned char *buf;
+	bool ret = false;
+	int fd;
+
+	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &head) == -1 ||
+	    fstat(tdb->fd, &st) == -1) {
+		return false;
+	}
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		return false;
+	}
+	if (pread(tdb->fd, buf, st.st_size, 0) != st.st_size) {
+		goto out;
+	}
+
+	if (read_gen(tdb, TDB_SYNC_GEN_OFS) !=
+	    read_gen(tdb, TDB_COMMIT_GEN_OFS)) {
+		memcpy(buf + head + offsetof(struct tdb_record, magic),
+		       &magic, sizeof(magic));
+	}
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		goto out;
+	}
+	ret = (write(fd, buf, st.st_size) == st.st_size);
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb, *tdb2;
+	struct tdb_commit_stats stats;
+	TDB_DATA key = mkdata("key");
+	uint64_t latencies, shared_syncs, syncs;
+	uint32_t synced, gen;
+	int i;
+
+	plan_tests(38);
+
+	/* We want to count the syncs */
+	unsetenv("TDB_NO_FSYNC");
+
+	tdb = tdb_open_ex("run-group-commit.tdb", 0,
+			  TDB_INTERNAL|TDB_GROUP_COMMIT,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok(tdb == NULL && errno == EINVAL,
+	   "TDB_GROUP_COMMIT|TDB_INTERNAL should fail");
+
+	/* A normal commit syncs four times */
+	tdb = tdb_open_ex("run-group-commit.tdb", 0, TDB_CLEAR_IF_FIRST,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+	tdb_commit_stats(tdb, &stats);
+	ok1(stats.commits == 1 && stats.syncs == 4 && stats.shared_syncs == 0);
+	tdb_close(tdb);
+
+	/* A group commit syncs twice under the locks and once after */
+	tdb = tdb_open_ex("run-group-commit.tdb", 0,
+			  TDB_CLEAR_IF_FIRST|TDB_GROUP_COMMIT,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_GROUP_COMMIT);
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+	tdb_commit_stats(tdb, &stats);
+	ok1(stats.commits == 1 && stats.syncs == 3 && stats.shared_syncs == 0);
+	ok1(read_gen(tdb, TDB_COMMIT_GEN_OFS) == 1);
+	ok1(read_gen(tdb, TDB_SYNC_GEN_OFS) == 1);
+	ok1(!tdb_needs_recovery(tdb));
+
+	/* A committer that finds its generation synced doesn't sync */
+	ok1(transaction_group_sync(tdb, 1) == 0);
+	tdb_commit_stats(tdb, &stats);
+	ok1(stats.syncs == 3 && stats.shared_syncs == 1);
+
+	for (i = 0; i < 10; i++) {
+		const char *value = (i % 2) ? "old-value" : "new-value";
+
+		if (!commit_one(tdb, key, mkdata(value))) {
+			break;
+		}
+	}
+	ok1(i == 10);
+	ok1(read_gen(tdb, TDB_COMMIT_GEN_OFS) == 11);
+	ok1(read_gen(tdb, TDB_SYNC_GEN_OFS) == 11);
+	tdb_commit_stats(tdb, &stats);
+	latencies = 0;
+	for (i = 0; i < TDB_COMMIT_LATENCY_BUCKETS; i++) {
+		latencies += stats.latency[i];
+	}
+	ok1(stats.commits == 11 && latencies == 11);
+
+	/* A sync by a waiter during a transaction is not written back */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("key2"), mkdata("value"), TDB_INSERT) == 0);
+	synced = 1000;
+	ok1(tdb->transaction->io_methods->tdb_write(tdb, TDB_SYNC_GEN_OFS,
+						    &synced,
+						    sizeof(synced)) == 0);
+	tdb_commit_stats(tdb, &stats);
+	shared_syncs = stats.shared_syncs;
+	ok1(tdb_transaction_commit(tdb) == 0);
+	tdb_commit_stats(tdb, &stats);
+	ok1(read_gen(tdb, TDB_COMMIT_GEN_OFS) == 12);
+	ok1(read_gen(tdb, TDB_SYNC_GEN_OFS) == 1000 &&
+	    stats.shared_syncs == shared_syncs + 1);
+
+	/* Crash between the recovery sync and the data writes */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, key, mkdata("new-value"), TDB_MODIFY) == 0);
+	ok1(tdb_transaction_prepare_commit(tdb) == 0);
+	ok1(crash_image(tdb, "run-group-commit-1.tdb", false) &&
+	    crash_image(tdb, "run-group-commit-2.tdb", true));
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(fetch_matches(tdb, key, "new-value"));
+	tdb_close(tdb);
+
+	/* A complete recovery record is replayed */
+	tdb2 = tdb_open_ex("run-group-commit-1.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb2 && fetch_matches(tdb2, key, "old-value") &&
+	    tdb_check(tdb2, NULL, NULL) == 0);
+	tdb_close(tdb2);
+
+	/* A torn one is ignored */
+	suppress_logging = true;
+	tdb2 = tdb_open_ex("run-group-commit-2.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	suppress_logging = false;
+	ok1(tdb2 && fetch_matches(tdb2, key, "XXX-value") &&
+	    !tdb_needs_recovery(tdb2));
+	tdb_close(tdb2);
+
+	/* A store outside a transaction waits for the last commit's sync */
+	tdb = tdb_open_ex("run-group-commit-3.tdb", 0,
+			  TDB_CLEAR_IF_FIRST|TDB_GROUP_COMMIT,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(commit_one(tdb, key, mkdata("old-value")) &&
+	    commit_one(tdb, key, mkdata("new-value")));
+	gen = read_gen(tdb, TDB_COMMIT_GEN_OFS);
+	synced = gen - 1;
+	ok1(tdb->methods->tdb_write(tdb, TDB_SYNC_GEN_OFS, &synced,
+				    sizeof(synced)) == 0);
+	tdb_commit_stats(tdb, &stats);
+	syncs = stats.syncs;
+	ok1(tdb_store(tdb, key, mkdata("xyz-value"), TDB_MODIFY) == 0);
+	tdb_commit_stats(tdb, &stats);
+	ok1(stats.syncs == syncs + 1 && read_gen(tdb, TDB_SYNC_GEN_OFS) == gen);
+	ok1(unsynced_image(tdb, "run-group-commit-4.tdb"));
+	tdb_close(tdb);
+
+	/* So a crash now doesn't roll the store back */
+	tdb2 = tdb_open_ex("run-group-commit-4.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb2 && fetch_matches(tdb2, key, "xyz-value"));
+	tdb_close(tdb2);
+
+	return exit_status();
+}
@@ -10,6 +10,9 @@
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
 #include "tap-interface.h"
 #include <stdlib.h>
 #include <stdbool.h>
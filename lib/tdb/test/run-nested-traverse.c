@@ -12,6 +12,9 @@
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
 #include "tap-interface.h"
 #undef fcntl
 #include <stdlib.h>
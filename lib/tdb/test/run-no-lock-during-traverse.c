@@ -14,6 +14,9 @@
 #include "../common/check.c"
 #include "../common/hash.c"
 #include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
 #include "tap-interface.h"
 #include <stdlib.h>
 #include "logging.h"
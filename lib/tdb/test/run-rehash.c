@@ -0,0 +1,191 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/summary.c"
+#include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include "logging.h"
+
+#define NUM_RECORDS 1000
+
+static TDB_DATA mkkey(char *buf, int i)
+{
+	TDB_DATA key;
+
+	snprintf(buf, 16, "key%d", i);
+	key.dptr = (uint8_t *)buf;
+	key.dsize = strlen(buf);
+	return key;
+}
+
+static bool store_records(struct tdb_context *tdb, int from, int to)
+{
+	char buf[16];
+	int i;
+
+	for (i = from; i < to; i++) {
+		TDB_DATA key = mkkey(buf, i);
+
+		if (tdb_store(tdb, key, key, TDB_INSERT) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Every record in [from, to) is there, every other one in [0, max) isn't */
+static bool check_records(struct tdb_context *tdb, int from, int to, int max)
+{
+	char buf[16];
+	int i;
+
+	for (i = 0; i < max; i++) {
+		TDB_DATA key = mkkey(buf, i);
+		TDB_DATA data = tdb_fetch(tdb, key);
+		bool found = (data.dptr != NULL);
+
+		if (found && (data.dsize != key.dsize ||
+			      memcmp(data.dptr, key.dptr, key.dsize) != 0)) {
+			diag("bad data for %s", buf);
+			found = !found;
+		}
+		free(data.dptr);
+		if (found != (i >= from && i < to)) {
+			diag("%s: found %d", buf, (int)found);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int count_keys(struct tdb_context *tdb)
+{
+	TDB_DATA key, next;
+	int count = 0;
+
+	for (key = tdb_firstkey(tdb); key.dptr; key = next) {
+		next = tdb_nextkey(tdb, key);
+		free(key.dptr);
+		count++;
+	}
+	return count;
+}
+
+static struct tdb_hash_resize get_resize(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r;
+
+	if (tdb_hash_resize_read(tdb, &r) == -1) {
+		memset(&r, 0xff, sizeof(r));
+	}
+	return r;
+}
+
+/* Make this process want to resize right now */
+static void want_resize(struct tdb_context *tdb)
+{
+	struct tdb_hash_resize r = get_resize(tdb);
+
+	tdb->rehash_buckets = tdb->hash_size * (r.table ? r.factor : 1);
+	tdb->rehash_chain_avg = UINT32_MAX;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	struct tdb_hash_resize r;
+	uint32_t factor;
+	char *summary, buf[16];
+	int steps;
+
+	plan_tests(32);
+
+	tdb = tdb_open_ex("run-rehash.tdb", 7,
+			  TDB_INTERNAL|TDB_RESIZABLE_HASH,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok(tdb == NULL && errno == EINVAL,
+	   "TDB_RESIZABLE_HASH|TDB_INTERNAL should fail");
+
+	tdb = tdb_open_ex("run-rehash.tdb", 7,
+			  TDB_CLEAR_IF_FIRST|TDB_RESIZABLE_HASH,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_HASH_RESIZE);
+	ok1(!tdb_hash_resized(tdb));
+
+	/* Inserting misses on ever longer chains, the table grows */
+	ok1(store_records(tdb, 0, NUM_RECORDS));
+	r = get_resize(tdb);
+	ok1(r.table != 0 && r.factor >= 16);
+	ok1(tdb_hash_resized(tdb));
+	ok1(check_records(tdb, 0, NUM_RECORDS, NUM_RECORDS));
+	ok1(tdb_traverse(tdb, NULL, NULL) == NUM_RECORDS);
+	ok1(count_keys(tdb) == NUM_RECORDS);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	summary = tdb_summary(tdb);
+	ok1(summary && strstr(summary, "Hash buckets/lock chains: "));
+	ok1(summary && strstr(summary, "Hash chain lengths "));
+	free(summary);
+
+	/* Stop in the middle of a resize, the stores must not go on */
+	factor = r.factor;
+	want_resize(tdb);
+	ok1(tdb_rehash_step(tdb) == 0);
+	tdb->rehash_countdown = UINT32_MAX;
+	r = get_resize(tdb);
+	ok1(r.new_table != 0 && r.new_factor == factor * TDB_REHASH_GROWTH);
+	ok1(r.progress > 0 && r.progress < tdb->hash_size);
+
+	ok1(store_records(tdb, NUM_RECORDS, NUM_RECORDS + 100));
+	ok1(tdb_delete(tdb, mkkey(buf, 0)) == 0);
+	ok1(check_records(tdb, 1, NUM_RECORDS + 100, NUM_RECORDS + 100));
+	ok1(tdb_traverse(tdb, NULL, NULL) == NUM_RECORDS + 99);
+	ok1(count_keys(tdb) == NUM_RECORDS + 99);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	summary = tdb_summary(tdb);
+	ok1(summary && strstr(summary, "Hash table resize: "));
+	free(summary);
+
+	/* A cancelled transaction leaves the table alone */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_rehash_step(tdb) == -1);
+	ok1(tdb_transaction_cancel(tdb) == 0);
+
+	for (steps = 0; get_resize(tdb).new_table != 0; steps++) {
+		if (tdb_rehash_step(tdb) != 0 || steps > TDB_REHASH_STEPS) {
+			break;
+		}
+	}
+	r = get_resize(tdb);
+	ok1(r.new_table == 0 && r.factor == factor * TDB_REHASH_GROWTH);
+	ok1(check_records(tdb, 1, NUM_RECORDS + 100, NUM_RECORDS + 100));
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	/* Other openers find the records in the resized table */
+	tdb_close(tdb);
+	tdb = tdb_open_ex("run-rehash.tdb", 0, TDB_DEFAULT,
+			  O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb && check_records(tdb, 1, NUM_RECORDS + 100,
+				 NUM_RECORDS + 100));
+
+	/* Wiping goes back to the table behind the header */
+	ok1(tdb_wipe_all(tdb) == 0 && !tdb_hash_resized(tdb));
+	ok1(store_records(tdb, 0, 10) && tdb_check(tdb, NULL, NULL) == 0);
+	tdb_close(tdb);
+
+	return exit_status();
+}
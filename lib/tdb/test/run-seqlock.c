@@ -0,0 +1,180 @@
+#include "../common/tdb_private.h"
+#include "lock-tracking.h"
+
+#define fcntl fcntl_with_lockcheck
+
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#undef fcntl
+
+static unsigned int num_unlocks;
+
+static void count_unlock(int fd)
+{
+	num_unlocks++;
+}
+
+static TDB_DATA mkdata(const char *str, size_t len)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = len;
+	return d;
+}
+
+static int parse_fn(TDB_DATA key, TDB_DATA data, void *private_data)
+{
+	TDB_DATA *expected = (TDB_DATA *)private_data;
+
+	if (data.dsize != expected->dsize) {
+		return -1;
+	}
+	return memcmp(data.dptr, expected->dptr, data.dsize);
+}
+
+static uint32_t chain_seqnum(struct tdb_context *tdb, TDB_DATA key)
+{
+	return tdb->seqlocks->seqnums[BUCKET(tdb->hash_fn(&key)) + 1];
+}
+
+static bool fetch_matches(struct tdb_context *tdb, TDB_DATA key,
+			  TDB_DATA expected)
+{
+	TDB_DATA d;
+	bool ret;
+
+	d = tdb_fetch(tdb, key);
+	ret = (d.dsize == expected.dsize) &&
+		(memcmp(d.dptr, expected.dptr, d.dsize) == 0);
+	free(d.dptr);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	TDB_DATA key, key2, data, data2;
+	unsigned int unlocks;
+	uint32_t seqnum;
+	int status;
+	pid_t child;
+
+	plan_tests(34);
+
+	key = mkdata("hi", strlen("hi"));
+	key2 = mkdata("missing", strlen("missing"));
+	data = mkdata("world", strlen("world"));
+	data2 = mkdata("other world", strlen("other world"));
+
+	unlock_callback = count_unlock;
+
+	tdb = tdb_open_ex("run-seqlock.tdb", 0,
+			  TDB_INTERNAL|TDB_SEQLOCK,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok(tdb == NULL && errno == EINVAL,
+	   "TDB_SEQLOCK|TDB_INTERNAL should fail");
+
+	tdb = tdb_open_ex("run-seqlock.tdb", 1024,
+			  TDB_CLEAR_IF_FIRST|TDB_SEQLOCK,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK);
+	ok1(tdb->seqlocks != NULL);
+	ok1(tdb->hdr_ofs == tdb->seqlock_size);
+	ok1((tdb->seqlocks->seqnums[0] & 1) == 0);
+
+	/* A store makes the chain counter go through one write section */
+	seqnum = chain_seqnum(tdb, key);
+	ok1(tdb_store(tdb, key, data, TDB_INSERT) == 0);
+	ok1(chain_seqnum(tdb, key) == seqnum + 2);
+
+	/* Readers don't lock */
+	unlocks = num_unlocks;
+	ok1(fetch_matches(tdb, key, data));
+	ok1(tdb_parse_record(tdb, key, parse_fn, &data) == 0);
+	ok1(tdb_exists(tdb, key) == 1);
+	ok1(tdb_exists(tdb, key2) == 0);
+	ok1(tdb_fetch(tdb, key2).dptr == NULL);
+	ok1(tdb_error(tdb) == TDB_ERR_NOEXIST);
+	ok1(num_unlocks == unlocks);
+
+	/* The counter is odd while we hold the chain lock */
+	ok1(tdb_chainlock(tdb, key) == 0);
+	ok1(chain_seqnum(tdb, key) & 1);
+	ok1(fetch_matches(tdb, key, data));
+	ok1(tdb_chainunlock(tdb, key) == 0);
+	ok1((chain_seqnum(tdb, key) & 1) == 0);
+
+	/* A writer that died in its write section: fall back to locking */
+	tdb->seqlocks->seqnums[BUCKET(tdb->hash_fn(&key)) + 1] |= 1;
+	unlocks = num_unlocks;
+	ok1(fetch_matches(tdb, key, data));
+	ok1(num_unlocks != unlocks);
+	ok1(tdb_store(tdb, key, data, TDB_MODIFY) == 0);
+	ok1((chain_seqnum(tdb, key) & 1) == 0);
+
+	/* Allrecord writers and transaction commits */
+	seqnum = tdb->seqlocks->seqnums[0];
+	ok1(tdb_lockall(tdb) == 0);
+	ok1(tdb->seqlocks->seqnums[0] & 1);
+	ok1(tdb_unlockall(tdb) == 0);
+	ok1(tdb->seqlocks->seqnums[0] == seqnum + 2);
+
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb->seqlocks->seqnums[0] == seqnum + 2);
+	ok1(tdb_store(tdb, key, data2, TDB_MODIFY) == 0);
+	ok1(fetch_matches(tdb, key, data2));
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(tdb->seqlocks->seqnums[0] == seqnum + 4);
+
+	/* Other openers pick up the feature from the header */
+	ok1(tdb_close(tdb) == 0);
+	child = fork();
+	if (child == 0) {
+		struct tdb_context *tdb2;
+
+		tdb2 = tdb_open_ex("run-seqlock.tdb", 0, TDB_DEFAULT,
+				   O_RDWR, 0, &taplogctx, NULL);
+		if (tdb2 == NULL || tdb2->seqlocks == NULL) {
+			exit(1);
+		}
+		if (tdb_store(tdb2, key, data, TDB_MODIFY) != 0) {
+			exit(2);
+		}
+		tdb_close(tdb2);
+		exit(0);
+	}
+
+	ok1(waitpid(child, &status, 0) == child);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	tdb = tdb_open_ex("run-seqlock.tdb", 0, TDB_DEFAULT,
+			  O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb);
+	unlocks = num_unlocks;
+	ok1(fetch_matches(tdb, key, data));
+	ok1(num_unlocks == unlocks);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+	tdb_close(tdb);
+
+	return exit_status();
+}
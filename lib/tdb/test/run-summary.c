@@ -11,6 +11,9 @@
 #include "../common/hash.c"
 #include "../common/summary.c"
 #include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
 #include "tap-interface.h"
 #include <stdlib.h>
 
@@ -0,0 +1,296 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "../common/seqlock.c"
+#include "../common/rehash.c"
+#include "../common/wal.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include "logging.h"
+
+static TDB_DATA mkdata(const char *str)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = strlen(str);
+	return d;
+}
+
+static bool fetch_matches(struct tdb_context *tdb, TDB_DATA key,
+			  const char *expected)
+{
+	TDB_DATA d;
+	bool ret;
+
+	d = tdb_fetch(tdb, key);
+	ret = (d.dsize == strlen(expected)) &&
+		(memcmp(d.dptr, expected, d.dsize) == 0);
+	free(d.dptr);
+	return ret;
+}
+
+static bool commit_one(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data)
+{
+	return tdb_transaction_start(tdb) == 0 &&
+		tdb_store(tdb, key, data, TDB_REPLACE) == 0 &&
+		tdb_transaction_commit(tdb) == 0;
+}
+
+static bool log_empty(struct tdb_context *tdb)
+{
+	return tdb->wal->hdr->end == sizeof(struct tdb_wal_header) &&
+		tdb->wal->hdr->applying == 0;
+}
+
+static off_t file_size(const char *name)
+{
+	struct stat st;
+
+	if (stat(name, &st) == -1) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+/* Copy what is on disk now, optionally damaging the byte at damage */
+static bool copy_fd(int from, const char *name, off_t damage)
+{
+	struct stat st;
+	unsigned char *buf;
+	bool ret = false;
+	int fd;
+
+	if (fstat(from, &st) == -1) {
+		return false;
+	}
+	buf = malloc(st.st_size);
+	if (buf == NULL) {
+		return false;
+	}
+	if (pread(from, buf, st.st_size, 0) != st.st_size) {
+		goto out;
+	}
+	if (damage >= 0 && damage < st.st_size) {
+		buf[damage] ^= 0xff;
+	}
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		goto out;
+	}
+	ret = (write(fd, buf, st.st_size) == st.st_size);
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+static int expand_fails(struct tdb_context *tdb, tdb_off_t size,
+			tdb_off_t addition)
+{
+	tdb->ecode = TDB_ERR_IO;
+	return -1;
+}
+
+static int (*real_write)(struct tdb_context *, tdb_off_t, const void *,
+			 tdb_len_t);
+static int num_writes;
+
+static int first_write_fails(struct tdb_context *tdb, tdb_off_t off,
+			     const void *buf, tdb_len_t len)
+{
+	if (num_writes++ == 0) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return real_write(tdb, off, buf, len);
+}
+
+/* A crash now must not bring in the failed commit */
+static bool crash_keeps_old_value(struct tdb_context *tdb, TDB_DATA key,
+				  const char *name)
+{
+	struct tdb_context *tdb2;
+	char walname[64];
+	bool ret;
+
+	snprintf(walname, sizeof(walname), "%s.wal", name);
+	if (!copy_fd(tdb->fd, name, -1) ||
+	    !copy_fd(tdb->wal->fd, walname, -1)) {
+		return false;
+	}
+	tdb2 = tdb_open_ex(name, 0, TDB_DEFAULT, O_RDWR, 0, &taplogctx, NULL);
+	ret = tdb2 && fetch_matches(tdb2, key, "old-value") &&
+		tdb_check(tdb2, NULL, NULL) == 0;
+	tdb_close(tdb2);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb, *tdb2;
+	struct tdb_commit_stats stats;
+	const struct tdb_methods *methods;
+	struct tdb_methods failing;
+	TDB_DATA key = mkdata("key");
+	TDB_DATA big;
+	tdb_off_t recovery_head;
+	uint32_t gen, ofs;
+	uint64_t syncs;
+	unsigned char *p;
+
+	plan_tests(44);
+
+	/* We want to count the syncs */
+	unsetenv("TDB_NO_FSYNC");
+
+	tdb = tdb_open_ex("run-wal.tdb", 0, TDB_INTERNAL|TDB_WAL,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok(tdb == NULL && errno == EINVAL,
+	   "TDB_WAL|TDB_INTERNAL should fail");
+	tdb = tdb_open_ex("run-wal.tdb", 0, TDB_WAL|TDB_GROUP_COMMIT,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok(tdb == NULL && errno == EINVAL,
+	   "TDB_WAL|TDB_GROUP_COMMIT should fail");
+
+	tdb = tdb_open_ex("run-wal.tdb", 0, TDB_CLEAR_IF_FIRST|TDB_WAL,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_WAL);
+	ok1(tdb->wal != NULL && log_empty(tdb));
+
+	/* A commit syncs the log once and has no recovery area */
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+	tdb_commit_stats(tdb, &stats);
+	ok1(stats.commits == 1 && stats.syncs == 1);
+	ok1(!log_empty(tdb) && !tdb_needs_recovery(tdb));
+	ok1(tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == 0 &&
+	    recovery_head == 0);
+	ok1(fetch_matches(tdb, key, "old-value"));
+
+	/* A write outside a transaction checkpoints first */
+	gen = tdb->wal->hdr->generation;
+	ok1(tdb_store(tdb, key, mkdata("new-value"), TDB_REPLACE) == 0);
+	ok1(log_empty(tdb) && tdb->wal->hdr->generation == gen + 1);
+	ok1(file_size("run-wal.tdb.wal") == sizeof(struct tdb_wal_header));
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+	ok1(tdb_checkpoint(tdb) == 0 && log_empty(tdb));
+
+	/* A prepared transaction is not in the log yet */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, key, mkdata("new-value"), TDB_MODIFY) == 0);
+	ok1(tdb_transaction_prepare_commit(tdb) == 0);
+	ok1(copy_fd(tdb->fd, "run-wal-1.tdb", -1) &&
+	    copy_fd(tdb->wal->fd, "run-wal-1.tdb.wal", -1) &&
+	    copy_fd(tdb->fd, "run-wal-2.tdb", -1) &&
+	    copy_fd(tdb->fd, "run-wal-3.tdb", -1));
+	ok1(tdb_transaction_commit(tdb) == 0);
+
+	/* A committed one is, torn ones are ignored */
+	ok1(copy_fd(tdb->wal->fd, "run-wal-2.tdb.wal", -1) &&
+	    copy_fd(tdb->wal->fd, "run-wal-3.tdb.wal",
+		    file_size("run-wal.tdb.wal") - 1));
+	ok1(fetch_matches(tdb, key, "new-value"));
+
+	tdb2 = tdb_open_ex("run-wal-1.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb2 && fetch_matches(tdb2, key, "old-value"));
+	tdb_close(tdb2);
+
+	tdb2 = tdb_open_ex("run-wal-2.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb2 && fetch_matches(tdb2, key, "new-value") &&
+	    log_empty(tdb2) && tdb_check(tdb2, NULL, NULL) == 0);
+	tdb_close(tdb2);
+
+	tdb2 = tdb_open_ex("run-wal-3.tdb", 0, TDB_DEFAULT,
+			   O_RDWR, 0, &taplogctx, NULL);
+	ok1(tdb2 && fetch_matches(tdb2, key, "old-value"));
+	tdb_close(tdb2);
+
+	/* A committer died while writing the record into the database */
+	ofs = tdb->wal->hdr->end;
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+	p = memmem(tdb->map_ptr, tdb->map_size, "old-value",
+		   strlen("old-value"));
+	ok1(p != NULL);
+	memcpy(p, "XXX", 3);
+	tdb->wal->hdr->applying = ofs;
+	ok1(tdb_needs_recovery(tdb));
+	ok1(fetch_matches(tdb, key, "old-value") && !tdb_needs_recovery(tdb));
+
+	/* A commit that fails after writing its log record leaves it out */
+	ofs = tdb->wal->hdr->end;
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, key, mkdata("new-value"), TDB_MODIFY) == 0);
+	suppress_logging = true;
+	tdb->traverse_read++;
+	ok(tdb_transaction_commit(tdb) == -1, "lock upgrade fails");
+	tdb->traverse_read--;
+	suppress_logging = false;
+	ok1(tdb->wal->hdr->end == ofs && fetch_matches(tdb, key, "old-value"));
+	ok1(crash_keeps_old_value(tdb, key, "run-wal-4.tdb"));
+
+	big.dsize = 1024*1024;
+	big.dptr = calloc(1, big.dsize);
+	ok1(big.dptr && tdb_transaction_start(tdb) == 0 &&
+	    tdb_store(tdb, key, big, TDB_MODIFY) == 0);
+	methods = tdb->transaction->io_methods;
+	failing = *methods;
+	failing.tdb_expand_file = expand_fails;
+	tdb->transaction->io_methods = &failing;
+	suppress_logging = true;
+	ok(tdb_transaction_commit(tdb) == -1, "expansion fails");
+	suppress_logging = false;
+	tdb->methods = methods;
+	free(big.dptr);
+	ok1(tdb->wal->hdr->end == ofs && fetch_matches(tdb, key, "old-value"));
+	ok1(crash_keeps_old_value(tdb, key, "run-wal-5.tdb"));
+
+	/* If the in place write fails, the log record is tried again */
+	ok1(tdb_transaction_start(tdb) == 0 &&
+	    tdb_store(tdb, key, mkdata("new-value"), TDB_MODIFY) == 0);
+	methods = tdb->transaction->io_methods;
+	failing = *methods;
+	real_write = methods->tdb_write;
+	failing.tdb_write = first_write_fails;
+	tdb->transaction->io_methods = &failing;
+	suppress_logging = true;
+	ok(tdb_transaction_commit(tdb) == 0, "replay finishes the commit");
+	suppress_logging = false;
+	tdb->methods = methods;
+	ok1(num_writes > 1 && !tdb_needs_recovery(tdb) &&
+	    fetch_matches(tdb, key, "new-value"));
+	ok1(commit_one(tdb, key, mkdata("old-value")));
+
+	/* A large commit checkpoints right away */
+	big.dsize = TDB_WAL_CHECKPOINT_SIZE;
+	big.dptr = calloc(1, big.dsize);
+	tdb_commit_stats(tdb, &stats);
+	syncs = stats.syncs;
+	ok1(big.dptr && commit_one(tdb, key, big));
+	tdb_commit_stats(tdb, &stats);
+	ok1(log_empty(tdb) && stats.syncs == syncs + 3);
+	free(big.dptr);
+
+	/* The last one to close empties the log, read only opens work */
+	ok1(commit_one(tdb, key, mkdata("new-value")));
+	tdb_close(tdb);
+	ok1(file_size("run-wal.tdb.wal") == sizeof(struct tdb_wal_header));
+	tdb = tdb_open_ex("run-wal.tdb", 0, TDB_DEFAULT,
+			  O_RDONLY, 0, &taplogctx, NULL);
+	ok1(tdb && fetch_matches(tdb, key, "new-value"));
+	tdb_close(tdb);
+
+	return exit_status();
+}
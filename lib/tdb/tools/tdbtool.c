@@ -228,7 +228,9 @@ static void help(void)
 "  dump                 : dump the database as strings\n"
 "  keys                 : dump the database keys as strings\n"
 "  hexkeys              : dump the database keys as hex values\n"
-"  info                 : print summary info about the database\n"
+"  info                 : print summary info about the database, the\n"
+"                         hash chain lengths and the fragmentation\n"
+"                         of each freelist\n"
 "  insert    key  data  : insert a record\n"
 "  move      key  file  : move a record to a destination tdb\n"
 "  storehex  key  data  : store a record (replace), key/value in hex format\n"
@@ -236,7 +238,7 @@ static void help(void)
 "  show      key        : show a record by key\n"
 "  delete    key        : delete a record by key\n"
 "  list                 : print the database hash table and freelist\n"
-"  free                 : print the database freelist\n"
+"  free                 : print the database freelist(s)\n"
 "  freelist_size        : print the number of records in the freelist\n"
 "  check                : check the integrity of an opened database\n"
 "  repack               : repack the database\n"
@@ -34,6 +34,11 @@ static int hash_size = 2;
 static int loopnum;
 static int count_pipe;
 static bool mutex = false;
+static bool seqlock = false;
+static bool freelist_classes = false;
+static bool resizable_hash = false;
+static bool group_commit = false;
+static bool wal = false;
 static struct tdb_logging_context log_ctx;
 
 #ifdef PRINTF_ATTRIBUTE
@@ -217,7 +222,7 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-t] [-k] [-m] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-t] [-k] [-m] [-S] [-F] [-R] [-G] [-W] [-r] [-c] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
 	exit(0);
 }
 
@@ -240,6 +245,21 @@ static int run_child(const char *filename, int i, int seed, unsigned num_loops,
 	if (mutex) {
 		tdb_flags |= TDB_MUTEX_LOCKING;
 	}
+	if (seqlock) {
+		tdb_flags |= TDB_SEQLOCK;
+	}
+	if (freelist_classes) {
+		tdb_flags |= TDB_FREELIST_CLASSES;
+	}
+	if (resizable_hash) {
+		tdb_flags |= TDB_RESIZABLE_HASH;
+	}
+	if (group_commit) {
+		tdb_flags |= TDB_GROUP_COMMIT;
+	}
+	if (wal) {
+		tdb_flags |= TDB_WAL;
+	}
 
 	db = tdb_open_ex(filename, hash_size, tdb_flags,
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
@@ -281,6 +301,360 @@ static int run_child(const char *filename, int i, int seed, unsigned num_loops,
 	return (error_count < 100 ? error_count : 100);
 }
 
+/*
+ * Read scalability: NUM_PROCS readers fetch random records while one
+ * writer keeps rewriting them. Every rewrite fills a record with a
+ * different byte, so a reader seeing a mix of bytes caught a torn
+ * record.
+ */
+
+#define READ_RECORDS 1000
+#define READ_DATALEN 64
+
+static volatile sig_atomic_t stop_writer;
+
+static void writer_stop(int sig)
+{
+	stop_writer = 1;
+}
+
+static void read_record_fill(unsigned char *buf, unsigned i, unsigned gen)
+{
+	memset(buf, 'a' + ((i + gen) % 26), READ_DATALEN);
+}
+
+static int run_read_writer(int seed)
+{
+	unsigned char buf[READ_DATALEN];
+	unsigned gen = 0;
+
+	if (tdb_reopen(db) != 0) {
+		fatal("tdb_reopen failed");
+		return 1;
+	}
+	srandom(seed);
+
+	while (!stop_writer && error_count == 0) {
+		unsigned i = random() % READ_RECORDS;
+		TDB_DATA key, data;
+
+		key.dptr = (unsigned char *)&i;
+		key.dsize = sizeof(i);
+		data.dptr = buf;
+		data.dsize = sizeof(buf);
+
+		read_record_fill(buf, i, ++gen);
+
+		if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+			fatal("tdb_store failed");
+		}
+	}
+
+	tdb_close(db);
+	return (error_count < 100 ? error_count : 100);
+}
+
+static int run_read_child(int i, int seed, unsigned num_loops)
+{
+	unsigned loop;
+
+	if (tdb_reopen(db) != 0) {
+		fatal("tdb_reopen failed");
+		return 1;
+	}
+	srandom(seed + i);
+
+	for (loop = 0; loop < num_loops && error_count == 0; loop++) {
+		unsigned r = random() % READ_RECORDS;
+		TDB_DATA key, data;
+		unsigned j;
+
+		key.dptr = (unsigned char *)&r;
+		key.dsize = sizeof(r);
+
+		data = tdb_fetch(db, key);
+		if (data.dptr == NULL || data.dsize != READ_DATALEN) {
+			fatal("tdb_fetch failed");
+			free(data.dptr);
+			break;
+		}
+		for (j = 1; j < data.dsize; j++) {
+			if (data.dptr[j] != data.dptr[0]) {
+				printf("torn record %u: %.*s\n", r,
+				       (int)data.dsize, (char *)data.dptr);
+				error_count++;
+				break;
+			}
+		}
+		free(data.dptr);
+	}
+
+	tdb_close(db);
+	return (error_count < 100 ? error_count : 100);
+}
+
+static int run_read_bench(const char *filename, int num_procs, int seed,
+			  unsigned num_loops)
+{
+	unsigned char buf[READ_DATALEN];
+	struct timeval start, end;
+	pid_t writer, *pids;
+	double secs;
+	unsigned i;
+	int j, status;
+	int tdb_flags = TDB_DEFAULT|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH;
+
+	if (mutex) {
+		tdb_flags |= TDB_MUTEX_LOCKING;
+	}
+	if (seqlock) {
+		tdb_flags |= TDB_SEQLOCK;
+	}
+
+	/*
+	 * We keep the tdb open while forking, so the children
+	 * don't wipe it with TDB_CLEAR_IF_FIRST.
+	 */
+	db = tdb_open_ex(filename, hash_size, tdb_flags,
+			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
+	if (!db) {
+		fatal("db open failed");
+		return 1;
+	}
+
+	for (i = 0; i < READ_RECORDS; i++) {
+		TDB_DATA key, data;
+
+		key.dptr = (unsigned char *)&i;
+		key.dsize = sizeof(i);
+		data.dptr = buf;
+		data.dsize = sizeof(buf);
+
+		read_record_fill(buf, i, 0);
+
+		if (tdb_store(db, key, data, TDB_INSERT) != 0) {
+			fatal("tdb_store failed");
+			return 1;
+		}
+	}
+
+	pids = (pid_t *)calloc(sizeof(pid_t), num_procs);
+	if (pids == NULL) {
+		perror("Unable to allocate memory for pids");
+		return 1;
+	}
+
+	signal(SIGUSR1, writer_stop);
+
+	writer = fork();
+	if (writer == 0) {
+		exit(run_read_writer(seed));
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (j = 0; j < num_procs; j++) {
+		pids[j] = fork();
+		if (pids[j] == 0) {
+			exit(run_read_child(j, seed, num_loops));
+		}
+	}
+
+	for (j = 0; j < num_procs; j++) {
+		if (waitpid(pids[j], &status, 0) != pids[j] ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("reader %d failed\n", j);
+			error_count++;
+		}
+	}
+
+	gettimeofday(&end, NULL);
+
+	kill(writer, SIGUSR1);
+	if (waitpid(writer, &status, 0) != writer ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("writer failed\n");
+		error_count++;
+	}
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) * 1.0e-6;
+
+	printf("%d readers%s%s: %u fetches in %.3f seconds, "
+	       "%.0f fetches/sec\n", num_procs,
+	       mutex ? " (mutex)" : "", seqlock ? " (seqlock)" : "",
+	       num_procs * num_loops, secs,
+	       secs > 0 ? num_procs * num_loops / secs : 0);
+
+	free(pids);
+	tdb_close(db);
+	return error_count;
+}
+
+/*
+ * Commit throughput: NUM_PROCS processes each commit NUM_LOOPS
+ * transactions that change one small record, the way registry and
+ * passdb updates do. Every child sends its commit statistics back.
+ */
+
+static int run_commit_child(int i, int seed, unsigned num_loops, int fd)
+{
+	unsigned char buf[READ_DATALEN];
+	struct tdb_commit_stats stats;
+	unsigned loop;
+	ssize_t ret;
+
+	if (tdb_reopen(db) != 0) {
+		fatal("tdb_reopen failed");
+		return 1;
+	}
+	srandom(seed + i);
+
+	for (loop = 0; loop < num_loops && error_count == 0; loop++) {
+		unsigned r = random() % READ_RECORDS;
+		TDB_DATA key, data;
+
+		key.dptr = (unsigned char *)&r;
+		key.dsize = sizeof(r);
+		data.dptr = buf;
+		data.dsize = sizeof(buf);
+
+		/* never the same data twice, so no commit is empty */
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, &i, sizeof(i));
+		memcpy(buf + sizeof(i), &loop, sizeof(loop));
+
+		if (tdb_transaction_start(db) != 0) {
+			fatal("tdb_transaction_start failed");
+			break;
+		}
+		if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+			fatal("tdb_store failed");
+			tdb_transaction_cancel(db);
+			break;
+		}
+		if (tdb_transaction_commit(db) != 0) {
+			fatal("tdb_transaction_commit failed");
+			break;
+		}
+	}
+
+	tdb_commit_stats(db, &stats);
+	do {
+		ret = write(fd, &stats, sizeof(stats));
+	} while (ret == -1 && errno == EINTR);
+
+	tdb_close(db);
+	return (error_count < 100 ? error_count : 100);
+}
+
+static int run_commit_bench(const char *filename, int num_procs, int seed,
+			    unsigned num_loops)
+{
+	struct tdb_commit_stats stats, total;
+	struct timeval start, end;
+	pid_t *pids;
+	double secs;
+	int i, j, status, pfds[2];
+	int tdb_flags = TDB_DEFAULT|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH;
+
+	if (mutex) {
+		tdb_flags |= TDB_MUTEX_LOCKING;
+	}
+	if (group_commit) {
+		tdb_flags |= TDB_GROUP_COMMIT;
+	}
+	if (wal) {
+		tdb_flags |= TDB_WAL;
+	}
+
+	/*
+	 * We keep the tdb open while forking, so the children
+	 * don't wipe it with TDB_CLEAR_IF_FIRST.
+	 */
+	db = tdb_open_ex(filename, hash_size, tdb_flags,
+			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
+	if (!db) {
+		fatal("db open failed");
+		return 1;
+	}
+
+	pids = (pid_t *)calloc(sizeof(pid_t), num_procs);
+	if (pids == NULL) {
+		perror("Unable to allocate memory for pids");
+		return 1;
+	}
+
+	if (pipe(pfds) != 0) {
+		perror("Creating pipe");
+		return 1;
+	}
+
+	fflush(stdout);
+	gettimeofday(&start, NULL);
+
+	for (j = 0; j < num_procs; j++) {
+		pids[j] = fork();
+		if (pids[j] == 0) {
+			close(pfds[0]);
+			exit(run_commit_child(j, seed, num_loops, pfds[1]));
+		}
+	}
+	close(pfds[1]);
+
+	for (j = 0; j < num_procs; j++) {
+		if (waitpid(pids[j], &status, 0) != pids[j] ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("committer %d failed\n", j);
+			error_count++;
+		}
+	}
+
+	gettimeofday(&end, NULL);
+
+	memset(&total, 0, sizeof(total));
+	while (read(pfds[0], &stats, sizeof(stats)) == sizeof(stats)) {
+		total.commits += stats.commits;
+		total.syncs += stats.syncs;
+		total.shared_syncs += stats.shared_syncs;
+		for (i = 0; i < TDB_COMMIT_LATENCY_BUCKETS; i++) {
+			total.latency[i] += stats.latency[i];
+		}
+	}
+	close(pfds[0]);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) * 1.0e-6;
+
+	printf("%d committers%s%s%s: %llu commits in %.3f seconds, "
+	       "%.0f commits/sec, %llu syncs, %llu shared\n", num_procs,
+	       mutex ? " (mutex)" : "",
+	       group_commit ? " (group commit)" : "",
+	       wal ? " (wal)" : "",
+	       (unsigned long long)total.commits, secs,
+	       secs > 0 ? total.commits / secs : 0,
+	       (unsigned long long)total.syncs,
+	       (unsigned long long)total.shared_syncs);
+
+	printf("Commit latency usecs:\n");
+	for (i = 0; i < TDB_COMMIT_LATENCY_BUCKETS; i++) {
+		if (total.latency[i] == 0) {
+			continue;
+		}
+		if (i == TDB_COMMIT_LATENCY_BUCKETS-1) {
+			printf("  >= %llu: %llu\n", 1ULL << (i-1),
+			       (unsigned long long)total.latency[i]);
+		} else {
+			printf("  < %llu: %llu\n", 1ULL << i,
+			       (unsigned long long)total.latency[i]);
+		}
+	}
+
+	free(pids);
+	tdb_close(db);
+	return error_count;
+}
+
 static char *test_path(const char *filename)
 {
 	const char *prefix = getenv("TEST_DATA_PREFIX");
@@ -308,12 +682,14 @@ int main(int argc, char * const *argv)
 	extern char *optarg;
 	pid_t *pids;
 	int kill_random = 0;
+	int read_bench = 0;
+	int commit_bench = 0;
 	int *done;
 	char *test_tdb;
 
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:thkm")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:thkmSFRGWrc")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -340,6 +716,27 @@ int main(int argc, char * const *argv)
 				exit(1);
 			}
 			break;
+		case 'S':
+			seqlock = true;
+			break;
+		case 'F':
+			freelist_classes = true;
+			break;
+		case 'R':
+			resizable_hash = true;
+			break;
+		case 'G':
+			group_commit = true;
+			break;
+		case 'W':
+			wal = true;
+			break;
+		case 'r':
+			read_bench = 1;
+			break;
+		case 'c':
+			commit_bench = 1;
+			break;
 		default:
 			usage();
 		}
@@ -357,6 +754,18 @@ int main(int argc, char * const *argv)
 	       num_procs, num_loops, hash_size, seed,
 	       (always_transaction ? " (all within transactions)" : ""));
 
+	if (read_bench) {
+		error_count = run_read_bench(test_tdb, num_procs, seed,
+					     num_loops);
+		goto done;
+	}
+
+	if (commit_bench) {
+		error_count = run_commit_bench(test_tdb, num_procs, seed,
+					       num_loops);
+		goto done;
+	}
+
 	if (num_procs == 1 && !kill_random) {
 		/* Don't fork for this case, makes debugging easier. */
 		error_count = run_child(test_tdb, 0, seed, num_loops, 0);
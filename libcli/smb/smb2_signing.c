@@ -24,10 +24,10 @@
 #include "../lib/crypto/crypto.h"
 #include "lib/util/iov_buf.h"
 
-NTSTATUS smb2_signing_sign_pdu(DATA_BLOB signing_key,
-			       enum protocol_types protocol,
-			       struct iovec *vector,
-			       int count)
+NTSTATUS smb2_signing_sign_pdu_nolog(DATA_BLOB signing_key,
+				     enum protocol_types protocol,
+				     struct iovec *vector,
+				     int count)
 {
 	uint8_t *hdr;
 	uint64_t session_id;
@@ -54,8 +54,6 @@ NTSTATUS smb2_signing_sign_pdu(DATA_BLOB signing_key,
 	}
 
 	if (signing_key.length == 0) {
-		DEBUG(2,("Wrong session key length %u for SMB2 signing\n",
-			 (unsigned)signing_key.length));
 		return NT_STATUS_ACCESS_DENIED;
 	}
 
@@ -90,13 +88,33 @@ NTSTATUS smb2_signing_sign_pdu(DATA_BLOB signing_key,
 		hmac_sha256_final(digest, &m);
 		memcpy(res, digest, 16);
 	}
-	DEBUG(5,("signed SMB2 message\n"));
 
 	memcpy(hdr + SMB2_HDR_SIGNATURE, res, 16);
 
 	return NT_STATUS_OK;
 }
 
+NTSTATUS smb2_signing_sign_pdu(DATA_BLOB signing_key,
+			       enum protocol_types protocol,
+			       struct iovec *vector,
+			       int count)
+{
+	NTSTATUS status;
+
+	status = smb2_signing_sign_pdu_nolog(signing_key, protocol,
+					     vector, count);
+	if (NT_STATUS_EQUAL(status, NT_STATUS_ACCESS_DENIED)) {
+		DEBUG(2,("Wrong session key length %u for SMB2 signing\n",
+			 (unsigned)signing_key.length));
+		return status;
+	}
+	if (NT_STATUS_IS_OK(status)) {
+		DEBUG(5,("signed SMB2 message\n"));
+	}
+
+	return status;
+}
+
 NTSTATUS smb2_signing_check_pdu(DATA_BLOB signing_key,
 				enum protocol_types protocol,
 				const struct iovec *vector,
@@ -209,10 +227,10 @@ void smb2_key_derivation(const uint8_t *KI, size_t KI_len,
 	memcpy(KO, digest, 16);
 }
 
-NTSTATUS smb2_signing_encrypt_pdu(DATA_BLOB encryption_key,
-				  uint16_t cipher_id,
-				  struct iovec *vector,
-				  int count)
+NTSTATUS smb2_signing_encrypt_pdu_nolog(DATA_BLOB encryption_key,
+					uint16_t cipher_id,
+					struct iovec *vector,
+					int count)
 {
 	uint8_t *tf;
 	uint8_t sig[16];
@@ -236,8 +254,6 @@ NTSTATUS smb2_signing_encrypt_pdu(DATA_BLOB encryption_key,
 	tf = (uint8_t *)vector[0].iov_base;
 
 	if (encryption_key.length == 0) {
-		DEBUG(2,("Wrong encryption key length %u for SMB2 signing\n",
-			 (unsigned)encryption_key.length));
 		return NT_STATUS_ACCESS_DENIED;
 	}
 
@@ -298,11 +314,30 @@ NTSTATUS smb2_signing_encrypt_pdu(DATA_BLOB encryption_key,
 
 	memcpy(tf + SMB2_TF_SIGNATURE, sig, 16);
 
-	DEBUG(5,("encrypt SMB2 message\n"));
-
 	return NT_STATUS_OK;
 }
 
+NTSTATUS smb2_signing_encrypt_pdu(DATA_BLOB encryption_key,
+				  uint16_t cipher_id,
+				  struct iovec *vector,
+				  int count)
+{
+	NTSTATUS status;
+
+	status = smb2_signing_encrypt_pdu_nolog(encryption_key, cipher_id,
+						vector, count);
+	if (NT_STATUS_EQUAL(status, NT_STATUS_ACCESS_DENIED)) {
+		DEBUG(2,("Wrong encryption key length %u for SMB2 signing\n",
+			 (unsigned)encryption_key.length));
+		return status;
+	}
+	if (NT_STATUS_IS_OK(status)) {
+		DEBUG(5,("encrypt SMB2 message\n"));
+	}
+
+	return status;
+}
+
 NTSTATUS smb2_signing_decrypt_pdu(DATA_BLOB decryption_key,
 				  uint16_t cipher_id,
 				  struct iovec *vector,
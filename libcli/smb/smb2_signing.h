@@ -28,6 +28,15 @@ NTSTATUS smb2_signing_sign_pdu(DATA_BLOB signing_key,
 			       struct iovec *vector,
 			       int count);
 
+/*
+ * The _nolog variants don't call DEBUG(), so they can be used
+ * from a worker thread.
+ */
+NTSTATUS smb2_signing_sign_pdu_nolog(DATA_BLOB signing_key,
+				     enum protocol_types protocol,
+				     struct iovec *vector,
+				     int count);
+
 NTSTATUS smb2_signing_check_pdu(DATA_BLOB signing_key,
 				enum protocol_types protocol,
 				const struct iovec *vector,
@@ -42,6 +51,10 @@ NTSTATUS smb2_signing_encrypt_pdu(DATA_BLOB encryption_key,
 				  uint16_t cipher_id,
 				  struct iovec *vector,
 				  int count);
+NTSTATUS smb2_signing_encrypt_pdu_nolog(DATA_BLOB encryption_key,
+					uint16_t cipher_id,
+					struct iovec *vector,
+					int count);
 NTSTATUS smb2_signing_decrypt_pdu(DATA_BLOB decryption_key,
 				  uint16_t cipher_id,
 				  struct iovec *vector,
@@ -864,6 +864,7 @@ my @exported_envvars = (
 	"RESOLV_CONF",
 	"UNACCEPTABLE_PASSWORD",
 	"LOCK_DIR",
+	"PIDDIR",
 
 	# nss_wrapper
 	"NSS_WRAPPER_PASSWD",
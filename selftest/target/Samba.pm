@@ -343,6 +343,7 @@ sub get_interface($)
     $interfaces{"localktest6"} = 7;
     $interfaces{"maptoguest"} = 8;
     $interfaces{"localnt4dc9"} = 9;
+    $interfaces{"preforkserver"} = 10;
 
     # 11-16 used by selftest.pl for client interfaces
 
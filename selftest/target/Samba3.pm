@@ -189,6 +189,8 @@ sub setup_env($$$)
 		return $self->setup_fileserver("$path/fileserver");
 	} elsif ($envname eq "maptoguest") {
 		return $self->setup_maptoguest("$path/maptoguest");
+	} elsif ($envname eq "preforkserver") {
+		return $self->setup_preforkserver("$path/preforkserver");
 	} elsif ($envname eq "ktest") {
 		return $self->setup_ktest("$path/ktest");
 	} elsif ($envname eq "nt4_member") {
@@ -1015,6 +1017,32 @@ ntlm auth = yes
 	return $vars;
 }
 
+sub setup_preforkserver($$)
+{
+	my ($self, $path) = @_;
+
+	print "PROVISIONING preforkserver...";
+
+	my $options = "
+	smbd:prefork children = 2
+";
+
+	my $vars = $self->provision($path,
+				    "preforkserver",
+				    "preforkpass",
+				    $options);
+
+	$vars or return undef;
+
+	if (not $self->check_or_start($vars, "no", "no", "yes")) {
+	       return undef;
+	}
+
+	$self->{vars}->{preforkserver} = $vars;
+
+	return $vars;
+}
+
 sub stop_sig_term($$) {
 	my ($self, $pid) = @_;
 	kill("USR1", $pid) or kill("ALRM", $pid) or warn("Unable to kill $pid: $!");
@@ -1759,6 +1787,38 @@ sub provision($$$$$$$$)
 	aio read size = 1
 	aio write size = 1
 
+[dircache]
+	copy = tmp
+	smbd:directory cache = yes
+
+[dir_prefetch]
+	copy = tmp
+	vfs objects =
+	smbd:dir prefetch = 16
+
+[name_index]
+	copy = tmp
+	smbd:name index = yes
+
+[write_gather]
+	copy = aio
+	vfs objects = fake_dfq
+	smbd:write gather size = 65536
+	fake_dfq:file size limit = 1048576
+	fake_dfq:write delay = 50
+
+[write_gather_short]
+	copy = write_gather
+	fake_dfq:max write size = 4096
+
+[readahead]
+	copy = aio
+	vfs objects = readahead
+
+[readahead_adaptive]
+	copy = readahead
+	readahead:adaptive = yes
+
 [print\$]
 	copy = tmp
 
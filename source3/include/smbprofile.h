@@ -25,6 +25,25 @@ struct tevent_context;
 
 #ifdef WITH_PROFILE
 
+/* One entry per locking.tdb/brlock.tdb shard, see LOCKING_MAX_SHARDS */
+#define SMBPROFILE_STATS_SHARDS(name) \
+	SMBPROFILE_STATS_BASIC(name##_0) \
+	SMBPROFILE_STATS_BASIC(name##_1) \
+	SMBPROFILE_STATS_BASIC(name##_2) \
+	SMBPROFILE_STATS_BASIC(name##_3) \
+	SMBPROFILE_STATS_BASIC(name##_4) \
+	SMBPROFILE_STATS_BASIC(name##_5) \
+	SMBPROFILE_STATS_BASIC(name##_6) \
+	SMBPROFILE_STATS_BASIC(name##_7) \
+	SMBPROFILE_STATS_BASIC(name##_8) \
+	SMBPROFILE_STATS_BASIC(name##_9) \
+	SMBPROFILE_STATS_BASIC(name##_10) \
+	SMBPROFILE_STATS_BASIC(name##_11) \
+	SMBPROFILE_STATS_BASIC(name##_12) \
+	SMBPROFILE_STATS_BASIC(name##_13) \
+	SMBPROFILE_STATS_BASIC(name##_14) \
+	SMBPROFILE_STATS_BASIC(name##_15)
+
 #define SMBPROFILE_STATS_ALL_SECTIONS \
 	SMBPROFILE_STATS_START \
 	\
@@ -112,6 +131,31 @@ struct tevent_context;
 	SMBPROFILE_STATS_COUNT(statcache_lookups) \
 	SMBPROFILE_STATS_COUNT(statcache_misses) \
 	SMBPROFILE_STATS_COUNT(statcache_hits) \
+	SMBPROFILE_STATS_COUNT(statcache_name_index_hits) \
+	SMBPROFILE_STATS_COUNT(statcache_name_index_builds) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(dircache, "Directory Cache") \
+	SMBPROFILE_STATS_COUNT(dircache_lookups) \
+	SMBPROFILE_STATS_COUNT(dircache_misses) \
+	SMBPROFILE_STATS_COUNT(dircache_hits) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(brlock, "Byte Range Locking") \
+	SMBPROFILE_STATS_COUNT(strict_lock_checked) \
+	SMBPROFILE_STATS_COUNT(strict_lock_skipped) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(locking_shards, "Locking Shards") \
+	SMBPROFILE_STATS_SHARDS(share_mode_shard) \
+	SMBPROFILE_STATS_SHARDS(brlock_shard) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(notifyd, "Notify Daemon") \
+	SMBPROFILE_STATS_COUNT(notifyd_events) \
+	SMBPROFILE_STATS_COUNT(notifyd_events_coalesced) \
+	SMBPROFILE_STATS_COUNT(notifyd_batches) \
+	SMBPROFILE_STATS_COUNT(notifyd_batched_events) \
 	SMBPROFILE_STATS_SECTION_END \
 	\
 	SMBPROFILE_STATS_SECTION_START(writecache, "Write Cache") \
@@ -135,6 +179,27 @@ struct tevent_context;
 	SMBPROFILE_STATS_COUNT(writecache_flush_reason_sizechange) \
 	SMBPROFILE_STATS_SECTION_END \
 	\
+	SMBPROFILE_STATS_SECTION_START(write_gather, "SMB2 Write Gathering") \
+	SMBPROFILE_STATS_COUNT(write_gather_writes) \
+	SMBPROFILE_STATS_COUNT(write_gather_queued) \
+	SMBPROFILE_STATS_COUNT(write_gather_pwrites) \
+	SMBPROFILE_STATS_COUNT(write_gather_merged_pwrites) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(readahead, "Adaptive Read-ahead") \
+	SMBPROFILE_STATS_COUNT(readahead_sequential) \
+	SMBPROFILE_STATS_COUNT(readahead_random) \
+	SMBPROFILE_STATS_COUNT(readahead_hits) \
+	SMBPROFILE_STATS_COUNT(readahead_misses) \
+	SMBPROFILE_STATS_COUNT(readahead_issued) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
+	SMBPROFILE_STATS_SECTION_START(smb2_send, "SMB2 Send Queue") \
+	SMBPROFILE_STATS_COUNT(smb2_send_responses) \
+	SMBPROFILE_STATS_COUNT(smb2_send_syscalls) \
+	SMBPROFILE_STATS_COUNT(smb2_send_batches) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
 	SMBPROFILE_STATS_SECTION_START(SMB, "SMB Calls") \
 	SMBPROFILE_STATS_BASIC(SMBmkdir) \
 	SMBPROFILE_STATS_BASIC(SMBrmdir) \
@@ -565,6 +630,83 @@ static inline uint64_t profile_timestamp(void)
 #define END_PROFILE_BYTES(x) \
 	SMBPROFILE_BYTES_ASYNC_END(__profasync_##x)
 
+/*
+ * One case per SMBPROFILE_STATS_SHARDS() member.
+ */
+#define START_PROFILE_SHARD(x,n) \
+	struct smbprofile_stats_basic_async __profasync_##x = {}; \
+	switch (n) { \
+	case 0: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_0_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 1: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_1_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 2: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_2_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 3: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_3_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 4: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_4_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 5: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_5_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 6: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_6_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 7: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_7_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 8: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_8_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 9: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_9_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 10: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_10_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 11: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_11_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 12: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_12_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 13: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_13_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 14: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_14_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	case 15: \
+		_SMBPROFILE_BASIC_ASYNC_START(x##_15_stats, profile_p, \
+					      __profasync_##x); \
+		break; \
+	default: \
+		break; \
+	}
+
+#define END_PROFILE_SHARD(x) \
+	SMBPROFILE_BASIC_ASYNC_END(__profasync_##x)
+
 #define PROFILE_TIMESTAMP(x) clock_gettime_mono(x)
 
 #else /* WITH_PROFILE */
@@ -596,6 +738,8 @@ static inline uint64_t profile_timestamp(void)
 #define START_PROFILE_BYTES(x,n)
 #define END_PROFILE(x)
 #define END_PROFILE_BYTES(x)
+#define START_PROFILE_SHARD(x,n)
+#define END_PROFILE_SHARD(x)
 
 #define PROFILE_TIMESTAMP(x) (*(x)=(struct timespec){0})
 
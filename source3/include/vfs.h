@@ -197,6 +197,7 @@
 /* Version 36 - Remove is_offline and set_offline */
 /* Version 37 - Module init functions now take a TALLOC_CTX * parameter. */
 /* Version 37 - Add vfs_copy_chunk_flags for DUP_EXTENTS_TO_FILE */
+/* Version 37 - Add struct aio_write_gather to struct files_struct */
 
 #define SMB_VFS_INTERFACE_VERSION 37
 
@@ -320,6 +321,12 @@ typedef struct files_struct {
 	unsigned num_aio_requests;
 	struct tevent_req **aio_requests;
 
+	/*
+	 * Queue of small SMB2 writes waiting to be merged, see
+	 * "smbd:write gather size"
+	 */
+	struct aio_write_gather *write_gather;
+
 	/*
 	 * If a close request comes in while we still have aio_requests
 	 * around, we need to hold back the close. When all aio_requests are
@@ -26,6 +26,7 @@
 
 #include "includes.h"
 #include "system/filesys.h"
+#include "system/shmem.h"
 #include "lib/util/server_id.h"
 #include "locking/proto.h"
 #include "smbd/globals.h"
@@ -34,15 +35,53 @@
 #include "serverid.h"
 #include "messages.h"
 #include "util_tdb.h"
+#include "smbprofile.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_LOCKING
 
 #define ZERO_ZERO 0
 
-/* The open brlock.tdb database. */
+/* The open brlock.tdb database shards, see locking_num_shards(). */
 
-static struct db_context *brlock_db;
+static struct db_context *brlock_db[LOCKING_MAX_SHARDS];
+static unsigned brlock_num_shards;
+
+static struct db_context *brlock_db_shard(const struct file_id *id,
+					  unsigned *shard)
+{
+	unsigned s = locking_shard(id, brlock_num_shards);
+
+	if (shard != NULL) {
+		*shard = s;
+	}
+	return brlock_db[s];
+}
+
+/*
+ * brlock_hint.dat, mapped by every process opening brlock.tdb
+ * read-write: For every bucket of file_ids the number of brlock.tdb
+ * records holding byte range locks. If the bucket is 0, the file is
+ * not locked and the strict locking check on read and write does not
+ * need to look at brlock.tdb at all.
+ *
+ * Like TDB_CLEAR_IF_FIRST, every process that counts holds a read
+ * lock on the first byte of the file. The process that gets a write
+ * lock instead is the only user and sets up the counters.
+ */
+
+#define BRL_HINT_BUCKETS 16384
+#define BRL_HINT_MAGIC 0x6272686e /* "brhn" */
+
+struct brl_hint_file {
+	uint32_t magic;
+	uint32_t buckets[BRL_HINT_BUCKETS];
+};
+
+static struct brl_hint_file *brl_hint;
+static int brl_hint_fd = -1;
+/* The process holding our read lock, we don't inherit it on fork */
+static pid_t brl_hint_locked_pid;
 
 struct byte_range_lock {
 	struct files_struct *fsp;
@@ -51,6 +90,14 @@ struct byte_range_lock {
 	uint32_t num_read_oplocks;
 	struct lock_struct *lock_data;
 	struct db_record *record;
+	/* Does the record count in brl_hint? */
+	bool hinted;
+	/*
+	 * lock_data is sorted by start and size. max_size is an upper
+	 * bound of all lock sizes, together they narrow down the
+	 * locks that can overlap a range, see brl_candidates().
+	 */
+	br_off max_size;
 };
 
 /****************************************************************************
@@ -304,6 +351,131 @@ static bool brl_pending_overlap(const struct lock_struct *lock, const struct loc
 	return False;
 }
 
+/****************************************************************************
+ Lock ordering for the sorted lock array.
+****************************************************************************/
+
+static int brl_lock_cmp(const struct lock_struct *lck1,
+			const struct lock_struct *lck2)
+{
+	if (lck1->start != lck2->start) {
+		return (lck1->start < lck2->start) ? -1 : 1;
+	}
+	if (lck1->size != lck2->size) {
+		return (lck1->size < lck2->size) ? -1 : 1;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ Sort a lock array and return the biggest lock size. This is an insertion
+ sort on purpose: It is stable, so stacked identical locks keep the order
+ brl_unlock_windows_default() depends on, and it is O(n) on the nearly
+ sorted arrays the POSIX split/merge code produces.
+****************************************************************************/
+
+static br_off brl_sort_locks(struct lock_struct *locks, unsigned int num_locks)
+{
+	br_off max_size = 0;
+	unsigned int i, j;
+
+	for (i=0; i < num_locks; i++) {
+		struct lock_struct tmp;
+
+		max_size = MAX(max_size, locks[i].size);
+
+		if ((i == 0) || (brl_lock_cmp(&locks[i-1], &locks[i]) <= 0)) {
+			continue;
+		}
+
+		tmp = locks[i];
+		for (j=i; (j > 0) && (brl_lock_cmp(&locks[j-1], &tmp) > 0);
+		     j--) {
+			locks[j] = locks[j-1];
+		}
+		locks[j] = tmp;
+	}
+
+	return max_size;
+}
+
+/****************************************************************************
+ Index of the first lock starting after start.
+****************************************************************************/
+
+static unsigned int brl_upper_bound(const struct lock_struct *locks,
+				    unsigned int num_locks,
+				    br_off start)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (locks[mid].start <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Index where plock has to be inserted, behind all equal locks.
+****************************************************************************/
+
+static unsigned int brl_insert_index(const struct lock_struct *locks,
+				     unsigned int num_locks,
+				     const struct lock_struct *plock)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (brl_lock_cmp(&locks[mid], plock) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Find the range [*pfirst, *plast) of locks that brl_overlap(lock, plock)
+ can possibly be true for. Locks starting beyond the end of plock can't
+ overlap. Locks starting max_size or more before plock end before it.
+****************************************************************************/
+
+static void brl_candidates(const struct byte_range_lock *br_lck,
+			   const struct lock_struct *plock,
+			   unsigned int *pfirst,
+			   unsigned int *plast)
+{
+	br_off last_byte = plock->start;
+
+	*pfirst = 0;
+	*plast = br_lck->num_locks;
+
+	if (plock->size != 0) {
+		last_byte = plock->start + plock->size - 1;
+		if (last_byte < plock->start) {
+			/* Wraps, brl_overlap() is not linear here */
+			return;
+		}
+	}
+
+	*plast = brl_upper_bound(br_lck->lock_data, br_lck->num_locks,
+				 last_byte);
+
+	if (br_lck->max_size < plock->start) {
+		*pfirst = brl_upper_bound(br_lck->lock_data, *plast,
+					  plock->start - br_lck->max_size);
+	}
+}
+
 /****************************************************************************
  Amazingly enough, w2k3 "remembers" whether the last lock failure on a fnum
  is the same as this one and changes its error code. I wonder if any
@@ -338,6 +510,198 @@ static NTSTATUS brl_lock_failed(files_struct *fsp,
 	return NT_STATUS_LOCK_NOT_GRANTED;
 }
 
+/****************************************************************************
+ Set up brl_hint. All processes modifying brlock.tdb have to take part,
+ otherwise their locks are not counted.
+****************************************************************************/
+
+static bool brl_hint_empty_dbs(void)
+{
+	unsigned i;
+
+	/*
+	 * We can't tell how many locks belong to which bucket, so
+	 * only start counting with empty databases.
+	 */
+	for (i=0; i<brlock_num_shards; i++) {
+		int count = 0;
+		NTSTATUS status;
+
+		status = dbwrap_traverse_read(brlock_db[i], NULL, NULL,
+					      &count);
+		if (!NT_STATUS_IS_OK(status) || (count != 0)) {
+			DBG_NOTICE("%s not empty, not using brlock hints\n",
+				   dbwrap_name(brlock_db[i]));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void brl_hint_init(void)
+{
+#if defined(HAVE___SYNC_FETCH_AND_ADD)
+	struct brl_hint_file *h;
+	char *path;
+	int fd;
+	bool first;
+	int ret;
+
+	if (brl_hint != NULL) {
+		return;
+	}
+
+	if (lp_clustering()) {
+		/* We don't see locks taken on other nodes */
+		return;
+	}
+
+	if (!lp_parm_bool(-1, "smbd", "brlock hint", true)) {
+		return;
+	}
+
+	path = lock_path("brlock_hint.dat");
+	if (path == NULL) {
+		return;
+	}
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd == -1) {
+		DBG_WARNING("open(%s) failed: %s\n", path, strerror(errno));
+		TALLOC_FREE(path);
+		return;
+	}
+	TALLOC_FREE(path);
+
+	first = fcntl_lock(fd, F_SETLK, 0, 1, F_WRLCK);
+	if (!first) {
+		/* Wait for the first one to set up the file */
+		if (!fcntl_lock(fd, F_SETLKW, 0, 1, F_RDLCK)) {
+			DBG_WARNING("fcntl_lock failed: %s\n",
+				    strerror(errno));
+			close(fd);
+			return;
+		}
+	} else {
+		/*
+		 * Only grow the file, others might still have a
+		 * mapping of an earlier instance.
+		 */
+		ret = ftruncate(fd, sizeof(struct brl_hint_file));
+		if (ret == -1) {
+			DBG_WARNING("ftruncate failed: %s\n",
+				    strerror(errno));
+			close(fd);
+			return;
+		}
+	}
+
+	h = mmap(NULL, sizeof(struct brl_hint_file), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		DBG_WARNING("mmap failed: %s\n", strerror(errno));
+		if (!first) {
+			/*
+			 * We won't count our locks, nobody must rely
+			 * on the counters anymore.
+			 */
+			uint32_t magic = 0;
+			(void)pwrite(fd, &magic, sizeof(magic), 0);
+		}
+		close(fd);
+		return;
+	}
+
+	if (first) {
+		h->magic = 0;
+		__sync_synchronize();
+		memset(h->buckets, 0, sizeof(h->buckets));
+		__sync_synchronize();
+		if (brl_hint_empty_dbs()) {
+			h->magic = BRL_HINT_MAGIC;
+		}
+		if (!fcntl_lock(fd, F_SETLKW, 0, 1, F_RDLCK)) {
+			DBG_WARNING("fcntl_lock failed: %s\n",
+				    strerror(errno));
+			h->magic = 0;
+			munmap(h, sizeof(struct brl_hint_file));
+			close(fd);
+			return;
+		}
+	}
+
+	if (h->magic != BRL_HINT_MAGIC) {
+		munmap(h, sizeof(struct brl_hint_file));
+		close(fd);
+		return;
+	}
+
+	brl_hint = h;
+	brl_hint_fd = fd;
+	brl_hint_locked_pid = getpid();
+#endif
+}
+
+static uint32_t *brl_hint_bucket(const struct file_id *id)
+{
+	TDB_DATA key = make_tdb_data((const uint8_t *)id, sizeof(*id));
+
+	return &brl_hint->buckets[tdb_jenkins_hash(&key) % BRL_HINT_BUCKETS];
+}
+
+static void brl_hint_adjust(const struct file_id *id, int delta)
+{
+	if (brl_hint == NULL) {
+		return;
+	}
+
+	if (brl_hint_locked_pid != getpid()) {
+		/*
+		 * We're a fork child, make sure nobody resets the
+		 * counters while we use them.
+		 */
+		if (!fcntl_lock(brl_hint_fd, F_SETLKW, 0, 1, F_RDLCK)) {
+			smb_panic("brl_hint_adjust: fcntl_lock failed");
+		}
+		brl_hint_locked_pid = getpid();
+	}
+
+#if defined(HAVE___SYNC_FETCH_AND_ADD)
+	/* A full barrier, the lock is not yet or no longer visible */
+	__sync_fetch_and_add(brl_hint_bucket(id), delta);
+#endif
+}
+
+/****************************************************************************
+ Returns false if the file can't have any byte range locks. Without
+ brl_hint or with a hash collision this might return true for unlocked
+ files.
+****************************************************************************/
+
+bool brl_maybe_locked(files_struct *fsp)
+{
+	uint32_t magic, count;
+
+	if (brl_hint == NULL) {
+		return true;
+	}
+
+#if defined(HAVE___SYNC_FETCH_AND_ADD)
+	/*
+	 * Order the loads after everything we did before, pairs
+	 * with the barrier in brl_hint_adjust().
+	 */
+	__sync_synchronize();
+#endif
+	magic = *(volatile uint32_t *)&brl_hint->magic;
+	count = *(volatile uint32_t *)brl_hint_bucket(&fsp->file_id);
+
+	if (magic != BRL_HINT_MAGIC) {
+		/* Being reset by a new first user */
+		return true;
+	}
+	return (count != 0);
+}
+
 /****************************************************************************
  Open up the brlock.tdb database.
 ****************************************************************************/
@@ -345,9 +709,9 @@ static NTSTATUS brl_lock_failed(files_struct *fsp,
 void brl_init(bool read_only)
 {
 	int tdb_flags;
-	char *db_path;
+	unsigned i, num_shards;
 
-	if (brlock_db) {
+	if (brlock_db[0] != NULL) {
 		return;
 	}
 
@@ -362,23 +726,37 @@ void brl_init(bool read_only)
 		tdb_flags |= TDB_SEQNUM;
 	}
 
-	db_path = lock_path("brlock.tdb");
-	if (db_path == NULL) {
-		DEBUG(0, ("out of memory!\n"));
-		return;
-	}
+	num_shards = locking_num_shards();
+
+	for (i=0; i<num_shards; i++) {
+		char *db_path;
 
-	brlock_db = db_open(NULL, db_path,
-			    SMB_OPEN_DATABASE_TDB_HASH_SIZE, tdb_flags,
-			    read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644,
-			    DBWRAP_LOCK_ORDER_2, DBWRAP_FLAG_NONE);
-	if (!brlock_db) {
-		DEBUG(0,("Failed to open byte range locking database %s\n",
-			 db_path));
+		db_path = locking_shard_path("brlock", i);
+		if (db_path == NULL) {
+			DEBUG(0, ("out of memory!\n"));
+			brl_shutdown();
+			return;
+		}
+
+		brlock_db[i] = db_open(NULL, db_path,
+				       locking_hash_size(num_shards), tdb_flags,
+				       read_only?O_RDONLY:(O_RDWR|O_CREAT),
+				       0644, DBWRAP_LOCK_ORDER_2,
+				       DBWRAP_FLAG_NONE);
+		if (!brlock_db[i]) {
+			DEBUG(0,("Failed to open byte range locking "
+				 "database %s\n", db_path));
+			TALLOC_FREE(db_path);
+			brl_shutdown();
+			return;
+		}
 		TALLOC_FREE(db_path);
-		return;
+		brlock_num_shards = i + 1;
+	}
+
+	if (!read_only) {
+		brl_hint_init();
 	}
-	TALLOC_FREE(db_path);
 }
 
 /****************************************************************************
@@ -387,7 +765,12 @@ void brl_init(bool read_only)
 
 void brl_shutdown(void)
 {
-	TALLOC_FREE(brlock_db);
+	unsigned i;
+
+	for (i=0; i<brlock_num_shards; i++) {
+		TALLOC_FREE(brlock_db[i]);
+	}
+	brlock_num_shards = 0;
 }
 
 #if ZERO_ZERO
@@ -415,7 +798,7 @@ static int lock_compare(const struct lock_struct *lck1,
 NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
     struct lock_struct *plock, bool blocking_lock)
 {
-	unsigned int i;
+	unsigned int i, first, last;
 	files_struct *fsp = br_lck->fsp;
 	struct lock_struct *locks = br_lck->lock_data;
 	NTSTATUS status;
@@ -427,7 +810,9 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 		return NT_STATUS_INVALID_LOCK_RANGE;
 	}
 
-	for (i=0; i < br_lck->num_locks; i++) {
+	brl_candidates(br_lck, plock, &first, &last);
+
+	for (i=first; i < last; i++) {
 		/* Do any Windows or POSIX locks conflict ? */
 		if (brl_conflict(&locks[i], plock)) {
 			if (!serverid_exists(&locks[i].context.pid)) {
@@ -487,9 +872,15 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 		goto fail;
 	}
 
-	memcpy(&locks[br_lck->num_locks], plock, sizeof(struct lock_struct));
+	i = brl_insert_index(locks, br_lck->num_locks, plock);
+	if (i < br_lck->num_locks) {
+		memmove(&locks[i+1], &locks[i],
+			(br_lck->num_locks - i)*sizeof(struct lock_struct));
+	}
+	memcpy(&locks[i], plock, sizeof(struct lock_struct));
 	br_lck->num_locks += 1;
 	br_lck->lock_data = locks;
+	br_lck->max_size = MAX(br_lck->max_size, plock->size);
 	br_lck->modified = True;
 
 	return NT_STATUS_OK;
@@ -801,6 +1192,7 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	unsigned int i, count, posix_count;
 	struct lock_struct *locks = br_lck->lock_data;
 	struct lock_struct *tp;
+	br_off max_size;
 	bool signal_pending_read = False;
 	bool break_oplocks = false;
 	NTSTATUS status;
@@ -893,21 +1285,13 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 					     LEVEL2_CONTEND_POSIX_BRL);
 	}
 
-	/* Try and add the lock in order, sorted by lock start. */
-	for (i=0; i < count; i++) {
-		struct lock_struct *curr_lock = &tp[i];
-
-		if (curr_lock->start <= plock->start) {
-			continue;
-		}
-	}
-
-	if (i < count) {
-		memmove(&tp[i+1], &tp[i],
-			(count - i)*sizeof(struct lock_struct));
-	}
-	memcpy(&tp[i], plock, sizeof(struct lock_struct));
+	/*
+	 * Add the lock and restore the sort order, splits and merges
+	 * might have moved existing locks a bit.
+	 */
+	memcpy(&tp[count], plock, sizeof(struct lock_struct));
 	count++;
+	max_size = brl_sort_locks(tp, count);
 
 	/* We can get the POSIX lock, now see if it needs to
 	   be mapped into a lower level POSIX one, and if so can
@@ -955,6 +1339,7 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	br_lck->num_locks = count;
 	TALLOC_FREE(br_lck->lock_data);
 	br_lck->lock_data = tp;
+	br_lck->max_size = max_size;
 	locks = tp;
 	br_lck->modified = True;
 
@@ -1192,6 +1577,7 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 	unsigned int i, j, count;
 	struct lock_struct *tp;
 	struct lock_struct *locks = br_lck->lock_data;
+	br_off max_size;
 	bool overlap_found = False;
 
 	/* No zero-zero locks for POSIX. */
@@ -1282,6 +1668,8 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 		return True;
 	}
 
+	max_size = brl_sort_locks(tp, count);
+
 	/* Unlock any POSIX regions. */
 	if(lp_posix_locking(br_lck->fsp->conn->params)) {
 		release_posix_lock_posix_flavour(br_lck->fsp,
@@ -1312,6 +1700,7 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 	TALLOC_FREE(br_lck->lock_data);
 	locks = tp;
 	br_lck->lock_data = tp;
+	br_lck->max_size = max_size;
 	br_lck->modified = True;
 
 	/* Send unlock messages to any pending waiters that overlap. */
@@ -1390,13 +1779,14 @@ bool brl_unlock(struct messaging_context *msg_ctx,
 bool brl_locktest(struct byte_range_lock *br_lck,
 		  const struct lock_struct *rw_probe)
 {
-	bool ret = True;
-	unsigned int i;
+	unsigned int i, first, last;
 	struct lock_struct *locks = br_lck->lock_data;
 	files_struct *fsp = br_lck->fsp;
 
+	brl_candidates(br_lck, rw_probe, &first, &last);
+
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
+	for (i=first; i < last; i++) {
 		/*
 		 * Our own locks don't conflict.
 		 */
@@ -1416,11 +1806,18 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 		}
 	}
 
-	/*
-	 * There is no lock held by an SMB daemon, check to
-	 * see if there is a POSIX lock from a UNIX or NFS process.
-	 * This only conflicts with Windows locks, not POSIX locks.
-	 */
+	return brl_locktest_posix(fsp, rw_probe);
+}
+
+/****************************************************************************
+ The part of brl_locktest() not looking at our own locks: Is there a POSIX
+ lock from a UNIX or NFS process? This only conflicts with Windows locks,
+ not POSIX locks.
+****************************************************************************/
+
+bool brl_locktest_posix(files_struct *fsp, const struct lock_struct *rw_probe)
+{
+	bool ret = true;
 
 	if(lp_posix_locking(fsp->conn->params) &&
 	   (rw_probe->lock_flav == WINDOWS_LOCK)) {
@@ -1459,7 +1856,7 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		enum brl_type *plock_type,
 		enum brl_flavour lock_flav)
 {
-	unsigned int i;
+	unsigned int i, first, last;
 	struct lock_struct lock;
 	const struct lock_struct *locks = br_lck->lock_data;
 	files_struct *fsp = br_lck->fsp;
@@ -1473,8 +1870,10 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 	lock.lock_type = *plock_type;
 	lock.lock_flav = lock_flav;
 
+	brl_candidates(br_lck, &lock, &first, &last);
+
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
+	for (i=first; i < last; i++) {
 		const struct lock_struct *exlock = &locks[i];
 		bool conflict = False;
 
@@ -1844,20 +2243,24 @@ int brl_forall(void (*fn)(struct file_id id, struct server_id pid,
 {
 	struct brl_forall_cb cb;
 	NTSTATUS status;
-	int count = 0;
+	unsigned i;
+	int total = 0;
 
-	if (!brlock_db) {
-		return 0;
-	}
 	cb.fn = fn;
 	cb.private_data = private_data;
-	status = dbwrap_traverse(brlock_db, brl_traverse_fn, &cb, &count);
 
-	if (!NT_STATUS_IS_OK(status)) {
-		return -1;
-	} else {
-		return count;
+	for (i=0; i<brlock_num_shards; i++) {
+		int count = 0;
+
+		status = dbwrap_traverse(brlock_db[i], brl_traverse_fn, &cb,
+					 &count);
+		if (!NT_STATUS_IS_OK(status)) {
+			return -1;
+		}
+		total += count;
 	}
+
+	return total;
 }
 
 /*******************************************************************
@@ -1868,7 +2271,7 @@ int brl_forall(void (*fn)(struct file_id id, struct server_id pid,
 
 static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 {
-	unsigned i;
+	unsigned i, j;
 	struct lock_struct *locks = br_lck->lock_data;
 
 	if (!br_lck->modified) {
@@ -1876,19 +2279,28 @@ static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 		goto done;
 	}
 
-	i = 0;
+	j = 0;
 
-	while (i < br_lck->num_locks) {
+	for (i=0; i < br_lck->num_locks; i++) {
 		if (locks[i].context.pid.pid == 0) {
 			/*
 			 * Autocleanup, the process conflicted and does not
 			 * exist anymore.
 			 */
-			locks[i] = locks[br_lck->num_locks-1];
-			br_lck->num_locks -= 1;
-		} else {
-			i += 1;
+			continue;
+		}
+		if (i != j) {
+			/* Keep the array sorted */
+			locks[j] = locks[i];
 		}
+		j += 1;
+	}
+	br_lck->num_locks = j;
+
+	if (!br_lck->hinted && (br_lck->num_locks != 0)) {
+		/* Before anybody can see the lock */
+		brl_hint_adjust(&br_lck->fsp->file_id, 1);
+		br_lck->hinted = true;
 	}
 
 	if ((br_lck->num_locks == 0) && (br_lck->num_read_oplocks == 0)) {
@@ -1923,7 +2335,13 @@ static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 		}
 	}
 
-	DEBUG(10, ("seqnum=%d\n", dbwrap_get_seqnum(brlock_db)));
+	if (br_lck->hinted && (br_lck->num_locks == 0)) {
+		brl_hint_adjust(&br_lck->fsp->file_id, -1);
+		br_lck->hinted = false;
+	}
+
+	DEBUG(10, ("seqnum=%d\n",
+		   dbwrap_get_seqnum(dbwrap_record_get_db(br_lck->record))));
 
  done:
 	br_lck->modified = false;
@@ -1959,6 +2377,13 @@ static bool brl_parse_data(struct byte_range_lock *br_lck, TDB_DATA data)
 	}
 	memcpy(&br_lck->num_read_oplocks, data.dptr + data_len,
 	       sizeof(br_lck->num_read_oplocks));
+
+	/*
+	 * Records written by us are sorted already, this just
+	 * computes max_size then.
+	 */
+	br_lck->max_size = brl_sort_locks(br_lck->lock_data,
+					  br_lck->num_locks);
 	return true;
 }
 
@@ -1972,6 +2397,8 @@ struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
 {
 	TDB_DATA key, data;
 	struct byte_range_lock *br_lck;
+	struct db_context *db;
+	unsigned shard;
 
 	br_lck = talloc_zero(mem_ctx, struct byte_range_lock);
 	if (br_lck == NULL) {
@@ -1983,7 +2410,11 @@ struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
 	key.dptr = (uint8_t *)&fsp->file_id;
 	key.dsize = sizeof(struct file_id);
 
-	br_lck->record = dbwrap_fetch_locked(brlock_db, br_lck, key);
+	db = brlock_db_shard(&fsp->file_id, &shard);
+
+	START_PROFILE_SHARD(brlock_shard, shard);
+	br_lck->record = dbwrap_fetch_locked(db, br_lck, key);
+	END_PROFILE_SHARD(brlock_shard);
 
 	if (br_lck->record == NULL) {
 		DEBUG(3, ("Could not lock byte range lock entry\n"));
@@ -1997,6 +2428,7 @@ struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
 		TALLOC_FREE(br_lck);
 		return NULL;
 	}
+	br_lck->hinted = (br_lck->num_locks != 0);
 
 	talloc_set_destructor(br_lck, byte_range_lock_destructor);
 
@@ -2044,13 +2476,18 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 {
 	struct byte_range_lock *br_lock = NULL;
 	struct brl_get_locks_readonly_state state;
+	struct db_context *db = brlock_db_shard(&fsp->file_id, NULL);
 	NTSTATUS status;
 
 	DEBUG(10, ("seqnum=%d, fsp->brlock_seqnum=%d\n",
-		   dbwrap_get_seqnum(brlock_db), fsp->brlock_seqnum));
+		   dbwrap_get_seqnum(db), fsp->brlock_seqnum));
 
+	/*
+	 * A file always maps to the same shard, so its seqnum is all
+	 * we have to look at.
+	 */
 	if ((fsp->brlock_rec != NULL)
-	    && (dbwrap_get_seqnum(brlock_db) == fsp->brlock_seqnum)) {
+	    && (dbwrap_get_seqnum(db) == fsp->brlock_seqnum)) {
 		/*
 		 * We have cached the brlock_rec and the database did not
 		 * change.
@@ -2066,7 +2503,7 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 	state.br_lock = &br_lock;
 
 	status = dbwrap_parse_record(
-		brlock_db,
+		db,
 		make_tdb_data((uint8_t *)&fsp->file_id,
 			      sizeof(fsp->file_id)),
 		brl_get_locks_readonly_parser, &state);
@@ -2083,6 +2520,7 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 		br_lock->num_read_oplocks = 0;
 		br_lock->num_locks = 0;
 		br_lock->lock_data = NULL;
+		br_lock->max_size = 0;
 
 	} else if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(3, ("Could not parse byte range lock record: "
@@ -2111,7 +2549,7 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 		 */
 		TALLOC_FREE(fsp->brlock_rec);
 		fsp->brlock_rec = br_lock;
-		fsp->brlock_seqnum = dbwrap_get_seqnum(brlock_db);
+		fsp->brlock_seqnum = dbwrap_get_seqnum(db);
 	}
 
 	return br_lock;
@@ -2223,12 +2661,13 @@ bool brl_cleanup_disconnected(struct file_id fid, uint64_t open_persistent_id)
 	TDB_DATA key, val;
 	struct db_record *rec;
 	struct lock_struct *lock;
+	struct db_context *db = brlock_db_shard(&fid, NULL);
 	unsigned n, num;
 	NTSTATUS status;
 
 	key = make_tdb_data((void*)&fid, sizeof(fid));
 
-	rec = dbwrap_fetch_locked(brlock_db, frame, key);
+	rec = dbwrap_fetch_locked(db, frame, key);
 	if (rec == NULL) {
 		DEBUG(5, ("brl_cleanup_disconnected: failed to fetch record "
 			  "for file %s\n", file_id_string(frame, &fid)));
@@ -2272,12 +2711,16 @@ bool brl_cleanup_disconnected(struct file_id fid, uint64_t open_persistent_id)
 	if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(5, ("brl_cleanup_disconnected: failed to delete record "
 			  "for file %s from %s, open %llu: %s\n",
-			  file_id_string(frame, &fid), dbwrap_name(brlock_db),
+			  file_id_string(frame, &fid), dbwrap_name(db),
 			  (unsigned long long)open_persistent_id,
 			  nt_errstr(status)));
 		goto done;
 	}
 
+	if (num != 0) {
+		brl_hint_adjust(&fid, -1);
+	}
+
 	DEBUG(10, ("brl_cleanup_disconnected: "
 		   "file %s cleaned up %u entries from open %llu\n",
 		   file_id_string(frame, &fid), num,
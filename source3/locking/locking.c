@@ -49,6 +49,7 @@
 #include "../librpc/gen_ndr/ndr_open_files.h"
 #include "librpc/gen_ndr/ndr_file_id.h"
 #include "locking/leases_db.h"
+#include "smbprofile.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_LOCKING
@@ -80,6 +81,180 @@ const char *lock_flav_name(enum brl_flavour lock_flav)
 	return (lock_flav == WINDOWS_LOCK) ? "WINDOWS_LOCK" : "POSIX_LOCK";
 }
 
+/****************************************************************************
+ locking.tdb and brlock.tdb can be split into "smbd:locking shards"
+ files to spread the chain lock contention on busy servers. A file
+ always lives in the same shard of both databases, selected by a hash
+ of its file_id. Shard 0 keeps the traditional file name.
+****************************************************************************/
+
+/* Set by locking_fix_num_shards(), 0 before the databases are open */
+static unsigned locking_shards;
+
+static unsigned locking_configured_shards(void)
+{
+	int num;
+
+	if (lp_clustering()) {
+		/* ctdb distributes the records itself */
+		return 1;
+	}
+
+	num = lp_parm_int(-1, "smbd", "locking shards", 1);
+	if (num < 1) {
+		return 1;
+	}
+	return MIN(num, LOCKING_MAX_SHARDS);
+}
+
+unsigned locking_num_shards(void)
+{
+	if (locking_shards != 0) {
+		return locking_shards;
+	}
+	return locking_configured_shards();
+}
+
+/****************************************************************************
+ All processes have to agree on the number of shards, whatever their
+ smb.conf says by now. The first process opening locking.tdb stores
+ its "smbd:locking shards" in it, everybody else uses the stored value
+ for as long as the database exists. db is shard 0 of locking.tdb, the
+ key can't be mistaken for a file_id.
+****************************************************************************/
+
+#define LOCKING_SHARDS_KEY "LOCKING_SHARDS"
+
+static void locking_parse_num_shards(TDB_DATA key, TDB_DATA data,
+				     void *private_data)
+{
+	unsigned *num = private_data;
+
+	if (data.dsize == sizeof(uint32_t)) {
+		*num = IVAL(data.dptr, 0);
+	}
+}
+
+bool locking_fix_num_shards(struct db_context *db, bool read_only)
+{
+	TDB_DATA key = string_term_tdb_data(LOCKING_SHARDS_KEY);
+	struct db_record *rec;
+	unsigned num = 0;
+	uint8_t buf[4];
+	NTSTATUS status;
+
+	if (read_only) {
+		/* Without the record nobody has used the databases yet */
+		num = 1;
+		(void)dbwrap_parse_record(db, key, locking_parse_num_shards,
+					  &num);
+		goto done;
+	}
+
+	rec = dbwrap_fetch_locked(db, talloc_tos(), key);
+	if (rec == NULL) {
+		DBG_ERR("dbwrap_fetch_locked failed\n");
+		return false;
+	}
+
+	locking_parse_num_shards(key, dbwrap_record_get_value(rec), &num);
+	if (num == 0) {
+		num = locking_configured_shards();
+		SIVAL(buf, 0, num);
+		status = dbwrap_record_store(rec, make_tdb_data(buf, 4), 0);
+		if (!NT_STATUS_IS_OK(status)) {
+			DBG_ERR("dbwrap_record_store failed: %s\n",
+				nt_errstr(status));
+			TALLOC_FREE(rec);
+			return false;
+		}
+	}
+	TALLOC_FREE(rec);
+
+done:
+	if ((num == 0) || (num > LOCKING_MAX_SHARDS)) {
+		DBG_ERR("Invalid number of locking shards %u\n", num);
+		return false;
+	}
+	if (num != locking_configured_shards()) {
+		DBG_NOTICE("Using %u locking shards instead of the configured "
+			   "%u until all processes are restarted\n",
+			   num, locking_configured_shards());
+	}
+	locking_shards = num;
+	return true;
+}
+
+unsigned locking_shard(const struct file_id *id, unsigned num_shards)
+{
+	TDB_DATA key = make_tdb_data((const uint8_t *)id, sizeof(*id));
+
+	if (num_shards <= 1) {
+		return 0;
+	}
+
+	/*
+	 * tdb picks the hash chain with the same hash, the hash sizes
+	 * from locking_hash_size() are prime so all chains of a shard
+	 * are used.
+	 */
+	return tdb_jenkins_hash(&key) % num_shards;
+}
+
+char *locking_shard_path(const char *name, unsigned shard)
+{
+	char *fname, *path;
+
+	if (shard == 0) {
+		fname = talloc_asprintf(talloc_tos(), "%s.tdb", name);
+	} else {
+		fname = talloc_asprintf(talloc_tos(), "%s.%u.tdb", name,
+					shard);
+	}
+	if (fname == NULL) {
+		return NULL;
+	}
+	path = lock_path(fname);
+	TALLOC_FREE(fname);
+	return path;
+}
+
+/****************************************************************************
+ Hash size for each shard. With "smbd:locking expected open files"
+ set, size the hash so that chains stay at about one record.
+****************************************************************************/
+
+static bool locking_is_prime(unsigned n)
+{
+	unsigned i;
+
+	for (i = 2; i * i <= n; i++) {
+		if ((n % i) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int locking_hash_size(unsigned num_shards)
+{
+	int expected;
+	unsigned size;
+
+	expected = lp_parm_int(-1, "smbd", "locking expected open files", 0);
+	if (expected <= 0) {
+		return SMB_OPEN_DATABASE_TDB_HASH_SIZE;
+	}
+
+	size = MAX(expected / MAX(num_shards, 1), 131);
+	size = MIN(size, 1000003);
+
+	while (!locking_is_prime(size)) {
+		size += 1;
+	}
+	return size;
+}
+
 /****************************************************************************
  Utility function called to see if a file region is locked.
  Called in the read/write codepath.
@@ -138,6 +313,18 @@ bool strict_lock_default(files_struct *fsp, struct lock_struct *plock)
 		}
 	}
 
+	if (!brl_maybe_locked(fsp)) {
+		/*
+		 * Nobody holds a byte range lock, only check for
+		 * locks from outside smbd.
+		 */
+		DO_PROFILE_INC(strict_lock_skipped);
+		ret = brl_locktest_posix(fsp, plock);
+		goto done;
+	}
+
+	DO_PROFILE_INC(strict_lock_checked);
+
 	br_lck = brl_get_locks_readonly(fsp);
 	if (!br_lck) {
 		return true;
@@ -154,6 +341,7 @@ bool strict_lock_default(files_struct *fsp, struct lock_struct *plock)
 		TALLOC_FREE(br_lck);
 	}
 
+done:
 	DEBUG(10, ("strict_lock_default: flavour = %s brl start=%ju "
 		   "len=%ju %s for fnum %ju file %s\n",
 		   lock_flav_name(plock->lock_flav),
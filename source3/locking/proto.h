@@ -23,6 +23,8 @@
 #ifndef _LOCKING_PROTO_H_
 #define _LOCKING_PROTO_H_
 
+struct db_context;
+
 /* The following definitions come from locking/brlock.c  */
 
 void brl_init(bool read_only);
@@ -58,8 +60,10 @@ bool brl_unlock(struct messaging_context *msg_ctx,
 bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 			       struct byte_range_lock *br_lck,
 			       const struct lock_struct *plock);
+bool brl_maybe_locked(files_struct *fsp);
 bool brl_locktest(struct byte_range_lock *br_lck,
 		  const struct lock_struct *rw_probe);
+bool brl_locktest_posix(files_struct *fsp, const struct lock_struct *rw_probe);
 NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		uint64_t *psmblctx,
 		struct server_id pid,
@@ -99,6 +103,13 @@ bool brl_cleanup_disconnected(struct file_id fid, uint64_t open_persistent_id);
 
 const char *lock_type_name(enum brl_type lock_type);
 const char *lock_flav_name(enum brl_flavour lock_flav);
+/* Needs to match SMBPROFILE_STATS_SHARDS() */
+#define LOCKING_MAX_SHARDS 16
+unsigned locking_num_shards(void);
+bool locking_fix_num_shards(struct db_context *db, bool read_only);
+unsigned locking_shard(const struct file_id *id, unsigned num_shards);
+char *locking_shard_path(const char *name, unsigned shard);
+int locking_hash_size(unsigned num_shards);
 void init_strict_lock_struct(files_struct *fsp,
 				uint64_t smblctx,
 				br_off start,
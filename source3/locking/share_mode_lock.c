@@ -51,56 +51,120 @@
 #include "locking/leases_db.h"
 #include "../lib/util/memcache.h"
 #include "lib/util/tevent_ntstatus.h"
+#include "smbprofile.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_LOCKING
 
 #define NO_LOCKING_COUNT (-1)
 
-/* the locking database handle */
-static struct db_context *lock_db;
+/*
+ * The locking database handles, see locking_num_shards(). All shards
+ * are opened together, lock_db[0] != NULL means we are initialized.
+ */
+static struct db_context *lock_db[LOCKING_MAX_SHARDS];
+static unsigned lock_num_shards;
 
-static bool locking_init_internal(bool read_only)
+static void locking_close_shards(void)
 {
-	struct db_context *backend;
-	char *db_path;
+	unsigned i;
 
-	brl_init(read_only);
+	for (i=0; i<lock_num_shards; i++) {
+		TALLOC_FREE(lock_db[i]);
+	}
+	lock_num_shards = 0;
+}
 
-	if (lock_db)
-		return True;
+static struct db_context *locking_open_shard(unsigned shard,
+					     unsigned num_shards,
+					     bool read_only)
+{
+	struct db_context *backend, *db;
+	char *db_path;
 
-	db_path = lock_path("locking.tdb");
+	db_path = locking_shard_path("locking", shard);
 	if (db_path == NULL) {
-		return false;
+		return NULL;
 	}
 
 	backend = db_open(NULL, db_path,
-			  SMB_OPEN_DATABASE_TDB_HASH_SIZE,
+			  locking_hash_size(num_shards),
 			  TDB_DEFAULT|TDB_VOLATILE|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH,
 			  read_only?O_RDONLY:O_RDWR|O_CREAT, 0644,
 			  DBWRAP_LOCK_ORDER_1, DBWRAP_FLAG_NONE);
-	TALLOC_FREE(db_path);
 	if (!backend) {
-		DEBUG(0,("ERROR: Failed to initialise locking database\n"));
-		return False;
+		DEBUG(0,("ERROR: Failed to initialise locking database %s\n",
+			 db_path));
+		TALLOC_FREE(db_path);
+		return NULL;
 	}
+	TALLOC_FREE(db_path);
 
-	lock_db = db_open_watched(NULL, backend, server_messaging_context());
-	if (lock_db == NULL) {
+	db = db_open_watched(NULL, backend, server_messaging_context());
+	if (db == NULL) {
 		DBG_ERR("db_open_watched failed\n");
 		TALLOC_FREE(backend);
-		return false;
+		return NULL;
+	}
+	return db;
+}
+
+static bool locking_init_internal(bool read_only)
+{
+	unsigned i, num_shards;
+
+	if (lock_db[0] != NULL) {
+		brl_init(read_only);
+		return True;
 	}
 
+	/* Shard 0 tells us how many shards there are */
+	lock_db[0] = locking_open_shard(0, locking_num_shards(), read_only);
+	if (lock_db[0] == NULL) {
+		return False;
+	}
+	lock_num_shards = 1;
+
+	if (!locking_fix_num_shards(lock_db[0], read_only)) {
+		locking_close_shards();
+		return False;
+	}
+	num_shards = locking_num_shards();
+
+	for (i=1; i<num_shards; i++) {
+		lock_db[i] = locking_open_shard(i, num_shards, read_only);
+		if (lock_db[i] == NULL) {
+			locking_close_shards();
+			return False;
+		}
+		lock_num_shards = i + 1;
+	}
+
+	brl_init(read_only);
+
 	if (!posix_locking_init(read_only)) {
-		TALLOC_FREE(lock_db);
+		locking_close_shards();
 		return False;
 	}
 
 	return True;
 }
 
+/*******************************************************************
+ The locking database shard holding a file_id.
+******************************************************************/
+
+static struct db_context *share_mode_db(const struct file_id *id,
+					unsigned *shard)
+{
+	unsigned s = locking_shard(id, lock_num_shards);
+
+	if (shard != NULL) {
+		*shard = s;
+	}
+	return lock_db[s];
+}
+
 bool locking_init(void)
 {
 	return locking_init_internal(false);
@@ -118,7 +182,7 @@ bool locking_init_readonly(void)
 bool locking_end(void)
 {
 	brl_shutdown();
-	TALLOC_FREE(lock_db);
+	locking_close_shards();
 	return true;
 }
 
@@ -287,50 +351,201 @@ static struct share_mode_data *share_mode_memcache_fetch(TALLOC_CTX *mem_ctx,
 	return d;
 }
 
+/*
+ * Hot files can have thousands of share mode entries and leases,
+ * marshalling them with NDR on every open and close is too
+ * expensive. A locking.tdb record is the NDR encoded share_mode_data
+ * without the leases and share mode entries, followed by the leases
+ * and entries in a fixed size little endian format and a trailer
+ * with the sizes:
+ *
+ * header_len bytes      NDR share_mode_data, no leases/entries
+ * num_leases * 52       SHARE_MODE_LEASE_SIZE per lease
+ * num_share_modes * 104 SHARE_MODE_ENTRY_SIZE per entry
+ * 12 bytes              header_len, num_leases, num_share_modes
+ *
+ * The sequence number stays at the start of the record for
+ * share_mode_memcache_fetch().
+ */
+
+#define SHARE_MODE_LEASE_SIZE 52
+#define SHARE_MODE_ENTRY_SIZE 104
+#define SHARE_MODE_TRAILER_SIZE 12
+
+static void share_mode_guid_push(uint8_t *buf, const struct GUID *guid)
+{
+	SIVAL(buf, 0, guid->time_low);
+	SSVAL(buf, 4, guid->time_mid);
+	SSVAL(buf, 6, guid->time_hi_and_version);
+	memcpy(buf + 8, guid->clock_seq, 2);
+	memcpy(buf + 10, guid->node, 6);
+}
+
+static void share_mode_guid_pull(const uint8_t *buf, struct GUID *guid)
+{
+	guid->time_low = IVAL(buf, 0);
+	guid->time_mid = SVAL(buf, 4);
+	guid->time_hi_and_version = SVAL(buf, 6);
+	memcpy(guid->clock_seq, buf + 8, 2);
+	memcpy(guid->node, buf + 10, 6);
+}
+
+static void share_mode_lease_push(uint8_t *buf,
+				  const struct share_mode_lease *l)
+{
+	share_mode_guid_push(buf, &l->client_guid);
+	SBVAL(buf, 16, l->lease_key.data[0]);
+	SBVAL(buf, 24, l->lease_key.data[1]);
+	SIVAL(buf, 32, l->current_state);
+	SIVAL(buf, 36, l->breaking_to_requested);
+	SIVAL(buf, 40, l->breaking_to_required);
+	SSVAL(buf, 44, l->lease_version);
+	SSVAL(buf, 46, l->epoch);
+	SIVAL(buf, 48, l->breaking);
+}
+
+static void share_mode_lease_pull(const uint8_t *buf,
+				  struct share_mode_lease *l)
+{
+	share_mode_guid_pull(buf, &l->client_guid);
+	l->lease_key.data[0] = BVAL(buf, 16);
+	l->lease_key.data[1] = BVAL(buf, 24);
+	l->current_state = IVAL(buf, 32);
+	l->breaking_to_requested = IVAL(buf, 36);
+	l->breaking_to_required = IVAL(buf, 40);
+	l->lease_version = SVAL(buf, 44);
+	l->epoch = SVAL(buf, 46);
+	l->breaking = (IVAL(buf, 48) != 0);
+}
+
+static void share_mode_entry_push(uint8_t *buf,
+				  const struct share_mode_entry *e)
+{
+	SBVAL(buf, 0, e->pid.pid);
+	SIVAL(buf, 8, e->pid.task_id);
+	SIVAL(buf, 12, e->pid.vnn);
+	SBVAL(buf, 16, e->pid.unique_id);
+	SBVAL(buf, 24, e->op_mid);
+	SSVAL(buf, 32, e->op_type);
+	SSVAL(buf, 34, e->flags);
+	SIVAL(buf, 36, e->lease_idx);
+	SIVAL(buf, 40, e->access_mask);
+	SIVAL(buf, 44, e->share_access);
+	SIVAL(buf, 48, e->private_options);
+	SIVAL(buf, 52, e->uid);
+	SBVAL(buf, 56, (uint64_t)e->time.tv_sec);
+	SIVAL(buf, 64, e->time.tv_usec);
+	SIVAL(buf, 68, e->name_hash);
+	SBVAL(buf, 72, e->id.devid);
+	SBVAL(buf, 80, e->id.inode);
+	SBVAL(buf, 88, e->id.extid);
+	SBVAL(buf, 96, e->share_file_id);
+}
+
+static void share_mode_entry_pull(const uint8_t *buf,
+				  struct share_mode_entry *e)
+{
+	e->pid.pid = BVAL(buf, 0);
+	e->pid.task_id = IVAL(buf, 8);
+	e->pid.vnn = IVAL(buf, 12);
+	e->pid.unique_id = BVAL(buf, 16);
+	e->op_mid = BVAL(buf, 24);
+	e->op_type = SVAL(buf, 32);
+	e->flags = SVAL(buf, 34);
+	e->lease_idx = IVAL(buf, 36);
+	e->access_mask = IVAL(buf, 40);
+	e->share_access = IVAL(buf, 44);
+	e->private_options = IVAL(buf, 48);
+	e->uid = IVAL(buf, 52);
+	e->time.tv_sec = BVAL(buf, 56);
+	e->time.tv_usec = IVAL(buf, 64);
+	e->name_hash = IVAL(buf, 68);
+	e->id.devid = BVAL(buf, 72);
+	e->id.inode = BVAL(buf, 80);
+	e->id.extid = BVAL(buf, 88);
+	e->share_file_id = BVAL(buf, 96);
+}
+
 /*******************************************************************
- Get all share mode entries for a dev/inode pair.
+ Parse a locking.tdb record. Does not look at the memcache.
 ********************************************************************/
 
-static struct share_mode_data *parse_share_modes(TALLOC_CTX *mem_ctx,
-						const TDB_DATA key,
-						const TDB_DATA dbuf)
+static struct share_mode_data *share_mode_data_pull(TALLOC_CTX *mem_ctx,
+						    DATA_BLOB blob)
 {
 	struct share_mode_data *d;
 	enum ndr_err_code ndr_err;
+	const uint8_t *trailer, *p;
+	uint32_t header_len, num_leases, num_share_modes;
+	DATA_BLOB header;
+	size_t len;
 	uint32_t i;
-	DATA_BLOB blob;
-
-	blob.data = dbuf.dptr;
-	blob.length = dbuf.dsize;
 
-	/* See if we already have a cached copy of this key. */
-	d = share_mode_memcache_fetch(mem_ctx, key, &blob);
-	if (d != NULL) {
-		return d;
+	if (blob.length < SHARE_MODE_TRAILER_SIZE) {
+		DEBUG(1, ("share mode record too short: %zu\n", blob.length));
+		return NULL;
+	}
+	trailer = blob.data + blob.length - SHARE_MODE_TRAILER_SIZE;
+	header_len = IVAL(trailer, 0);
+	num_leases = IVAL(trailer, 4);
+	num_share_modes = IVAL(trailer, 8);
+
+	len = blob.length - SHARE_MODE_TRAILER_SIZE;
+	if ((header_len > len) ||
+	    (num_leases > (len - header_len) / SHARE_MODE_LEASE_SIZE)) {
+		goto invalid;
+	}
+	len -= header_len + (size_t)num_leases * SHARE_MODE_LEASE_SIZE;
+	if (len != (size_t)num_share_modes * SHARE_MODE_ENTRY_SIZE) {
+		goto invalid;
 	}
 
 	d = talloc(mem_ctx, struct share_mode_data);
 	if (d == NULL) {
 		DEBUG(0, ("talloc failed\n"));
-		goto fail;
+		return NULL;
 	}
 
+	header = data_blob_const(blob.data, header_len);
+
 	ndr_err = ndr_pull_struct_blob_all(
-		&blob, d, d, (ndr_pull_flags_fn_t)ndr_pull_share_mode_data);
+		&header, d, d, (ndr_pull_flags_fn_t)ndr_pull_share_mode_data);
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
 		DEBUG(1, ("ndr_pull_share_mode_lock failed: %s\n",
 			  ndr_errstr(ndr_err)));
-		goto fail;
+		TALLOC_FREE(d);
+		return NULL;
+	}
+
+	d->leases = talloc_array(d, struct share_mode_lease, num_leases);
+	d->share_modes = talloc_array(d, struct share_mode_entry,
+				      num_share_modes);
+	if ((d->leases == NULL) || (d->share_modes == NULL)) {
+		DEBUG(0, ("talloc failed\n"));
+		TALLOC_FREE(d);
+		return NULL;
+	}
+	d->num_leases = num_leases;
+	d->num_share_modes = num_share_modes;
+
+	p = blob.data + header_len;
+
+	for (i=0; i<num_leases; i++) {
+		share_mode_lease_pull(p, &d->leases[i]);
+		p += SHARE_MODE_LEASE_SIZE;
 	}
 
 	/*
 	 * Initialize the values that are [skip] or [ignore]
-	 * in the idl. The NDR code does not initialize them.
+	 * in the idl.
 	 */
 
-	for (i=0; i<d->num_share_modes; i++) {
+	for (i=0; i<num_share_modes; i++) {
 		struct share_mode_entry *e = &d->share_modes[i];
 
+		share_mode_entry_pull(p, e);
+		p += SHARE_MODE_ENTRY_SIZE;
+
 		e->stale = false;
 		e->lease = NULL;
 		if (e->op_type != LEASE_OPLOCK) {
@@ -344,15 +559,108 @@ static struct share_mode_data *parse_share_modes(TALLOC_CTX *mem_ctx,
 	d->modified = false;
 	d->fresh = false;
 
+	return d;
+
+invalid:
+	DEBUG(1, ("Invalid share mode record: len=%zu, header_len=%"PRIu32
+		  ", num_leases=%"PRIu32", num_share_modes=%"PRIu32"\n",
+		  blob.length, header_len, num_leases, num_share_modes));
+	return NULL;
+}
+
+/*******************************************************************
+ Marshall share_mode_data into a locking.tdb record, allocated on d.
+********************************************************************/
+
+static TDB_DATA share_mode_data_push(struct share_mode_data *d)
+{
+	uint32_t num_leases = d->num_leases;
+	uint32_t num_share_modes = d->num_share_modes;
+	enum ndr_err_code ndr_err;
+	DATA_BLOB header;
+	uint8_t *buf, *p;
+	size_t len;
+	uint32_t i;
+
+	/*
+	 * Only marshall the header with NDR, the arrays follow in
+	 * the fixed size format.
+	 */
+	d->num_leases = 0;
+	d->num_share_modes = 0;
+
+	ndr_err = ndr_push_struct_blob(
+		&header, d, d, (ndr_push_flags_fn_t)ndr_push_share_mode_data);
+
+	d->num_leases = num_leases;
+	d->num_share_modes = num_share_modes;
+
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		smb_panic("ndr_push_share_mode_lock failed");
+	}
+
+	len = header.length +
+		(size_t)num_leases * SHARE_MODE_LEASE_SIZE +
+		(size_t)num_share_modes * SHARE_MODE_ENTRY_SIZE +
+		SHARE_MODE_TRAILER_SIZE;
+
+	buf = talloc_array(d, uint8_t, len);
+	if (buf == NULL) {
+		smb_panic("talloc failed");
+	}
+
+	memcpy(buf, header.data, header.length);
+	p = buf + header.length;
+
+	for (i=0; i<num_leases; i++) {
+		share_mode_lease_push(p, &d->leases[i]);
+		p += SHARE_MODE_LEASE_SIZE;
+	}
+	for (i=0; i<num_share_modes; i++) {
+		share_mode_entry_push(p, &d->share_modes[i]);
+		p += SHARE_MODE_ENTRY_SIZE;
+	}
+
+	SIVAL(p, 0, header.length);
+	SIVAL(p, 4, num_leases);
+	SIVAL(p, 8, num_share_modes);
+
+	TALLOC_FREE(header.data);
+
+	return make_tdb_data(buf, len);
+}
+
+/*******************************************************************
+ Get all share mode entries for a dev/inode pair.
+********************************************************************/
+
+static struct share_mode_data *parse_share_modes(TALLOC_CTX *mem_ctx,
+						const TDB_DATA key,
+						const TDB_DATA dbuf)
+{
+	struct share_mode_data *d;
+	DATA_BLOB blob;
+
+	blob.data = dbuf.dptr;
+	blob.length = dbuf.dsize;
+
+	/* See if we already have a cached copy of this key. */
+	d = share_mode_memcache_fetch(mem_ctx, key, &blob);
+	if (d != NULL) {
+		return d;
+	}
+
+	d = share_mode_data_pull(mem_ctx, blob);
+	if (d == NULL) {
+		return NULL;
+	}
+
 	if (DEBUGLEVEL >= 10) {
 		DEBUG(10, ("parse_share_modes:\n"));
 		NDR_PRINT_DEBUG(share_mode_data, d);
 	}
 
 	return d;
-fail:
-	TALLOC_FREE(d);
-	return NULL;
 }
 
 /*******************************************************************
@@ -361,9 +669,6 @@ fail:
 
 static TDB_DATA unparse_share_modes(struct share_mode_data *d)
 {
-	DATA_BLOB blob;
-	enum ndr_err_code ndr_err;
-
 	if (DEBUGLEVEL >= 10) {
 		DEBUG(10, ("unparse_share_modes:\n"));
 		NDR_PRINT_DEBUG(share_mode_data, d);
@@ -381,13 +686,7 @@ static TDB_DATA unparse_share_modes(struct share_mode_data *d)
 		return make_tdb_data(NULL, 0);
 	}
 
-	ndr_err = ndr_push_struct_blob(
-		&blob, d, d, (ndr_push_flags_fn_t)ndr_push_share_mode_data);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		smb_panic("ndr_push_share_mode_lock failed");
-	}
-
-	return make_tdb_data(blob.data, blob.length);
+	return share_mode_data_push(d);
 }
 
 /*******************************************************************
@@ -528,8 +827,14 @@ static struct share_mode_lock *get_share_mode_lock_internal(
 	struct db_record *rec;
 	TDB_DATA key = locking_key(&id);
 	TDB_DATA value;
+	struct db_context *db;
+	unsigned shard;
 
-	rec = dbwrap_fetch_locked(lock_db, mem_ctx, key);
+	db = share_mode_db(&id, &shard);
+
+	START_PROFILE_SHARD(share_mode_shard, shard);
+	rec = dbwrap_fetch_locked(db, mem_ctx, key);
+	END_PROFILE_SHARD(share_mode_shard);
 	if (rec == NULL) {
 		DEBUG(3, ("Could not lock share entry\n"));
 		return NULL;
@@ -661,7 +966,8 @@ struct share_mode_lock *fetch_share_mode_unlocked(TALLOC_CTX *mem_ctx,
 	NTSTATUS status;
 
 	status = dbwrap_parse_record(
-		lock_db, key, fetch_share_mode_unlocked_parser, &state);
+		share_mode_db(&id, NULL), key,
+		fetch_share_mode_unlocked_parser, &state);
 	if (!NT_STATUS_IS_OK(status)) {
 		return NULL;
 	}
@@ -728,7 +1034,7 @@ struct tevent_req *fetch_share_mode_send(TALLOC_CTX *mem_ctx,
 
 	subreq = dbwrap_parse_record_send(state,
 					  ev,
-					  lock_db,
+					  share_mode_db(&state->id, NULL),
 					  state->key,
 					  fetch_share_mode_unlocked_parser,
 					  state->lck,
@@ -796,17 +1102,16 @@ struct share_mode_forall_state {
 	int (*fn)(struct file_id fid, const struct share_mode_data *data,
 		  void *private_data);
 	void *private_data;
+	bool stopped;
 };
 
 static int share_mode_traverse_fn(struct db_record *rec, void *_state)
 {
 	struct share_mode_forall_state *state =
 		(struct share_mode_forall_state *)_state;
-	uint32_t i;
 	TDB_DATA key;
 	TDB_DATA value;
 	DATA_BLOB blob;
-	enum ndr_err_code ndr_err;
 	struct share_mode_data *d;
 	struct file_id fid;
 	int ret;
@@ -820,33 +1125,23 @@ static int share_mode_traverse_fn(struct db_record *rec, void *_state)
 	}
 	memcpy(&fid, key.dptr, sizeof(fid));
 
-	d = talloc(talloc_tos(), struct share_mode_data);
-	if (d == NULL) {
-		return 0;
-	}
-
 	blob.data = value.dptr;
 	blob.length = value.dsize;
 
-	ndr_err = ndr_pull_struct_blob_all(
-		&blob, d, d, (ndr_pull_flags_fn_t)ndr_pull_share_mode_data);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		DEBUG(1, ("ndr_pull_share_mode_lock failed\n"));
+	d = share_mode_data_pull(talloc_tos(), blob);
+	if (d == NULL) {
 		return 0;
 	}
 
-	for (i=0; i<d->num_share_modes; i++) {
-		struct share_mode_entry *entry = &d->share_modes[i];
-		entry->stale = false; /* [skip] in idl */
-		entry->lease = &d->leases[entry->lease_idx];
-	}
-
 	if (DEBUGLEVEL > 10) {
 		DEBUG(11, ("parse_share_modes:\n"));
 		NDR_PRINT_DEBUG(share_mode_data, d);
 	}
 
 	ret = state->fn(fid, d, state->private_data);
+	if (ret != 0) {
+		state->stopped = true;
+	}
 
 	TALLOC_FREE(d);
 	return ret;
@@ -862,19 +1157,20 @@ int share_mode_forall(int (*fn)(struct file_id fid,
 		.private_data = private_data
 	};
 	NTSTATUS status;
-	int count;
-
-	if (lock_db == NULL) {
-		return 0;
-	}
-
-	status = dbwrap_traverse_read(lock_db, share_mode_traverse_fn,
-				      &state, &count);
-	if (!NT_STATUS_IS_OK(status)) {
-		return -1;
+	unsigned i;
+	int count, total = 0;
+
+	for (i=0; (i<lock_num_shards) && !state.stopped; i++) {
+		status = dbwrap_traverse_read(lock_db[i],
+					      share_mode_traverse_fn,
+					      &state, &count);
+		if (!NT_STATUS_IS_OK(status)) {
+			return -1;
+		}
+		total += count;
 	}
 
-	return count;
+	return total;
 }
 
 struct share_entry_forall_state {
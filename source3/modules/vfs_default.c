@@ -35,6 +35,20 @@
 #include "lib/pthreadpool/pthreadpool_tevent.h"
 #include "librpc/gen_ndr/ndr_ioctl.h"
 
+#ifdef HAVE_DECL_FICLONERANGE
+/*
+ * <linux/fs.h> clashes with <sys/mount.h> from system/filesys.h with
+ * some glibc and kernel header versions, so only take what we need.
+ */
+struct vfswrap_file_clone_range {
+	int64_t src_fd;
+	uint64_t src_offset;
+	uint64_t src_length;
+	uint64_t dest_offset;
+};
+#define VFSWRAP_FICLONERANGE _IOW(0x94, 13, struct vfswrap_file_clone_range)
+#endif
+
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_VFS
 
@@ -706,19 +720,6 @@ static ssize_t vfswrap_pwrite(vfs_handle_struct *handle, files_struct *fsp, cons
 	return result;
 }
 
-static int vfswrap_init_pool(struct smbd_server_connection *conn)
-{
-	int ret;
-
-	if (conn->pool != NULL) {
-		return 0;
-	}
-
-	ret = pthreadpool_tevent_init(conn, lp_aio_max_threads(),
-				      &conn->pool);
-	return ret;
-}
-
 struct vfswrap_pread_state {
 	ssize_t ret;
 	int err;
@@ -750,7 +751,7 @@ static struct tevent_req *vfswrap_pread_send(struct vfs_handle_struct *handle,
 		return NULL;
 	}
 
-	ret = vfswrap_init_pool(handle->conn->sconn);
+	ret = smbd_init_pool(handle->conn->sconn);
 	if (tevent_req_error(req, ret)) {
 		return tevent_req_post(req, ev);
 	}
@@ -866,7 +867,7 @@ static struct tevent_req *vfswrap_pwrite_send(struct vfs_handle_struct *handle,
 		return NULL;
 	}
 
-	ret = vfswrap_init_pool(handle->conn->sconn);
+	ret = smbd_init_pool(handle->conn->sconn);
 	if (tevent_req_error(req, ret)) {
 		return tevent_req_post(req, ev);
 	}
@@ -977,7 +978,7 @@ static struct tevent_req *vfswrap_fsync_send(struct vfs_handle_struct *handle,
 		return NULL;
 	}
 
-	ret = vfswrap_init_pool(handle->conn->sconn);
+	ret = smbd_init_pool(handle->conn->sconn);
 	if (tevent_req_error(req, ret)) {
 		return tevent_req_post(req, ev);
 	}
@@ -1606,8 +1607,16 @@ struct vfs_cc_state {
 	off_t remaining;
 	size_t next_io_size;
 	uint32_t flags;
+
+	/* in-kernel copy done by vfswrap_copy_chunk_offload_do() */
+	int src_fd;
+	int dst_fd;
+	off_t offload_copied;
+	int offload_err;
 };
 
+static NTSTATUS copy_chunk_offload(struct vfs_handle_struct *handle,
+				   struct tevent_req *req);
 static NTSTATUS copy_chunk_loop(struct tevent_req *req);
 
 static struct tevent_req *vfswrap_copy_chunk_send(struct vfs_handle_struct *handle,
@@ -1623,6 +1632,7 @@ static struct tevent_req *vfswrap_copy_chunk_send(struct vfs_handle_struct *hand
 	struct tevent_req *req;
 	struct vfs_cc_state *state = NULL;
 	size_t num = MIN(to_copy, COPYCHUNK_MAX_TOTAL_LEN);
+	bool offload;
 	NTSTATUS status;
 
 	DBG_DEBUG("server side copy chunk of length %" PRIu64 "\n", to_copy);
@@ -1652,11 +1662,9 @@ static struct tevent_req *vfswrap_copy_chunk_send(struct vfs_handle_struct *hand
 		.to_copy = to_copy,
 		.remaining = to_copy,
 		.flags = flags,
+		.src_fd = -1,
+		.dst_fd = -1,
 	};
-	state->buf = talloc_array(state, uint8_t, num);
-	if (tevent_req_nomem(state->buf, req)) {
-		return tevent_req_post(req, ev);
-	}
 
 	status = vfs_stat_fsp(src_fsp);
 	if (tevent_req_nterror(req, status)) {
@@ -1687,6 +1695,45 @@ static struct tevent_req *vfswrap_copy_chunk_send(struct vfs_handle_struct *hand
 		return tevent_req_post(req, ev);
 	}
 
+	if (to_copy == 0) {
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	/*
+	 * Let the kernel (and the filesystem) do the copy if we can,
+	 * this avoids shuffling all the data through our buffer. This
+	 * bypasses the pread/pwrite VFS functions of all modules, so
+	 * it has to be switched on explicitly, and we only do it for
+	 * plain files opened by us.
+	 */
+	offload = lp_parm_bool(SNUM(dest_fsp->conn),
+			       "vfs_default",
+			       "copy_file_range",
+			       false);
+	if (offload &&
+	    (src_fsp->base_fsp == NULL) &&
+	    (dest_fsp->base_fsp == NULL) &&
+	    (src_fsp->fh->fd != -1) &&
+	    (dest_fsp->fh->fd != -1) &&
+	    S_ISREG(src_fsp->fsp_name->st.st_ex_mode) &&
+	    S_ISREG(dest_fsp->fsp_name->st.st_ex_mode))
+	{
+		status = copy_chunk_offload(handle, req);
+		if (NT_STATUS_IS_OK(status)) {
+			return req;
+		}
+		if (!NT_STATUS_EQUAL(status, NT_STATUS_NOT_SUPPORTED)) {
+			tevent_req_nterror(req, status);
+			return tevent_req_post(req, ev);
+		}
+	}
+
+	state->buf = talloc_array(state, uint8_t, num);
+	if (tevent_req_nomem(state->buf, req)) {
+		return tevent_req_post(req, ev);
+	}
+
 	status = copy_chunk_loop(req);
 	if (!NT_STATUS_IS_OK(status)) {
 		tevent_req_nterror(req, status);
@@ -1696,6 +1743,209 @@ static struct tevent_req *vfswrap_copy_chunk_send(struct vfs_handle_struct *hand
 	return req;
 }
 
+static void vfswrap_copy_chunk_offload_do(void *private_data);
+static void vfswrap_copy_chunk_offload_done(struct tevent_req *subreq);
+
+static NTSTATUS copy_chunk_offload(struct vfs_handle_struct *handle,
+				   struct tevent_req *req)
+{
+	struct vfs_cc_state *state = tevent_req_data(req, struct vfs_cc_state);
+	struct tevent_req *subreq = NULL;
+	bool ok;
+	int ret;
+
+#if !defined(HAVE_COPY_FILE_RANGE) && !defined(HAVE_DECL_FICLONERANGE)
+	return NT_STATUS_NOT_SUPPORTED;
+#endif
+
+	ret = smbd_init_pool(handle->conn->sconn);
+	if (ret != 0) {
+		return NT_STATUS_NOT_SUPPORTED;
+	}
+
+	/*
+	 * The whole range is copied in one go, so lock all of it
+	 * on both sides.
+	 */
+	if (!(state->flags & VFS_COPY_CHUNK_FL_IGNORE_LOCKS)) {
+		init_strict_lock_struct(state->src_fsp,
+				state->src_fsp->op->global->open_persistent_id,
+					state->src_off,
+					state->remaining,
+					READ_LOCK,
+					&state->read_lck);
+
+		ok = SMB_VFS_STRICT_LOCK(state->src_fsp->conn,
+					 state->src_fsp,
+					 &state->read_lck);
+		if (!ok) {
+			return NT_STATUS_FILE_LOCK_CONFLICT;
+		}
+		state->read_lck_locked = true;
+
+		init_strict_lock_struct(state->dst_fsp,
+				state->dst_fsp->op->global->open_persistent_id,
+					state->dst_off,
+					state->remaining,
+					WRITE_LOCK,
+					&state->write_lck);
+
+		ok = SMB_VFS_STRICT_LOCK(state->dst_fsp->conn,
+					 state->dst_fsp,
+					 &state->write_lck);
+		if (!ok) {
+			SMB_VFS_STRICT_UNLOCK(state->src_fsp->conn,
+					      state->src_fsp,
+					      &state->read_lck);
+			ZERO_STRUCT(state->read_lck);
+			state->read_lck_locked = false;
+			return NT_STATUS_FILE_LOCK_CONFLICT;
+		}
+		state->write_lck_locked = true;
+	}
+
+	state->src_fd = state->src_fsp->fh->fd;
+	state->dst_fd = state->dst_fsp->fh->fd;
+	state->offload_copied = 0;
+	state->offload_err = 0;
+
+	subreq = pthreadpool_tevent_job_send(
+		state, state->ev, handle->conn->sconn->pool,
+		vfswrap_copy_chunk_offload_do, state);
+	if (subreq == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	tevent_req_set_callback(subreq, vfswrap_copy_chunk_offload_done, req);
+
+	return NT_STATUS_OK;
+}
+
+static void vfswrap_copy_chunk_offload_do(void *private_data)
+{
+	struct vfs_cc_state *state = talloc_get_type_abort(
+		private_data, struct vfs_cc_state);
+	off_t src_off = state->src_off;
+	off_t dst_off = state->dst_off;
+	off_t remaining = state->remaining;
+
+#ifdef HAVE_DECL_FICLONERANGE
+	{
+		/*
+		 * Try to share the extents first. This only works
+		 * within one filesystem that supports it and for
+		 * block aligned ranges, anything else fails and we
+		 * copy instead.
+		 */
+		struct vfswrap_file_clone_range fcr = {
+			.src_fd = state->src_fd,
+			.src_offset = src_off,
+			.src_length = remaining,
+			.dest_offset = dst_off,
+		};
+		int ret;
+
+		ret = ioctl(state->dst_fd, VFSWRAP_FICLONERANGE, &fcr);
+		if (ret == 0) {
+			state->offload_copied = remaining;
+			return;
+		}
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (remaining > 0) {
+		ssize_t ret;
+
+		ret = copy_file_range(state->src_fd, &src_off,
+				      state->dst_fd, &dst_off,
+				      remaining, 0);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			state->offload_err = errno;
+			return;
+		}
+		if (ret == 0) {
+			/* Source truncated under us */
+			return;
+		}
+
+		state->offload_copied += ret;
+		remaining -= ret;
+	}
+#else
+	state->offload_err = ENOSYS;
+#endif
+}
+
+static void vfswrap_copy_chunk_offload_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct vfs_cc_state *state = tevent_req_data(req, struct vfs_cc_state);
+	size_t num = MIN(state->to_copy, COPYCHUNK_MAX_TOTAL_LEN);
+	NTSTATUS status;
+	int ret;
+
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	if (state->read_lck_locked) {
+		SMB_VFS_STRICT_UNLOCK(state->src_fsp->conn,
+				      state->src_fsp,
+				      &state->read_lck);
+		ZERO_STRUCT(state->read_lck);
+		state->read_lck_locked = false;
+	}
+	if (state->write_lck_locked) {
+		SMB_VFS_STRICT_UNLOCK(state->dst_fsp->conn,
+				      state->dst_fsp,
+				      &state->write_lck);
+		ZERO_STRUCT(state->write_lck);
+		state->write_lck_locked = false;
+	}
+
+	if (tevent_req_error(req, ret)) {
+		return;
+	}
+
+	if (state->offload_copied > state->remaining) {
+		/* Paranoia check */
+		tevent_req_nterror(req, NT_STATUS_INTERNAL_ERROR);
+		return;
+	}
+
+	DBG_DEBUG("offloaded %jd of %jd bytes: %s\n",
+		  (intmax_t)state->offload_copied,
+		  (intmax_t)state->remaining,
+		  strerror(state->offload_err));
+
+	state->src_off += state->offload_copied;
+	state->dst_off += state->offload_copied;
+	state->remaining -= state->offload_copied;
+	if (state->remaining == 0) {
+		tevent_req_done(req);
+		return;
+	}
+
+	/*
+	 * The kernel could not do it (EXDEV, EOPNOTSUPP, ENOSYS, ...)
+	 * or stopped early. Copy the rest by hand, a real I/O
+	 * problem will show up there again.
+	 */
+	state->buf = talloc_array(state, uint8_t, num);
+	if (tevent_req_nomem(state->buf, req)) {
+		return;
+	}
+
+	status = copy_chunk_loop(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		tevent_req_nterror(req, status);
+		return;
+	}
+}
+
 static void vfswrap_copy_chunk_read_done(struct tevent_req *subreq);
 
 static NTSTATUS copy_chunk_loop(struct tevent_req *req)
@@ -3,6 +3,13 @@
  * of all VFS calls, except for "disk free" and "get quota" which
  * are handled by reading a text file named ".dfq" in the current directory.
  *
+ * With "fake_dfq:file size limit" set, writes behave as if the disk
+ * filled up at that file size: a write across the limit is cut short,
+ * a write beyond it fails with ENOSPC. "fake_dfq:max write size" cuts
+ * every write short to that many bytes. "fake_dfq:write delay" makes
+ * asynchronous writes wait the given number of milliseconds before
+ * they are started, like a slow disk.
+ *
  * This module is intended for testing purposes.
  *
  * Copyright (C) Uri Simchoni, 2016
@@ -23,6 +30,7 @@
 
 #include "includes.h"
 #include "smbd/smbd.h"
+#include "lib/util/tevent_unix.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_VFS
@@ -167,11 +175,169 @@ out:
 	return rc;
 }
 
+/*
+ * Trim a write to the maximum write size and the file size limit.
+ * Returns false if nothing can be written at all.
+ */
+static bool dfq_write_limit(struct vfs_handle_struct *handle, size_t *n,
+			    off_t offset)
+{
+	int snum = SNUM(handle->conn);
+	uint64_t max_write, limit;
+
+	max_write = lp_parm_ulonglong(snum, "fake_dfq", "max write size", 0);
+	if ((max_write != 0) && (*n > max_write)) {
+		*n = max_write;
+	}
+
+	limit = lp_parm_ulonglong(snum, "fake_dfq", "file size limit", 0);
+	if (limit == 0) {
+		return true;
+	}
+	if ((*n == 0) || (offset < 0)) {
+		return true;
+	}
+	if ((uint64_t)offset >= limit) {
+		return false;
+	}
+	if (*n > limit - (uint64_t)offset) {
+		*n = limit - (uint64_t)offset;
+	}
+	return true;
+}
+
+static ssize_t dfq_pwrite(struct vfs_handle_struct *handle,
+			  struct files_struct *fsp, const void *data,
+			  size_t n, off_t offset)
+{
+	if (!dfq_write_limit(handle, &n, offset)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return SMB_VFS_NEXT_PWRITE(handle, fsp, data, n, offset);
+}
+
+struct dfq_pwrite_state {
+	struct tevent_context *ev;
+	struct vfs_handle_struct *handle;
+	struct files_struct *fsp;
+	const void *data;
+	size_t n;
+	off_t offset;
+	ssize_t ret;
+	struct vfs_aio_state vfs_aio_state;
+};
+
+static void dfq_pwrite_delayed(struct tevent_req *subreq);
+static void dfq_pwrite_done(struct tevent_req *subreq);
+
+static struct tevent_req *dfq_pwrite_send(struct vfs_handle_struct *handle,
+					  TALLOC_CTX *mem_ctx,
+					  struct tevent_context *ev,
+					  struct files_struct *fsp,
+					  const void *data,
+					  size_t n, off_t offset)
+{
+	struct tevent_req *req, *subreq;
+	struct dfq_pwrite_state *state;
+	int delay;
+
+	req = tevent_req_create(mem_ctx, &state, struct dfq_pwrite_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->ev = ev;
+	state->handle = handle;
+	state->fsp = fsp;
+	state->data = data;
+	state->n = n;
+	state->offset = offset;
+
+	if (!dfq_write_limit(handle, &state->n, offset)) {
+		tevent_req_error(req, ENOSPC);
+		return tevent_req_post(req, ev);
+	}
+
+	delay = lp_parm_int(SNUM(handle->conn), "fake_dfq", "write delay", 0);
+	if (delay > 0) {
+		subreq = tevent_wakeup_send(
+			state, ev, timeval_current_ofs_msec(delay));
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_set_callback(subreq, dfq_pwrite_delayed, req);
+		return req;
+	}
+
+	subreq = SMB_VFS_NEXT_PWRITE_SEND(state, ev, handle, fsp, data,
+					  state->n, offset);
+	if (tevent_req_nomem(subreq, req)) {
+		return tevent_req_post(req, ev);
+	}
+	tevent_req_set_callback(subreq, dfq_pwrite_done, req);
+	return req;
+}
+
+static void dfq_pwrite_delayed(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct dfq_pwrite_state *state = tevent_req_data(
+		req, struct dfq_pwrite_state);
+	bool ok;
+
+	ok = tevent_wakeup_recv(subreq);
+	TALLOC_FREE(subreq);
+	if (!ok) {
+		tevent_req_error(req, EIO);
+		return;
+	}
+
+	subreq = SMB_VFS_NEXT_PWRITE_SEND(state, state->ev, state->handle,
+					  state->fsp, state->data, state->n,
+					  state->offset);
+	if (tevent_req_nomem(subreq, req)) {
+		return;
+	}
+	tevent_req_set_callback(subreq, dfq_pwrite_done, req);
+}
+
+static void dfq_pwrite_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct dfq_pwrite_state *state = tevent_req_data(
+		req, struct dfq_pwrite_state);
+
+	state->ret = SMB_VFS_PWRITE_RECV(subreq, &state->vfs_aio_state);
+	TALLOC_FREE(subreq);
+	tevent_req_done(req);
+}
+
+static ssize_t dfq_pwrite_recv(struct tevent_req *req,
+			       struct vfs_aio_state *vfs_aio_state)
+{
+	struct dfq_pwrite_state *state = tevent_req_data(
+		req, struct dfq_pwrite_state);
+
+	if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+		return -1;
+	}
+	*vfs_aio_state = state->vfs_aio_state;
+	return state->ret;
+}
+
 struct vfs_fn_pointers vfs_fake_dfq_fns = {
     /* Disk operations */
 
     .disk_free_fn = dfq_disk_free,
     .get_quota_fn = dfq_get_quota,
+
+    /* File operations */
+
+    .pwrite_fn = dfq_pwrite,
+    .pwrite_send_fn = dfq_pwrite_send,
+    .pwrite_recv_fn = dfq_pwrite_recv,
 };
 
 static_decl_vfs;
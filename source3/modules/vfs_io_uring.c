@@ -0,0 +1,751 @@
+/*
+ * Use the io_uring of Linux (>= 5.1)
+ *
+ * Based on vfs_aio_linux.c
+ *
+ * Copyright (C) Jeremy Allison 2012
+ * Copyright (C) Volker Lendecke 2012
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "lib/util/tevent_unix.h"
+#include "lib/util/sys_rw.h"
+#include "smbprofile.h"
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+/*
+ * One ring per smbd process. Requests are queued in
+ * "queue" and handed to the kernel in one io_uring_submit()
+ * per tevent loop iteration (via "submit_im"). Completions
+ * are signalled through a single eventfd and reaped in one go.
+ */
+
+struct vfs_io_uring_request;
+
+struct vfs_io_uring_config {
+	struct io_uring uring;
+	unsigned num_entries;
+	int event_fd;
+	struct tevent_context *ev;
+	struct tevent_fd *fde;
+	struct tevent_immediate *submit_im;
+	bool submit_scheduled;
+	bool retired;
+	unsigned num_pending;
+	struct vfs_io_uring_request *queue;
+	struct vfs_io_uring_request *pending;
+};
+
+struct vfs_io_uring_request {
+	struct vfs_io_uring_request *prev, *next;
+	struct vfs_io_uring_request **list_head;
+	struct vfs_io_uring_config *config;
+	struct tevent_req *req;
+	void (*completion_fn)(struct vfs_io_uring_request *cur);
+	struct io_uring_sqe sqe;
+	struct io_uring_cqe cqe;
+	/*
+	 * The iovec lives here and not in the tevent_req state:
+	 * the kernel may still reference it if the request is
+	 * talloc_free'd while in flight.
+	 */
+	struct iovec iov;
+	struct timespec start_time;
+	struct timespec end_time;
+};
+
+static struct vfs_io_uring_config *vfs_io_uring_config;
+
+static void vfs_io_uring_fd_handler(struct tevent_context *ev,
+				    struct tevent_fd *fde,
+				    uint16_t flags,
+				    void *private_data);
+static void vfs_io_uring_queue_run(struct vfs_io_uring_config *config);
+static void vfs_io_uring_cqe_handle(struct vfs_io_uring_config *config,
+				    struct io_uring_cqe *cqe,
+				    const struct timespec *end_time);
+
+static void vfs_io_uring_fail_list(struct vfs_io_uring_request **list,
+				   int err)
+{
+	while (*list != NULL) {
+		struct vfs_io_uring_request *cur = *list;
+
+		DLIST_REMOVE(*list, cur);
+		cur->list_head = NULL;
+
+		if (cur->req == NULL) {
+			/* Orphaned by vfs_io_uring_request_destructor */
+			talloc_set_destructor(cur, NULL);
+			TALLOC_FREE(cur);
+			continue;
+		}
+
+		tevent_req_error(cur->req, err);
+	}
+}
+
+static int vfs_io_uring_config_destructor(struct vfs_io_uring_config *config)
+{
+	if (vfs_io_uring_config == config) {
+		vfs_io_uring_config = NULL;
+	}
+
+	if ((config->num_pending != 0) || (config->queue != NULL)) {
+		/*
+		 * The kernel could still read or write the buffers of
+		 * the requests it took from the submission queue. We
+		 * must not wait for them or run any completion while
+		 * we are half gone. Leak the ring, the fd handler
+		 * keeps reaping.
+		 */
+		DBG_WARNING("%u requests in flight, keeping ring\n",
+			    config->num_pending);
+		return -1;
+	}
+
+	TALLOC_FREE(config->fde);
+	io_uring_queue_exit(&config->uring);
+
+	if (config->event_fd != -1) {
+		close(config->event_fd);
+		config->event_fd = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop using a ring after a fatal io_uring_submit() error. Requests
+ * the kernel did not take are failed, the ones it did take complete
+ * normally and the last one to do so frees the ring.
+ */
+static void vfs_io_uring_config_retire(struct vfs_io_uring_config *config)
+{
+	struct vfs_io_uring_request *unsubmitted = NULL;
+	unsigned num_unsubmitted;
+
+	/* New requests get a new ring */
+	if (vfs_io_uring_config == config) {
+		vfs_io_uring_config = NULL;
+	}
+	config->retired = true;
+
+	/*
+	 * io_uring_sq_ready() looks at the kernel's head of the
+	 * submission queue, so this is the number of sqes that were
+	 * never consumed. They were the last ones we queued.
+	 */
+	num_unsubmitted = io_uring_sq_ready(&config->uring);
+	num_unsubmitted = MIN(num_unsubmitted, config->num_pending);
+
+	while (num_unsubmitted > 0) {
+		struct vfs_io_uring_request *cur = DLIST_TAIL(config->pending);
+
+		DLIST_REMOVE(config->pending, cur);
+		DLIST_ADD(unsubmitted, cur);
+		cur->list_head = &unsubmitted;
+		config->num_pending -= 1;
+		num_unsubmitted -= 1;
+	}
+
+	vfs_io_uring_fail_list(&unsubmitted, EIO);
+	vfs_io_uring_fail_list(&config->queue, EIO);
+
+	if (config->num_pending == 0) {
+		TALLOC_FREE(config);
+	}
+}
+
+/*
+ * The ring is shared by all connections of the process, so it only
+ * takes global parameters.
+ */
+static struct vfs_io_uring_config *vfs_io_uring_config_init(void)
+{
+	struct vfs_io_uring_config *config = NULL;
+	int ret;
+
+	if (vfs_io_uring_config != NULL) {
+		return vfs_io_uring_config;
+	}
+
+	config = talloc_zero(NULL, struct vfs_io_uring_config);
+	if (config == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	config->event_fd = -1;
+	config->ev = server_event_context();
+	config->num_entries = lp_parm_int(-1,
+					  "io_uring",
+					  "num_entries",
+					  128);
+	config->num_entries = MAX(1, config->num_entries);
+
+	config->submit_im = tevent_create_immediate(config);
+	if (config->submit_im == NULL) {
+		TALLOC_FREE(config);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ret = io_uring_queue_init(config->num_entries, &config->uring, 0);
+	if (ret < 0) {
+		DBG_ERR("io_uring_queue_init(%u) failed: %s\n",
+			config->num_entries, strerror(-ret));
+		TALLOC_FREE(config);
+		errno = -ret;
+		return NULL;
+	}
+	talloc_set_destructor(config, vfs_io_uring_config_destructor);
+
+	config->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (config->event_fd == -1) {
+		ret = errno;
+		TALLOC_FREE(config);
+		errno = ret;
+		return NULL;
+	}
+
+	ret = io_uring_register_eventfd(&config->uring, config->event_fd);
+	if (ret < 0) {
+		DBG_ERR("io_uring_register_eventfd failed: %s\n",
+			strerror(-ret));
+		TALLOC_FREE(config);
+		errno = -ret;
+		return NULL;
+	}
+
+	config->fde = tevent_add_fd(config->ev,
+				    config,
+				    config->event_fd,
+				    TEVENT_FD_READ,
+				    vfs_io_uring_fd_handler,
+				    config);
+	if (config->fde == NULL) {
+		TALLOC_FREE(config);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	DBG_DEBUG("initialized io_uring with %u entries\n",
+		  config->num_entries);
+
+	vfs_io_uring_config = config;
+	return config;
+}
+
+static int vfs_io_uring_connect(vfs_handle_struct *handle,
+				const char *service,
+				const char *user)
+{
+	struct vfs_io_uring_config *config = NULL;
+	int ret;
+
+	ret = SMB_VFS_NEXT_CONNECT(handle, service, user);
+	if (ret < 0) {
+		return ret;
+	}
+
+	config = vfs_io_uring_config_init();
+	if (config == NULL) {
+		int saved_errno = errno;
+		SMB_VFS_NEXT_DISCONNECT(handle);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int vfs_io_uring_request_destructor(struct vfs_io_uring_request *cur)
+{
+	if (cur->list_head == NULL) {
+		return 0;
+	}
+
+	if (cur->list_head == &cur->config->pending) {
+		/*
+		 * The kernel still owns the sqe, we can't go away
+		 * now. Detach from the tevent_req, the completion
+		 * handler will free us.
+		 */
+		cur->req = NULL;
+		return -1;
+	}
+
+	DLIST_REMOVE(*cur->list_head, cur);
+	cur->list_head = NULL;
+
+	return 0;
+}
+
+static struct vfs_io_uring_request *vfs_io_uring_request_create(
+	struct vfs_handle_struct *handle,
+	TALLOC_CTX *mem_ctx,
+	struct tevent_req *req,
+	void (*completion_fn)(struct vfs_io_uring_request *cur))
+{
+	struct vfs_io_uring_config *config = NULL;
+	struct vfs_io_uring_request *cur = NULL;
+
+	/*
+	 * The ring might have been torn down after a fatal
+	 * io_uring_submit() error, try to set up a new one.
+	 */
+	config = vfs_io_uring_config_init();
+	if (config == NULL) {
+		return NULL;
+	}
+
+	cur = talloc_zero(mem_ctx, struct vfs_io_uring_request);
+	if (cur == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	cur->config = config;
+	cur->req = req;
+	cur->completion_fn = completion_fn;
+	talloc_set_destructor(cur, vfs_io_uring_request_destructor);
+
+	return cur;
+}
+
+static void vfs_io_uring_submit_im_handler(struct tevent_context *ev,
+					   struct tevent_immediate *im,
+					   void *private_data)
+{
+	struct vfs_io_uring_config *config = talloc_get_type_abort(
+		private_data, struct vfs_io_uring_config);
+
+	config->submit_scheduled = false;
+	vfs_io_uring_queue_run(config);
+}
+
+static void vfs_io_uring_request_submit(struct vfs_io_uring_request *cur)
+{
+	struct vfs_io_uring_config *config = cur->config;
+
+	PROFILE_TIMESTAMP(&cur->start_time);
+
+	io_uring_sqe_set_data(&cur->sqe, cur);
+	DLIST_ADD_END(config->queue, cur);
+	cur->list_head = &config->queue;
+
+	/*
+	 * Defer the io_uring_enter() syscall to the next loop
+	 * iteration, so that all requests created by the current
+	 * event handler (e.g. an SMB2 compound chain or a batch of
+	 * reads read from the socket) go down in one go.
+	 */
+	if (!config->submit_scheduled) {
+		tevent_schedule_immediate(config->submit_im,
+					  config->ev,
+					  vfs_io_uring_submit_im_handler,
+					  config);
+		config->submit_scheduled = true;
+	}
+}
+
+static void vfs_io_uring_queue_run(struct vfs_io_uring_config *config)
+{
+	struct vfs_io_uring_request *cur = NULL, *next = NULL;
+	unsigned num_queued = 0;
+	int ret;
+
+	for (cur = config->queue; cur != NULL; cur = next) {
+		struct io_uring_sqe *sqe = NULL;
+
+		next = cur->next;
+
+		/*
+		 * Never have more requests in flight than we
+		 * have completion entries.
+		 */
+		if (config->num_pending >= config->num_entries) {
+			break;
+		}
+
+		sqe = io_uring_get_sqe(&config->uring);
+		if (sqe == NULL) {
+			break;
+		}
+
+		*sqe = cur->sqe;
+
+		DLIST_REMOVE(config->queue, cur);
+		DLIST_ADD_END(config->pending, cur);
+		cur->list_head = &config->pending;
+		config->num_pending += 1;
+		num_queued += 1;
+	}
+
+	if (num_queued == 0) {
+		return;
+	}
+
+	ret = io_uring_submit(&config->uring);
+	if (ret < 0) {
+		DBG_ERR("io_uring_submit failed: %s\n", strerror(-ret));
+		vfs_io_uring_config_retire(config);
+		return;
+	}
+
+	DBG_DEBUG("submitted %u requests with one syscall\n", num_queued);
+}
+
+static void vfs_io_uring_cqe_handle(struct vfs_io_uring_config *config,
+				    struct io_uring_cqe *cqe,
+				    const struct timespec *end_time)
+{
+	struct vfs_io_uring_request *cur = NULL;
+
+	cur = (struct vfs_io_uring_request *)io_uring_cqe_get_data(cqe);
+	cur->cqe = *cqe;
+	cur->end_time = *end_time;
+	io_uring_cqe_seen(&config->uring, cqe);
+
+	DLIST_REMOVE(config->pending, cur);
+	cur->list_head = NULL;
+	config->num_pending -= 1;
+
+	if (cur->req == NULL) {
+		/* Orphaned by vfs_io_uring_request_destructor */
+		talloc_set_destructor(cur, NULL);
+		TALLOC_FREE(cur);
+		return;
+	}
+
+	cur->completion_fn(cur);
+}
+
+static void vfs_io_uring_fd_handler(struct tevent_context *ev,
+				    struct tevent_fd *fde,
+				    uint16_t flags,
+				    void *private_data)
+{
+	struct vfs_io_uring_config *config = talloc_get_type_abort(
+		private_data, struct vfs_io_uring_config);
+	struct io_uring_cqe *cqe = NULL;
+	struct timespec end_time;
+	uint64_t num_events = 0;
+	unsigned num_reaped = 0;
+	ssize_t nread;
+
+	/*
+	 * Just drain the eventfd, the cq ring is the source of
+	 * truth for completions.
+	 */
+	nread = sys_read(config->event_fd, &num_events, sizeof(num_events));
+	if ((nread == -1) && (errno != EAGAIN)) {
+		DBG_ERR("reading eventfd failed: %s\n", strerror(errno));
+	}
+
+	PROFILE_TIMESTAMP(&end_time);
+
+	while (io_uring_peek_cqe(&config->uring, &cqe) == 0) {
+		if (cqe == NULL) {
+			break;
+		}
+		vfs_io_uring_cqe_handle(config, cqe, &end_time);
+		num_reaped += 1;
+	}
+
+	DBG_DEBUG("reaped %u completions\n", num_reaped);
+
+	/*
+	 * Completions made room in the ring, push more requests
+	 * down if we had to hold some back.
+	 */
+	if (config->queue != NULL) {
+		vfs_io_uring_queue_run(config);
+		return;
+	}
+
+	if (config->retired && (config->num_pending == 0)) {
+		TALLOC_FREE(config);
+	}
+}
+
+struct vfs_io_uring_pread_state {
+	struct vfs_io_uring_request *ur;
+	ssize_t ret;
+	struct vfs_aio_state vfs_aio_state;
+	SMBPROFILE_BYTES_ASYNC_STATE(profile_bytes);
+};
+
+static void vfs_io_uring_pread_completion(struct vfs_io_uring_request *cur);
+
+static struct tevent_req *vfs_io_uring_pread_send(
+	struct vfs_handle_struct *handle,
+	TALLOC_CTX *mem_ctx,
+	struct tevent_context *ev,
+	struct files_struct *fsp,
+	void *data,
+	size_t n, off_t offset)
+{
+	struct tevent_req *req = NULL;
+	struct vfs_io_uring_pread_state *state = NULL;
+
+	req = tevent_req_create(mem_ctx, &state,
+				struct vfs_io_uring_pread_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->ret = -1;
+
+	state->ur = vfs_io_uring_request_create(
+		handle, state, req, vfs_io_uring_pread_completion);
+	if (state->ur == NULL) {
+		tevent_req_error(req, errno);
+		return tevent_req_post(req, ev);
+	}
+
+	SMBPROFILE_BYTES_ASYNC_START(syscall_asys_pread, profile_p,
+				     state->profile_bytes, n);
+	SMBPROFILE_BYTES_ASYNC_SET_IDLE(state->profile_bytes);
+
+	state->ur->iov.iov_base = data;
+	state->ur->iov.iov_len = n;
+	io_uring_prep_readv(&state->ur->sqe,
+			    fsp->fh->fd,
+			    &state->ur->iov, 1,
+			    offset);
+	vfs_io_uring_request_submit(state->ur);
+
+	return req;
+}
+
+static void vfs_io_uring_pread_completion(struct vfs_io_uring_request *cur)
+{
+	struct tevent_req *req = cur->req;
+	struct vfs_io_uring_pread_state *state = tevent_req_data(
+		req, struct vfs_io_uring_pread_state);
+
+	SMBPROFILE_BYTES_ASYNC_END(state->profile_bytes);
+
+	state->vfs_aio_state.duration = nsec_time_diff(&cur->end_time,
+						       &cur->start_time);
+
+	if (cur->cqe.res < 0) {
+		state->vfs_aio_state.error = -cur->cqe.res;
+		state->ret = -1;
+	} else {
+		state->ret = cur->cqe.res;
+	}
+
+	TALLOC_FREE(state->ur);
+	tevent_req_done(req);
+}
+
+static ssize_t vfs_io_uring_pread_recv(struct tevent_req *req,
+				       struct vfs_aio_state *vfs_aio_state)
+{
+	struct vfs_io_uring_pread_state *state = tevent_req_data(
+		req, struct vfs_io_uring_pread_state);
+
+	if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+		return -1;
+	}
+
+	*vfs_aio_state = state->vfs_aio_state;
+	return state->ret;
+}
+
+struct vfs_io_uring_pwrite_state {
+	struct vfs_io_uring_request *ur;
+	ssize_t ret;
+	struct vfs_aio_state vfs_aio_state;
+	SMBPROFILE_BYTES_ASYNC_STATE(profile_bytes);
+};
+
+static void vfs_io_uring_pwrite_completion(struct vfs_io_uring_request *cur);
+
+static struct tevent_req *vfs_io_uring_pwrite_send(
+	struct vfs_handle_struct *handle,
+	TALLOC_CTX *mem_ctx,
+	struct tevent_context *ev,
+	struct files_struct *fsp,
+	const void *data,
+	size_t n, off_t offset)
+{
+	struct tevent_req *req = NULL;
+	struct vfs_io_uring_pwrite_state *state = NULL;
+
+	req = tevent_req_create(mem_ctx, &state,
+				struct vfs_io_uring_pwrite_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->ret = -1;
+
+	state->ur = vfs_io_uring_request_create(
+		handle, state, req, vfs_io_uring_pwrite_completion);
+	if (state->ur == NULL) {
+		tevent_req_error(req, errno);
+		return tevent_req_post(req, ev);
+	}
+
+	SMBPROFILE_BYTES_ASYNC_START(syscall_asys_pwrite, profile_p,
+				     state->profile_bytes, n);
+	SMBPROFILE_BYTES_ASYNC_SET_IDLE(state->profile_bytes);
+
+	state->ur->iov.iov_base = discard_const(data);
+	state->ur->iov.iov_len = n;
+	io_uring_prep_writev(&state->ur->sqe,
+			     fsp->fh->fd,
+			     &state->ur->iov, 1,
+			     offset);
+	vfs_io_uring_request_submit(state->ur);
+
+	return req;
+}
+
+static void vfs_io_uring_pwrite_completion(struct vfs_io_uring_request *cur)
+{
+	struct tevent_req *req = cur->req;
+	struct vfs_io_uring_pwrite_state *state = tevent_req_data(
+		req, struct vfs_io_uring_pwrite_state);
+
+	SMBPROFILE_BYTES_ASYNC_END(state->profile_bytes);
+
+	state->vfs_aio_state.duration = nsec_time_diff(&cur->end_time,
+						       &cur->start_time);
+
+	if (cur->cqe.res < 0) {
+		state->vfs_aio_state.error = -cur->cqe.res;
+		state->ret = -1;
+	} else {
+		state->ret = cur->cqe.res;
+	}
+
+	TALLOC_FREE(state->ur);
+	tevent_req_done(req);
+}
+
+static ssize_t vfs_io_uring_pwrite_recv(struct tevent_req *req,
+					struct vfs_aio_state *vfs_aio_state)
+{
+	struct vfs_io_uring_pwrite_state *state = tevent_req_data(
+		req, struct vfs_io_uring_pwrite_state);
+
+	if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+		return -1;
+	}
+
+	*vfs_aio_state = state->vfs_aio_state;
+	return state->ret;
+}
+
+struct vfs_io_uring_fsync_state {
+	struct vfs_io_uring_request *ur;
+	int ret;
+	struct vfs_aio_state vfs_aio_state;
+	SMBPROFILE_BASIC_ASYNC_STATE(profile_basic);
+};
+
+static void vfs_io_uring_fsync_completion(struct vfs_io_uring_request *cur);
+
+static struct tevent_req *vfs_io_uring_fsync_send(
+	struct vfs_handle_struct *handle,
+	TALLOC_CTX *mem_ctx,
+	struct tevent_context *ev,
+	struct files_struct *fsp)
+{
+	struct tevent_req *req = NULL;
+	struct vfs_io_uring_fsync_state *state = NULL;
+
+	req = tevent_req_create(mem_ctx, &state,
+				struct vfs_io_uring_fsync_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->ret = -1;
+
+	state->ur = vfs_io_uring_request_create(
+		handle, state, req, vfs_io_uring_fsync_completion);
+	if (state->ur == NULL) {
+		tevent_req_error(req, errno);
+		return tevent_req_post(req, ev);
+	}
+
+	SMBPROFILE_BASIC_ASYNC_START(syscall_asys_fsync, profile_p,
+				     state->profile_basic);
+
+	io_uring_prep_fsync(&state->ur->sqe, fsp->fh->fd, 0);
+	vfs_io_uring_request_submit(state->ur);
+
+	return req;
+}
+
+static void vfs_io_uring_fsync_completion(struct vfs_io_uring_request *cur)
+{
+	struct tevent_req *req = cur->req;
+	struct vfs_io_uring_fsync_state *state = tevent_req_data(
+		req, struct vfs_io_uring_fsync_state);
+
+	SMBPROFILE_BASIC_ASYNC_END(state->profile_basic);
+
+	state->vfs_aio_state.duration = nsec_time_diff(&cur->end_time,
+						       &cur->start_time);
+
+	if (cur->cqe.res < 0) {
+		state->vfs_aio_state.error = -cur->cqe.res;
+		state->ret = -1;
+	} else {
+		state->ret = 0;
+	}
+
+	TALLOC_FREE(state->ur);
+	tevent_req_done(req);
+}
+
+static int vfs_io_uring_fsync_recv(struct tevent_req *req,
+				   struct vfs_aio_state *vfs_aio_state)
+{
+	struct vfs_io_uring_fsync_state *state = tevent_req_data(
+		req, struct vfs_io_uring_fsync_state);
+
+	if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+		return -1;
+	}
+
+	*vfs_aio_state = state->vfs_aio_state;
+	return state->ret;
+}
+
+static struct vfs_fn_pointers vfs_io_uring_fns = {
+	.connect_fn = vfs_io_uring_connect,
+	.pread_send_fn = vfs_io_uring_pread_send,
+	.pread_recv_fn = vfs_io_uring_pread_recv,
+	.pwrite_send_fn = vfs_io_uring_pwrite_send,
+	.pwrite_recv_fn = vfs_io_uring_pwrite_recv,
+	.fsync_send_fn = vfs_io_uring_fsync_send,
+	.fsync_recv_fn = vfs_io_uring_fsync_recv,
+};
+
+static_decl_vfs;
+NTSTATUS vfs_io_uring_init(TALLOC_CTX *ctx)
+{
+	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION,
+				"io_uring", &vfs_io_uring_fns);
+}
@@ -18,6 +18,9 @@
 #include "includes.h"
 #include "system/filesys.h"
 #include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "lib/util/tevent_unix.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
 
 #if defined(HAVE_LINUX_READAHEAD) && ! defined(HAVE_READAHEAD_DECL)
 ssize_t readahead(int fd, off_t offset, size_t count);
@@ -27,6 +30,10 @@ struct readahead_data {
 	off_t off_bound;
 	off_t len;
 	bool didmsg;
+	bool adaptive;
+	size_t min_window;
+	size_t max_window;
+	unsigned outstanding;
 };
 
 /* 
@@ -35,6 +42,236 @@ struct readahead_data {
  * the buffer cache to be filled in advance.
  */
 
+/*
+ * With readahead:adaptive = yes we instead follow one sequential
+ * stream per open file. Clients with several read credits in flight
+ * send their reads slightly out of order, so a read counts as
+ * sequential if it starts within "outstanding" reads of the furthest
+ * read seen so far. The window ahead of the client doubles each time
+ * we extend it and is halved by random reads, down to not reading
+ * ahead at all.
+ */
+
+struct readahead_job;
+
+struct readahead_stream {
+	struct readahead_job *job;
+	off_t next_ofs;
+	off_t ra_start;
+	off_t ra_end;
+	size_t window;
+	unsigned seq_reads;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t random;
+};
+
+/*
+ * readahead(2) blocks until the I/O has been submitted, which can take
+ * a while. Do it in the smbd thread pool. The job has its own dup'ed
+ * descriptor, it might outlive the fsp.
+ */
+
+struct readahead_job {
+	struct readahead_stream *stream;
+	int fd;
+	off_t offset;
+	size_t len;
+	int ret;
+	int err;
+};
+
+static void readahead_job_do(void *private_data)
+{
+	struct readahead_job *job = talloc_get_type_abort(
+		private_data, struct readahead_job);
+
+#if defined(HAVE_LINUX_READAHEAD)
+	job->ret = readahead(job->fd, job->offset, job->len);
+	job->err = errno;
+#elif defined(HAVE_POSIX_FADVISE)
+	job->ret = posix_fadvise(job->fd, job->offset, (off_t)job->len,
+				 POSIX_FADV_WILLNEED);
+	job->err = job->ret;
+#else
+	job->ret = -1;
+	job->err = ENOSYS;
+#endif
+}
+
+static void readahead_job_done(struct tevent_req *subreq)
+{
+	struct readahead_job *job = tevent_req_callback_data(
+		subreq, struct readahead_job);
+	int ret;
+
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	if (ret != 0) {
+		DEBUG(1, ("readahead_job_done: pthreadpool_tevent_job "
+			  "failed: %s\n", strerror(ret)));
+	} else {
+		DEBUG(10, ("readahead_job_done: readahead on fd %d, "
+			   "offset %llu, len %zu returned %d (%s)\n",
+			   job->fd, (unsigned long long)job->offset,
+			   job->len, job->ret,
+			   job->ret == 0 ? "ok" : strerror(job->err)));
+	}
+
+	if (job->stream != NULL) {
+		job->stream->job = NULL;
+	}
+	close(job->fd);
+	TALLOC_FREE(job);
+}
+
+static bool readahead_issue(struct vfs_handle_struct *handle,
+			    files_struct *fsp,
+			    struct readahead_stream *stream,
+			    off_t offset,
+			    size_t len)
+{
+	struct smbd_server_connection *sconn = handle->conn->sconn;
+	struct readahead_job *job;
+	struct tevent_req *subreq;
+	int ret;
+
+	ret = smbd_init_pool(sconn);
+	if (ret != 0) {
+		DEBUG(1, ("readahead_issue: smbd_init_pool failed: %s\n",
+			  strerror(ret)));
+		return false;
+	}
+
+	job = talloc_zero(NULL, struct readahead_job);
+	if (job == NULL) {
+		return false;
+	}
+	job->stream = stream;
+	job->offset = offset;
+	job->len = len;
+
+	job->fd = dup(fsp->fh->fd);
+	if (job->fd == -1) {
+		DEBUG(10, ("readahead_issue: dup failed: %s\n",
+			   strerror(errno)));
+		TALLOC_FREE(job);
+		return false;
+	}
+
+	subreq = pthreadpool_tevent_job_send(job, sconn->ev_ctx, sconn->pool,
+					     readahead_job_do, job);
+	if (subreq == NULL) {
+		close(job->fd);
+		TALLOC_FREE(job);
+		return false;
+	}
+	tevent_req_set_callback(subreq, readahead_job_done, job);
+
+	stream->job = job;
+	DO_PROFILE_INC(readahead_issued);
+	return true;
+}
+
+static void readahead_stream_destroy(void *p_data)
+{
+	struct readahead_stream *stream = (struct readahead_stream *)p_data;
+
+	if (stream->job != NULL) {
+		stream->job->stream = NULL;
+	}
+}
+
+static void readahead_adaptive(struct vfs_handle_struct *handle,
+			       struct readahead_data *rhd,
+			       files_struct *fsp,
+			       off_t offset,
+			       size_t count)
+{
+	struct readahead_stream *stream;
+	off_t end = offset + count;
+	off_t slack = (off_t)count * rhd->outstanding;
+	off_t start;
+	size_t len;
+
+	if (count == 0) {
+		return;
+	}
+
+	stream = (struct readahead_stream *)VFS_FETCH_FSP_EXTENSION(
+		handle, fsp);
+	if (stream == NULL) {
+		stream = (struct readahead_stream *)VFS_ADD_FSP_EXTENSION(
+			handle, fsp, struct readahead_stream,
+			readahead_stream_destroy);
+		if (stream == NULL) {
+			return;
+		}
+	}
+
+	if ((offset + slack < stream->next_ofs) ||
+	    (offset > stream->next_ofs + slack)) {
+		stream->random += 1;
+		DO_PROFILE_INC(readahead_random);
+
+		stream->window /= 2;
+		if (stream->window < rhd->min_window) {
+			stream->window = 0;
+			stream->seq_reads = 0;
+		}
+		stream->next_ofs = end;
+		stream->ra_start = 0;
+		stream->ra_end = 0;
+		return;
+	}
+
+	stream->seq_reads += 1;
+	DO_PROFILE_INC(readahead_sequential);
+	stream->next_ofs = MAX(stream->next_ofs, end);
+
+	if (stream->window != 0) {
+		if ((offset >= stream->ra_start) && (end <= stream->ra_end)) {
+			stream->hits += 1;
+			DO_PROFILE_INC(readahead_hits);
+		} else {
+			stream->misses += 1;
+			DO_PROFILE_INC(readahead_misses);
+		}
+	} else {
+		if (stream->seq_reads < 2) {
+			return;
+		}
+		stream->window = rhd->min_window;
+	}
+
+	if (stream->ra_end - stream->next_ofs >= (off_t)stream->window / 2) {
+		/*
+		 * Still far enough ahead of the client
+		 */
+		return;
+	}
+	if (stream->job != NULL) {
+		/*
+		 * The next read will try again
+		 */
+		return;
+	}
+
+	start = MAX(stream->ra_end, stream->next_ofs);
+	len = stream->next_ofs + stream->window - start;
+
+	if (!readahead_issue(handle, fsp, stream, start, len)) {
+		return;
+	}
+
+	if (start > stream->ra_end) {
+		stream->ra_start = start;
+	}
+	stream->ra_end = start + len;
+	stream->window = MIN(stream->window * 2, rhd->max_window);
+}
+
 /*******************************************************************
  sendfile wrapper that does readahead/posix_fadvise.
 *******************************************************************/
@@ -48,7 +285,9 @@ static ssize_t readahead_sendfile(struct vfs_handle_struct *handle,
 {
 	struct readahead_data *rhd = (struct readahead_data *)handle->data;
 
-	if ( offset % rhd->off_bound == 0) {
+	if (rhd->adaptive) {
+		readahead_adaptive(handle, rhd, fromfsp, offset, count);
+	} else if ( offset % rhd->off_bound == 0) {
 #if defined(HAVE_LINUX_READAHEAD)
 		int err = readahead(fromfsp->fh->fd, offset, (size_t)rhd->len);
 		DEBUG(10,("readahead_sendfile: readahead on fd %u, offset %llu, len %u returned %d\n",
@@ -90,7 +329,9 @@ static ssize_t readahead_pread(vfs_handle_struct *handle,
 {
 	struct readahead_data *rhd = (struct readahead_data *)handle->data;
 
-	if ( offset % rhd->off_bound == 0) {
+	if (rhd->adaptive) {
+		readahead_adaptive(handle, rhd, fsp, offset, count);
+	} else if ( offset % rhd->off_bound == 0) {
 #if defined(HAVE_LINUX_READAHEAD)
 		int err = readahead(fsp->fh->fd, offset, (size_t)rhd->len);
 		DEBUG(10,("readahead_pread: readahead on fd %u, offset %llu, len %u returned %d\n",
@@ -115,6 +356,100 @@ static ssize_t readahead_pread(vfs_handle_struct *handle,
         return SMB_VFS_NEXT_PREAD(handle, fsp, data, count, offset);
 }
 
+/*******************************************************************
+ Async pread wrapper. Without readahead:adaptive it only passes the
+ request through to the next module.
+*******************************************************************/
+
+struct readahead_pread_state {
+	bool passthrough;
+	struct tevent_req *subreq;
+	ssize_t ret;
+	struct vfs_aio_state vfs_aio_state;
+};
+
+static void readahead_pread_done(struct tevent_req *subreq);
+
+static struct tevent_req *readahead_pread_send(
+	struct vfs_handle_struct *handle,
+	TALLOC_CTX *mem_ctx,
+	struct tevent_context *ev,
+	struct files_struct *fsp,
+	void *data,
+	size_t n,
+	off_t offset)
+{
+	struct readahead_data *rhd = (struct readahead_data *)handle->data;
+	struct tevent_req *req;
+	struct readahead_pread_state *state;
+
+	req = tevent_req_create(mem_ctx, &state,
+				struct readahead_pread_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->passthrough = !rhd->adaptive;
+
+	if (!state->passthrough) {
+		readahead_adaptive(handle, rhd, fsp, offset, n);
+	}
+
+	state->subreq = SMB_VFS_NEXT_PREAD_SEND(state, ev, handle, fsp, data,
+						n, offset);
+	if (tevent_req_nomem(state->subreq, req)) {
+		return tevent_req_post(req, ev);
+	}
+	tevent_req_set_callback(state->subreq, readahead_pread_done, req);
+	return req;
+}
+
+static void readahead_pread_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct readahead_pread_state *state = tevent_req_data(
+		req, struct readahead_pread_state);
+
+	state->ret = SMB_VFS_PREAD_RECV(subreq, &state->vfs_aio_state);
+	TALLOC_FREE(state->subreq);
+	tevent_req_done(req);
+}
+
+static ssize_t readahead_pread_recv(struct tevent_req *req,
+				    struct vfs_aio_state *vfs_aio_state)
+{
+	struct readahead_pread_state *state = tevent_req_data(
+		req, struct readahead_pread_state);
+
+	if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+		return -1;
+	}
+	*vfs_aio_state = state->vfs_aio_state;
+	return state->ret;
+}
+
+/*******************************************************************
+ Report the per file statistics of readahead:adaptive.
+*******************************************************************/
+
+static int readahead_close(vfs_handle_struct *handle, files_struct *fsp)
+{
+	struct readahead_stream *stream;
+
+	stream = (struct readahead_stream *)VFS_FETCH_FSP_EXTENSION(
+		handle, fsp);
+	if (stream != NULL) {
+		DEBUG(10, ("readahead_close: %s: %llu hits, %llu misses, "
+			   "%llu random reads, window %zu\n",
+			   fsp_str_dbg(fsp),
+			   (unsigned long long)stream->hits,
+			   (unsigned long long)stream->misses,
+			   (unsigned long long)stream->random,
+			   stream->window));
+	}
+	return SMB_VFS_NEXT_CLOSE(handle, fsp);
+}
+
 /*******************************************************************
  Directly called from main smbd when freeing handle.
 *******************************************************************/
@@ -163,6 +498,31 @@ static int readahead_connect(struct vfs_handle_struct *handle,
 		rhd->len = rhd->off_bound;
 	}
 
+	rhd->adaptive = lp_parm_bool(SNUM(handle->conn),
+				     "readahead",
+				     "adaptive",
+				     false);
+	rhd->min_window = conv_str_size(lp_parm_const_string(
+						SNUM(handle->conn),
+						"readahead",
+						"min window",
+						NULL));
+	if (rhd->min_window == 0) {
+		rhd->min_window = 0x20000;
+	}
+	rhd->max_window = conv_str_size(lp_parm_const_string(
+						SNUM(handle->conn),
+						"readahead",
+						"max window",
+						NULL));
+	if (rhd->max_window < rhd->min_window) {
+		rhd->max_window = MAX(0x400000, rhd->min_window);
+	}
+	rhd->outstanding = MAX(lp_parm_int(SNUM(handle->conn),
+					   "readahead",
+					   "outstanding",
+					   8), 1);
+
 	handle->data = (void *)rhd;
 	handle->free_data = free_readahead_data;
 	return 0;
@@ -171,6 +531,9 @@ static int readahead_connect(struct vfs_handle_struct *handle,
 static struct vfs_fn_pointers vfs_readahead_fns = {
 	.sendfile_fn = readahead_sendfile,
 	.pread_fn = readahead_pread,
+	.pread_send_fn = readahead_pread_send,
+	.pread_recv_fn = readahead_pread_recv,
+	.close_fn = readahead_close,
 	.connect_fn = readahead_connect
 };
 
@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Blackbox test for "smbd:prefork children". A connection has to be
+# served by a child that was forked before it came in, and the parent
+# has to refill the pool when a spare goes away.
+#
+
+if [ $# -lt 6 ]; then
+cat <<EOF
+Usage: test_smbd_prefork.sh SERVER USERNAME PASSWORD PIDDIR SMBCLIENT SMBSTATUS <configuration>
+EOF
+exit 1;
+fi
+
+SERVER=$1
+USERNAME=$2
+PASSWORD=$3
+PIDDIR=$4
+SMBCLIENT="$VALGRIND $5"
+SMBSTATUS="$VALGRIND $6"
+shift 6
+ADDARGS="$*"
+failed=0
+
+incdir=`dirname $0`/../../../testprogs/blackbox
+. $incdir/subunit.sh
+
+smbd_pid=`cat $PIDDIR/smbd.pid`
+
+smbd_children() {
+	ps -eo pid=,ppid= | awk -v ppid=$smbd_pid '$2 == ppid { print $1 }'
+}
+
+# Print the pids in the second list that are not in the first one
+new_children() {
+	for pid in $2; do
+		case " `echo $1` " in
+		*" $pid "*)
+			;;
+		*)
+			echo $pid
+			;;
+		esac
+	done
+}
+
+# Wait for the pool to be filled after smbd came up or changed
+wait_for_new_children() {
+	before="$1"
+	i=0
+	while [ $i -lt 20 ]; do
+		new=`new_children "$before" "\`smbd_children\`"`
+		if [ -n "$new" ]; then
+			echo $new
+			return 0
+		fi
+		sleep 0.5
+		i=`expr $i + 1`
+	done
+	return 1
+}
+
+# Give the spares time to report back to the parent
+sleep 2
+
+name="smbd_prefork spare serves connection"
+subunit_start_test "$name"
+spares=`smbd_children`
+(sleep 5; echo quit) | $SMBCLIENT //$SERVER/tmp -U$USERNAME%$PASSWORD -mSMB3 $ADDARGS >/dev/null 2>&1 &
+client=$!
+
+served=""
+i=0
+while [ -z "$served" -a $i -lt 20 ]; do
+	sleep 0.5
+	served=`$SMBSTATUS -p $ADDARGS 2>/dev/null | awk '$1 ~ /^[0-9]+$/ { print $1; exit }'`
+	i=`expr $i + 1`
+done
+
+case " `echo $spares` " in
+*" $served "*)
+	subunit_pass_test "$name"
+	;;
+*)
+	echo "connection served by '$served', spares were: `echo $spares`" |
+		subunit_fail_test "$name"
+	failed=`expr $failed + 1`
+	;;
+esac
+
+name="smbd_prefork pool refilled after connection"
+subunit_start_test "$name"
+# The child serving the connection is not a spare
+refill=`wait_for_new_children "$spares $served"`
+if [ -n "$refill" ]; then
+	subunit_pass_test "$name"
+else
+	echo "no new spare after the connection" | subunit_fail_test "$name"
+	failed=`expr $failed + 1`
+fi
+
+kill $client 2>/dev/null
+wait $client 2>/dev/null
+
+name="smbd_prefork pool refilled after child exit"
+subunit_start_test "$name"
+if [ -n "$refill" ]; then
+	before=`smbd_children`
+	kill $refill
+	new=`wait_for_new_children "$before"`
+	if [ -n "$new" ]; then
+		subunit_pass_test "$name"
+	else
+		echo "no new spare after killing $refill" |
+			subunit_fail_test "$name"
+		failed=`expr $failed + 1`
+	fi
+else
+	echo "no spare to kill" | subunit_fail_test "$name"
+	failed=`expr $failed + 1`
+fi
+
+exit $failed
@@ -421,6 +421,451 @@ static ssize_t pwrite_fsync_recv(struct tevent_req *req, int *perr)
 	return state->nwritten;
 }
 
+/*
+ * SMB2 write gathering
+ *
+ * Applications appending to a file in small chunks produce a stream
+ * of adjacent SMB2 WRITEs, each of which becomes a separate pwrite in
+ * the threadpool. With "smbd:write gather size" set, small writes to
+ * an fsp that come in while another write to it is in flight are
+ * queued. When a write finishes, queued writes that continue each
+ * other are merged into one pwrite of up to "smbd:write gather size"
+ * bytes.
+ *
+ * A write is only acknowledged after the data has hit the file, so
+ * oplock and lease breaks and durable reconnects never see data the
+ * client believes to be written. Write-through requests are not
+ * delayed.
+ *
+ * Queued writes are sent in the order they came in. A write that
+ * overlaps one in flight waits for it to finish. If a merged pwrite
+ * comes back short, the members it did not cover completely are
+ * written again one by one, so that each of them gets its own byte
+ * count or error.
+ */
+
+struct aio_write_gather {
+	struct tevent_context *ev;
+	files_struct *fsp;
+	size_t max_size;
+	struct pwrite_gather_batch *in_flight;
+	struct pwrite_gather_state *queue;
+	struct tevent_immediate *im;
+};
+
+struct pwrite_gather_batch {
+	struct pwrite_gather_batch *prev, *next;
+	struct aio_write_gather *g;
+	struct pwrite_gather_state **members;
+	size_t num_members;
+	off_t offset;
+	size_t len;
+	uint8_t *buf;
+};
+
+struct pwrite_gather_state {
+	struct pwrite_gather_state *prev, *next;
+	struct tevent_req *req;
+	struct aio_write_gather *g;
+	struct pwrite_gather_batch *batch;
+	size_t batch_idx;
+	bool queued;
+	bool no_merge;
+	const uint8_t *data;
+	size_t n;
+	off_t offset;
+	ssize_t nwritten;
+};
+
+static void pwrite_gather_done(struct tevent_req *subreq);
+static void pwrite_gather_batch_done(struct tevent_req *subreq);
+static bool pwrite_gather_dispatch(struct aio_write_gather *g,
+				   struct pwrite_gather_state **members,
+				   size_t num_members);
+
+static int pwrite_gather_state_destructor(struct pwrite_gather_state *state)
+{
+	struct pwrite_gather_batch *batch = state->batch;
+
+	if (state->queued) {
+		DLIST_REMOVE(state->g->queue, state);
+		state->queued = false;
+	}
+
+	if (batch != NULL) {
+		batch->members[state->batch_idx] = NULL;
+		if (batch->buf == NULL) {
+			/*
+			 * The pwrite uses our buffer
+			 */
+			TALLOC_FREE(batch);
+		}
+	}
+
+	return 0;
+}
+
+static void pwrite_gather_flush_handler(struct tevent_context *ev,
+					struct tevent_immediate *im,
+					void *private_data);
+
+static int pwrite_gather_batch_destructor(struct pwrite_gather_batch *batch)
+{
+	struct aio_write_gather *g = batch->g;
+	size_t i;
+
+	for (i=0; i<batch->num_members; i++) {
+		if (batch->members[i] != NULL) {
+			batch->members[i]->batch = NULL;
+		}
+	}
+
+	DLIST_REMOVE(g->in_flight, batch);
+
+	if (g->queue != NULL) {
+		tevent_schedule_immediate(g->im, g->ev,
+					  pwrite_gather_flush_handler, g);
+	}
+	return 0;
+}
+
+static struct aio_write_gather *aio_write_gather_get(files_struct *fsp,
+						     struct tevent_context *ev)
+{
+	struct aio_write_gather *g = fsp->write_gather;
+	unsigned long max_size;
+
+	if (g != NULL) {
+		return g;
+	}
+
+	max_size = lp_parm_ulong(SNUM(fsp->conn), "smbd", "write gather size",
+				 0);
+	if (max_size == 0) {
+		return NULL;
+	}
+
+	g = talloc_zero(fsp, struct aio_write_gather);
+	if (g == NULL) {
+		return NULL;
+	}
+	g->im = tevent_create_immediate(g);
+	if (g->im == NULL) {
+		TALLOC_FREE(g);
+		return NULL;
+	}
+	g->ev = ev;
+	g->fsp = fsp;
+	g->max_size = max_size;
+
+	fsp->write_gather = g;
+	return g;
+}
+
+static struct tevent_req *pwrite_gather_send(TALLOC_CTX *mem_ctx,
+					     struct tevent_context *ev,
+					     struct files_struct *fsp,
+					     const void *data,
+					     size_t n, off_t offset,
+					     bool write_through)
+{
+	struct tevent_req *req, *subreq;
+	struct pwrite_gather_state *state;
+	struct aio_write_gather *g = NULL;
+
+	req = tevent_req_create(mem_ctx, &state, struct pwrite_gather_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->req = req;
+	state->data = (const uint8_t *)data;
+	state->n = n;
+	state->offset = offset;
+
+	if (!write_through) {
+		g = aio_write_gather_get(fsp, ev);
+	}
+
+	if ((g == NULL) || (n >= g->max_size)) {
+		subreq = pwrite_fsync_send(state, ev, fsp, data, n, offset,
+					   write_through);
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_set_callback(subreq, pwrite_gather_done, req);
+		return req;
+	}
+
+	state->g = g;
+	talloc_set_destructor(state, pwrite_gather_state_destructor);
+
+	DO_PROFILE_INC(write_gather_writes);
+
+	if ((g->in_flight == NULL) && (g->queue == NULL)) {
+		if (!pwrite_gather_dispatch(g, &state, 1)) {
+			tevent_req_oom(req);
+			return tevent_req_post(req, ev);
+		}
+		return req;
+	}
+
+	DO_PROFILE_INC(write_gather_queued);
+
+	DLIST_ADD_END(g->queue, state);
+	state->queued = true;
+
+	return req;
+}
+
+static void pwrite_gather_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct pwrite_gather_state *state = tevent_req_data(
+		req, struct pwrite_gather_state);
+	int err;
+
+	state->nwritten = pwrite_fsync_recv(subreq, &err);
+	TALLOC_FREE(subreq);
+	if (state->nwritten == -1) {
+		tevent_req_error(req, err);
+		return;
+	}
+	tevent_req_done(req);
+}
+
+/*
+ * Send one pwrite for writes that continue each other. With more
+ * than one member we have to copy, the members' buffers belong to
+ * separate SMB2 requests.
+ */
+static bool pwrite_gather_dispatch(struct aio_write_gather *g,
+				   struct pwrite_gather_state **members,
+				   size_t num_members)
+{
+	struct pwrite_gather_batch *batch;
+	struct tevent_req *subreq;
+	const uint8_t *data;
+	size_t i, len = 0;
+
+	batch = talloc_zero(g, struct pwrite_gather_batch);
+	if (batch == NULL) {
+		return false;
+	}
+	batch->g = g;
+	batch->members = talloc_memdup(
+		batch, members, sizeof(*members) * num_members);
+	if (batch->members == NULL) {
+		TALLOC_FREE(batch);
+		return false;
+	}
+	batch->num_members = num_members;
+
+	for (i=0; i<num_members; i++) {
+		len += members[i]->n;
+	}
+	batch->offset = members[0]->offset;
+	batch->len = len;
+
+	if (num_members == 1) {
+		data = members[0]->data;
+	} else {
+		uint8_t *p;
+
+		batch->buf = talloc_array(batch, uint8_t, len);
+		if (batch->buf == NULL) {
+			TALLOC_FREE(batch);
+			return false;
+		}
+		p = batch->buf;
+		for (i=0; i<num_members; i++) {
+			memcpy(p, members[i]->data, members[i]->n);
+			p += members[i]->n;
+		}
+		data = batch->buf;
+
+		DO_PROFILE_INC(write_gather_merged_pwrites);
+	}
+
+	subreq = pwrite_fsync_send(batch, g->ev, g->fsp, data, len,
+				   members[0]->offset, false);
+	if (subreq == NULL) {
+		TALLOC_FREE(batch);
+		return false;
+	}
+	tevent_req_set_callback(subreq, pwrite_gather_batch_done, batch);
+
+	for (i=0; i<num_members; i++) {
+		members[i]->batch = batch;
+		members[i]->batch_idx = i;
+	}
+
+	DLIST_ADD_END(g->in_flight, batch);
+	talloc_set_destructor(batch, pwrite_gather_batch_destructor);
+
+	DEBUG(10, ("smb2: gathered %u writes for file %s, offset %.0f, "
+		   "len = %u\n", (unsigned)num_members, fsp_str_dbg(g->fsp),
+		   (double)members[0]->offset, (unsigned)len));
+
+	DO_PROFILE_INC(write_gather_pwrites);
+
+	return true;
+}
+
+static bool pwrite_gather_overlaps_in_flight(struct aio_write_gather *g,
+					     struct pwrite_gather_state *state)
+{
+	struct pwrite_gather_batch *batch;
+
+	for (batch = g->in_flight; batch != NULL; batch = batch->next) {
+		if ((state->offset < batch->offset + (off_t)batch->len) &&
+		    (batch->offset < state->offset + (off_t)state->n)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Dispatch queued writes in order, merging runs of adjacent ones. Stop
+ * at the first one that has to wait for a write in flight.
+ */
+static void pwrite_gather_flush(struct aio_write_gather *g)
+{
+	while (g->queue != NULL) {
+		struct pwrite_gather_state *members[64];
+		size_t num_members = 0;
+		size_t len = 0;
+		off_t end;
+		size_t i;
+
+		if (pwrite_gather_overlaps_in_flight(g, g->queue)) {
+			break;
+		}
+
+		members[num_members++] = g->queue;
+		len = g->queue->n;
+		end = g->queue->offset + g->queue->n;
+
+		while ((num_members < ARRAY_SIZE(members)) &&
+		       !members[0]->no_merge &&
+		       (members[num_members-1]->next != NULL)) {
+			struct pwrite_gather_state *next =
+				members[num_members-1]->next;
+
+			if ((next->offset != end) ||
+			    (len + next->n > g->max_size) ||
+			    next->no_merge ||
+			    pwrite_gather_overlaps_in_flight(g, next)) {
+				break;
+			}
+			members[num_members++] = next;
+			len += next->n;
+			end += next->n;
+		}
+
+		for (i=0; i<num_members; i++) {
+			DLIST_REMOVE(g->queue, members[i]);
+			members[i]->queued = false;
+		}
+
+		if (!pwrite_gather_dispatch(g, members, num_members)) {
+			for (i=0; i<num_members; i++) {
+				tevent_req_defer_callback(members[i]->req,
+							  g->ev);
+				tevent_req_oom(members[i]->req);
+			}
+		}
+	}
+}
+
+static void pwrite_gather_flush_handler(struct tevent_context *ev,
+					struct tevent_immediate *im,
+					void *private_data)
+{
+	struct aio_write_gather *g = talloc_get_type_abort(
+		private_data, struct aio_write_gather);
+
+	pwrite_gather_flush(g);
+}
+
+static void pwrite_gather_batch_done(struct tevent_req *subreq)
+{
+	struct pwrite_gather_batch *batch = tevent_req_callback_data(
+		subreq, struct pwrite_gather_batch);
+	struct aio_write_gather *g = batch->g;
+	struct pwrite_gather_state *retry = NULL;
+	ssize_t nwritten;
+	off_t end = 0;
+	size_t i;
+	int err;
+
+	nwritten = pwrite_fsync_recv(subreq, &err);
+	TALLOC_FREE(subreq);
+
+	if (nwritten != -1) {
+		end = batch->offset + nwritten;
+	}
+
+	/*
+	 * Completing a request might close the file and free
+	 * us. Defer the callbacks until we're done with the batch.
+	 */
+
+	for (i=0; i<batch->num_members; i++) {
+		struct pwrite_gather_state *state = batch->members[i];
+
+		if (state == NULL) {
+			continue;
+		}
+		state->batch = NULL;
+		batch->members[i] = NULL;
+
+		if ((nwritten != -1) && (batch->num_members > 1) &&
+		    (state->offset + (off_t)state->n > end)) {
+			/*
+			 * Not completely covered by a short merged
+			 * write. Write it again on its own, ahead of
+			 * everything that came in later.
+			 */
+			state->no_merge = true;
+			state->queued = true;
+			if (retry == NULL) {
+				DLIST_ADD(g->queue, state);
+			} else {
+				DLIST_ADD_AFTER(g->queue, state, retry);
+			}
+			retry = state;
+			continue;
+		}
+
+		tevent_req_defer_callback(state->req, g->ev);
+
+		if (nwritten == -1) {
+			tevent_req_error(state->req, err);
+			continue;
+		}
+
+		state->nwritten = MIN((size_t)nwritten, state->n);
+		tevent_req_done(state->req);
+	}
+
+	TALLOC_FREE(batch);
+
+	pwrite_gather_flush(g);
+}
+
+static ssize_t pwrite_gather_recv(struct tevent_req *req, int *perr)
+{
+	struct pwrite_gather_state *state = tevent_req_data(
+		req, struct pwrite_gather_state);
+
+	if (tevent_req_is_unix_error(req, perr)) {
+		return -1;
+	}
+	return state->nwritten;
+}
+
 static void aio_pwrite_smb1_done(struct tevent_req *req);
 
 /****************************************************************************
@@ -666,30 +1111,25 @@ bool cancel_smb2_aio(struct smb_request *smbreq)
 static void aio_pread_smb2_done(struct tevent_req *req);
 
 /****************************************************************************
- Set up an aio request from a SMB2 read call.
+ Would schedule_smb2_aio_read() try a read of smb_maxcnt bytes? Lets the
+ caller skip allocating the buffer if not.
 *****************************************************************************/
 
-NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
-				struct smb_request *smbreq,
-				files_struct *fsp,
-				TALLOC_CTX *ctx,
-				DATA_BLOB *preadbuf,
-				off_t startpos,
-				size_t smb_maxcnt)
+bool smb2_aio_read_possible(connection_struct *conn,
+			    files_struct *fsp,
+			    size_t smb_maxcnt)
 {
-	struct aio_extra *aio_ex;
 	size_t min_aio_read_size = lp_aio_read_size(SNUM(conn));
-	struct tevent_req *req;
 
 	if (fsp->base_fsp != NULL) {
 		/* No AIO on streams yet */
 		DEBUG(10, ("AIO on streams not yet supported\n"));
-		return NT_STATUS_RETRY;
+		return false;
 	}
 
 	if (fsp->op == NULL) {
 		/* No AIO on internal opens. */
-		return NT_STATUS_RETRY;
+		return false;
 	}
 
 	if ((!min_aio_read_size || (smb_maxcnt < min_aio_read_size))
@@ -699,18 +1139,34 @@ NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 			"for minimum aio_read of %u\n",
 			(unsigned int)smb_maxcnt,
 			(unsigned int)min_aio_read_size ));
-		return NT_STATUS_RETRY;
+		return false;
 	}
 
 	/* Only do this on reads not using the write cache. */
 	if (lp_write_cache_size(SNUM(conn)) != 0) {
-		return NT_STATUS_RETRY;
+		return false;
 	}
 
-	/* Create the out buffer. */
-	*preadbuf = data_blob_talloc(ctx, NULL, smb_maxcnt);
-	if (preadbuf->data == NULL) {
-		return NT_STATUS_NO_MEMORY;
+	return true;
+}
+
+/****************************************************************************
+ Set up an aio request from a SMB2 read call. The caller provides the
+ buffer of smb_maxcnt bytes the data is read into.
+*****************************************************************************/
+
+NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
+				struct smb_request *smbreq,
+				files_struct *fsp,
+				uint8_t *preadbuf,
+				off_t startpos,
+				size_t smb_maxcnt)
+{
+	struct aio_extra *aio_ex;
+	struct tevent_req *req;
+
+	if (!smb2_aio_read_possible(conn, fsp, smb_maxcnt)) {
+		return NT_STATUS_RETRY;
 	}
 
 	if (!(aio_ex = create_aio_extra(smbreq->smb2req, fsp, 0))) {
@@ -731,7 +1187,7 @@ NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 	aio_ex->offset = startpos;
 
 	req = SMB_VFS_PREAD_SEND(aio_ex, fsp->conn->sconn->ev_ctx, fsp,
-				 preadbuf->data, smb_maxcnt, startpos);
+				 preadbuf, smb_maxcnt, startpos);
 	if (req == NULL) {
 		DEBUG(0, ("smb2: SMB_VFS_PREAD_SEND failed. "
 			  "Error %s\n", strerror(errno)));
@@ -880,9 +1336,9 @@ NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
 	aio_ex->nbyte = in_data.length;
 	aio_ex->offset = in_offset;
 
-	req = pwrite_fsync_send(aio_ex, fsp->conn->sconn->ev_ctx, fsp,
-				in_data.data, in_data.length, in_offset,
-				write_through);
+	req = pwrite_gather_send(aio_ex, fsp->conn->sconn->ev_ctx, fsp,
+				 in_data.data, in_data.length, in_offset,
+				 write_through);
 	if (req == NULL) {
 		DEBUG(3, ("smb2: SMB_VFS_PWRITE_SEND failed. "
 			  "Error %s\n", strerror(errno)));
@@ -937,7 +1393,7 @@ static void aio_pwrite_smb2_done(struct tevent_req *req)
 	ssize_t nwritten;
 	int err = 0;
 
-	nwritten = pwrite_fsync_recv(req, &err);
+	nwritten = pwrite_gather_recv(req, &err);
 	TALLOC_FREE(req);
 
 	DEBUG(10, ("pwrite_recv returned %d, err = %s\n", (int)nwritten,
@@ -26,6 +26,8 @@
 #include "lib/util/bitmap.h"
 #include "../lib/util/memcache.h"
 #include "../librpc/gen_ndr/open_files.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+#include "lib/util/tevent_unix.h"
 
 /*
    This module implements directory related functions for Samba.
@@ -76,6 +78,9 @@ struct dptr_struct {
 	bool priv;     /* Directory handle opened with privilege. */
 	uint32_t counter;
 	struct memcache *dptr_cache;
+	bool dircache_looked_up;
+	uint64_t dircache_generation;
+	struct smbd_dircache_dir *dircache;
 };
 
 static struct smb_Dir *OpenDir_fsp(TALLOC_CTX *mem_ctx, connection_struct *conn,
@@ -893,6 +898,311 @@ void dptr_init_search_op(struct dptr_struct *dptr)
 	SMB_VFS_INIT_SEARCH_OP(dptr->conn, dptr->dir_hnd->dir);
 }
 
+/****************************************************************************
+ Return the directory entry cache for this search, NULL if not enabled.
+
+ This is called for every entry returned. The lookup is done once per
+ dptr, we only redo it when a cached directory was freed in between, as
+ that might have been ours.
+****************************************************************************/
+
+struct smbd_dircache_dir *dptr_dircache(struct dptr_struct *dptr)
+{
+	struct smbd_server_connection *sconn = dptr->conn->sconn;
+
+	if (dptr->dircache_looked_up &&
+	    (dptr->dircache_generation == sconn->dircache.generation)) {
+		return dptr->dircache;
+	}
+
+	dptr->dircache = smbd_dircache_get(dptr->conn, dptr->smb_dname);
+	dptr->dircache_generation = sconn->dircache.generation;
+	dptr->dircache_looked_up = true;
+
+	return dptr->dircache;
+}
+
+/****************************************************************************
+ Warm up the inode and xattr caches for the next entries of a search.
+
+ smbd_dirptr_get_entry() stats every entry and reads its DOS
+ attributes one after the other. On network and cluster file systems
+ each of those is a round trip, so we look ahead at the next names
+ and let the worker threads stat them in parallel. The workers can't
+ go through the VFS, so this is only done for shares without any VFS
+ module on top of vfs_default, and they run with the credentials of
+ the current user. The results are thrown away, the real calls still
+ happen on the main thread, but they will hit the caches.
+****************************************************************************/
+
+#define DPTR_PREFETCH_PER_JOB 16
+
+struct dptr_prefetch_state;
+
+struct dptr_prefetch_job {
+	struct dptr_prefetch_job *prev, *next;
+	struct dptr_prefetch_state *state;
+	struct security_unix_token *utok;
+	char **paths;
+	size_t num_paths;
+	bool read_dosattrib;
+};
+
+struct dptr_prefetch_state {
+	struct tevent_req *req;
+	struct dptr_prefetch_job *jobs;
+};
+
+static bool dptr_prefetch_possible(connection_struct *conn)
+{
+#ifdef USE_LINUX_THREAD_CREDENTIALS
+	/*
+	 * vfs_default is always loaded first, anything else is on
+	 * top of it.
+	 */
+	return ((conn->vfs_handles != NULL) &&
+		(conn->vfs_handles->next == NULL));
+#else
+	/* The workers must not stat as root */
+	return false;
+#endif
+}
+
+static int dptr_prefetch_state_destructor(struct dptr_prefetch_state *state)
+{
+	struct dptr_prefetch_job *job, *next;
+
+	/*
+	 * The jobs still in flight clean up after themselves once
+	 * the worker is done, see dptr_prefetch_done().
+	 */
+	for (job = state->jobs; job != NULL; job = next) {
+		next = job->next;
+		DLIST_REMOVE(state->jobs, job);
+		job->state = NULL;
+	}
+	return 0;
+}
+
+static void dptr_prefetch_do(void *private_data);
+static void dptr_prefetch_done(struct tevent_req *subreq);
+
+static bool dptr_prefetch_job_send(struct tevent_context *ev,
+				   struct pthreadpool_tevent *pool,
+				   struct dptr_prefetch_state *state,
+				   struct dptr_prefetch_job *job)
+{
+	struct tevent_req *subreq;
+
+	/*
+	 * The job is not a child of the request: a worker might
+	 * still use it when the request goes away. It is freed in
+	 * dptr_prefetch_done() only, and takes the subreq with it.
+	 */
+	subreq = pthreadpool_tevent_job_send(job, ev, pool,
+					     dptr_prefetch_do, job);
+	if (subreq == NULL) {
+		TALLOC_FREE(job);
+		return false;
+	}
+	tevent_req_set_callback(subreq, dptr_prefetch_done, job);
+
+	job->state = state;
+	DLIST_ADD(state->jobs, job);
+	return true;
+}
+
+struct tevent_req *dptr_prefetch_send(TALLOC_CTX *mem_ctx,
+				      struct tevent_context *ev,
+				      struct dptr_struct *dptr,
+				      size_t max_entries)
+{
+	connection_struct *conn = dptr->conn;
+	struct smbd_server_connection *sconn = conn->sconn;
+	struct smb_Dir *dir_hnd = dptr->dir_hnd;
+	struct tevent_req *req;
+	struct dptr_prefetch_state *state;
+	struct dptr_prefetch_job *job = NULL;
+	bool read_dosattrib = lp_store_dos_attributes(SNUM(conn));
+	long saved_offset = dir_hnd->offset;
+	unsigned int saved_file_number = dir_hnd->file_number;
+	long offset = saved_offset;
+	char *dirpath;
+	size_t num_entries = 0;
+	size_t num_jobs = 0;
+	int ret;
+
+	req = tevent_req_create(mem_ctx, &state, struct dptr_prefetch_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->req = req;
+	talloc_set_destructor(state, dptr_prefetch_state_destructor);
+
+	if (!dptr->has_wild || (max_entries == 0) ||
+	    !dptr_prefetch_possible(conn)) {
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	ret = smbd_init_pool(sconn);
+	if (tevent_req_error(req, ret)) {
+		return tevent_req_post(req, ev);
+	}
+
+	if (ISDOT(dptr->smb_dname->base_name)) {
+		dirpath = talloc_strdup(state, conn->connectpath);
+	} else {
+		dirpath = talloc_asprintf(state, "%s/%s",
+					  conn->connectpath,
+					  dptr->smb_dname->base_name);
+	}
+	if (tevent_req_nomem(dirpath, req)) {
+		return tevent_req_post(req, ev);
+	}
+
+	while (num_entries < max_entries) {
+		SMB_STRUCT_STAT st;
+		char *talloced = NULL;
+		const char *dname;
+		char *path;
+
+		dname = ReadDirName(dir_hnd, &offset, &st, &talloced);
+		if (dname == NULL) {
+			break;
+		}
+		if (ISDOT(dname) || ISDOTDOT(dname)) {
+			TALLOC_FREE(talloced);
+			continue;
+		}
+
+		if (job == NULL) {
+			job = talloc_zero(NULL, struct dptr_prefetch_job);
+			if (job == NULL) {
+				TALLOC_FREE(talloced);
+				break;
+			}
+			job->utok = copy_unix_token(job,
+						    get_current_utok(conn));
+			job->paths = talloc_array(job, char *,
+						  DPTR_PREFETCH_PER_JOB);
+			if ((job->utok == NULL) || (job->paths == NULL)) {
+				TALLOC_FREE(talloced);
+				break;
+			}
+			job->read_dosattrib = read_dosattrib;
+		}
+
+		path = talloc_asprintf(job->paths, "%s/%s", dirpath, dname);
+		TALLOC_FREE(talloced);
+		if (path == NULL) {
+			break;
+		}
+		job->paths[job->num_paths++] = path;
+		num_entries += 1;
+
+		if (job->num_paths == DPTR_PREFETCH_PER_JOB) {
+			bool ok = dptr_prefetch_job_send(ev, sconn->pool,
+							 state, job);
+			job = NULL;
+			if (!ok) {
+				break;
+			}
+			num_jobs += 1;
+		}
+	}
+
+	if ((job != NULL) && (job->num_paths > 0)) {
+		if (dptr_prefetch_job_send(ev, sconn->pool, state, job)) {
+			num_jobs += 1;
+		}
+	} else {
+		TALLOC_FREE(job);
+	}
+
+	/*
+	 * Put the directory back to where the search left it, the
+	 * entries will be read again by smbd_dirptr_get_entry().
+	 */
+	SeekDir(dir_hnd, saved_offset);
+	dir_hnd->file_number = saved_file_number;
+
+	DBG_DEBUG("%s: prefetching %zu entries in %zu jobs\n", dirpath,
+		  num_entries, num_jobs);
+
+	if (state->jobs == NULL) {
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	return req;
+}
+
+static void dptr_prefetch_do(void *private_data)
+{
+	struct dptr_prefetch_job *job = talloc_get_type_abort(
+		private_data, struct dptr_prefetch_job);
+	size_t i;
+	int ret;
+
+#ifdef USE_LINUX_THREAD_CREDENTIALS
+	ret = set_thread_credentials(job->utok->uid,
+				     job->utok->gid,
+				     (size_t)job->utok->ngroups,
+				     job->utok->groups);
+	if (ret != 0) {
+		return;
+	}
+#else
+	return;
+#endif
+
+	for (i=0; i<job->num_paths; i++) {
+		struct stat st;
+		char buf[256];
+
+		ret = stat(job->paths[i], &st);
+		if (ret != 0) {
+			continue;
+		}
+		if (job->read_dosattrib) {
+			(void)getxattr(job->paths[i], SAMBA_XATTR_DOS_ATTRIB,
+				       buf, sizeof(buf));
+		}
+	}
+}
+
+static void dptr_prefetch_done(struct tevent_req *subreq)
+{
+	struct dptr_prefetch_job *job = tevent_req_callback_data(
+		subreq, struct dptr_prefetch_job);
+	struct dptr_prefetch_state *state = job->state;
+
+	/*
+	 * Failures don't matter, smbd_dirptr_get_entry() will just
+	 * be slower.
+	 */
+	(void)pthreadpool_tevent_job_recv(subreq);
+
+	if (state != NULL) {
+		DLIST_REMOVE(state->jobs, job);
+	}
+	TALLOC_FREE(job);
+
+	if (state == NULL) {
+		/* The search went away while we were running */
+		return;
+	}
+	if (state->jobs == NULL) {
+		tevent_req_done(state->req);
+	}
+}
+
+int dptr_prefetch_recv(struct tevent_req *req)
+{
+	return tevent_req_simple_recv_unix(req);
+}
+
 /****************************************************************************
  Map a native directory offset to a 32-bit cookie.
 ****************************************************************************/
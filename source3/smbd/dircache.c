@@ -0,0 +1,363 @@
+/*
+   Unix SMB/CIFS implementation.
+   Directory listing cache
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Directory enumeration spends most of its time in stat() and in
+ * reading the DOS attribute xattr of every entry. Clients list the
+ * same directories over and over again, so with "smbd:directory
+ * cache = yes" we remember the stat and DOS mode of each entry we
+ * have returned and skip both on the next enumeration.
+ *
+ * Every cached directory has a change notify watch registered with
+ * notifyd, so changes done by any smbd invalidate the affected
+ * entries. Changes done behind our back are only picked up when the
+ * directory mtime changes or after "smbd:directory cache ttl"
+ * seconds, so this should only be enabled on shares not modified
+ * locally.
+ *
+ * Note that this also applies to local changes that do not touch the
+ * directory itself: a file written, truncated or chmod'ed by a local
+ * process keeps its cached stat and DOS mode for up to "smbd:directory
+ * cache ttl" seconds.
+ */
+
+#include "includes.h"
+#include "smbd/smbd.h"
+#include "smbd/globals.h"
+#include "dbwrap/dbwrap.h"
+#include "dbwrap/dbwrap_rbt.h"
+#include "util_tdb.h"
+#include "../librpc/gen_ndr/ndr_notify.h"
+#include "smbprofile.h"
+
+struct smbd_dircache_dir {
+	struct smbd_dircache_dir *prev, *next;
+	struct smbd_server_connection *sconn;
+	connection_struct *conn;
+	char *fullpath;
+	struct timespec dir_mtime;
+	struct timespec filled;
+	int ttl;
+	size_t num_entries;
+	size_t max_entries;
+	struct db_context *entries;
+};
+
+struct smbd_dircache_entry {
+	SMB_STRUCT_STAT st;
+	uint32_t mode;
+};
+
+static int smbd_dircache_dir_destructor(struct smbd_dircache_dir *d)
+{
+	struct smbd_server_connection *sconn = d->sconn;
+
+	DLIST_REMOVE(sconn->dircache.dirs, d);
+	sconn->dircache.num_dirs -= 1;
+	sconn->dircache.generation += 1;
+
+	notify_remove(sconn->notify_ctx, d, d->fullpath);
+
+	return 0;
+}
+
+static void smbd_dircache_dir_flush(struct smbd_dircache_dir *d)
+{
+	TALLOC_FREE(d->entries);
+	d->num_entries = 0;
+	d->filled = timespec_current();
+}
+
+static void smbd_dircache_dir_expire(struct smbd_dircache_dir *d)
+{
+	if (timespec_elapsed(&d->filled) > d->ttl) {
+		smbd_dircache_dir_flush(d);
+	}
+}
+
+static struct smbd_dircache_dir *smbd_dircache_dir_create(
+	connection_struct *conn, const char *fullpath)
+{
+	struct smbd_server_connection *sconn = conn->sconn;
+	struct smbd_dircache_dir *d;
+	int max_dirs, max_entries;
+	NTSTATUS status;
+
+	max_dirs = lp_parm_int(-1, "smbd", "directory cache dirs", 64);
+	if (max_dirs <= 0) {
+		return NULL;
+	}
+	max_entries = lp_parm_int(-1, "smbd", "directory cache entries",
+				  10000);
+	if (max_entries <= 0) {
+		return NULL;
+	}
+
+	while ((sconn->dircache.num_dirs >= (size_t)max_dirs) &&
+	       (sconn->dircache.dirs != NULL)) {
+		struct smbd_dircache_dir *oldest =
+			DLIST_TAIL(sconn->dircache.dirs);
+		TALLOC_FREE(oldest);
+	}
+
+	d = talloc_zero(sconn, struct smbd_dircache_dir);
+	if (d == NULL) {
+		return NULL;
+	}
+	d->sconn = sconn;
+	d->conn = conn;
+	d->filled = timespec_current();
+	d->ttl = lp_parm_int(SNUM(conn), "smbd", "directory cache ttl", 5);
+	d->max_entries = max_entries;
+
+	d->fullpath = talloc_strdup(d, fullpath);
+	if (d->fullpath == NULL) {
+		TALLOC_FREE(d);
+		return NULL;
+	}
+
+	/*
+	 * Watch before anything gets cached, we must not miss a
+	 * change.
+	 */
+	status = notify_add(sconn->notify_ctx, d->fullpath,
+			    FILE_NOTIFY_CHANGE_ALL, 0, d);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("notify_add for %s failed: %s\n", d->fullpath,
+			  nt_errstr(status));
+		TALLOC_FREE(d);
+		return NULL;
+	}
+
+	DLIST_ADD(sconn->dircache.dirs, d);
+	sconn->dircache.num_dirs += 1;
+	talloc_set_destructor(d, smbd_dircache_dir_destructor);
+
+	return d;
+}
+
+/*
+ * Find or create the cache for the directory smb_dname is open
+ * on. Returns NULL if caching is not possible, callers then just
+ * do the work themselves.
+ *
+ * The result stays valid as long as sconn->dircache.generation does
+ * not change, see dptr_dircache().
+ */
+struct smbd_dircache_dir *smbd_dircache_get(
+	connection_struct *conn, const struct smb_filename *smb_dname)
+{
+	struct smbd_server_connection *sconn = conn->sconn;
+	struct smbd_dircache_dir *d;
+	char *fullpath;
+
+	if (sconn->notify_ctx == NULL) {
+		/* We can't invalidate without notifyd */
+		return NULL;
+	}
+	if (!lp_parm_bool(SNUM(conn), "smbd", "directory cache", false)) {
+		return NULL;
+	}
+
+	if (ISDOT(smb_dname->base_name)) {
+		fullpath = talloc_strdup(talloc_tos(), conn->connectpath);
+	} else {
+		fullpath = talloc_asprintf(talloc_tos(), "%s/%s",
+					   conn->connectpath,
+					   smb_dname->base_name);
+	}
+	if (fullpath == NULL) {
+		return NULL;
+	}
+
+	for (d = sconn->dircache.dirs; d != NULL; d = d->next) {
+		if ((d->conn == conn) && (strcmp(d->fullpath, fullpath) == 0)) {
+			break;
+		}
+	}
+
+	if (d == NULL) {
+		d = smbd_dircache_dir_create(conn, fullpath);
+		TALLOC_FREE(fullpath);
+		if (d == NULL) {
+			return NULL;
+		}
+	} else {
+		TALLOC_FREE(fullpath);
+		DLIST_PROMOTE(sconn->dircache.dirs, d);
+	}
+
+	/*
+	 * Entries created or removed behind our back show up in the
+	 * directory mtime. Handles opened earlier might carry an older
+	 * mtime, that does not say anything about our entries.
+	 */
+	if (VALID_STAT(smb_dname->st) &&
+	    (timespec_compare(&smb_dname->st.st_ex_mtime,
+			      &d->dir_mtime) > 0)) {
+		d->dir_mtime = smb_dname->st.st_ex_mtime;
+		smbd_dircache_dir_flush(d);
+	}
+
+	smbd_dircache_dir_expire(d);
+
+	return d;
+}
+
+static const char *smbd_dircache_name(const struct smb_filename *smb_fname)
+{
+	const char *p = strrchr(smb_fname->base_name, '/');
+
+	if (p == NULL) {
+		return smb_fname->base_name;
+	}
+	return p + 1;
+}
+
+static void smbd_dircache_parse_entry(TDB_DATA key, TDB_DATA data,
+				      void *private_data)
+{
+	struct smbd_dircache_entry *e = private_data;
+
+	if (data.dsize != sizeof(*e)) {
+		return;
+	}
+	memcpy(e, data.dptr, sizeof(*e));
+}
+
+bool smbd_dircache_lookup(struct smbd_dircache_dir *d,
+			  struct smb_filename *smb_fname,
+			  uint32_t *mode)
+{
+	const char *name = smbd_dircache_name(smb_fname);
+	struct smbd_dircache_entry e = { .mode = 0 };
+	NTSTATUS status;
+
+	DO_PROFILE_INC(dircache_lookups);
+
+	smbd_dircache_dir_expire(d);
+
+	if (d->entries == NULL) {
+		DO_PROFILE_INC(dircache_misses);
+		return false;
+	}
+
+	status = dbwrap_parse_record(d->entries, string_term_tdb_data(name),
+				     smbd_dircache_parse_entry, &e);
+	if (!NT_STATUS_IS_OK(status) || !VALID_STAT(e.st)) {
+		DO_PROFILE_INC(dircache_misses);
+		return false;
+	}
+
+	DO_PROFILE_INC(dircache_hits);
+
+	smb_fname->st = e.st;
+	*mode = e.mode;
+	return true;
+}
+
+void smbd_dircache_store(struct smbd_dircache_dir *d,
+			 const struct smb_filename *smb_fname,
+			 uint32_t mode)
+{
+	const char *name = smbd_dircache_name(smb_fname);
+	struct smbd_dircache_entry e = { .st = smb_fname->st, .mode = mode };
+	NTSTATUS status;
+
+	if (d->num_entries >= d->max_entries) {
+		return;
+	}
+
+	if (d->entries == NULL) {
+		d->entries = db_open_rbt(d);
+		if (d->entries == NULL) {
+			return;
+		}
+	}
+
+	status = dbwrap_store(d->entries, string_term_tdb_data(name),
+			      make_tdb_data((uint8_t *)&e, sizeof(e)), 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("dbwrap_store failed: %s\n", nt_errstr(status));
+		return;
+	}
+	d->num_entries += 1;
+}
+
+/*
+ * Called from notify_callback(), returns true if the event was for
+ * one of our watches.
+ */
+bool smbd_dircache_notify(struct smbd_server_connection *sconn,
+			  void *private_data,
+			  const struct notify_event *e)
+{
+	struct smbd_dircache_dir *d;
+
+	/*
+	 * private_data might be a stale pointer from an in-flight
+	 * message, don't dereference it before we found it in our
+	 * list.
+	 */
+	for (d = sconn->dircache.dirs; d != NULL; d = d->next) {
+		if (d == private_data) {
+			break;
+		}
+	}
+	if (d == NULL) {
+		return false;
+	}
+
+	DBG_DEBUG("%s: action %u for %s\n", d->fullpath,
+		  (unsigned)e->action, e->path);
+
+	if ((d->entries == NULL) || (strchr(e->path, '/') != NULL)) {
+		smbd_dircache_dir_flush(d);
+		return true;
+	}
+
+	/*
+	 * Keep the count as is, it only limits the memory we use and
+	 * the directory is flushed after the ttl anyway.
+	 */
+	dbwrap_delete(d->entries, string_term_tdb_data(e->path));
+
+	return true;
+}
+
+void smbd_dircache_close_conn(connection_struct *conn)
+{
+	struct smbd_server_connection *sconn = conn->sconn;
+	struct smbd_dircache_dir *d, *next;
+
+	for (d = sconn->dircache.dirs; d != NULL; d = next) {
+		next = d->next;
+		if (d->conn == conn) {
+			TALLOC_FREE(d);
+		}
+	}
+}
+
+void smbd_dircache_flush_all(struct smbd_server_connection *sconn)
+{
+	while (sconn->dircache.dirs != NULL) {
+		struct smbd_dircache_dir *d = sconn->dircache.dirs;
+		TALLOC_FREE(d);
+	}
+}
@@ -1362,6 +1362,15 @@ static int get_real_filename_full_scan(connection_struct *conn,
 		}
 	}
 
+	if (!mangled) {
+		int ret = stat_cache_name_index_lookup(conn, path, name,
+						       mem_ctx, found_name);
+		if ((ret == 0) || (errno != EAGAIN)) {
+			TALLOC_FREE(unmangled_name);
+			return ret;
+		}
+	}
+
 	smb_fname = synthetic_smb_fname(talloc_tos(),
 					path,
 					NULL,
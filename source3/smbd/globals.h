@@ -462,6 +462,23 @@ struct smbXsrv_connection {
 		struct smbd_smb2_send_queue *send_queue;
 		size_t send_queue_len;
 
+		/*
+		 * Encrypted responses of at least this size are
+		 * encrypted in a worker thread, 0 means never.
+		 */
+		size_t encrypt_offload_size;
+		/*
+		 * The same for signed responses, 0 (the default)
+		 * means never.
+		 */
+		size_t sign_offload_size;
+
+		/*
+		 * The maximum number of bytes of queued responses
+		 * we gather into one writev() call.
+		 */
+		size_t send_batch_size;
+
 		struct {
 			/*
 			 * seq_low is the lowest sequence number
@@ -682,6 +699,12 @@ struct smbd_smb2_send_queue {
 	struct iovec *vector;
 	int count;
 
+	/*
+	 * Set while a worker thread still encrypts or signs the
+	 * vectors, the send queue is not flushed beyond this entry.
+	 */
+	bool crypto_pending;
+
 	TALLOC_CTX *mem_ctx;
 };
 
@@ -729,6 +752,18 @@ struct smbd_smb2_request {
 	DATA_BLOB last_key;
 	struct smbXsrv_preauth *preauth;
 
+	/*
+	 * Large responses are encrypted or signed by a pthreadpool
+	 * job, see smbd_smb2_request_crypto_send().
+	 */
+	struct tevent_req *crypto_subreq;
+	DATA_BLOB crypto_signing_key;
+	enum protocol_types crypto_protocol;
+	uint16_t crypto_cipher;
+	struct iovec *crypto_vector;
+	int crypto_count;
+	NTSTATUS crypto_status;
+
 	struct timeval request_time;
 
 	SMBPROFILE_IOBYTES_ASYNC_STATE(profile);
@@ -900,6 +935,14 @@ struct smbd_server_connection {
 		int dirhandles_open;
 	} searches;
 
+	/* cached directory entries, see dircache.c */
+	struct {
+		struct smbd_dircache_dir *dirs;
+		size_t num_dirs;
+		/* bumped whenever a dir is freed, see dptr_dircache() */
+		uint64_t generation;
+	} dircache;
+
 	uint64_t num_requests;
 
 	/* Current number of oplocks we have outstanding. */
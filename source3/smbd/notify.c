@@ -273,6 +273,11 @@ void notify_callback(struct smbd_server_connection *sconn,
 	struct notify_fsp_state state = {
 		.notified_fsp = private_data, .when = when, .e = e
 	};
+
+	if (smbd_dircache_notify(sconn, private_data, e)) {
+		return;
+	}
+
 	files_forall(sconn, notify_fsp_cb, &state);
 }
 
@@ -528,6 +533,12 @@ void smbd_notifyd_restarted(struct messaging_context *msg,
 	struct smbd_server_connection *sconn = talloc_get_type_abort(
 		private_data, struct smbd_server_connection);
 
+	/*
+	 * The directory cache watches died with notifyd, we might
+	 * have missed changes.
+	 */
+	smbd_dircache_flush_all(sconn);
+
 	TALLOC_FREE(sconn->notify_ctx);
 
 	sconn->notify_ctx = notify_init(sconn, sconn->msg_ctx, sconn->ev_ctx,
@@ -0,0 +1,1072 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * notify implementation using fanotify filesystem marks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * inotify needs one kernel watch per watched directory. With many
+ * thousand watched directories this hits max_user_watches and costs
+ * kernel memory plus a syscall per directory.
+ *
+ * Here we put a single fanotify mark on every file system with a
+ * watched directory. The kernel reports the file handle of the
+ * directory an event happened in plus the name of the object. We
+ * identify watched directories by their file handle, so matching
+ * an event is a lookup in an in-memory index. Events in directories
+ * nobody watches are dropped there.
+ *
+ * FAN_MODIFY is the exception: On a file system mark it would wake
+ * us for every write anywhere on the file system. Directories with
+ * a watch asking for it get their own FAN_MODIFY mark instead.
+ *
+ * This requires Linux 5.9 or later and CAP_SYS_ADMIN.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "../librpc/gen_ndr/notify.h"
+#include "smbd/smbd.h"
+#include "lib/dbwrap/dbwrap.h"
+#include "lib/dbwrap/dbwrap_rbt.h"
+#include "util_tdb.h"
+#include "lib/util/sys_rw.h"
+
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+
+#define FANOTIFY_BUFSIZE 65536
+
+/*
+ * Key of a directory in fanotify_private->dirs: The file system id,
+ * the handle type and the handle bytes. That's what the kernel
+ * reports for an event.
+ */
+#define FANOTIFY_FSID_LEN 8
+#define FANOTIFY_KEY_LEN (FANOTIFY_FSID_LEN + sizeof(int) + MAX_HANDLE_SZ)
+
+/*
+ * The events we put on file system marks
+ */
+static const uint64_t fanotify_fs_events[] = {
+	FAN_CREATE, FAN_DELETE, FAN_MOVED_FROM, FAN_MOVED_TO, FAN_ATTRIB
+};
+
+struct fanotify_fs {
+	struct fanotify_fs *prev, *next;
+	struct fanotify_private *fan;
+	uint8_t fsid[FANOTIFY_FSID_LEN];
+
+	/*
+	 * Any directory on the file system, to refer to the mark and
+	 * for open_by_handle_at()
+	 */
+	int mount_fd;
+
+	/*
+	 * The mask of the mark, and for every bit in
+	 * fanotify_fs_events the number of watches asking for it. A
+	 * bit is removed from the mark when nobody needs it anymore.
+	 */
+	uint64_t mask;
+	size_t counts[ARRAY_SIZE(fanotify_fs_events)];
+	size_t num_dirs;
+};
+
+struct fanotify_private {
+	struct sys_notify_context *ctx;
+	int fd;
+	uint8_t *buf;
+
+	/*
+	 * File systems we have marked
+	 */
+	struct fanotify_fs *filesystems;
+
+	/*
+	 * Indexed by the directory key, the value is a pointer to
+	 * struct fanotify_dir
+	 */
+	struct db_context *dirs;
+};
+
+struct fanotify_dir {
+	struct fanotify_fs *fs;
+	struct fanotify_watch_context *watches;
+	size_t num_modify; /* watches asking for FAN_MODIFY */
+	size_t keylen;
+	uint8_t key[FANOTIFY_KEY_LEN];
+};
+
+struct fanotify_watch_context {
+	struct fanotify_watch_context *next, *prev;
+	struct fanotify_dir *dir;
+	void (*callback)(struct sys_notify_context *ctx,
+			 void *private_data,
+			 struct notify_event *ev,
+			 uint32_t filter);
+	void *private_data;
+	uint64_t mask; /* the fanotify mask */
+	uint32_t filter; /* the windows completion filter */
+	const char *path;
+};
+
+/*
+ * map from a change notify mask to a fanotify mask. Remove any bits
+ * which we can handle
+ */
+static const struct {
+	uint32_t notify_mask;
+	uint64_t fanotify_mask;
+} fanotify_mapping[] = {
+	{FILE_NOTIFY_CHANGE_FILE_NAME,
+	 FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO},
+	{FILE_NOTIFY_CHANGE_DIR_NAME,
+	 FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO},
+	{FILE_NOTIFY_CHANGE_ATTRIBUTES,
+	 FAN_ATTRIB|FAN_MOVED_TO|FAN_MOVED_FROM|FAN_MODIFY},
+	{FILE_NOTIFY_CHANGE_LAST_WRITE,  FAN_ATTRIB},
+	{FILE_NOTIFY_CHANGE_LAST_ACCESS, FAN_ATTRIB},
+	{FILE_NOTIFY_CHANGE_EA,          FAN_ATTRIB},
+	{FILE_NOTIFY_CHANGE_SECURITY,    FAN_ATTRIB}
+};
+
+static uint64_t fanotify_map(uint32_t *filter)
+{
+	size_t i;
+	uint64_t out = 0;
+
+	for (i=0; i<ARRAY_SIZE(fanotify_mapping); i++) {
+		if (fanotify_mapping[i].notify_mask & *filter) {
+			out |= fanotify_mapping[i].fanotify_mask;
+			*filter &= ~fanotify_mapping[i].notify_mask;
+		}
+	}
+	return out;
+}
+
+/*
+ * Map fanotify mask back to filter. This returns all filters that
+ * could have created the watch.
+ */
+static uint32_t fanotify_map_mask_to_filter(uint64_t mask)
+{
+	size_t i;
+	uint32_t filter = 0;
+
+	for (i=0; i<ARRAY_SIZE(fanotify_mapping); i++) {
+		if (fanotify_mapping[i].fanotify_mask & mask) {
+			filter |= fanotify_mapping[i].notify_mask;
+		}
+	}
+
+	if (mask & FAN_ONDIR) {
+		filter &= ~FILE_NOTIFY_CHANGE_FILE_NAME;
+	} else {
+		filter &= ~FILE_NOTIFY_CHANGE_DIR_NAME;
+	}
+
+	return filter;
+}
+
+static size_t fanotify_dir_key(const uint8_t fsid[FANOTIFY_FSID_LEN],
+			       const struct file_handle *fh,
+			       uint8_t key[FANOTIFY_KEY_LEN])
+{
+	int handle_type = fh->handle_type;
+
+	if (fh->handle_bytes > MAX_HANDLE_SZ) {
+		return 0;
+	}
+
+	memcpy(key, fsid, FANOTIFY_FSID_LEN);
+	memcpy(key + FANOTIFY_FSID_LEN, &handle_type, sizeof(handle_type));
+	memcpy(key + FANOTIFY_FSID_LEN + sizeof(handle_type),
+	       fh->f_handle, fh->handle_bytes);
+
+	return FANOTIFY_FSID_LEN + sizeof(handle_type) + fh->handle_bytes;
+}
+
+static void fanotify_dir_parser(TDB_DATA key, TDB_DATA data,
+				void *private_data)
+{
+	struct fanotify_dir **pdir = private_data;
+
+	if (data.dsize == sizeof(*pdir)) {
+		memcpy(pdir, data.dptr, sizeof(*pdir));
+	}
+}
+
+static struct fanotify_dir *fanotify_dir_find(struct fanotify_private *fan,
+					      const uint8_t *key,
+					      size_t keylen)
+{
+	struct fanotify_dir *dir = NULL;
+
+	dbwrap_parse_record(fan->dirs,
+			    make_tdb_data(key, keylen),
+			    fanotify_dir_parser, &dir);
+	return dir;
+}
+
+static struct fanotify_fs *fanotify_fs_find(
+	struct fanotify_private *fan, const uint8_t fsid[FANOTIFY_FSID_LEN])
+{
+	struct fanotify_fs *fs;
+
+	for (fs = fan->filesystems; fs != NULL; fs = fs->next) {
+		if (memcmp(fs->fsid, fsid, FANOTIFY_FSID_LEN) == 0) {
+			return fs;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the file handle back from a directory key
+ */
+static void fanotify_key_handle(const uint8_t *key, size_t keylen,
+				struct file_handle *fh)
+{
+	const uint8_t *p = key + FANOTIFY_FSID_LEN;
+	int handle_type;
+
+	memcpy(&handle_type, p, sizeof(handle_type));
+	p += sizeof(handle_type);
+
+	fh->handle_type = handle_type;
+	fh->handle_bytes = keylen - (p - key);
+	memcpy(fh->f_handle, p, fh->handle_bytes);
+}
+
+static int fanotify_dir_destructor(struct fanotify_dir *dir)
+{
+	dbwrap_delete(dir->fs->fan->dirs,
+		      make_tdb_data(dir->key, dir->keylen));
+	dir->fs->num_dirs -= 1;
+	return 0;
+}
+
+/*
+ * destroy the fanotify private context
+ */
+static int fanotify_destructor(struct fanotify_private *fan)
+{
+	close(fan->fd);
+	return 0;
+}
+
+/*
+ * see if a particular event from fanotify really does match a
+ * requested notify event in SMB
+ */
+static bool filter_match(struct fanotify_watch_context *w, uint64_t mask)
+{
+	bool ok;
+
+	DEBUG(10, ("filter_match: mask=%llx, w->mask=%llx, w->filter=%x\n",
+		   (unsigned long long)mask, (unsigned long long)w->mask,
+		   w->filter));
+
+	if ((mask & w->mask) == 0) {
+		/*
+		 * The file system mark carries the masks of all
+		 * watches
+		 */
+		return false;
+	}
+
+	/* SMB separates the filters for files and directories */
+	if (mask & FAN_ONDIR) {
+		ok = ((w->filter & FILE_NOTIFY_CHANGE_DIR_NAME) != 0);
+		return ok;
+	}
+
+	if ((mask & FAN_ATTRIB) &&
+	    (w->filter & (FILE_NOTIFY_CHANGE_ATTRIBUTES|
+			  FILE_NOTIFY_CHANGE_LAST_WRITE|
+			  FILE_NOTIFY_CHANGE_LAST_ACCESS|
+			  FILE_NOTIFY_CHANGE_EA|
+			  FILE_NOTIFY_CHANGE_SECURITY))) {
+		return true;
+	}
+	if ((mask & FAN_MODIFY) &&
+	    (w->filter & FILE_NOTIFY_CHANGE_ATTRIBUTES)) {
+		return true;
+	}
+
+	ok = ((w->filter & FILE_NOTIFY_CHANGE_FILE_NAME) != 0);
+	return ok;
+}
+
+static void fanotify_dispatch_one(struct fanotify_dir *dir,
+				  uint64_t mask, uint32_t action,
+				  const char *name)
+{
+	struct fanotify_private *fan = dir->fs->fan;
+	struct fanotify_watch_context *w, *next;
+	struct notify_event ne;
+	uint32_t filter;
+
+	ne.action = action;
+	ne.path = name;
+
+	filter = fanotify_map_mask_to_filter(mask);
+
+	DBG_DEBUG("ne.action = %d, ne.path = %s, filter = %d\n",
+		  ne.action, ne.path, filter);
+
+	for (w=dir->watches; w; w=next) {
+		next = w->next;
+		if (filter_match(w, mask)) {
+			ne.dir = w->path;
+			w->callback(fan->ctx, w->private_data, &ne, filter);
+		}
+	}
+
+	if ((ne.action == NOTIFY_ACTION_NEW_NAME) &&
+	    ((mask & FAN_ONDIR) == 0)) {
+
+		/*
+		 * SMB expects a file rename to generate three events, two for
+		 * the rename and the other for a modify of the
+		 * destination. Strange!
+		 */
+
+		ne.action = NOTIFY_ACTION_MODIFIED;
+		mask = FAN_ATTRIB;
+
+		for (w=dir->watches; w; w=next) {
+			next = w->next;
+			if (filter_match(w, mask) &&
+			    !(w->filter & FILE_NOTIFY_CHANGE_CREATION)) {
+				ne.dir = w->path;
+				w->callback(fan->ctx, w->private_data, &ne,
+					    filter);
+			}
+		}
+	}
+}
+
+/*
+ * Find the directory handle and name in an event. Returns the length
+ * of the directory key, 0 if there is none.
+ */
+static size_t fanotify_event_dir(const struct fanotify_event_metadata *m,
+				 uint8_t key[FANOTIFY_KEY_LEN],
+				 const char **pname)
+{
+	const uint8_t *p = (const uint8_t *)m + m->metadata_len;
+	const uint8_t *end = (const uint8_t *)m + m->event_len;
+
+	while ((end - p) >= (ptrdiff_t)sizeof(struct fanotify_event_info_fid)) {
+		const struct fanotify_event_info_fid *fid =
+			(const struct fanotify_event_info_fid *)p;
+		const struct file_handle *fh;
+		const char *name;
+		size_t hlen;
+
+		if ((fid->hdr.len < sizeof(*fid)) ||
+		    (fid->hdr.len > (end - p))) {
+			return 0;
+		}
+
+		if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+			p += fid->hdr.len;
+			continue;
+		}
+
+		fh = (const struct file_handle *)fid->handle;
+		hlen = offsetof(struct fanotify_event_info_fid, handle) +
+			sizeof(struct file_handle) + fh->handle_bytes;
+		if (hlen >= fid->hdr.len) {
+			return 0;
+		}
+
+		name = (const char *)p + hlen;
+		if (memchr(name, '\0', fid->hdr.len - hlen) == NULL) {
+			return 0;
+		}
+		*pname = name;
+
+		return fanotify_dir_key((const uint8_t *)&fid->fsid, fh, key);
+	}
+
+	return 0;
+}
+
+/*
+ * For an event on the directory with "key" itself, find the watched
+ * parent directory and the name of the directory in it
+ */
+static struct fanotify_dir *fanotify_dot_parent(struct fanotify_private *fan,
+						const uint8_t *key,
+						size_t keylen,
+						char *name,
+						size_t namelen)
+{
+	struct fanotify_fs *fs;
+	struct fanotify_dir *parent;
+	union {
+		struct file_handle fh;
+		uint8_t buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	uint8_t pkey[FANOTIFY_KEY_LEN];
+	char procpath[64];
+	char path[PATH_MAX];
+	const char *p;
+	size_t pkeylen;
+	ssize_t len;
+	int mount_id;
+	int fd, ret;
+
+	fs = fanotify_fs_find(fan, key);
+	if (fs == NULL) {
+		return NULL;
+	}
+
+	fanotify_key_handle(key, keylen, &h.fh);
+
+	fd = open_by_handle_at(fs->mount_fd, &h.fh,
+			       O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		DEBUG(10, ("open_by_handle_at returned %s\n",
+			   strerror(errno)));
+		return NULL;
+	}
+
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	ret = name_to_handle_at(fd, "..", &h.fh, &mount_id, 0);
+	if (ret == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	pkeylen = fanotify_dir_key(fs->fsid, &h.fh, pkey);
+	if ((pkeylen == 0) ||
+	    ((pkeylen == keylen) && (memcmp(pkey, key, keylen) == 0))) {
+		/*
+		 * The root of the mount is its own parent
+		 */
+		close(fd);
+		return NULL;
+	}
+
+	parent = fanotify_dir_find(fan, pkey, pkeylen);
+	if (parent == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+	len = readlink(procpath, path, sizeof(path)-1);
+	close(fd);
+	if (len <= 0) {
+		return NULL;
+	}
+	path[len] = '\0';
+
+	p = strrchr(path, '/');
+	if ((p == NULL) || (p[1] == '\0')) {
+		return NULL;
+	}
+	strlcpy(name, p+1, namelen);
+
+	return parent;
+}
+
+/*
+ * dispatch one fanotify event. The kernel merges events for the same
+ * object, so one event can carry several actions.
+ *
+ * fanotify does not have rename cookies. A FAN_MOVED_FROM directly
+ * followed by a FAN_MOVED_TO in the same directory is taken as a
+ * rename.
+ */
+static void fanotify_dispatch(struct fanotify_private *fan,
+			      const struct fanotify_event_metadata *m,
+			      bool moved_from_prev,
+			      bool moved_to_next)
+{
+	uint8_t key[FANOTIFY_KEY_LEN];
+	char dirname[NAME_MAX+1];
+	struct fanotify_dir *dir;
+	const char *name = NULL;
+	size_t keylen;
+	uint64_t mask = m->mask;
+
+	DEBUG(10, ("fanotify_dispatch called with mask=%llx\n",
+		   (unsigned long long)mask));
+
+	if (mask & FAN_Q_OVERFLOW) {
+		DEBUG(1, ("fanotify event queue overflow, "
+			  "events have been lost\n"));
+		return;
+	}
+
+	keylen = fanotify_event_dir(m, key, &name);
+	if (keylen == 0) {
+		return;
+	}
+
+	if (ISDOT(name)) {
+		/*
+		 * Event on a directory itself. With inotify the watcher
+		 * of its parent sees it under the directory's name.
+		 */
+		dir = fanotify_dot_parent(fan, key, keylen,
+					  dirname, sizeof(dirname));
+		name = dirname;
+	} else {
+		dir = fanotify_dir_find(fan, key, keylen);
+	}
+	if (dir == NULL) {
+		/*
+		 * Nobody is watching this directory
+		 */
+		return;
+	}
+
+	if (mask & FAN_CREATE) {
+		fanotify_dispatch_one(
+			dir, mask & (FAN_CREATE|FAN_ONDIR),
+			NOTIFY_ACTION_ADDED, name);
+	}
+	if (mask & FAN_MOVED_TO) {
+		fanotify_dispatch_one(
+			dir, mask & (FAN_MOVED_TO|FAN_ONDIR),
+			moved_from_prev ?
+			NOTIFY_ACTION_NEW_NAME : NOTIFY_ACTION_ADDED,
+			name);
+	}
+	if (mask & (FAN_ATTRIB|FAN_MODIFY)) {
+		fanotify_dispatch_one(
+			dir, mask & (FAN_ATTRIB|FAN_MODIFY|FAN_ONDIR),
+			NOTIFY_ACTION_MODIFIED, name);
+	}
+	if (mask & FAN_MOVED_FROM) {
+		fanotify_dispatch_one(
+			dir, mask & (FAN_MOVED_FROM|FAN_ONDIR),
+			moved_to_next ?
+			NOTIFY_ACTION_OLD_NAME : NOTIFY_ACTION_REMOVED,
+			name);
+	}
+	if (mask & FAN_DELETE) {
+		fanotify_dispatch_one(
+			dir, mask & (FAN_DELETE|FAN_ONDIR),
+			NOTIFY_ACTION_REMOVED, name);
+	}
+}
+
+static bool fanotify_same_dir(const struct fanotify_event_metadata *m1,
+			      const struct fanotify_event_metadata *m2)
+{
+	uint8_t key1[FANOTIFY_KEY_LEN], key2[FANOTIFY_KEY_LEN];
+	const char *name;
+	size_t len1, len2;
+
+	len1 = fanotify_event_dir(m1, key1, &name);
+	len2 = fanotify_event_dir(m2, key2, &name);
+
+	return ((len1 != 0) && (len1 == len2) &&
+		(memcmp(key1, key2, len1) == 0));
+}
+
+/*
+ * called when the kernel has some events for us
+ */
+static void fanotify_handler(struct tevent_context *ev, struct tevent_fd *fde,
+			     uint16_t flags, void *private_data)
+{
+	struct fanotify_private *fan = talloc_get_type_abort(
+		private_data, struct fanotify_private);
+	const struct fanotify_event_metadata *m, *next;
+	bool moved_from_prev = false;
+	ssize_t len;
+
+	len = sys_read(fan->fd, fan->buf, FANOTIFY_BUFSIZE);
+	if (len == -1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			return;
+		}
+		DEBUG(0, ("Failed to read fanotify data - %s\n",
+			  strerror(errno)));
+		TALLOC_FREE(fde);
+		return;
+	}
+
+	m = (const struct fanotify_event_metadata *)fan->buf;
+
+	while (FAN_EVENT_OK(m, len)) {
+		bool moved_to_next = false;
+
+		if (m->vers != FANOTIFY_METADATA_VERSION) {
+			DEBUG(0, ("fanotify metadata version %u, "
+				  "expected %u\n", (unsigned)m->vers,
+				  (unsigned)FANOTIFY_METADATA_VERSION));
+			TALLOC_FREE(fde);
+			return;
+		}
+
+		next = FAN_EVENT_NEXT(m, len);
+
+		if ((m->mask & FAN_MOVED_FROM) && FAN_EVENT_OK(next, len) &&
+		    (next->mask & FAN_MOVED_TO)) {
+			moved_to_next = fanotify_same_dir(m, next);
+		}
+
+		fanotify_dispatch(fan, m, moved_from_prev, moved_to_next);
+
+		moved_from_prev = moved_to_next;
+		m = next;
+	}
+}
+
+/*
+ * setup the fanotify handle - called the first time a watch is added on
+ * this context
+ */
+static int fanotify_setup(struct sys_notify_context *ctx)
+{
+	struct fanotify_private *fan;
+	struct tevent_fd *fde;
+
+	fan = talloc_zero(ctx, struct fanotify_private);
+	if (fan == NULL) {
+		return ENOMEM;
+	}
+
+	fan->buf = talloc_array(fan, uint8_t, FANOTIFY_BUFSIZE);
+	if (fan->buf == NULL) {
+		TALLOC_FREE(fan);
+		return ENOMEM;
+	}
+
+	fan->dirs = db_open_rbt(fan);
+	if (fan->dirs == NULL) {
+		TALLOC_FREE(fan);
+		return ENOMEM;
+	}
+
+	fan->fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|
+				FAN_CLOEXEC|FAN_NONBLOCK,
+				O_RDONLY);
+	if (fan->fd == -1) {
+		int ret = errno;
+		DEBUG(0, ("Failed to init fanotify - %s\n", strerror(ret)));
+		TALLOC_FREE(fan);
+		return ret;
+	}
+	fan->ctx = ctx;
+
+	ctx->private_data = fan;
+	talloc_set_destructor(fan, fanotify_destructor);
+
+	/* add a event waiting for the fanotify fd to be readable */
+	fde = tevent_add_fd(ctx->ev, fan, fan->fd, TEVENT_FD_READ,
+			    fanotify_handler, fan);
+	if (fde == NULL) {
+		ctx->private_data = NULL;
+		TALLOC_FREE(fan);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static int fanotify_fs_destructor(struct fanotify_fs *fs)
+{
+	struct fanotify_private *fan = fs->fan;
+
+	if (fs->mask != 0) {
+		fanotify_mark(fan->fd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM,
+			      fs->mask|FAN_ONDIR, fs->mount_fd, NULL);
+	}
+	close(fs->mount_fd);
+	DLIST_REMOVE(fan->filesystems, fs);
+	return 0;
+}
+
+static struct fanotify_fs *fanotify_fs_get(struct fanotify_private *fan,
+					   const uint8_t fsid[FANOTIFY_FSID_LEN],
+					   const char *path)
+{
+	struct fanotify_fs *fs;
+
+	fs = fanotify_fs_find(fan, fsid);
+	if (fs != NULL) {
+		return fs;
+	}
+
+	fs = talloc_zero(fan, struct fanotify_fs);
+	if (fs == NULL) {
+		return NULL;
+	}
+	fs->fan = fan;
+	memcpy(fs->fsid, fsid, FANOTIFY_FSID_LEN);
+
+	fs->mount_fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fs->mount_fd == -1) {
+		DEBUG(1, ("open %s failed: %s\n", path, strerror(errno)));
+		TALLOC_FREE(fs);
+		return NULL;
+	}
+
+	DLIST_ADD(fan->filesystems, fs);
+	talloc_set_destructor(fs, fanotify_fs_destructor);
+
+	return fs;
+}
+
+/*
+ * Make sure the file system mark has all the events in "mask"
+ */
+static int fanotify_fs_add(struct fanotify_fs *fs, uint64_t mask)
+{
+	uint64_t new_mask = fs->mask | mask;
+	size_t i;
+
+	if (new_mask != fs->mask) {
+		int ret;
+
+		ret = fanotify_mark(fs->fan->fd,
+				    FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+				    new_mask|FAN_ONDIR, fs->mount_fd, NULL);
+		if (ret == -1) {
+			int err = errno;
+			DEBUG(1, ("fanotify_mark returned %s\n",
+				  strerror(err)));
+			return err;
+		}
+
+		DEBUG(10, ("fanotify_mark mask %llx\n",
+			   (unsigned long long)new_mask));
+
+		fs->mask = new_mask;
+	}
+
+	for (i=0; i<ARRAY_SIZE(fanotify_fs_events); i++) {
+		if (mask & fanotify_fs_events[i]) {
+			fs->counts[i] += 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A watch asking for "mask" is gone, remove the events nobody needs
+ * anymore from the mark
+ */
+static void fanotify_fs_del(struct fanotify_fs *fs, uint64_t mask)
+{
+	uint64_t new_mask = 0;
+	uint64_t remove;
+	size_t i;
+	int ret;
+
+	for (i=0; i<ARRAY_SIZE(fanotify_fs_events); i++) {
+		if (mask & fanotify_fs_events[i]) {
+			fs->counts[i] -= 1;
+		}
+		if (fs->counts[i] != 0) {
+			new_mask |= fanotify_fs_events[i];
+		}
+	}
+
+	if (new_mask == fs->mask) {
+		return;
+	}
+
+	remove = fs->mask & ~new_mask;
+	if (new_mask == 0) {
+		remove |= FAN_ONDIR;
+	}
+
+	ret = fanotify_mark(fs->fan->fd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM,
+			    remove, fs->mount_fd, NULL);
+	if (ret == -1) {
+		DEBUG(1, ("fanotify_mark remove returned %s\n",
+			  strerror(errno)));
+	}
+
+	fs->mask = new_mask;
+}
+
+static struct fanotify_dir *fanotify_dir_get(struct fanotify_fs *fs,
+					     const uint8_t *key,
+					     size_t keylen)
+{
+	struct fanotify_private *fan = fs->fan;
+	struct fanotify_dir *dir;
+	NTSTATUS status;
+
+	dir = fanotify_dir_find(fan, key, keylen);
+	if (dir != NULL) {
+		return dir;
+	}
+
+	dir = talloc_zero(fan, struct fanotify_dir);
+	if (dir == NULL) {
+		return NULL;
+	}
+	dir->fs = fs;
+	dir->keylen = keylen;
+	memcpy(dir->key, key, keylen);
+
+	status = dbwrap_store(fan->dirs, make_tdb_data(key, keylen),
+			      make_tdb_data((uint8_t *)&dir, sizeof(dir)), 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(dir);
+		return NULL;
+	}
+	fs->num_dirs += 1;
+	talloc_set_destructor(dir, fanotify_dir_destructor);
+
+	return dir;
+}
+
+/*
+ * FAN_MODIFY for the files in a directory comes from a mark on the
+ * directory itself, see the comment at the top of this file
+ */
+static int fanotify_dir_add_modify(struct fanotify_dir *dir,
+				   const char *path)
+{
+	int ret;
+
+	if (dir->num_modify == 0) {
+		ret = fanotify_mark(dir->fs->fan->fd,
+				    FAN_MARK_ADD|FAN_MARK_ONLYDIR,
+				    FAN_MODIFY|FAN_EVENT_ON_CHILD,
+				    AT_FDCWD, path);
+		if (ret == -1) {
+			int err = errno;
+			DEBUG(1, ("fanotify_mark for %s returned %s\n",
+				  path, strerror(err)));
+			return err;
+		}
+	}
+
+	dir->num_modify += 1;
+	return 0;
+}
+
+static void fanotify_dir_del_modify(struct fanotify_dir *dir)
+{
+	union {
+		struct file_handle fh;
+		uint8_t buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	int fd;
+
+	dir->num_modify -= 1;
+	if (dir->num_modify != 0) {
+		return;
+	}
+
+	/*
+	 * The directory might have been renamed since we marked it,
+	 * find it by its handle. If it is gone, so is the mark.
+	 */
+	fanotify_key_handle(dir->key, dir->keylen, &h.fh);
+
+	fd = open_by_handle_at(dir->fs->mount_fd, &h.fh,
+			       O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		DEBUG(10, ("open_by_handle_at returned %s\n",
+			   strerror(errno)));
+		return;
+	}
+
+	fanotify_mark(dir->fs->fan->fd, FAN_MARK_REMOVE,
+		      FAN_MODIFY|FAN_EVENT_ON_CHILD, fd, NULL);
+	close(fd);
+}
+
+/*
+ * destroy a watch
+ */
+static int watch_destructor(struct fanotify_watch_context *w)
+{
+	struct fanotify_dir *dir = w->dir;
+	struct fanotify_fs *fs = dir->fs;
+
+	fanotify_fs_del(fs, w->mask & ~FAN_MODIFY);
+	if (w->mask & FAN_MODIFY) {
+		fanotify_dir_del_modify(dir);
+	}
+
+	DLIST_REMOVE(dir->watches, w);
+
+	if (dir->watches == NULL) {
+		TALLOC_FREE(dir);
+	}
+	if (fs->num_dirs == 0) {
+		TALLOC_FREE(fs);
+	}
+	return 0;
+}
+
+/*
+ * add a watch. The watch is removed when the caller calls
+ * talloc_free() on *handle
+ */
+int fanotify_watch(TALLOC_CTX *mem_ctx,
+		   struct sys_notify_context *ctx,
+		   const char *path,
+		   uint32_t *filter,
+		   uint32_t *subdir_filter,
+		   void (*callback)(struct sys_notify_context *ctx,
+				    void *private_data,
+				    struct notify_event *ev,
+				    uint32_t filter),
+		   void *private_data,
+		   void *handle_p)
+{
+	struct fanotify_private *fan;
+	struct fanotify_watch_context *w;
+	struct fanotify_fs *fs;
+	struct fanotify_dir *dir;
+	uint32_t orig_filter = *filter;
+	void **handle = (void **)handle_p;
+	union {
+		struct file_handle fh;
+		uint8_t buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	uint8_t key[FANOTIFY_KEY_LEN];
+	uint8_t fsid[FANOTIFY_FSID_LEN];
+	struct statfs sbuf;
+	size_t keylen;
+	uint64_t mask;
+	int mount_id;
+	int ret;
+
+	/* maybe setup the fanotify fd */
+	if (ctx->private_data == NULL) {
+		ret = fanotify_setup(ctx);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	fan = talloc_get_type_abort(ctx->private_data,
+				    struct fanotify_private);
+
+	mask = fanotify_map(filter);
+	if (mask == 0) {
+		/* this filter can't be handled by fanotify */
+		return EINVAL;
+	}
+
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+
+	ret = name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0);
+	if (ret == -1) {
+		int err = errno;
+		*filter = orig_filter;
+		DEBUG(1, ("name_to_handle_at for %s returned %s\n",
+			  path, strerror(err)));
+		return err;
+	}
+
+	ret = statfs(path, &sbuf);
+	if (ret == -1) {
+		int err = errno;
+		*filter = orig_filter;
+		DEBUG(1, ("statfs for %s returned %s\n",
+			  path, strerror(err)));
+		return err;
+	}
+	SMB_ASSERT(sizeof(sbuf.f_fsid) == sizeof(fsid));
+	memcpy(fsid, &sbuf.f_fsid, sizeof(fsid));
+
+	keylen = fanotify_dir_key(fsid, &h.fh, key);
+	if (keylen == 0) {
+		*filter = orig_filter;
+		return EINVAL;
+	}
+
+	fs = fanotify_fs_get(fan, fsid, path);
+	if (fs == NULL) {
+		*filter = orig_filter;
+		return ENOMEM;
+	}
+
+	dir = fanotify_dir_get(fs, key, keylen);
+	if (dir == NULL) {
+		*filter = orig_filter;
+		if (fs->num_dirs == 0) {
+			TALLOC_FREE(fs);
+		}
+		return ENOMEM;
+	}
+
+	w = talloc_zero(mem_ctx, struct fanotify_watch_context);
+	if (w == NULL) {
+		*filter = orig_filter;
+		if (dir->watches == NULL) {
+			TALLOC_FREE(dir);
+		}
+		if (fs->num_dirs == 0) {
+			TALLOC_FREE(fs);
+		}
+		return ENOMEM;
+	}
+
+	w->dir = dir;
+	w->callback = callback;
+	w->private_data = private_data;
+	w->filter = orig_filter;
+
+	/*
+	 * From here on the destructor cleans up, w->mask holds what
+	 * has been added to the marks so far
+	 */
+	DLIST_ADD(dir->watches, w);
+	talloc_set_destructor(w, watch_destructor);
+
+	w->path = talloc_strdup(w, path);
+	if (w->path == NULL) {
+		*filter = orig_filter;
+		TALLOC_FREE(w);
+		return ENOMEM;
+	}
+
+	ret = fanotify_fs_add(fs, mask & ~FAN_MODIFY);
+	if (ret != 0) {
+		*filter = orig_filter;
+		TALLOC_FREE(w);
+		return ret;
+	}
+	w->mask = mask & ~FAN_MODIFY;
+
+	if (mask & FAN_MODIFY) {
+		ret = fanotify_dir_add_modify(dir, path);
+		if (ret != 0) {
+			*filter = orig_filter;
+			TALLOC_FREE(w);
+			return ret;
+		}
+		w->mask |= FAN_MODIFY;
+	}
+
+	DEBUG(10, ("fanotify watch for %s mask %llx\n",
+		   path, (unsigned long long)mask));
+
+	(*handle) = w;
+
+	return 0;
+}
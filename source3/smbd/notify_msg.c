@@ -44,6 +44,10 @@ struct notify_context {
 static void notify_handler(struct messaging_context *msg, void *private_data,
 			   uint32_t msg_type, struct server_id src,
 			   DATA_BLOB *data);
+static void notify_batch_handler(struct messaging_context *msg,
+				 void *private_data,
+				 uint32_t msg_type, struct server_id src,
+				 DATA_BLOB *data);
 static int notify_context_destructor(struct notify_context *ctx);
 
 struct notify_context *notify_init(
@@ -90,6 +94,15 @@ struct notify_context *notify_init(
 			TALLOC_FREE(ctx);
 			return NULL;
 		}
+		status = messaging_register(msg, ctx, MSG_SMB_NOTIFY_EVENTS,
+					    notify_batch_handler);
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(1, ("messaging_register failed: %s\n",
+				  nt_errstr(status)));
+			messaging_deregister(msg, MSG_PVFS_NOTIFY, ctx);
+			TALLOC_FREE(ctx);
+			return NULL;
+		}
 	}
 
 	talloc_set_destructor(ctx, notify_context_destructor);
@@ -101,6 +114,7 @@ static int notify_context_destructor(struct notify_context *ctx)
 {
 	if (ctx->callback != NULL) {
 		messaging_deregister(ctx->msg_ctx, MSG_PVFS_NOTIFY, ctx);
+		messaging_deregister(ctx->msg_ctx, MSG_SMB_NOTIFY_EVENTS, ctx);
 	}
 
 	return 0;
@@ -137,6 +151,68 @@ static void notify_handler(struct messaging_context *msg, void *private_data,
 	ctx->callback(ctx->sconn, event.private_data, event_msg->when, &event);
 }
 
+/*
+ * A batch of events collected by notifyd, see NOTIFY_EVENT_MSG_ALIGN
+ */
+
+static void notify_batch_handler(struct messaging_context *msg,
+				 void *private_data,
+				 uint32_t msg_type, struct server_id src,
+				 DATA_BLOB *data)
+{
+	struct notify_context *ctx = talloc_get_type_abort(
+		private_data, struct notify_context);
+	size_t hdrlen = offsetof(struct notify_event_msg, path);
+	size_t ofs = 0;
+
+	/*
+	 * Don't act on a part of a broken batch, check all of it
+	 * first.
+	 */
+	while (ofs < data->length) {
+		size_t len = notify_event_msg_len(data->data + ofs,
+						  data->length - ofs);
+		if (len == 0) {
+			DEBUG(1, ("%s: invalid event at offset %zu, "
+				  "dropping %zu bytes\n", __func__, ofs,
+				  data->length));
+			return;
+		}
+		ofs += len;
+	}
+
+	ofs = 0;
+
+	while (ofs < data->length) {
+		struct notify_event_msg event_msg;
+		struct notify_event event;
+		size_t len;
+
+		len = notify_event_msg_len(data->data + ofs,
+					   data->length - ofs);
+
+		/*
+		 * Copy the header, the sender might not have padded
+		 * properly.
+		 */
+		memcpy(&event_msg, data->data + ofs, hdrlen);
+
+		event.action = event_msg.action;
+		event.path = (const char *)data->data + ofs + hdrlen;
+		event.private_data = event_msg.private_data;
+
+		DEBUG(10, ("%s: Got notify_event action=%u, "
+			   "private_data=%p, path=%s\n", __func__,
+			   (unsigned)event.action, event.private_data,
+			   event.path));
+
+		ctx->callback(ctx->sconn, event.private_data, event_msg.when,
+			      &event);
+
+		ofs += len;
+	}
+}
+
 NTSTATUS notify_add(struct notify_context *ctx,
 		    const char *path, uint32_t filter, uint32_t subdir_filter,
 		    void *private_data)
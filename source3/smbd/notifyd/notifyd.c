@@ -26,6 +26,7 @@
 #include "librpc/gen_ndr/server_id.h"
 #include "lib/dbwrap/dbwrap.h"
 #include "lib/dbwrap/dbwrap_rbt.h"
+#include "lib/util/rbtree.h"
 #include "messages.h"
 #include "tdb.h"
 #include "util_tdb.h"
@@ -37,6 +38,7 @@
 #include "server_id_db_util.h"
 #include "lib/util/iov_buf.h"
 #include "messages_util.h"
+#include "smbprofile.h"
 
 #ifdef CLUSTER_SUPPORT
 #include "ctdb_protocol.h"
@@ -66,6 +68,14 @@ struct notifyd_state {
 	 */
 	struct db_context *entries;
 
+	/*
+	 * Index over the paths in "entries", one node per path
+	 * component. See notifyd_trie_update(). NULL if we ran out of
+	 * memory maintaining it, notifyd_trigger() then looks up
+	 * every parent directory in "entries".
+	 */
+	struct notifyd_trie_node *trie;
+
 	/*
 	 * In the cluster case, this is the place where we store a log
 	 * of all MSG_SMB_NOTIFY_REC_CHANGE messages. We just 1:1
@@ -96,6 +106,64 @@ struct notifyd_state {
 
 	sys_notify_watch_fn sys_notify_watch;
 	struct sys_notify_context *sys_notify_ctx;
+
+	/*
+	 * With "notifyd:batch window" we don't send every event
+	 * right away. For batch_window_msec milliseconds we collect
+	 * the events per client in struct notifyd_batch and then send
+	 * them as one MSG_SMB_NOTIFY_EVENTS message. Indexed by the
+	 * client's server_id.
+	 */
+	unsigned batch_window_msec;
+	unsigned batch_max_events;
+	struct db_context *batch_index;
+	struct notifyd_batch *batches;
+	struct tevent_timer *batch_timer;
+};
+
+/*
+ * A path component in notifyd_state->trie. notifyd_trigger() walks
+ * down the trie along the path of the event. It only looks up the
+ * entries for directories with a watch whose filter could match, and
+ * it stops when no deeper directory is watched.
+ */
+struct notifyd_trie_node {
+	struct rb_node rb_node;
+	struct rb_root children;
+	struct notifyd_trie_node *parent;
+
+	/*
+	 * Union of the filters of all instances watching this
+	 * directory, 0 if it is not watched. subdir_filter != 0 marks
+	 * a recursive watch.
+	 */
+	uint32_t filter;
+	uint32_t subdir_filter;
+
+	size_t namelen;
+	char name[];
+};
+
+/*
+ * Events queued for one client
+ */
+struct notifyd_batch {
+	struct notifyd_batch *prev, *next;
+	struct notifyd_state *state;
+	struct server_id client;
+
+	uint8_t *buf;
+	size_t buflen;
+	size_t num_events;
+
+	/*
+	 * Indexed by private_data and path of the events, the value
+	 * is the last action queued plus the watched path. A repeated
+	 * action for the same file is dropped, the client can't tell
+	 * the difference. The watched path is required to clean up
+	 * after dead clients.
+	 */
+	struct db_context *events;
 };
 
 /*
@@ -217,6 +285,23 @@ struct tevent_req *notifyd_send(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
 		return tevent_req_post(req, ev);
 	}
 
+	state->trie = talloc_zero(state, struct notifyd_trie_node);
+	if (tevent_req_nomem(state->trie, req)) {
+		return tevent_req_post(req, ev);
+	}
+
+	state->batch_window_msec = MAX(
+		lp_parm_int(-1, "notifyd", "batch window", 0), 0);
+	state->batch_max_events = MAX(
+		lp_parm_int(-1, "notifyd", "batch events", 256), 1);
+
+	if (state->batch_window_msec != 0) {
+		state->batch_index = db_open_rbt(state);
+		if (tevent_req_nomem(state->batch_index, req)) {
+			return tevent_req_post(req, ev);
+		}
+	}
+
 	subreq = messaging_handler_send(state, ev, msg_ctx,
 					MSG_SMB_NOTIFY_REC_CHANGE,
 					notifyd_rec_change, state);
@@ -513,6 +598,220 @@ fail:
 	return ok;
 }
 
+static struct notifyd_trie_node *notifyd_trie_entry(struct rb_node *node)
+{
+	return (struct notifyd_trie_node *)
+		((char *)node - offsetof(struct notifyd_trie_node, rb_node));
+}
+
+static int notifyd_trie_cmp(const char *name, size_t namelen,
+			    const struct notifyd_trie_node *node)
+{
+	int ret;
+
+	ret = memcmp(name, node->name, MIN(namelen, node->namelen));
+	if (ret != 0) {
+		return ret;
+	}
+	if (namelen < node->namelen) {
+		return -1;
+	}
+	if (namelen > node->namelen) {
+		return 1;
+	}
+	return 0;
+}
+
+static struct notifyd_trie_node *notifyd_trie_child(
+	struct notifyd_trie_node *node, const char *name, size_t namelen)
+{
+	struct rb_node *n = node->children.rb_node;
+
+	while (n != NULL) {
+		struct notifyd_trie_node *child = notifyd_trie_entry(n);
+		int cmp = notifyd_trie_cmp(name, namelen, child);
+
+		if (cmp < 0) {
+			n = n->rb_left;
+		} else if (cmp > 0) {
+			n = n->rb_right;
+		} else {
+			return child;
+		}
+	}
+
+	return NULL;
+}
+
+static struct notifyd_trie_node *notifyd_trie_add_child(
+	struct notifyd_trie_node *node, const char *name, size_t namelen)
+{
+	struct rb_node **p = &node->children.rb_node;
+	struct rb_node *parent = NULL;
+	struct notifyd_trie_node *child;
+
+	while (*p != NULL) {
+		int cmp;
+
+		parent = *p;
+		child = notifyd_trie_entry(parent);
+		cmp = notifyd_trie_cmp(name, namelen, child);
+
+		if (cmp < 0) {
+			p = &parent->rb_left;
+		} else if (cmp > 0) {
+			p = &parent->rb_right;
+		} else {
+			return child;
+		}
+	}
+
+	child = talloc_size(
+		node, offsetof(struct notifyd_trie_node, name) + namelen);
+	if (child == NULL) {
+		return NULL;
+	}
+	talloc_set_name_const(child, "struct notifyd_trie_node");
+
+	*child = (struct notifyd_trie_node) {
+		.parent = node, .namelen = namelen
+	};
+	memcpy(child->name, name, namelen);
+
+	rb_link_node(&child->rb_node, parent, p);
+	rb_insert_color(&child->rb_node, &node->children);
+
+	return child;
+}
+
+/*
+ * Remove nodes that neither carry a watch nor lead to one
+ */
+
+static void notifyd_trie_prune(struct notifyd_trie_node *node)
+{
+	while ((node->parent != NULL) &&
+	       (node->filter == 0) && (node->subdir_filter == 0) &&
+	       (node->children.rb_node == NULL)) {
+		struct notifyd_trie_node *parent = node->parent;
+
+		rb_erase(&node->rb_node, &parent->children);
+		TALLOC_FREE(node);
+		node = parent;
+	}
+}
+
+struct notifyd_trie_filters {
+	uint32_t filter;
+	uint32_t subdir_filter;
+};
+
+static void notifyd_trie_filters_parser(TDB_DATA key, TDB_DATA data,
+					void *private_data)
+{
+	struct notifyd_trie_filters *f = private_data;
+	struct notifyd_instance *instances = NULL;
+	size_t num_instances = 0;
+	size_t i;
+
+	if (!notifyd_parse_entry(data.dptr, data.dsize, &instances,
+				 &num_instances)) {
+		/*
+		 * Make notifyd_trigger() look at the entry,
+		 * it will complain.
+		 */
+		f->filter = f->subdir_filter = UINT32_MAX;
+		return;
+	}
+
+	for (i=0; i<num_instances; i++) {
+		struct notifyd_instance *instance = &instances[i];
+
+		f->filter |= instance->instance.filter;
+		f->filter |= instance->internal_filter;
+		f->subdir_filter |= instance->instance.subdir_filter;
+		f->subdir_filter |= instance->internal_subdir_filter;
+	}
+}
+
+/*
+ * Make the trie reflect the entry for "path" after a change. Paths
+ * are split at every '/' exactly like notifyd_trigger() does, so
+ * "//" gives an empty component on both sides.
+ */
+
+static void notifyd_trie_update(struct notifyd_state *state,
+				const char *path, size_t pathlen)
+{
+	struct notifyd_trie_filters f = { .filter = 0 };
+	struct notifyd_trie_node *node = state->trie;
+	const char *p, *end;
+
+	if ((node == NULL) || (pathlen == 0) || (path[0] != '/')) {
+		/*
+		 * notifyd_trigger() never looks at relative paths
+		 */
+		return;
+	}
+
+	dbwrap_parse_record(state->entries,
+			    make_tdb_data((const uint8_t *)path, pathlen),
+			    notifyd_trie_filters_parser, &f);
+
+	p = path + 1;
+	end = path + pathlen;
+
+	while (true) {
+		const char *slash = memchr(p, '/', end - p);
+		size_t len = ((slash != NULL) ? slash : end) - p;
+
+		if ((f.filter == 0) && (f.subdir_filter == 0)) {
+			node = notifyd_trie_child(node, p, len);
+			if (node == NULL) {
+				/*
+				 * Deleted an entry we never indexed
+				 */
+				return;
+			}
+		} else {
+			node = notifyd_trie_add_child(node, p, len);
+			if (node == NULL) {
+				DEBUG(1, ("%s: talloc failed, dropping the "
+					  "path index\n", __func__));
+				TALLOC_FREE(state->trie);
+				return;
+			}
+		}
+
+		if (slash == NULL) {
+			break;
+		}
+		p = slash + 1;
+	}
+
+	node->filter = f.filter;
+	node->subdir_filter = f.subdir_filter;
+
+	notifyd_trie_prune(node);
+}
+
+/*
+ * Can an event with "filter" match a watch on "node"? "recursive"
+ * is true if the event is further down than directly in "node".
+ */
+
+static bool notifyd_trie_match(const struct notifyd_trie_node *node,
+			       bool recursive, uint32_t filter)
+{
+	if (node == NULL) {
+		return false;
+	}
+	if (recursive) {
+		return ((node->subdir_filter & filter) != 0);
+	}
+	return ((node->filter & filter) != 0);
+}
+
 static void notifyd_sys_callback(struct sys_notify_context *ctx,
 				 void *private_data, struct notify_event *ev,
 				 uint32_t filter)
@@ -599,6 +898,8 @@ static bool notifyd_rec_change(struct messaging_context *msg_ctx,
 		return true;
 	}
 
+	notifyd_trie_update(state, msg->path, pathlen-1);
+
 	if ((state->log == NULL) || (state->ctdbd_conn == NULL)) {
 		return true;
 	}
@@ -637,6 +938,7 @@ static bool notifyd_rec_change(struct messaging_context *msg_ctx,
 }
 
 struct notifyd_trigger_state {
+	struct notifyd_state *state;
 	struct messaging_context *msg_ctx;
 	struct notify_trigger_msg *msg;
 	bool recursive;
@@ -655,8 +957,9 @@ static bool notifyd_trigger(struct messaging_context *msg_ctx,
 	struct server_id my_id = messaging_server_id(msg_ctx);
 	struct messaging_rec *rec = *prec;
 	struct notifyd_trigger_state tstate;
+	struct notifyd_trie_node *node;
 	const char *path;
-	const char *p, *next_p;
+	const char *p, *next_p, *prev_p;
 
 	if (rec->buf.length < offsetof(struct notify_trigger_msg, path) + 1) {
 		DEBUG(1, ("message too short, ignoring: %u\n",
@@ -668,6 +971,7 @@ static bool notifyd_trigger(struct messaging_context *msg_ctx,
 		return true;
 	}
 
+	tstate.state = state;
 	tstate.msg_ctx = msg_ctx;
 
 	tstate.covered_by_sys_notify = (rec->src.vnn == my_id.vnn);
@@ -686,6 +990,9 @@ static bool notifyd_trigger(struct messaging_context *msg_ctx,
 		return true;
 	}
 
+	node = state->trie;
+	prev_p = path;
+
 	for (p = strchr(path+1, '/'); p != NULL; p = next_p) {
 		ptrdiff_t path_len = p - path;
 		TDB_DATA key;
@@ -700,10 +1007,28 @@ static bool notifyd_trigger(struct messaging_context *msg_ctx,
 		key = (TDB_DATA) { .dptr = discard_const_p(uint8_t, path),
 				   .dsize = path_len };
 
-		dbwrap_parse_record(state->entries, key,
-				    notifyd_trigger_parser, &tstate);
+		if (state->trie == NULL) {
+			dbwrap_parse_record(state->entries, key,
+					    notifyd_trigger_parser, &tstate);
+		} else if (node != NULL) {
+			node = notifyd_trie_child(node, prev_p + 1,
+						  p - prev_p - 1);
+			if (notifyd_trie_match(node, tstate.recursive,
+					       tstate.msg->filter)) {
+				dbwrap_parse_record(
+					state->entries, key,
+					notifyd_trigger_parser, &tstate);
+			}
+		}
+		prev_p = p;
 
 		if (state->peers == NULL) {
+			if ((state->trie != NULL) && (node == NULL)) {
+				/*
+				 * Nothing further down is watched
+				 */
+				break;
+			}
 			continue;
 		}
 
@@ -729,6 +1054,10 @@ static bool notifyd_trigger(struct messaging_context *msg_ctx,
 static void notifyd_send_delete(struct messaging_context *msg_ctx,
 				TDB_DATA key,
 				struct notifyd_instance *instance);
+static bool notifyd_batch_add(struct notifyd_state *state, TDB_DATA key,
+			      const struct notifyd_instance *instance,
+			      const struct notify_event_msg *msg,
+			      const char *path);
 
 static void notifyd_trigger_parser(TDB_DATA key, TDB_DATA data,
 				   void *private_data)
@@ -784,6 +1113,14 @@ static void notifyd_trigger_parser(TDB_DATA key, TDB_DATA data,
 
 		msg.private_data = instance->instance.private_data;
 
+		DO_PROFILE_INC(notifyd_events);
+
+		if ((tstate->state->batch_index != NULL) &&
+		    notifyd_batch_add(tstate->state, key, instance, &msg,
+				      iov[1].iov_base)) {
+			continue;
+		}
+
 		status = messaging_send_iov(
 			tstate->msg_ctx, instance->client,
 			MSG_PVFS_NOTIFY, iov, ARRAY_SIZE(iov), NULL, 0);
@@ -845,6 +1182,266 @@ static void notifyd_send_delete(struct messaging_context *msg_ctx,
 	}
 }
 
+static int notifyd_batch_destructor(struct notifyd_batch *b)
+{
+	struct notifyd_state *state = b->state;
+
+	DLIST_REMOVE(state->batches, b);
+	dbwrap_delete(state->batch_index,
+		      make_tdb_data((uint8_t *)&b->client,
+				    sizeof(b->client)));
+	return 0;
+}
+
+static void notifyd_batch_timer(struct tevent_context *ev,
+				struct tevent_timer *te,
+				struct timeval current_time,
+				void *private_data);
+
+static void notifyd_batch_get_parser(TDB_DATA key, TDB_DATA data,
+				     void *private_data)
+{
+	struct notifyd_batch **pb = private_data;
+
+	if (data.dsize == sizeof(*pb)) {
+		memcpy(pb, data.dptr, sizeof(*pb));
+	}
+}
+
+static struct notifyd_batch *notifyd_batch_get(struct notifyd_state *state,
+					       struct server_id client)
+{
+	TDB_DATA key = make_tdb_data((uint8_t *)&client, sizeof(client));
+	struct notifyd_batch *b = NULL;
+	NTSTATUS status;
+
+	dbwrap_parse_record(state->batch_index, key,
+			    notifyd_batch_get_parser, &b);
+	if (b != NULL) {
+		return b;
+	}
+
+	if (state->batch_timer == NULL) {
+		state->batch_timer = tevent_add_timer(
+			state->ev, state,
+			timeval_current_ofs_msec(state->batch_window_msec),
+			notifyd_batch_timer, state);
+		if (state->batch_timer == NULL) {
+			return NULL;
+		}
+	}
+
+	b = talloc_zero(state, struct notifyd_batch);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->state = state;
+	b->client = client;
+
+	b->events = db_open_rbt(b);
+	if (b->events == NULL) {
+		TALLOC_FREE(b);
+		return NULL;
+	}
+
+	status = dbwrap_store(state->batch_index, key,
+			      make_tdb_data((uint8_t *)&b, sizeof(b)), 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(b);
+		return NULL;
+	}
+	DLIST_ADD_END(state->batches, b);
+	talloc_set_destructor(b, notifyd_batch_destructor);
+
+	return b;
+}
+
+static void notifyd_batch_action_parser(TDB_DATA key, TDB_DATA data,
+					void *private_data)
+{
+	uint32_t *action = private_data;
+
+	if (data.dsize >= sizeof(*action)) {
+		memcpy(action, data.dptr, sizeof(*action));
+	}
+}
+
+static void notifyd_batch_send(struct notifyd_batch *b);
+
+/*
+ * Queue an event for a client. Returns false if the event could not
+ * be queued, the caller has to send it directly then.
+ */
+
+static bool notifyd_batch_add(struct notifyd_state *state, TDB_DATA key,
+			      const struct notifyd_instance *instance,
+			      const struct notify_event_msg *msg,
+			      const char *path)
+{
+	size_t hdrlen = offsetof(struct notify_event_msg, path);
+	size_t pathlen = strlen(path) + 1;
+	size_t len = hdrlen + pathlen;
+	size_t padded = (len + NOTIFY_EVENT_MSG_ALIGN - 1) &
+		~(NOTIFY_EVENT_MSG_ALIGN - 1);
+	size_t ev_keylen = sizeof(msg->private_data) + pathlen;
+	struct notifyd_batch *b;
+	uint32_t last_action = UINT32_MAX;
+	uint8_t *ev_key, *ev_val, *buf;
+	struct iovec iov[2];
+	NTSTATUS status;
+
+	b = notifyd_batch_get(state, instance->client);
+	if (b == NULL) {
+		return false;
+	}
+
+	iov[0] = (struct iovec) {
+		.iov_base = discard_const_p(void *, &msg->private_data),
+		.iov_len = sizeof(msg->private_data) };
+	iov[1] = (struct iovec) {
+		.iov_base = discard_const_p(char, path),
+		.iov_len = pathlen };
+	ev_key = iov_concat(talloc_tos(), iov, ARRAY_SIZE(iov));
+	if (ev_key == NULL) {
+		return false;
+	}
+
+	dbwrap_parse_record(b->events,
+			    make_tdb_data(ev_key, ev_keylen),
+			    notifyd_batch_action_parser, &last_action);
+	if (last_action == msg->action) {
+		DO_PROFILE_INC(notifyd_events_coalesced);
+		TALLOC_FREE(ev_key);
+		return true;
+	}
+
+	iov[0] = (struct iovec) {
+		.iov_base = discard_const_p(uint32_t, &msg->action),
+		.iov_len = sizeof(msg->action) };
+	iov[1] = (struct iovec) { .iov_base = key.dptr,
+				  .iov_len = key.dsize };
+	ev_val = iov_concat(ev_key, iov, ARRAY_SIZE(iov));
+	if (ev_val == NULL) {
+		TALLOC_FREE(ev_key);
+		return false;
+	}
+
+	status = dbwrap_store(
+		b->events,
+		make_tdb_data(ev_key, ev_keylen),
+		make_tdb_data(ev_val, sizeof(msg->action) + key.dsize), 0);
+	TALLOC_FREE(ev_key);
+	if (!NT_STATUS_IS_OK(status)) {
+		return false;
+	}
+
+	buf = talloc_realloc(b, b->buf, uint8_t, b->buflen + padded);
+	if (buf == NULL) {
+		return false;
+	}
+	b->buf = buf;
+
+	buf += b->buflen;
+	memcpy(buf, msg, hdrlen);
+	memcpy(buf + hdrlen, path, pathlen);
+	memset(buf + len, 0, padded - len);
+
+	b->buflen += padded;
+	b->num_events += 1;
+
+	if (b->num_events >= state->batch_max_events) {
+		notifyd_batch_send(b);
+		TALLOC_FREE(b);
+	}
+
+	return true;
+}
+
+static int notifyd_batch_delete_fn(struct db_record *rec,
+				   void *private_data)
+{
+	struct notifyd_batch *b = private_data;
+	TDB_DATA key = dbwrap_record_get_key(rec);
+	TDB_DATA value = dbwrap_record_get_value(rec);
+	struct notifyd_instance instance = { .client = b->client };
+	uint32_t action;
+
+	if ((key.dsize < sizeof(instance.instance.private_data)) ||
+	    (value.dsize < sizeof(action))) {
+		return 0;
+	}
+	memcpy(&instance.instance.private_data, key.dptr,
+	       sizeof(instance.instance.private_data));
+
+	notifyd_send_delete(b->state->msg_ctx,
+			    make_tdb_data(value.dptr + sizeof(action),
+					  value.dsize - sizeof(action)),
+			    &instance);
+	return 0;
+}
+
+static void notifyd_batch_send(struct notifyd_batch *b)
+{
+	struct notifyd_state *state = b->state;
+	struct iovec iov = { .iov_base = b->buf, .iov_len = b->buflen };
+	struct server_id_buf idbuf;
+	uint32_t msg_type;
+	NTSTATUS status;
+
+	if (b->num_events == 0) {
+		return;
+	}
+
+	/*
+	 * The padding is 0, so a single event is a valid
+	 * MSG_PVFS_NOTIFY message.
+	 */
+	msg_type = (b->num_events == 1) ?
+		MSG_PVFS_NOTIFY : MSG_SMB_NOTIFY_EVENTS;
+
+	status = messaging_send_iov(state->msg_ctx, b->client, msg_type,
+				    &iov, 1, NULL, 0);
+
+	DO_PROFILE_INC(notifyd_batches);
+	SMBPROFILE_COUNT_INCREMENT(notifyd_batched_events, profile_p,
+				   b->num_events);
+
+	DBG_DEBUG("Sent %zu events to %s: %s\n", b->num_events,
+		  server_id_str_buf(b->client, &idbuf), nt_errstr(status));
+
+	if (NT_STATUS_EQUAL(status, NT_STATUS_OBJECT_NAME_NOT_FOUND) &&
+	    procid_is_local(&b->client)) {
+		/*
+		 * That process has died
+		 */
+		dbwrap_traverse_read(b->events, notifyd_batch_delete_fn, b,
+				     NULL);
+		return;
+	}
+
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_WARNING("messaging_send_iov returned %s\n",
+			    nt_errstr(status));
+	}
+}
+
+static void notifyd_batch_timer(struct tevent_context *ev,
+				struct tevent_timer *te,
+				struct timeval current_time,
+				void *private_data)
+{
+	struct notifyd_state *state = talloc_get_type_abort(
+		private_data, struct notifyd_state);
+
+	state->batch_timer = NULL;
+
+	while (state->batches != NULL) {
+		struct notifyd_batch *b = state->batches;
+		notifyd_batch_send(b);
+		TALLOC_FREE(b);
+	}
+}
+
 static bool notifyd_get_db(struct messaging_context *msg_ctx,
 			   struct messaging_rec **prec,
 			   void *private_data)
@@ -120,6 +120,41 @@ struct notify_event_msg {
 	char path[];
 };
 
+/*
+ * With "notifyd:batch window" set, notifyd collects the events for a
+ * client for a few milliseconds and sends them in one message. A batch
+ * is an array of notify_event_msg, each padded with 0 bytes to a
+ * multiple of NOTIFY_EVENT_MSG_ALIGN so that the next one is
+ * aligned. Batches with a single event are sent as MSG_PVFS_NOTIFY.
+ */
+
+/* MSG_SMB_NOTIFY_EVENTS payload */
+#define NOTIFY_EVENT_MSG_ALIGN 8
+
+/*
+ * Return the padded length of the notify_event_msg at the start of
+ * buf, 0 if it is invalid.
+ */
+static inline size_t notify_event_msg_len(const uint8_t *buf, size_t buflen)
+{
+	size_t hdrlen = offsetof(struct notify_event_msg, path);
+	const uint8_t *nul;
+	size_t len;
+
+	if (buflen < hdrlen + 1) {
+		return 0;
+	}
+	nul = memchr(buf + hdrlen, 0, buflen - hdrlen);
+	if (nul == NULL) {
+		return 0;
+	}
+	len = nul - buf + 1;
+	len = (len + NOTIFY_EVENT_MSG_ALIGN - 1) &
+		~(NOTIFY_EVENT_MSG_ALIGN - 1);
+
+	return MIN(len, buflen);
+}
+
 struct sys_notify_context;
 
 typedef int (*sys_notify_watch_fn)(TALLOC_CTX *mem_ctx,
@@ -21,6 +21,496 @@
 #include "notifyd.h"
 #include "messages.h"
 #include "lib/util/server_id_db.h"
+#include "smbd/smbd.h"
+
+static void notifyd_tests_rec_change(struct messaging_context *msg_ctx,
+				     struct server_id notifyd,
+				     const char *path, uint32_t filter,
+				     uint32_t subdir_filter)
+{
+	struct notify_rec_change_msg msg = {
+		.instance.filter = filter,
+		.instance.subdir_filter = subdir_filter
+	};
+	struct iovec iov[2];
+	NTSTATUS status;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = offsetof(struct notify_rec_change_msg, path);
+	iov[1].iov_base = discard_const_p(char, path);
+	iov[1].iov_len = strlen(path)+1;
+
+	status = messaging_send_iov(
+		msg_ctx, notifyd, MSG_SMB_NOTIFY_REC_CHANGE,
+		iov, ARRAY_SIZE(iov), NULL, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_send_iov returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+}
+
+/*
+ * Wait until notifyd has processed everything we sent so far
+ */
+
+static void notifyd_tests_ping(struct tevent_context *ev,
+			       struct messaging_context *msg_ctx,
+			       struct server_id notifyd)
+{
+	struct tevent_req *req;
+	bool ok;
+
+	req = messaging_read_send(ev, ev, msg_ctx, MSG_PONG);
+	if (req == NULL) {
+		fprintf(stderr, "messaging_read_send failed\n");
+		exit(1);
+	}
+	messaging_send_buf(msg_ctx, notifyd, MSG_PING, NULL, 0);
+
+	ok = tevent_req_poll(req, ev);
+	if (!ok) {
+		fprintf(stderr, "tevent_req_poll failed\n");
+		exit(1);
+	}
+	TALLOC_FREE(req);
+}
+
+static void notifyd_tests_trigger(struct messaging_context *msg_ctx,
+				  struct server_id notifyd,
+				  const char *path, uint32_t filter)
+{
+	struct notify_trigger_msg msg = {
+		.when = timespec_current(),
+		.action = NOTIFY_ACTION_ADDED,
+		.filter = filter
+	};
+	struct iovec iov[2];
+	NTSTATUS status;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = offsetof(struct notify_trigger_msg, path);
+	iov[1].iov_base = discard_const_p(char, path);
+	iov[1].iov_len = strlen(path)+1;
+
+	status = messaging_send_iov(
+		msg_ctx, notifyd, MSG_SMB_NOTIFY_TRIGGER,
+		iov, ARRAY_SIZE(iov), NULL, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_send_iov returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+}
+
+/*
+ * Wait until all events notifyd generated so far have arrived. With
+ * "notifyd:batch window" they might be queued for that long.
+ */
+
+static void notifyd_tests_settle(struct tevent_context *ev,
+				 struct messaging_context *msg_ctx,
+				 struct server_id notifyd)
+{
+	int window = lp_parm_int(-1, "notifyd", "batch window", 0);
+
+	notifyd_tests_ping(ev, msg_ctx, notifyd);
+
+	if (window > 0) {
+		struct tevent_req *req;
+		bool ok;
+
+		req = tevent_wakeup_send(
+			ev, ev, timeval_current_ofs_msec(window * 2));
+		if (req == NULL) {
+			fprintf(stderr, "tevent_wakeup_send failed\n");
+			exit(1);
+		}
+		ok = tevent_req_poll(req, ev);
+		if (!ok) {
+			fprintf(stderr, "tevent_req_poll failed\n");
+			exit(1);
+		}
+		TALLOC_FREE(req);
+		notifyd_tests_ping(ev, msg_ctx, notifyd);
+	}
+}
+
+static void notifyd_tests_got_event(struct messaging_context *msg,
+				    void *private_data,
+				    uint32_t msg_type,
+				    struct server_id server_id,
+				    DATA_BLOB *data)
+{
+	unsigned *num_events = private_data;
+	size_t ofs = 0;
+
+	while (ofs < data->length) {
+		size_t len = notify_event_msg_len(data->data + ofs,
+						  data->length - ofs);
+		if (len == 0) {
+			break;
+		}
+		*num_events += 1;
+		ofs += len;
+	}
+}
+
+static void notifyd_tests_register_events(struct messaging_context *msg_ctx,
+					  unsigned *num_events)
+{
+	NTSTATUS status;
+
+	status = messaging_register(msg_ctx, num_events, MSG_PVFS_NOTIFY,
+				    notifyd_tests_got_event);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_register returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+	status = messaging_register(msg_ctx, num_events,
+				    MSG_SMB_NOTIFY_EVENTS,
+				    notifyd_tests_got_event);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_register returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+}
+
+static void notifyd_tests_deregister_events(
+	struct messaging_context *msg_ctx, unsigned *num_events)
+{
+	messaging_deregister(msg_ctx, MSG_PVFS_NOTIFY, num_events);
+	messaging_deregister(msg_ctx, MSG_SMB_NOTIFY_EVENTS, num_events);
+}
+
+static void notifyd_tests_expect_events(struct tevent_context *ev,
+					struct messaging_context *msg_ctx,
+					struct server_id notifyd,
+					const char *what,
+					unsigned *num_events,
+					unsigned expected)
+{
+	notifyd_tests_settle(ev, msg_ctx, notifyd);
+
+	if (*num_events != expected) {
+		fprintf(stderr, "%s: expected %u events, got %u\n",
+			what, expected, *num_events);
+		exit(1);
+	}
+	*num_events = 0;
+}
+
+/*
+ * Count the nodes of notifyd's watch trie in its talloc report. 0
+ * means we can't tell, the root node always exists.
+ */
+
+static unsigned notifyd_tests_num_trie_nodes(
+	struct tevent_context *ev, struct messaging_context *msg_ctx,
+	struct server_id notifyd)
+{
+	static const char node_name[] = "struct notifyd_trie_node ";
+	struct tevent_req *req;
+	struct messaging_rec *rec;
+	char *report, *line;
+	unsigned num_nodes = 0;
+	int ret;
+	bool ok;
+
+	req = messaging_read_send(ev, ev, msg_ctx, MSG_POOL_USAGE);
+	if (req == NULL) {
+		fprintf(stderr, "messaging_read_send failed\n");
+		exit(1);
+	}
+	messaging_send_buf(msg_ctx, notifyd, MSG_REQ_POOL_USAGE, NULL, 0);
+
+	ok = tevent_req_poll(req, ev);
+	if (!ok) {
+		fprintf(stderr, "tevent_req_poll failed\n");
+		exit(1);
+	}
+	ret = messaging_read_recv(req, talloc_tos(), &rec);
+	TALLOC_FREE(req);
+	if (ret != 0) {
+		fprintf(stderr, "messaging_read_recv failed: %s\n",
+			strerror(ret));
+		exit(1);
+	}
+
+	report = talloc_strndup(rec, (const char *)rec->buf.data,
+				rec->buf.length);
+	if (report == NULL) {
+		fprintf(stderr, "talloc_strndup failed\n");
+		exit(1);
+	}
+
+	for (line = report; line != NULL; line = strchr(line, '\n')) {
+		line += strspn(line, "\n ");
+		if (strncmp(line, node_name, sizeof(node_name)-1) == 0) {
+			num_nodes += 1;
+		}
+	}
+
+	TALLOC_FREE(rec);
+	return num_nodes;
+}
+
+/*
+ * Check that the watch trie finds the right watches: Recursive
+ * watches see events anywhere below them, non-recursive ones only
+ * for their direct children, and removing the watches removes the
+ * trie nodes again.
+ */
+
+static void notifyd_tests_trie(struct tevent_context *ev,
+			       struct messaging_context *msg_ctx,
+			       struct server_id notifyd)
+{
+	unsigned num_events = 0;
+	unsigned num_nodes, num_nodes_after;
+	const uint32_t filter = FILE_NOTIFY_CHANGE_FILE_NAME;
+
+	notifyd_tests_register_events(msg_ctx, &num_events);
+
+	notifyd_tests_settle(ev, msg_ctx, notifyd);
+	num_nodes = notifyd_tests_num_trie_nodes(ev, msg_ctx, notifyd);
+	num_events = 0;
+
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/rec",
+				 filter, filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/rec/file", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/rec/a/b/c/file",
+			      filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/recfile", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/other/file", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/rec/file",
+			      FILE_NOTIFY_CHANGE_SIZE);
+	notifyd_tests_expect_events(ev, msg_ctx, notifyd, "recursive",
+				    &num_events, 2);
+
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/flat", filter, 0);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/file", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/sub/file",
+			      filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/sub/deep/file",
+			      filter);
+	notifyd_tests_expect_events(ev, msg_ctx, notifyd, "non-recursive",
+				    &num_events, 1);
+
+	/*
+	 * A watch below a non-recursive one, the trie has to walk
+	 * through /trie/flat/sub without a watch there.
+	 */
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/flat/sub/deep",
+				 filter, 0);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/sub/deep/file",
+			      filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/sub/file",
+			      filter);
+	notifyd_tests_expect_events(ev, msg_ctx, notifyd, "nested",
+				    &num_events, 1);
+
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/rec", 0, 0);
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/flat", 0, 0);
+	notifyd_tests_rec_change(msg_ctx, notifyd, "/trie/flat/sub/deep",
+				 0, 0);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/rec/file", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/file", filter);
+	notifyd_tests_trigger(msg_ctx, notifyd, "/trie/flat/sub/deep/file",
+			      filter);
+	notifyd_tests_expect_events(ev, msg_ctx, notifyd, "removed",
+				    &num_events, 0);
+
+	num_nodes_after = notifyd_tests_num_trie_nodes(ev, msg_ctx, notifyd);
+	if (num_nodes == 0) {
+		printf("notifyd has no talloc report, "
+		       "not checking the trie size\n");
+	} else if (num_nodes_after != num_nodes) {
+		fprintf(stderr, "%u trie nodes before, %u after removing "
+			"all watches\n", num_nodes, num_nodes_after);
+		exit(1);
+	}
+
+	notifyd_tests_deregister_events(msg_ctx, &num_events);
+
+	printf("trie tests passed\n");
+}
+
+static size_t notifyd_tests_put_event(uint8_t *buf, const char *path,
+				      void *private_data)
+{
+	struct notify_event_msg msg = {
+		.when = timespec_current(),
+		.private_data = private_data,
+		.action = NOTIFY_ACTION_ADDED
+	};
+	size_t hdrlen = offsetof(struct notify_event_msg, path);
+	size_t len = hdrlen + strlen(path) + 1;
+
+	memcpy(buf, &msg, hdrlen);
+	memcpy(buf + hdrlen, path, strlen(path) + 1);
+
+	return (len + NOTIFY_EVENT_MSG_ALIGN - 1) &
+		~(NOTIFY_EVENT_MSG_ALIGN - 1);
+}
+
+static void notifyd_tests_count_event(struct smbd_server_connection *sconn,
+				      void *private_data,
+				      struct timespec when,
+				      const struct notify_event *e)
+{
+	unsigned *num_events = private_data;
+	*num_events += 1;
+}
+
+/*
+ * Feed smbd's MSG_SMB_NOTIFY_EVENTS handler broken batches. Each of
+ * them starts with a valid event, which must not be delivered either.
+ */
+
+static void notifyd_tests_bad_batches(struct tevent_context *ev,
+				      struct messaging_context *msg_ctx)
+{
+	struct server_id self = messaging_server_id(msg_ctx);
+	struct notify_context *notify;
+	unsigned num_good = 0, num_bad = 0;
+	uint8_t buf[256];
+	size_t len;
+	NTSTATUS status;
+
+	notify = notify_init(talloc_tos(), msg_ctx, ev, NULL,
+			     notifyd_tests_count_event);
+	if (notify == NULL) {
+		fprintf(stderr, "notify_init failed\n");
+		exit(1);
+	}
+
+	/* The second event is cut off in the middle of its path */
+	memset(buf, 0, sizeof(buf));
+	len = notifyd_tests_put_event(buf, "/bad/first", &num_bad);
+	len += notifyd_tests_put_event(buf + len, "/bad/truncated",
+				       &num_bad);
+	len -= NOTIFY_EVENT_MSG_ALIGN;
+	status = messaging_send_buf(msg_ctx, self, MSG_SMB_NOTIFY_EVENTS,
+				    buf, len);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_send_buf returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+
+	/* Trailing bytes too short for another event header */
+	memset(buf, 0, sizeof(buf));
+	len = notifyd_tests_put_event(buf, "/bad/first", &num_bad);
+	len += 5;
+	status = messaging_send_buf(msg_ctx, self, MSG_SMB_NOTIFY_EVENTS,
+				    buf, len);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_send_buf returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+
+	/* A good one, the last event does not need padding */
+	memset(buf, 0, sizeof(buf));
+	len = notifyd_tests_put_event(buf, "/good/first", &num_good);
+	len += notifyd_tests_put_event(buf + len, "/good/second1",
+				       &num_good);
+	len -= 2;
+	status = messaging_send_buf(msg_ctx, self, MSG_SMB_NOTIFY_EVENTS,
+				    buf, len);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "messaging_send_buf returned %s\n",
+			nt_errstr(status));
+		exit(1);
+	}
+
+	/* Messages to ourselves arrive in order */
+	while (num_good < 2) {
+		if (tevent_loop_once(ev) != 0) {
+			fprintf(stderr, "tevent_loop_once failed\n");
+			exit(1);
+		}
+	}
+
+	if ((num_good != 2) || (num_bad != 0)) {
+		fprintf(stderr, "bad batches: %u good events, %u from "
+			"bad batches\n", num_good, num_bad);
+		exit(1);
+	}
+
+	TALLOC_FREE(notify);
+
+	printf("bad batch tests passed\n");
+}
+
+/*
+ * Benchmark notifyd_trigger: Watch NUM_STORM_DIRS profile-like
+ * directories non-recursively and fire NUM_STORM_EVENTS events at
+ * notifyd. Half of the events are for files directly in a watched
+ * directory, the other half are a few levels below, where nobody
+ * is interested. This takes a while, it only runs with
+ * --event-storm.
+ */
+
+#define NUM_STORM_DIRS 100000
+#define NUM_STORM_EVENTS 500000
+
+static void notifyd_tests_event_storm(struct tevent_context *ev,
+				      struct messaging_context *msg_ctx,
+				      struct server_id notifyd)
+{
+	unsigned num_events = 0;
+	struct timeval start;
+	char path[256];
+	unsigned i;
+
+	notifyd_tests_register_events(msg_ctx, &num_events);
+
+	for (i=0; i<NUM_STORM_DIRS; i++) {
+		snprintf(path, sizeof(path),
+			 "/storm/profiles/user%u/AppData/Roaming", i);
+		notifyd_tests_rec_change(msg_ctx, notifyd, path,
+					 FILE_NOTIFY_CHANGE_FILE_NAME, 0);
+	}
+	notifyd_tests_ping(ev, msg_ctx, notifyd);
+
+	start = timeval_current();
+
+	for (i=0; i<NUM_STORM_EVENTS; i++) {
+		snprintf(path, sizeof(path),
+			 "/storm/profiles/user%u/AppData/Roaming/%s%u",
+			 (i/2) % NUM_STORM_DIRS,
+			 (i % 2) ? "Microsoft/Windows/Recent/file" : "file",
+			 i);
+		notifyd_tests_trigger(msg_ctx, notifyd, path,
+				      FILE_NOTIFY_CHANGE_FILE_NAME);
+	}
+	notifyd_tests_ping(ev, msg_ctx, notifyd);
+
+	printf("%u triggers on %u watched directories: %f seconds, "
+	       "%u events received\n", (unsigned)NUM_STORM_EVENTS,
+	       (unsigned)NUM_STORM_DIRS, timeval_elapsed(&start),
+	       num_events);
+
+	/*
+	 * Only the events directly in the watched directories count,
+	 * all paths are different.
+	 */
+	notifyd_tests_expect_events(ev, msg_ctx, notifyd, "storm",
+				    &num_events, NUM_STORM_EVENTS/2);
+
+	for (i=0; i<NUM_STORM_DIRS; i++) {
+		snprintf(path, sizeof(path),
+			 "/storm/profiles/user%u/AppData/Roaming", i);
+		notifyd_tests_rec_change(msg_ctx, notifyd, path, 0, 0);
+	}
+	notifyd_tests_ping(ev, msg_ctx, notifyd);
+
+	notifyd_tests_deregister_events(msg_ctx, &num_events);
+}
 
 int main(int argc, const char *argv[])
 {
@@ -29,12 +519,15 @@ int main(int argc, const char *argv[])
 	struct messaging_context *msg_ctx;
 	struct server_id_db *names;
 	struct server_id notifyd;
-	struct tevent_req *req;
+	bool event_storm = false;
 	unsigned i;
 	bool ok;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <smb.conf-file>\n", argv[0]);
+	if ((argc == 3) && (strcmp(argv[2], "--event-storm") == 0)) {
+		event_storm = true;
+	} else if (argc != 2) {
+		fprintf(stderr, "Usage: %s <smb.conf-file> [--event-storm]\n",
+			argv[0]);
 		exit(1);
 	}
 
@@ -100,17 +593,14 @@ int main(int argc, const char *argv[])
 		}
 	}
 
-	req = messaging_read_send(ev, ev, msg_ctx, MSG_PONG);
-	if (req == NULL) {
-		fprintf(stderr, "messaging_read_send failed\n");
-		exit(1);
-	}
-	messaging_send_buf(msg_ctx, notifyd, MSG_PING, NULL, 0);
+	notifyd_tests_ping(ev, msg_ctx, notifyd);
 
-	ok = tevent_req_poll(req, ev);
-	if (!ok) {
-		fprintf(stderr, "tevent_req_poll failed\n");
-		exit(1);
+	notifyd_tests_trie(ev, msg_ctx, notifyd);
+
+	notifyd_tests_bad_batches(ev, msg_ctx);
+
+	if (event_storm) {
+		notifyd_tests_event_storm(ev, msg_ctx, notifyd);
 	}
 
 	TALLOC_FREE(frame);
@@ -42,6 +42,7 @@
 #include "lib/util/sys_rw_data.h"
 #include "serverid.h"
 #include "system/threads.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
 
 /* Internal message queue for deferred opens. */
 struct pending_message_list {
@@ -1014,6 +1015,20 @@ void smbd_setup_sig_hup_handler(struct smbd_server_connection *sconn)
 	}
 }
 
+/*
+ * The thread pool for async file system calls is created the first
+ * time it is needed
+ */
+int smbd_init_pool(struct smbd_server_connection *sconn)
+{
+	if (sconn->pool != NULL) {
+		return 0;
+	}
+
+	return pthreadpool_tevent_init(sconn, lp_aio_max_threads(),
+				       &sconn->pool);
+}
+
 static void smbd_conf_updated(struct messaging_context *msg,
 			      void *private_data,
 			      uint32_t msg_type,
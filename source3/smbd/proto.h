@@ -80,11 +80,13 @@ NTSTATUS schedule_aio_write_and_X(connection_struct *conn,
 			      files_struct *fsp, const char *data,
 			      off_t startpos,
 			      size_t numtowrite);
+bool smb2_aio_read_possible(connection_struct *conn,
+			    files_struct *fsp,
+			    size_t smb_maxcnt);
 NTSTATUS schedule_smb2_aio_read(connection_struct *conn,
 				struct smb_request *smbreq,
 				files_struct *fsp,
-				TALLOC_CTX *ctx,
-				DATA_BLOB *preadbuf,
+				uint8_t *preadbuf,
 				off_t startpos,
 				size_t smb_maxcnt);
 NTSTATUS schedule_aio_smb2_write(connection_struct *conn,
@@ -208,6 +210,12 @@ bool dptr_get_priv(struct dptr_struct *dptr);
 void dptr_set_priv(struct dptr_struct *dptr);
 bool dptr_SearchDir(struct dptr_struct *dptr, const char *name, long *poffset, SMB_STRUCT_STAT *pst);
 void dptr_init_search_op(struct dptr_struct *dptr);
+struct smbd_dircache_dir *dptr_dircache(struct dptr_struct *dptr);
+struct tevent_req *dptr_prefetch_send(TALLOC_CTX *mem_ctx,
+				      struct tevent_context *ev,
+				      struct dptr_struct *dptr,
+				      size_t max_entries);
+int dptr_prefetch_recv(struct tevent_req *req);
 bool dptr_fill(struct smbd_server_connection *sconn,
 	       char *buf1,unsigned int key);
 struct dptr_struct *dptr_fetch(struct smbd_server_connection *sconn,
@@ -241,6 +249,22 @@ NTSTATUS can_delete_directory(struct connection_struct *conn,
 bool have_file_open_below(connection_struct *conn,
 			const struct smb_filename *name);
 
+/* The following definitions come from smbd/dircache.c  */
+
+struct smbd_dircache_dir *smbd_dircache_get(
+	connection_struct *conn, const struct smb_filename *smb_dname);
+bool smbd_dircache_lookup(struct smbd_dircache_dir *d,
+			  struct smb_filename *smb_fname,
+			  uint32_t *mode);
+void smbd_dircache_store(struct smbd_dircache_dir *d,
+			 const struct smb_filename *smb_fname,
+			 uint32_t mode);
+bool smbd_dircache_notify(struct smbd_server_connection *sconn,
+			  void *private_data,
+			  const struct notify_event *e);
+void smbd_dircache_close_conn(connection_struct *conn);
+void smbd_dircache_flush_all(struct smbd_server_connection *sconn);
+
 /* The following definitions come from smbd/dmapi.c  */
 
 const void *dmapi_get_current_session(void);
@@ -567,6 +591,20 @@ int inotify_watch(TALLOC_CTX *mem_ctx,
 		  void *private_data,
 		  void *handle_p);
 
+/* The following definitions come from smbd/notify_fanotify.c  */
+
+int fanotify_watch(TALLOC_CTX *mem_ctx,
+		   struct sys_notify_context *ctx,
+		   const char *path,
+		   uint32_t *filter,
+		   uint32_t *subdir_filter,
+		   void (*callback)(struct sys_notify_context *ctx,
+				    void *private_data,
+				    struct notify_event *ev,
+				    uint32_t filter),
+		   void *private_data,
+		   void *handle_p);
+
 int fam_watch(TALLOC_CTX *mem_ctx,
 	      struct sys_notify_context *ctx,
 	      const char *path,
@@ -803,6 +841,7 @@ int posix_sys_acl_blob_get_fd(vfs_handle_struct *handle,
 
 void smbd_setup_sig_term_handler(struct smbd_server_connection *sconn);
 void smbd_setup_sig_hup_handler(struct smbd_server_connection *sconn);
+int smbd_init_pool(struct smbd_server_connection *sconn);
 bool srv_send_smb(struct smbXsrv_connection *xconn, char *buffer,
 		  bool no_signing, uint32_t seqnum,
 		  bool do_encrypt,
@@ -1111,6 +1150,13 @@ void smbd_send_stat_cache_delete_message(struct messaging_context *msg_ctx,
 void send_stat_cache_delete_message(struct messaging_context *msg_ctx,
 				    const char *name);
 void stat_cache_delete(const char *name);
+int stat_cache_name_index_lookup(connection_struct *conn,
+				 const char *path,
+				 const char *name,
+				 TALLOC_CTX *mem_ctx,
+				 char **found_name);
+void stat_cache_name_index_flush(void);
+void stat_cache_name_index_close_conn(connection_struct *conn);
 struct TDB_DATA;
 unsigned int fast_string_hash(struct TDB_DATA *key);
 bool reset_stat_cache( void );
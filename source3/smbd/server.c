@@ -60,6 +60,7 @@
 
 struct smbd_open_socket;
 struct smbd_child_pid;
+struct smbd_spare_child;
 
 struct smbd_parent_context {
 	bool interactive;
@@ -78,6 +79,11 @@ struct smbd_parent_context {
 	struct server_id notifyd;
 
 	struct tevent_timer *cleanup_te;
+
+	/* pre-forked children waiting for a connection */
+	struct smbd_spare_child *spares;
+	size_t num_spares;
+	struct tevent_timer *prefork_te;
 };
 
 struct smbd_open_socket {
@@ -92,6 +98,12 @@ struct smbd_child_pid {
 	pid_t pid;
 };
 
+struct smbd_spare_child {
+	struct smbd_spare_child *prev, *next;
+	pid_t pid;
+	bool ready;
+};
+
 extern void start_epmd(struct tevent_context *ev_ctx,
 		       struct messaging_context *msg_ctx);
 
@@ -104,6 +116,9 @@ extern void start_fssd(struct tevent_context *ev_ctx,
 extern void start_mdssd(struct tevent_context *ev_ctx,
 			struct messaging_context *msg_ctx);
 
+static void smbd_prefork_schedule(struct smbd_parent_context *parent,
+				  struct timeval when);
+
 /*******************************************************************
  What to do when smb.conf is updated.
  ********************************************************************/
@@ -122,6 +137,10 @@ static void smbd_parent_conf_updated(struct messaging_context *msg,
 	change_to_root_user();
 	reload_services(NULL, NULL, false);
 	printing_subsystem_update(ev_ctx, msg, false);
+
+	if (am_parent != NULL) {
+		smbd_prefork_schedule(am_parent, timeval_zero());
+	}
 }
 
 /*******************************************************************
@@ -341,6 +360,12 @@ static struct tevent_req *notifyd_req(struct messaging_context *msg_ctx,
 		}
 #endif
 
+#ifdef HAVE_FANOTIFY
+		if (lp_parm_bool(-1, "notify", "fanotify", false)) {
+			sys_notify_watch = fanotify_watch;
+		}
+#endif
+
 #ifdef HAVE_FAM
 		if (lp_parm_bool(-1, "notify", "fam",
 				 (sys_notify_watch == NULL))) {
@@ -418,6 +443,8 @@ static bool smbd_notifyd_init(struct messaging_context *msg, bool interactive,
 	}
 	tevent_req_set_callback(req, notifyd_stopped, msg);
 
+	smbprofile_dump_setup(ev);
+
 	/* Block those signals that we are not handling */
 	BlockSignals(True, SIGHUP);
 	BlockSignals(True, SIGUSR1);
@@ -772,6 +799,9 @@ static void cleanupd_started(struct tevent_req *req)
 	}
 }
 
+static void smbd_prefork_child_exited(struct smbd_parent_context *parent,
+				      pid_t pid);
+
 static void remove_child_pid(struct smbd_parent_context *parent,
 			     pid_t pid,
 			     bool unclean_shutdown)
@@ -796,6 +826,8 @@ static void remove_child_pid(struct smbd_parent_context *parent,
 		return;
 	}
 
+	smbd_prefork_child_exited(parent, pid);
+
 	if (pid == procid_to_pid(&parent->cleanupd)) {
 		struct tevent_req *req;
 
@@ -941,6 +973,283 @@ static void smbd_open_socket_close_fn(struct tevent_context *ev,
 	close(fd);
 }
 
+/****************************************************************************
+ Pre-forked children.
+
+ With "smbd:prefork children" set, the parent keeps that many children
+ around that went through smbd_reinit_after_fork() already. Accepted
+ sockets are passed to them via MSG_SMB_PREFORK_CONNECTION instead of
+ forking per connection. Like any other smbd child a spare serves
+ exactly one client, so the parent refills the pool afterwards, at
+ most "smbd:prefork spawn rate" children at a time.
+****************************************************************************/
+
+static bool smbd_prefork_connection_filter(struct messaging_rec *rec,
+					   void *private_data)
+{
+	struct server_id *parent_id = (struct server_id *)private_data;
+
+	if (rec->msg_type != MSG_SMB_PREFORK_CONNECTION) {
+		return false;
+	}
+	if (rec->num_fds != 1) {
+		return false;
+	}
+	return (rec->src.pid == parent_id->pid);
+}
+
+static void smbd_prefork_child(struct tevent_context *ev,
+			       struct messaging_context *msg_ctx,
+			       struct server_id parent_id)
+{
+	struct tevent_req *req;
+	struct messaging_rec *rec = NULL;
+	NTSTATUS status;
+	int ret;
+	int fd;
+
+	/*
+	 * smbd_process() reloads smb.conf if it changed, don't run
+	 * the parent's handler while we wait.
+	 */
+	messaging_deregister(msg_ctx, MSG_SMB_CONF_UPDATED, ev);
+
+	req = messaging_filtered_read_send(ev, ev, msg_ctx,
+					   smbd_prefork_connection_filter,
+					   &parent_id);
+	if (req == NULL) {
+		DEBUG(0, ("smbd_prefork_child: "
+			  "messaging_filtered_read_send failed\n"));
+		return;
+	}
+
+	status = messaging_send(msg_ctx, parent_id, MSG_SMB_PREFORK_READY,
+				&data_blob_null);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(1, ("smbd_prefork_child: messaging_send failed: %s\n",
+			  nt_errstr(status)));
+		return;
+	}
+
+	if (!tevent_req_poll(req, ev)) {
+		DEBUG(0, ("smbd_prefork_child: tevent_req_poll failed: %s\n",
+			  strerror(errno)));
+		return;
+	}
+
+	ret = messaging_filtered_read_recv(req, talloc_tos(), &rec);
+	TALLOC_FREE(req);
+	if (ret != 0) {
+		DEBUG(1, ("smbd_prefork_child: "
+			  "messaging_filtered_read_recv failed: %s\n",
+			  strerror(ret)));
+		return;
+	}
+
+	fd = rec->fds[0];
+	TALLOC_FREE(rec);
+
+	DEBUG(10, ("smbd_prefork_child: got connection fd %d\n", fd));
+
+	smbd_process(ev, msg_ctx, fd, false);
+}
+
+static bool smbd_prefork_spawn(struct smbd_parent_context *parent)
+{
+	struct smbd_spare_child *spare;
+	pid_t pid;
+
+	spare = talloc_zero(parent, struct smbd_spare_child);
+	if (spare == NULL) {
+		DEBUG(0, ("smbd_prefork_spawn: talloc failed\n"));
+		return false;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		struct tevent_context *ev = parent->ev_ctx;
+		struct messaging_context *msg_ctx = parent->msg_ctx;
+		struct server_id parent_id = messaging_server_id(msg_ctx);
+		NTSTATUS status;
+
+		talloc_free(parent);
+		parent = NULL;
+
+		CatchChild();
+
+		status = smbd_reinit_after_fork(msg_ctx, ev, true, NULL);
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(0, ("smbd_prefork_spawn: reinit_after_fork() "
+				  "failed: %s\n", nt_errstr(status)));
+			exit_server_cleanly("prefork child failed to start");
+			return false;
+		}
+
+		smbd_prefork_child(ev, msg_ctx, parent_id);
+		exit_server_cleanly("end of prefork child");
+		return false;
+	}
+
+	if (pid < 0) {
+		DEBUG(0, ("smbd_prefork_spawn: fork() failed: %s\n",
+			  strerror(errno)));
+		TALLOC_FREE(spare);
+		return false;
+	}
+
+	spare->pid = pid;
+	DLIST_ADD_END(parent->spares, spare);
+	parent->num_spares += 1;
+
+	add_child_pid(parent, pid);
+	return true;
+}
+
+static void smbd_prefork_refill(struct tevent_context *ev,
+				struct tevent_timer *te,
+				struct timeval current_time,
+				void *private_data);
+
+static void smbd_prefork_schedule(struct smbd_parent_context *parent,
+				  struct timeval when)
+{
+	int num_spares = lp_parm_int(-1, "smbd", "prefork children", 0);
+
+	if (parent->interactive) {
+		return;
+	}
+	if ((num_spares <= 0) || (parent->num_spares >= num_spares)) {
+		return;
+	}
+	if (parent->prefork_te != NULL) {
+		return;
+	}
+
+	parent->prefork_te = tevent_add_timer(parent->ev_ctx, parent, when,
+					      smbd_prefork_refill, parent);
+	if (parent->prefork_te == NULL) {
+		DEBUG(1, ("smbd_prefork_schedule: tevent_add_timer failed\n"));
+	}
+}
+
+static void smbd_prefork_refill(struct tevent_context *ev,
+				struct tevent_timer *te,
+				struct timeval current_time,
+				void *private_data)
+{
+	struct smbd_parent_context *parent = talloc_get_type_abort(
+		private_data, struct smbd_parent_context);
+	int num_spares = lp_parm_int(-1, "smbd", "prefork children", 0);
+	int spawn_rate = lp_parm_int(-1, "smbd", "prefork spawn rate", 10);
+	int i;
+
+	parent->prefork_te = NULL;
+
+	for (i=0; i<spawn_rate; i++) {
+		if (parent->num_spares >= num_spares) {
+			return;
+		}
+		if (!allowable_number_of_smbd_processes(parent)) {
+			/*
+			 * We'll be called again when a child exits
+			 */
+			return;
+		}
+		if (!smbd_prefork_spawn(parent)) {
+			break;
+		}
+	}
+
+	/*
+	 * Give the parent some air to accept connections before
+	 * forking the next batch.
+	 */
+	smbd_prefork_schedule(parent, timeval_current_ofs_msec(100));
+}
+
+static void smbd_prefork_child_ready(struct messaging_context *msg_ctx,
+				     void *private_data,
+				     uint32_t msg_type,
+				     struct server_id server_id,
+				     DATA_BLOB *data)
+{
+	struct smbd_spare_child *spare;
+
+	if (am_parent == NULL) {
+		return;
+	}
+
+	for (spare = am_parent->spares; spare != NULL; spare = spare->next) {
+		if (spare->pid == server_id.pid) {
+			spare->ready = true;
+			return;
+		}
+	}
+}
+
+static void smbd_prefork_child_exited(struct smbd_parent_context *parent,
+				      pid_t pid)
+{
+	struct smbd_spare_child *spare;
+
+	for (spare = parent->spares; spare != NULL; spare = spare->next) {
+		if (spare->pid == pid) {
+			DEBUG(3, ("prefork child %d exited unused\n",
+				  (int)pid));
+			DLIST_REMOVE(parent->spares, spare);
+			TALLOC_FREE(spare);
+			parent->num_spares -= 1;
+			break;
+		}
+	}
+
+	smbd_prefork_schedule(parent, timeval_zero());
+}
+
+/*
+ * Hand an accepted socket to a ready spare. Returns false if there is
+ * none, the caller forks as usual then.
+ */
+
+static bool smbd_prefork_pass_connection(struct smbd_parent_context *parent,
+					 int fd)
+{
+	struct smbd_spare_child *spare, *next;
+
+	for (spare = parent->spares; spare != NULL; spare = next) {
+		pid_t pid = spare->pid;
+		NTSTATUS status;
+
+		next = spare->next;
+
+		if (!spare->ready) {
+			continue;
+		}
+
+		DLIST_REMOVE(parent->spares, spare);
+		TALLOC_FREE(spare);
+		parent->num_spares -= 1;
+
+		smbd_prefork_schedule(parent, timeval_zero());
+
+		status = messaging_send_iov(parent->msg_ctx,
+					    pid_to_procid(pid),
+					    MSG_SMB_PREFORK_CONNECTION,
+					    NULL, 0, &fd, 1);
+		if (NT_STATUS_IS_OK(status)) {
+			DEBUG(10, ("passed connection to prefork child %d\n",
+				   (int)pid));
+			return true;
+		}
+
+		DEBUG(1, ("Could not pass connection to prefork child %d: "
+			  "%s\n", (int)pid, nt_errstr(status)));
+		kill(pid, SIGTERM);
+	}
+
+	return false;
+}
+
 static void smbd_accept_connection(struct tevent_context *ev,
 				   struct tevent_fd *fde,
 				   uint16_t flags,
@@ -971,6 +1280,12 @@ static void smbd_accept_connection(struct tevent_context *ev,
 		return;
 	}
 
+	if (smbd_prefork_pass_connection(s->parent, fd)) {
+		close(fd);
+		force_check_log_size();
+		return;
+	}
+
 	if (!allowable_number_of_smbd_processes(s->parent)) {
 		close(fd);
 		return;
@@ -1286,6 +1601,8 @@ static bool open_sockets_smbd(struct smbd_parent_context *parent,
 			   ID_CACHE_KILL, smbd_parent_id_cache_kill);
 	messaging_register(msg_ctx, NULL, MSG_SMB_NOTIFY_STARTED,
 			   smb_parent_send_to_children);
+	messaging_register(msg_ctx, NULL, MSG_SMB_PREFORK_READY,
+			   smbd_prefork_child_ready);
 
 #ifdef CLUSTER_SUPPORT
 	if (lp_clustering()) {
@@ -1440,6 +1757,8 @@ static void smbd_parent_sig_hup_handler(struct tevent_context *ev,
 	reload_services(NULL, NULL, false);
 
 	printing_subsystem_update(parent->ev_ctx, parent->msg_ctx, true);
+
+	smbd_prefork_schedule(parent, timeval_zero());
 }
 
 /****************************************************************************
@@ -2012,6 +2331,8 @@ extern void build_options(bool screen);
 		printing_subsystem_update(ev_ctx, msg_ctx, false);
 	}
 
+	smbd_prefork_schedule(parent, timeval_zero());
+
 	TALLOC_FREE(frame);
 	/* make sure we always have a valid stackframe */
 	frame = talloc_stackframe();
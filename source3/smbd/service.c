@@ -1087,6 +1087,8 @@ void close_cnum(connection_struct *conn, uint64_t vuid)
 
 	if (!IS_IPC(conn)) {
 		dptr_closecnum(conn);
+		smbd_dircache_close_conn(conn);
+		stat_cache_name_index_close_conn(conn);
 	}
 
 	change_to_root_user();
@@ -209,8 +209,27 @@ struct smbd_smb2_query_directory_state {
 	uint64_t async_count;
 	uint32_t find_async_delay_usec;
 	DATA_BLOB out_output_buffer;
+	struct smb_request *smbreq;
+	struct files_struct *fsp;
+	const char *in_file_name;
+	uint32_t in_output_buffer_length;
+	uint32_t dirtype;
+	uint32_t info_level;
+	uint32_t max_count;
+	char *pdata;
+	char *base_data;
+	char *end_data;
+	int last_entry_off;
+	int off;
+	uint32_t num;
+	bool dont_descend;
+	bool ask_sharemode;
+	bool async_ask_sharemode;
+	NTSTATUS empty_status;
 };
 
+static void smb2_query_directory_prefetched(struct tevent_req *subreq);
+static void smb2_query_directory_fill(struct tevent_req *req);
 static void smb2_query_directory_fetch_write_time_done(struct tevent_req *subreq);
 static void smb2_query_directory_waited(struct tevent_req *subreq);
 
@@ -244,6 +263,7 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 	bool ask_sharemode = false;
 	bool async_ask_sharemode = false;
 	bool wcard_has_wild = false;
+	unsigned long prefetch;
 	struct tm tm;
 	char *p;
 
@@ -498,10 +518,85 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 						     "find async delay usec",
 						     0);
 
+	state->smbreq = smbreq;
+	state->fsp = fsp;
+	state->in_file_name = in_file_name;
+	state->in_output_buffer_length = in_output_buffer_length;
+	state->dirtype = dirtype;
+	state->info_level = info_level;
+	state->max_count = max_count;
+	state->pdata = pdata;
+	state->base_data = base_data;
+	state->end_data = end_data;
+	state->last_entry_off = last_entry_off;
+	state->off = off;
+	state->num = num;
+	state->dont_descend = dont_descend;
+	state->ask_sharemode = ask_sharemode;
+	state->async_ask_sharemode = async_ask_sharemode;
+	state->empty_status = empty_status;
+
+	prefetch = lp_parm_ulong(SNUM(conn), "smbd", "dir prefetch", 0);
+	if ((prefetch > 0) && (info_level != SMB_FIND_FILE_NAMES_INFO)) {
+		struct tevent_req *subreq = NULL;
+
+		prefetch = MIN(prefetch, max_count);
+
+		subreq = dptr_prefetch_send(state, ev, fsp->dptr, prefetch);
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		if (tevent_req_is_in_progress(subreq)) {
+			tevent_req_set_callback(
+				subreq, smb2_query_directory_prefetched, req);
+
+			/*
+			 * A close has to wait for us, we continue to
+			 * use fsp->dptr once the prefetch is done.
+			 */
+			if (!aio_add_req_to_fsp(fsp, req)) {
+				tevent_req_nterror(req, NT_STATUS_NO_MEMORY);
+				return tevent_req_post(req, ev);
+			}
+			smb2_request_set_async_internal(smb2req, true);
+			return req;
+		}
+		TALLOC_FREE(subreq);
+	}
+
+	smb2_query_directory_fill(req);
+	if (!tevent_req_is_in_progress(req)) {
+		return tevent_req_post(req, ev);
+	}
+	return req;
+}
+
+static void smb2_query_directory_prefetched(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+
+	/*
+	 * The prefetch only warms up caches, ignore any error.
+	 */
+	(void)dptr_prefetch_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	smb2_query_directory_fill(req);
+}
+
+static void smb2_query_directory_fill(struct tevent_req *req)
+{
+	struct smbd_smb2_query_directory_state *state = tevent_req_data(
+		req, struct smbd_smb2_query_directory_state);
+	struct tevent_context *ev = state->ev;
+	connection_struct *conn = state->smb2req->tcon->compat;
+	NTSTATUS status;
+
 	while (true) {
 		bool got_exact_match = false;
-		int space_remaining = in_output_buffer_length - off;
-		int cur_off = off;
+		int space_remaining = state->in_output_buffer_length - state->off;
+		int cur_off = state->off;
 		struct file_id file_id;
 		bool stop = false;
 
@@ -509,26 +604,26 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 
 		status = smbd_dirptr_lanman2_entry(state,
 					       conn,
-					       fsp->dptr,
-					       smbreq->flags2,
-					       in_file_name,
-					       dirtype,
-					       info_level,
+					       state->fsp->dptr,
+					       state->smbreq->flags2,
+					       state->in_file_name,
+					       state->dirtype,
+					       state->info_level,
 					       false, /* requires_resume_key */
-					       dont_descend,
-					       ask_sharemode,
+					       state->dont_descend,
+					       state->ask_sharemode,
 					       8, /* align to 8 bytes */
 					       false, /* no padding */
-					       &pdata,
-					       base_data,
-					       end_data,
+					       &state->pdata,
+					       state->base_data,
+					       state->end_data,
 					       space_remaining,
 					       &got_exact_match,
-					       &last_entry_off,
+					       &state->last_entry_off,
 					       NULL,
 					       &file_id);
 
-		off = (int)PTR_DIFF(pdata, base_data);
+		state->off = (int)PTR_DIFF(state->pdata, state->base_data);
 
 		if (!NT_STATUS_IS_OK(status)) {
 			if (NT_STATUS_EQUAL(status, NT_STATUS_ILLEGAL_CHARACTER)) {
@@ -537,29 +632,29 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 				 * entry.
 				 */
 				continue;
-			} else if (num > 0) {
+			} else if (state->num > 0) {
 				goto last_entry_done;
 			} else if (NT_STATUS_EQUAL(status, STATUS_MORE_ENTRIES)) {
 				tevent_req_nterror(req, NT_STATUS_INFO_LENGTH_MISMATCH);
-				return tevent_req_post(req, ev);
+				return;
 			} else {
-				tevent_req_nterror(req, empty_status);
-				return tevent_req_post(req, ev);
+				tevent_req_nterror(req, state->empty_status);
+				return;
 			}
 		}
 
-		if (async_ask_sharemode) {
+		if (state->async_ask_sharemode) {
 			struct tevent_req *subreq = NULL;
 
 			subreq = fetch_write_time_send(req,
 						       ev,
 						       conn,
 						       file_id,
-						       info_level,
-						       base_data + cur_off,
+						       state->info_level,
+						       state->base_data + cur_off,
 						       &stop);
 			if (tevent_req_nomem(subreq, req)) {
-				return tevent_req_post(req, ev);
+				return;
 			}
 			tevent_req_set_callback(
 				subreq,
@@ -569,10 +664,10 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 			state->async_count++;
 		}
 
-		num++;
-		state->out_output_buffer.length = off;
+		state->num++;
+		state->out_output_buffer.length = state->off;
 
-		if (num >= max_count) {
+		if (state->num >= state->max_count) {
 			stop = true;
 		}
 
@@ -581,11 +676,11 @@ static struct tevent_req *smbd_smb2_query_directory_send(TALLOC_CTX *mem_ctx,
 		}
 
 last_entry_done:
-		SIVAL(state->out_output_buffer.data, last_entry_off, 0);
+		SIVAL(state->out_output_buffer.data, state->last_entry_off, 0);
 		if (state->async_count > 0) {
 			DBG_DEBUG("Stopping after %"PRIu64" async mtime "
 				  "updates\n", state->async_count);
-			return req;
+			return;
 		}
 
 		if (state->find_async_delay_usec > 0) {
@@ -597,26 +692,25 @@ last_entry_done:
 			 * if we're not the last request in
 			 * a compound chain?
 			 */
-			smb2_request_set_async_internal(smb2req, true);
+			smb2_request_set_async_internal(state->smb2req, true);
 
 			tv = timeval_current_ofs(0, state->find_async_delay_usec);
 
 			subreq = tevent_wakeup_send(state, ev, tv);
 			if (tevent_req_nomem(subreq, req)) {
-				return tevent_req_post(req, ev);
+				return;
 			}
 			tevent_req_set_callback(subreq,
 						smb2_query_directory_waited,
 						req);
-			return req;
+			return;
 		}
 
 		tevent_req_done(req);
-		return tevent_req_post(req, ev);
+		return;
 	}
 
 	tevent_req_nterror(req, NT_STATUS_INTERNAL_ERROR);
-	return tevent_req_post(req, ev);
 }
 
 static void smb2_query_directory_fetch_write_time_done(struct tevent_req *subreq)
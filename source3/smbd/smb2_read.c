@@ -40,6 +40,7 @@ static struct tevent_req *smbd_smb2_read_send(TALLOC_CTX *mem_ctx,
 static NTSTATUS smbd_smb2_read_recv(struct tevent_req *req,
 				    TALLOC_CTX *mem_ctx,
 				    DATA_BLOB *out_data,
+				    size_t *out_data_space,
 				    uint32_t *out_remaining);
 
 static void smbd_smb2_request_read_done(struct tevent_req *subreq);
@@ -117,6 +118,7 @@ static void smbd_smb2_request_read_done(struct tevent_req *subreq)
 	DATA_BLOB outdyn;
 	uint8_t out_data_offset;
 	DATA_BLOB out_data_buffer = data_blob_null;
+	size_t out_data_space = 0;
 	uint32_t out_data_remaining = 0;
 	NTSTATUS status;
 	NTSTATUS error; /* transport error */
@@ -124,6 +126,7 @@ static void smbd_smb2_request_read_done(struct tevent_req *subreq)
 	status = smbd_smb2_read_recv(subreq,
 				     req,
 				     &out_data_buffer,
+				     &out_data_space,
 				     &out_data_remaining);
 	TALLOC_FREE(subreq);
 	if (!NT_STATUS_IS_OK(status)) {
@@ -161,6 +164,21 @@ static void smbd_smb2_request_read_done(struct tevent_req *subreq)
 
 	outdyn = out_data_buffer;
 
+	if (req->out.vector_count >= (2 * SMBD_SMB2_NUM_IOV_PER_REQ)) {
+		size_t pad = (8 - (outdyn.length % 8)) % 8;
+
+		/*
+		 * Compound responses need 8 byte alignment. If we
+		 * have room behind the data, add the padding here,
+		 * otherwise smbd_smb2_request_done() has to copy the
+		 * whole buffer just to append a few zero bytes.
+		 */
+		if (pad != 0 && out_data_space >= outdyn.length + pad) {
+			memset(outdyn.data + outdyn.length, 0, pad);
+			outdyn.length += pad;
+		}
+	}
+
 	error = smbd_smb2_request_done(req, outbody, &outdyn);
 	if (!NT_STATUS_IS_OK(error)) {
 		smbd_server_connection_terminate(req->xconn,
@@ -180,9 +198,173 @@ struct smbd_smb2_read_state {
 	DATA_BLOB out_headers;
 	uint8_t _out_hdr_buf[NBT_HDR_SIZE + SMB2_HDR_BODY + 0x10];
 	DATA_BLOB out_data;
+	void *out_buffer;
+	size_t out_space;
 	uint32_t out_remaining;
 };
 
+/*
+ * Signed and sealed READ responses can't use sendfile, the file
+ * data is read into memory and signed or encrypted in place. For
+ * large reads we use page aligned buffers that are kept around
+ * after the response went out: a fresh malloc of that size is an
+ * mmap/munmap pair with page faults zero filling every page on
+ * each request, touching the memory one more time than the
+ * pread() and the crypto do.
+ *
+ * The cache holds at most SMBD_SMB2_READ_BUFFER_CACHE_BYTES and is
+ * emptied once it was not used for SMBD_SMB2_READ_BUFFER_IDLE_SECS.
+ */
+
+#define SMBD_SMB2_READ_BUFFER_MIN_SIZE (64*1024)
+#define SMBD_SMB2_READ_BUFFER_CACHE_SIZE 8
+#define SMBD_SMB2_READ_BUFFER_CACHE_BYTES (8*1024*1024)
+#define SMBD_SMB2_READ_BUFFER_IDLE_SECS 30
+
+struct smbd_smb2_read_buffer {
+	uint8_t *data;
+	size_t size;
+};
+
+static struct smbd_smb2_read_buffer
+	smbd_smb2_read_buffer_cache[SMBD_SMB2_READ_BUFFER_CACHE_SIZE];
+static size_t smbd_smb2_read_buffer_cache_bytes;
+static bool smbd_smb2_read_buffer_cache_used;
+static struct tevent_timer *smbd_smb2_read_buffer_cache_timer;
+
+static void smbd_smb2_read_buffer_cache_idle(struct tevent_context *ev,
+					     struct tevent_timer *te,
+					     struct timeval current_time,
+					     void *private_data);
+
+static void smbd_smb2_read_buffer_cache_schedule(void)
+{
+	if (smbd_smb2_read_buffer_cache_timer != NULL) {
+		return;
+	}
+	smbd_smb2_read_buffer_cache_timer = tevent_add_timer(
+		server_event_context(),
+		NULL,
+		timeval_current_ofs(SMBD_SMB2_READ_BUFFER_IDLE_SECS, 0),
+		smbd_smb2_read_buffer_cache_idle,
+		NULL);
+}
+
+static void smbd_smb2_read_buffer_cache_idle(struct tevent_context *ev,
+					     struct tevent_timer *te,
+					     struct timeval current_time,
+					     void *private_data)
+{
+	size_t i;
+
+	smbd_smb2_read_buffer_cache_timer = NULL;
+
+	if (smbd_smb2_read_buffer_cache_used) {
+		smbd_smb2_read_buffer_cache_used = false;
+		smbd_smb2_read_buffer_cache_schedule();
+		return;
+	}
+
+	for (i=0; i<ARRAY_SIZE(smbd_smb2_read_buffer_cache); i++) {
+		SAFE_FREE(smbd_smb2_read_buffer_cache[i].data);
+		smbd_smb2_read_buffer_cache[i].size = 0;
+	}
+	smbd_smb2_read_buffer_cache_bytes = 0;
+}
+
+static int smbd_smb2_read_buffer_destructor(struct smbd_smb2_read_buffer *buf)
+{
+	size_t i;
+
+	if (smbd_smb2_read_buffer_cache_bytes + buf->size >
+	    SMBD_SMB2_READ_BUFFER_CACHE_BYTES) {
+		SAFE_FREE(buf->data);
+		return 0;
+	}
+
+	for (i=0; i<ARRAY_SIZE(smbd_smb2_read_buffer_cache); i++) {
+		struct smbd_smb2_read_buffer *c =
+			&smbd_smb2_read_buffer_cache[i];
+
+		if (c->data == NULL) {
+			*c = *buf;
+			smbd_smb2_read_buffer_cache_bytes += buf->size;
+			smbd_smb2_read_buffer_cache_schedule();
+			return 0;
+		}
+	}
+
+	SAFE_FREE(buf->data);
+	return 0;
+}
+
+/*
+ * Allocate the buffer the file data is read into. We always leave
+ * room for 8 bytes of compound padding behind the data.
+ */
+static bool smbd_smb2_read_alloc_out_data(struct smbd_smb2_read_state *state,
+					  size_t length)
+{
+	struct smbd_smb2_read_buffer *buf = NULL;
+	size_t size;
+	size_t i;
+
+	if (length < SMBD_SMB2_READ_BUFFER_MIN_SIZE) {
+		uint8_t *data = talloc_array(state, uint8_t, length + 8);
+		if (data == NULL) {
+			return false;
+		}
+		state->out_buffer = data;
+		state->out_data = data_blob_const(data, length);
+		state->out_space = length + 8;
+		return true;
+	}
+
+	/*
+	 * Power of two size classes of the payload, so that
+	 * buffers of the typical client read sizes get reused. The
+	 * padding only costs one more page.
+	 */
+	size = SMBD_SMB2_READ_BUFFER_MIN_SIZE;
+	while (size < length) {
+		size *= 2;
+	}
+	size += 8;
+
+	buf = talloc_zero(state, struct smbd_smb2_read_buffer);
+	if (buf == NULL) {
+		return false;
+	}
+
+	for (i=0; i<ARRAY_SIZE(smbd_smb2_read_buffer_cache); i++) {
+		struct smbd_smb2_read_buffer *c =
+			&smbd_smb2_read_buffer_cache[i];
+
+		if (c->data != NULL && c->size == size) {
+			*buf = *c;
+			ZERO_STRUCTP(c);
+			smbd_smb2_read_buffer_cache_bytes -= size;
+			smbd_smb2_read_buffer_cache_used = true;
+			break;
+		}
+	}
+
+	if (buf->data == NULL) {
+		buf->data = (uint8_t *)memalign_array(1, getpagesize(), size);
+		if (buf->data == NULL) {
+			TALLOC_FREE(buf);
+			return false;
+		}
+		buf->size = size;
+	}
+	talloc_set_destructor(buf, smbd_smb2_read_buffer_destructor);
+
+	state->out_buffer = buf;
+	state->out_data = data_blob_const(buf->data, length);
+	state->out_space = size;
+	return true;
+}
+
 static int smb2_smb2_read_state_deny_destructor(struct smbd_smb2_read_state *state)
 {
 	return -1;
@@ -489,6 +671,8 @@ static struct tevent_req *smbd_smb2_read_send(TALLOC_CTX *mem_ctx,
 		if (in_length > 0 && tevent_req_nomem(state->out_data.data, req)) {
 			return tevent_req_post(req, ev);
 		}
+		state->out_buffer = state->out_data.data;
+		state->out_space = state->out_data.length;
 
 		if (!fsp_is_np(fsp)) {
 			tevent_req_nterror(req, NT_STATUS_FILE_CLOSED);
@@ -513,13 +697,20 @@ static struct tevent_req *smbd_smb2_read_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
 	}
 
-	status = schedule_smb2_aio_read(fsp->conn,
-				smbreq,
-				fsp,
-				state,
-				&state->out_data,
-				(off_t)in_offset,
-				(size_t)in_length);
+	status = NT_STATUS_RETRY;
+	if (smb2_aio_read_possible(fsp->conn, fsp, in_length)) {
+		if (!smbd_smb2_read_alloc_out_data(state, in_length)) {
+			tevent_req_oom(req);
+			return tevent_req_post(req, ev);
+		}
+
+		status = schedule_smb2_aio_read(fsp->conn,
+					smbreq,
+					fsp,
+					state->out_data.data,
+					(off_t)in_offset,
+					(size_t)in_length);
+	}
 
 	if (NT_STATUS_IS_OK(status)) {
 		/*
@@ -553,6 +744,9 @@ static struct tevent_req *smbd_smb2_read_send(TALLOC_CTX *mem_ctx,
 	/* Try sendfile in preference. */
 	status = schedule_smb2_sendfile_read(smb2req, state);
 	if (NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(state->out_buffer);
+		state->out_data.data = NULL;
+		state->out_space = 0;
 		tevent_req_done(req);
 		return tevent_req_post(req, ev);
 	} else {
@@ -563,13 +757,14 @@ static struct tevent_req *smbd_smb2_read_send(TALLOC_CTX *mem_ctx,
 		}
 	}
 
-	/* Ok, read into memory. Allocate the out buffer. */
-	state->out_data = data_blob_talloc(state, NULL, in_length);
-	if (in_length > 0 && tevent_req_nomem(state->out_data.data, req)) {
+	if (state->out_buffer == NULL &&
+	    !smbd_smb2_read_alloc_out_data(state, in_length)) {
 		SMB_VFS_STRICT_UNLOCK(conn, fsp, &lock);
+		tevent_req_oom(req);
 		return tevent_req_post(req, ev);
 	}
 
+	/* Ok, read into memory. */
 	nread = read_file(fsp,
 			  (char *)state->out_data.data,
 			  in_offset,
@@ -635,6 +830,7 @@ static void smbd_smb2_read_pipe_done(struct tevent_req *subreq)
 static NTSTATUS smbd_smb2_read_recv(struct tevent_req *req,
 				    TALLOC_CTX *mem_ctx,
 				    DATA_BLOB *out_data,
+				    size_t *out_data_space,
 				    uint32_t *out_remaining)
 {
 	NTSTATUS status;
@@ -647,7 +843,8 @@ static NTSTATUS smbd_smb2_read_recv(struct tevent_req *req,
 	}
 
 	*out_data = state->out_data;
-	talloc_steal(mem_ctx, out_data->data);
+	talloc_steal(mem_ctx, state->out_buffer);
+	*out_data_space = state->out_space;
 	*out_remaining = state->out_remaining;
 
 	if (state->out_headers.length > 0) {
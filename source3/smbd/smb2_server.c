@@ -31,6 +31,7 @@
 #include "lib/util/iov_buf.h"
 #include "auth.h"
 #include "lib/crypto/sha512.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
 
 static void smbd_smb2_connection_handler(struct tevent_context *ev,
 					 struct tevent_fd *fde,
@@ -219,6 +220,13 @@ static NTSTATUS smbd_initialize_smb2(struct smbXsrv_connection *xconn,
 		return NT_STATUS_NO_MEMORY;
 	}
 
+	xconn->smb2.encrypt_offload_size = lp_parm_ulong(
+		-1, "smbd", "encryption offload size", 64*1024);
+	xconn->smb2.sign_offload_size = lp_parm_ulong(
+		-1, "smbd", "signing offload size", 0);
+	xconn->smb2.send_batch_size = lp_parm_ulong(
+		-1, "smbd", "send batch size", 1024*1024);
+
 	xconn->transport.fde = tevent_add_fd(xconn->ev_ctx,
 					xconn,
 					xconn->transport.sock,
@@ -263,6 +271,16 @@ static bool smb2_setup_nbt_length(struct iovec *vector, int count)
 
 static int smbd_smb2_request_destructor(struct smbd_smb2_request *req)
 {
+	if (req->crypto_subreq != NULL) {
+		/*
+		 * A worker thread still writes into the out
+		 * vectors, which hang off req. Keep everything
+		 * around until the job is finished,
+		 * smbd_smb2_request_crypto_done() frees it.
+		 */
+		req->xconn = NULL;
+		return -1;
+	}
 	if (req->first_key.length > 0) {
 		data_blob_clear_free(&req->first_key);
 	}
@@ -2729,6 +2747,173 @@ static void smbd_smb2_request_reply_update_counts(struct smbd_smb2_request *req)
 	}
 }
 
+static void smbd_smb2_request_crypto_do(void *private_data);
+static void smbd_smb2_request_crypto_done(struct tevent_req *subreq);
+
+/*
+ * Encrypting or signing a large response is the most expensive part
+ * of sending it. Hand it to a worker thread, so that a client with
+ * many outstanding requests gets its responses processed on all
+ * cores. The response is put on the send queue right away and
+ * smbd_smb2_flush_send_queue() waits for it, so the responses still
+ * go out in order.
+ *
+ * If signing_key is given, the vectors are signed with it,
+ * otherwise they are encrypted with req->first_key.
+ *
+ * Returns NT_STATUS_RETRY if the caller should do it synchronously.
+ */
+static NTSTATUS smbd_smb2_request_crypto_send(struct smbd_smb2_request *req,
+					      const DATA_BLOB *signing_key,
+					      struct iovec *vector,
+					      int count)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	struct smbd_server_connection *sconn = req->sconn;
+	size_t offload_size;
+	ssize_t len;
+	int ret;
+
+	/*
+	 * The worker uses the _nolog variants, an invalid key is
+	 * only reported by the synchronous path.
+	 */
+	if (signing_key != NULL) {
+		offload_size = xconn->smb2.sign_offload_size;
+		if (signing_key->length == 0) {
+			/* let smb2_signing_sign_pdu() complain */
+			return NT_STATUS_RETRY;
+		}
+	} else {
+		offload_size = xconn->smb2.encrypt_offload_size;
+		if (req->first_key.length == 0) {
+			/* let smb2_signing_encrypt_pdu() complain */
+			return NT_STATUS_RETRY;
+		}
+	}
+
+	if (offload_size == 0) {
+		return NT_STATUS_RETRY;
+	}
+	if (req->preauth != NULL) {
+		/* the preauth hash is calculated over the result */
+		return NT_STATUS_RETRY;
+	}
+
+	len = iov_buflen(vector, count);
+	if (len == -1) {
+		return NT_STATUS_BUFFER_TOO_SMALL;
+	}
+	if ((size_t)len < offload_size) {
+		return NT_STATUS_RETRY;
+	}
+
+	ret = smbd_init_pool(sconn);
+	if (ret != 0) {
+		return NT_STATUS_RETRY;
+	}
+
+	if (signing_key != NULL) {
+		/*
+		 * The session might go away (logoff) before the
+		 * worker is done.
+		 */
+		req->crypto_signing_key = data_blob_dup_talloc(req,
+							       *signing_key);
+		if (req->crypto_signing_key.data == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+	}
+	req->crypto_protocol = xconn->protocol;
+	req->crypto_cipher = xconn->smb2.server.cipher;
+	req->crypto_vector = vector;
+	req->crypto_count = count;
+	req->crypto_status = NT_STATUS_INTERNAL_ERROR;
+
+	req->crypto_subreq = pthreadpool_tevent_job_send(
+		req, sconn->ev_ctx, sconn->pool,
+		smbd_smb2_request_crypto_do, req);
+	if (req->crypto_subreq == NULL) {
+		data_blob_clear_free(&req->crypto_signing_key);
+		return NT_STATUS_RETRY;
+	}
+	tevent_req_set_callback(req->crypto_subreq,
+				smbd_smb2_request_crypto_done,
+				req);
+
+	req->queue_entry.crypto_pending = true;
+	return NT_STATUS_OK;
+}
+
+static void smbd_smb2_request_crypto_do(void *private_data)
+{
+	struct smbd_smb2_request *req = talloc_get_type_abort(
+		private_data, struct smbd_smb2_request);
+
+	/* DEBUG() is not thread safe */
+
+	if (req->crypto_signing_key.length > 0) {
+		req->crypto_status = smb2_signing_sign_pdu_nolog(
+			req->crypto_signing_key,
+			req->crypto_protocol,
+			req->crypto_vector,
+			req->crypto_count);
+		return;
+	}
+
+	req->crypto_status = smb2_signing_encrypt_pdu_nolog(
+		req->first_key,
+		req->crypto_cipher,
+		req->crypto_vector,
+		req->crypto_count);
+}
+
+static void smbd_smb2_request_crypto_done(struct tevent_req *subreq)
+{
+	struct smbd_smb2_request *req = tevent_req_callback_data(
+		subreq, struct smbd_smb2_request);
+	struct smbXsrv_connection *xconn = req->xconn;
+	NTSTATUS status;
+	int ret;
+
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+	req->crypto_subreq = NULL;
+	req->queue_entry.crypto_pending = false;
+
+	if (req->first_key.length > 0) {
+		data_blob_clear_free(&req->first_key);
+	}
+	if (req->crypto_signing_key.length > 0) {
+		data_blob_clear_free(&req->crypto_signing_key);
+	}
+
+	if (xconn == NULL) {
+		/*
+		 * The connection went away while the worker was
+		 * busy, see smbd_smb2_request_destructor().
+		 */
+		TALLOC_FREE(req);
+		return;
+	}
+
+	if (ret != 0) {
+		status = map_nt_error_from_unix_common(ret);
+	} else {
+		status = req->crypto_status;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+
+	status = smbd_smb2_flush_send_queue(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+}
+
 static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
 {
 	struct smbXsrv_connection *xconn = req->xconn;
@@ -2878,10 +3063,16 @@ static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
 	 * now check if we need to sign the current response
 	 */
 	if (firsttf->iov_len == SMB2_TF_HDR_SIZE) {
-		status = smb2_signing_encrypt_pdu(req->first_key,
+		status = smbd_smb2_request_crypto_send(req,
+					NULL,
+					firsttf,
+					req->out.vector_count - first_idx);
+		if (NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
+			status = smb2_signing_encrypt_pdu(req->first_key,
 					xconn->smb2.server.cipher,
 					firsttf,
 					req->out.vector_count - first_idx);
+		}
 		if (!NT_STATUS_IS_OK(status)) {
 			return status;
 		}
@@ -2889,15 +3080,21 @@ static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
 		struct smbXsrv_session *x = req->session;
 		DATA_BLOB signing_key = smbd_smb2_signing_key(x, xconn);
 
-		status = smb2_signing_sign_pdu(signing_key,
+		status = smbd_smb2_request_crypto_send(req,
+					&signing_key,
+					outhdr,
+					SMBD_SMB2_NUM_IOV_PER_REQ - 1);
+		if (NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
+			status = smb2_signing_sign_pdu(signing_key,
 					       xconn->protocol,
 					       outhdr,
 					       SMBD_SMB2_NUM_IOV_PER_REQ - 1);
+		}
 		if (!NT_STATUS_IS_OK(status)) {
 			return status;
 		}
 	}
-	if (req->first_key.length > 0) {
+	if (req->first_key.length > 0 && req->crypto_subreq == NULL) {
 		data_blob_clear_free(&req->first_key);
 	}
 
@@ -3579,9 +3776,24 @@ static int socket_error_from_errno(int ret,
 	return sys_errno;
 }
 
+/*
+ * The number of vectors we gather from the send queue into one
+ * writev() call, each response typically uses 4-5.
+ */
+#if defined(IOV_MAX) && (IOV_MAX < 256)
+#define SMBD_SMB2_SEND_BATCH_MAX_IOV IOV_MAX
+#else
+#define SMBD_SMB2_SEND_BATCH_MAX_IOV 256
+#endif
+
 static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
 {
-	int ret;
+	struct iovec iov[SMBD_SMB2_SEND_BATCH_MAX_IOV];
+	struct smbd_smb2_send_queue *n = NULL;
+	size_t num_iov;
+	size_t num_entries;
+	size_t batch_len;
+	ssize_t ret;
 	int err;
 	bool retry;
 	NTSTATUS status;
@@ -3595,6 +3807,15 @@ static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
 		struct smbd_smb2_send_queue *e = xconn->smb2.send_queue;
 		bool ok;
 
+		if (e->crypto_pending) {
+			/*
+			 * Wait for smbd_smb2_request_crypto_done(),
+			 * responses have to go out in order.
+			 */
+			TEVENT_FD_NOT_WRITEABLE(xconn->transport.fde);
+			return NT_STATUS_OK;
+		}
+
 		if (e->sendfile_header != NULL) {
 			size_t size = 0;
 			size_t i = 0;
@@ -3642,7 +3863,49 @@ static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
 			continue;
 		}
 
-		ret = writev(xconn->transport.sock, e->vector, e->count);
+		/*
+		 * Gather as many of the queued responses as we can
+		 * into one writev(), so that clients with many
+		 * outstanding requests don't cost us one syscall per
+		 * response.
+		 */
+		num_iov = 0;
+		num_entries = 0;
+		batch_len = 0;
+		for (n = e; n != NULL; n = n->next) {
+			ssize_t len;
+
+			if (n->sendfile_header != NULL || n->crypto_pending) {
+				break;
+			}
+			if (num_iov + n->count > ARRAY_SIZE(iov)) {
+				break;
+			}
+			len = iov_buflen(n->vector, n->count);
+			if (len == -1) {
+				return NT_STATUS_INTERNAL_ERROR;
+			}
+			if ((num_entries > 0) &&
+			    (batch_len + len > xconn->smb2.send_batch_size)) {
+				break;
+			}
+			memcpy(&iov[num_iov], n->vector,
+			       n->count * sizeof(struct iovec));
+			num_iov += n->count;
+			batch_len += len;
+			num_entries += 1;
+		}
+
+		if (num_entries > 1) {
+			ret = writev(xconn->transport.sock, iov, num_iov);
+		} else {
+			/*
+			 * Just one response, or one with too many
+			 * vectors for our array.
+			 */
+			ret = writev(xconn->transport.sock, e->vector, e->count);
+		}
+		SMBPROFILE_COUNT_INCREMENT(smb2_send_syscalls, profile_p, 1);
 		if (ret == 0) {
 			/* propagate end of file */
 			return NT_STATUS_INTERNAL_ERROR;
@@ -3656,21 +3919,41 @@ static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
 		if (err != 0) {
 			return map_nt_error_from_unix_common(err);
 		}
-
-		ok = iov_advance(&e->vector, &e->count, ret);
-		if (!ok) {
-			return NT_STATUS_INTERNAL_ERROR;
+		if (num_entries > 1) {
+			SMBPROFILE_COUNT_INCREMENT(smb2_send_batches,
+						   profile_p, 1);
 		}
 
-		if (e->count > 0) {
-			/* we have more to write */
-			TEVENT_FD_WRITEABLE(xconn->transport.fde);
-			return NT_STATUS_OK;
-		}
+		/*
+		 * Retire the responses that went out completely,
+		 * the last one might have been sent partially.
+		 */
+		while (ret > 0) {
+			ssize_t len;
+
+			e = xconn->smb2.send_queue;
+
+			len = iov_buflen(e->vector, e->count);
+			if (len == -1) {
+				return NT_STATUS_INTERNAL_ERROR;
+			}
+			if (ret < len) {
+				ok = iov_advance(&e->vector, &e->count, ret);
+				if (!ok) {
+					return NT_STATUS_INTERNAL_ERROR;
+				}
+				/* we have more to write */
+				TEVENT_FD_WRITEABLE(xconn->transport.fde);
+				return NT_STATUS_OK;
+			}
+			ret -= len;
 
-		xconn->smb2.send_queue_len--;
-		DLIST_REMOVE(xconn->smb2.send_queue, e);
-		talloc_free(e->mem_ctx);
+			SMBPROFILE_COUNT_INCREMENT(smb2_send_responses,
+						   profile_p, 1);
+			xconn->smb2.send_queue_len--;
+			DLIST_REMOVE(xconn->smb2.send_queue, e);
+			talloc_free(e->mem_ctx);
+		}
 	}
 
 	/*
@@ -26,6 +26,9 @@
 #include "messages.h"
 #include "serverid.h"
 #include "smbprofile.h"
+#include "dbwrap/dbwrap.h"
+#include "dbwrap/dbwrap_rbt.h"
+#include "util_tdb.h"
 #include <tdb.h>
 
 /****************************************************************************
@@ -397,12 +400,310 @@ unsigned int fast_string_hash(TDB_DATA *key)
         return n;
 }
 
+/***************************************************************************
+ Case-folded name index for get_real_filename().
+
+ On case insensitive shares every open of a name that is not there
+ with exactly that case ends up scanning the whole directory. With
+ "smbd:name index = yes" the first scan keeps all names of the
+ directory, indexed by their upper case version, so later lookups -
+ including the ones for names that do not exist at all - are answered
+ without reading the directory.
+
+ An index is valid as long as the directory's mtime, ctime and inode
+ are unchanged, every create, rename or unlink in the directory
+ changes them, no matter who does it. A directory modified within
+ the timestamp granularity of building the index could change
+ without a visible mtime change, so we don't keep indexes of
+ directories modified less than a second ago.
+
+ The names are read with the permissions of the user, so an index is
+ only used for the same share and session it was built for.
+**************************************************************************/
+
+struct name_index {
+	struct name_index *prev, *next;
+	int snum;
+	uint64_t vuid;
+	char *dirpath;
+	struct stat_ex dir_st;
+	size_t num_names;
+	struct db_context *names;
+};
+
+static struct name_index *name_indexes;
+static size_t name_index_num_names;
+
+static void name_index_free(struct name_index *idx)
+{
+	DLIST_REMOVE(name_indexes, idx);
+	name_index_num_names -= idx->num_names;
+	TALLOC_FREE(idx);
+}
+
+static bool name_index_dir_unchanged(const struct stat_ex *a,
+				     const struct stat_ex *b)
+{
+	return ((a->st_ex_dev == b->st_ex_dev) &&
+		(a->st_ex_ino == b->st_ex_ino) &&
+		(timespec_compare(&a->st_ex_mtime, &b->st_ex_mtime) == 0) &&
+		(timespec_compare(&a->st_ex_ctime, &b->st_ex_ctime) == 0));
+}
+
+static struct name_index *name_index_build(connection_struct *conn,
+					   const char *path,
+					   const char *dirpath,
+					   const struct stat_ex *dir_st)
+{
+	struct name_index *idx;
+	struct smb_filename *smb_fname;
+	struct smb_Dir *cur_dir;
+	const char *dname;
+	char *talloced = NULL;
+	long curpos = 0;
+
+	DO_PROFILE_INC(statcache_name_index_builds);
+
+	idx = talloc_zero(NULL, struct name_index);
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->snum = SNUM(conn);
+	idx->vuid = conn->vuid;
+	idx->dir_st = *dir_st;
+	idx->dirpath = talloc_strdup(idx, dirpath);
+	idx->names = db_open_rbt(idx);
+	if ((idx->dirpath == NULL) || (idx->names == NULL)) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+
+	smb_fname = synthetic_smb_fname(talloc_tos(), path, NULL, NULL, 0);
+	if (smb_fname == NULL) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+	cur_dir = OpenDir(talloc_tos(), conn, smb_fname, NULL, 0);
+	TALLOC_FREE(smb_fname);
+	if (cur_dir == NULL) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+
+	while ((dname = ReadDirName(cur_dir, &curpos, NULL, &talloced))) {
+		char *key;
+		NTSTATUS status;
+
+		if (ISDOT(dname) || ISDOTDOT(dname)) {
+			TALLOC_FREE(talloced);
+			continue;
+		}
+
+		key = talloc_strdup_upper(talloc_tos(), dname);
+		if (key == NULL) {
+			TALLOC_FREE(talloced);
+			TALLOC_FREE(cur_dir);
+			TALLOC_FREE(idx);
+			return NULL;
+		}
+
+		/*
+		 * Names only differing in case: we can only return
+		 * one of them, the scan would have found the first one
+		 * as well.
+		 */
+		status = dbwrap_store(idx->names, string_term_tdb_data(key),
+				      string_term_tdb_data(dname),
+				      TDB_INSERT);
+		TALLOC_FREE(key);
+		TALLOC_FREE(talloced);
+
+		if (NT_STATUS_IS_OK(status)) {
+			idx->num_names += 1;
+		} else if (!NT_STATUS_EQUAL(status,
+					    NT_STATUS_OBJECT_NAME_COLLISION)) {
+			TALLOC_FREE(cur_dir);
+			TALLOC_FREE(idx);
+			return NULL;
+		}
+	}
+
+	TALLOC_FREE(cur_dir);
+	return idx;
+}
+
+struct name_index_lookup_state {
+	TALLOC_CTX *mem_ctx;
+	char *found_name;
+};
+
+static void name_index_lookup_fn(TDB_DATA key, TDB_DATA data,
+				 void *private_data)
+{
+	struct name_index_lookup_state *state = private_data;
+
+	state->found_name = talloc_strndup(state->mem_ctx,
+					   (const char *)data.dptr,
+					   data.dsize);
+}
+
+/**
+ * Look up a name case insensitively in a directory using the name index.
+ *
+ * @return 0 and the real name in *found_name if it exists, -1 with
+ *         errno ENOENT if it does not exist, -1 with errno EAGAIN if
+ *         the caller has to scan the directory itself.
+ */
+
+int stat_cache_name_index_lookup(connection_struct *conn,
+				 const char *path,
+				 const char *name,
+				 TALLOC_CTX *mem_ctx,
+				 char **found_name)
+{
+	struct name_index *idx;
+	struct smb_filename smb_dname = {
+		.base_name = discard_const_p(char, path)
+	};
+	struct name_index_lookup_state state = { .mem_ctx = mem_ctx };
+	char *dirpath, *key;
+	size_t max_names;
+	bool built = false;
+	NTSTATUS status;
+	int ret;
+
+	if (!lp_stat_cache() || conn->case_sensitive ||
+	    !lp_parm_bool(SNUM(conn), "smbd", "name index", false)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	max_names = lp_parm_ulong(-1, "smbd", "name index max names",
+				  1000000);
+	if (max_names == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (ISDOT(path)) {
+		dirpath = talloc_strdup(talloc_tos(), conn->connectpath);
+	} else {
+		dirpath = talloc_asprintf(talloc_tos(), "%s/%s",
+					  conn->connectpath, path);
+	}
+	key = talloc_strdup_upper(talloc_tos(), name);
+	if ((dirpath == NULL) || (key == NULL)) {
+		TALLOC_FREE(dirpath);
+		TALLOC_FREE(key);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ret = SMB_VFS_STAT(conn, &smb_dname);
+	if (ret != 0) {
+		TALLOC_FREE(dirpath);
+		TALLOC_FREE(key);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (idx = name_indexes; idx != NULL; idx = idx->next) {
+		if ((idx->snum == SNUM(conn)) && (idx->vuid == conn->vuid) &&
+		    (strcmp(idx->dirpath, dirpath) == 0)) {
+			break;
+		}
+	}
+
+	if ((idx != NULL) &&
+	    !name_index_dir_unchanged(&idx->dir_st, &smb_dname.st)) {
+		DEBUG(10, ("stat_cache_name_index_lookup: %s changed\n",
+			   dirpath));
+		name_index_free(idx);
+		idx = NULL;
+	}
+
+	if (idx != NULL) {
+		DO_PROFILE_INC(statcache_name_index_hits);
+		DLIST_PROMOTE(name_indexes, idx);
+	} else {
+		idx = name_index_build(conn, path, dirpath, &smb_dname.st);
+		if (idx == NULL) {
+			TALLOC_FREE(dirpath);
+			TALLOC_FREE(key);
+			errno = EAGAIN;
+			return -1;
+		}
+		built = true;
+	}
+
+	status = dbwrap_parse_record(idx->names, string_term_tdb_data(key),
+				     name_index_lookup_fn, &state);
+
+	if (built) {
+		bool keep = ((idx->num_names <= max_names) &&
+			     (timespec_elapsed(&smb_dname.st.st_ex_mtime) >
+			      1.0));
+		if (keep) {
+			DLIST_ADD(name_indexes, idx);
+			name_index_num_names += idx->num_names;
+			while (name_index_num_names > max_names) {
+				name_index_free(DLIST_TAIL(name_indexes));
+			}
+		} else {
+			TALLOC_FREE(idx);
+		}
+	}
+
+	TALLOC_FREE(dirpath);
+	TALLOC_FREE(key);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (state.found_name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*found_name = state.found_name;
+	return 0;
+}
+
+void stat_cache_name_index_flush(void)
+{
+	while (name_indexes != NULL) {
+		name_index_free(name_indexes);
+	}
+}
+
+/*
+ * Other tree connects to the same share lose their indexes as well,
+ * they will just be rebuilt.
+ */
+void stat_cache_name_index_close_conn(connection_struct *conn)
+{
+	struct name_index *idx, *next;
+
+	for (idx = name_indexes; idx != NULL; idx = next) {
+		next = idx->next;
+		if (idx->snum == SNUM(conn)) {
+			name_index_free(idx);
+		}
+	}
+}
+
 /***************************************************************************
  Initializes or clears the stat cache.
 **************************************************************************/
 
 bool reset_stat_cache( void )
 {
+	/*
+	 * The name index depends on share options, always drop it
+	 * on a reload.
+	 */
+	stat_cache_name_index_flush();
+
 	if (!lp_stat_cache())
 		return True;
 
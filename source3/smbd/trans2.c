@@ -1603,6 +1603,7 @@ struct smbd_dirptr_lanman2_state {
 	bool check_mangled_names;
 	bool has_wild;
 	bool got_exact_match;
+	struct smbd_dircache_dir *dircache;
 };
 
 static bool smbd_dirptr_lanman2_match_fn(TALLOC_CTX *ctx,
@@ -1711,6 +1712,12 @@ static bool smbd_dirptr_lanman2_mode_fn(TALLOC_CTX *ctx,
 	bool ms_dfs_link = false;
 	uint32_t mode = 0;
 
+	if ((state->dircache != NULL) &&
+	    smbd_dircache_lookup(state->dircache, smb_fname, &mode)) {
+		*_mode = mode;
+		return true;
+	}
+
 	if (INFO_LEVEL_IS_UNIX(state->info_level)) {
 		if (SMB_VFS_LSTAT(state->conn, smb_fname) != 0) {
 			DEBUG(5,("smbd_dirptr_lanman2_mode_fn: "
@@ -1740,6 +1747,9 @@ static bool smbd_dirptr_lanman2_mode_fn(TALLOC_CTX *ctx,
 		mode = dos_mode_msdfs(state->conn, smb_fname);
 	} else {
 		mode = dos_mode(state->conn, smb_fname);
+		if (state->dircache != NULL) {
+			smbd_dircache_store(state->dircache, smb_fname, mode);
+		}
 	}
 
 	*_mode = mode;
@@ -2482,6 +2492,14 @@ NTSTATUS smbd_dirptr_lanman2_entry(TALLOC_CTX *ctx,
 	state.has_wild = dptr_has_wild(dirptr);
 	state.got_exact_match = false;
 
+	/*
+	 * The UNIX info levels want lstat() information, the cache
+	 * only has what the Windows levels return.
+	 */
+	if (!INFO_LEVEL_IS_UNIX(info_level)) {
+		state.dircache = dptr_dircache(dirptr);
+	}
+
 	*got_exact_match = false;
 
 	p = strrchr_m(path_mask,'/');
@@ -0,0 +1,231 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Benchmark SMB3 encryption offloaded to a pthreadpool, the way
+ * smbd_smb2_request_crypto_send() does it
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "proto.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+#include "../libcli/smb/smb_common.h"
+
+extern int torture_numops;
+
+#define BENCH_SMB2_CRYPTO_PDU_SIZE (1024*1024)
+
+struct bench_smb2_crypto_state {
+	struct tevent_context *ev;
+	struct pthreadpool_tevent *pool;
+	DATA_BLOB key;
+	int todo;
+	int pending;
+	bool ok;
+};
+
+struct bench_smb2_crypto_pdu {
+	struct bench_smb2_crypto_state *state;
+	uint8_t tf[SMB2_TF_HDR_SIZE];
+	struct iovec vector[2];
+	NTSTATUS status;
+};
+
+static void bench_smb2_crypto_do(void *private_data)
+{
+	struct bench_smb2_crypto_pdu *pdu = private_data;
+
+	pdu->status = smb2_signing_encrypt_pdu(pdu->state->key,
+					       SMB2_ENCRYPTION_AES128_GCM,
+					       pdu->vector,
+					       ARRAY_SIZE(pdu->vector));
+}
+
+static void bench_smb2_crypto_done(struct tevent_req *subreq);
+
+static bool bench_smb2_crypto_submit(struct bench_smb2_crypto_pdu *pdu)
+{
+	struct bench_smb2_crypto_state *state = pdu->state;
+	struct tevent_req *subreq;
+
+	if (state->todo == 0) {
+		return true;
+	}
+
+	pdu->vector[0] = (struct iovec) {
+		.iov_base = pdu->tf, .iov_len = sizeof(pdu->tf)
+	};
+
+	subreq = pthreadpool_tevent_job_send(pdu, state->ev, state->pool,
+					     bench_smb2_crypto_do, pdu);
+	if (subreq == NULL) {
+		return false;
+	}
+	tevent_req_set_callback(subreq, bench_smb2_crypto_done, pdu);
+
+	state->todo -= 1;
+	state->pending += 1;
+	return true;
+}
+
+static void bench_smb2_crypto_done(struct tevent_req *subreq)
+{
+	struct bench_smb2_crypto_pdu *pdu = tevent_req_callback_data(
+		subreq, struct bench_smb2_crypto_pdu);
+	struct bench_smb2_crypto_state *state = pdu->state;
+	int ret;
+
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+	state->pending -= 1;
+
+	if (ret != 0) {
+		fprintf(stderr, "pthreadpool job failed: %s\n",
+			strerror(ret));
+		state->ok = false;
+		return;
+	}
+	if (!NT_STATUS_IS_OK(pdu->status)) {
+		fprintf(stderr, "smb2_signing_encrypt_pdu failed: %s\n",
+			nt_errstr(pdu->status));
+		state->ok = false;
+		return;
+	}
+
+	if (!bench_smb2_crypto_submit(pdu)) {
+		fprintf(stderr, "bench_smb2_crypto_submit failed\n");
+		state->ok = false;
+		return;
+	}
+}
+
+static bool bench_smb2_crypto_one(TALLOC_CTX *mem_ctx, int num_threads,
+				  double *mbytes_per_sec)
+{
+	struct bench_smb2_crypto_state *state;
+	struct timeval start;
+	int i, num_pdus, ret;
+	bool ok = false;
+
+	state = talloc_zero(mem_ctx, struct bench_smb2_crypto_state);
+	if (state == NULL) {
+		return false;
+	}
+	state->todo = torture_numops;
+	state->ok = true;
+
+	state->key = data_blob_talloc(state, NULL, 16);
+	if (state->key.data == NULL) {
+		goto fail;
+	}
+	generate_random_buffer(state->key.data, state->key.length);
+
+	state->ev = samba_tevent_context_init(state);
+	if (state->ev == NULL) {
+		fprintf(stderr, "samba_tevent_context_init failed\n");
+		goto fail;
+	}
+
+	ret = pthreadpool_tevent_init(state, num_threads, &state->pool);
+	if (ret != 0) {
+		fprintf(stderr, "pthreadpool_tevent_init failed: %s\n",
+			strerror(ret));
+		goto fail;
+	}
+
+	/*
+	 * Keep all threads busy, like a client with many
+	 * outstanding reads does.
+	 */
+	num_pdus = num_threads * 2;
+
+	start = timeval_current();
+
+	for (i=0; i<num_pdus; i++) {
+		struct bench_smb2_crypto_pdu *pdu;
+		uint8_t *buf;
+
+		pdu = talloc_zero(state, struct bench_smb2_crypto_pdu);
+		buf = talloc_zero_array(pdu, uint8_t,
+					BENCH_SMB2_CRYPTO_PDU_SIZE);
+		if ((pdu == NULL) || (buf == NULL)) {
+			fprintf(stderr, "talloc failed\n");
+			goto fail;
+		}
+		pdu->state = state;
+		pdu->vector[1] = (struct iovec) {
+			.iov_base = buf, .iov_len = BENCH_SMB2_CRYPTO_PDU_SIZE
+		};
+
+		if (!bench_smb2_crypto_submit(pdu)) {
+			fprintf(stderr, "bench_smb2_crypto_submit failed\n");
+			goto fail;
+		}
+	}
+
+	while (state->pending > 0) {
+		ret = tevent_loop_once(state->ev);
+		if (ret != 0) {
+			fprintf(stderr, "tevent_loop_once failed: %s\n",
+				strerror(errno));
+			goto fail;
+		}
+	}
+
+	*mbytes_per_sec = (double)torture_numops *
+		BENCH_SMB2_CRYPTO_PDU_SIZE / (1024 * 1024) /
+		timeval_elapsed(&start);
+
+	ok = state->ok;
+fail:
+	TALLOC_FREE(state);
+	return ok;
+}
+
+bool run_bench_smb2_crypto(int dummy)
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_threads;
+
+	if (num_cpus < 1) {
+		num_cpus = 1;
+	}
+
+	printf("encrypting %d PDUs of %d bytes\n", torture_numops,
+	       BENCH_SMB2_CRYPTO_PDU_SIZE);
+
+	num_threads = 1;
+	while (true) {
+		double mbytes_per_sec = 0;
+		bool ok;
+
+		ok = bench_smb2_crypto_one(frame, num_threads,
+					   &mbytes_per_sec);
+		if (!ok) {
+			TALLOC_FREE(frame);
+			return false;
+		}
+		printf("%3d threads: %10.1f MB/s\n", num_threads,
+		       mbytes_per_sec);
+
+		if (num_threads == num_cpus) {
+			break;
+		}
+		num_threads = MIN(num_threads * 2, num_cpus);
+	}
+
+	TALLOC_FREE(frame);
+	return true;
+}
@@ -114,6 +114,7 @@ bool run_idmap_tdb_common_test(int dummy);
 bool run_local_dbwrap_ctdb(int dummy);
 bool run_qpathinfo_bufsize(int dummy);
 bool run_bench_pthreadpool(int dummy);
+bool run_bench_smb2_crypto(int dummy);
 bool run_messaging_read1(int dummy);
 bool run_messaging_read2(int dummy);
 bool run_messaging_read3(int dummy);
@@ -124,5 +125,8 @@ bool run_messaging_fdpass2a(int dummy);
 bool run_messaging_fdpass2b(int dummy);
 bool run_oplock_cancel(int dummy);
 bool run_pthreadpool_tevent(int dummy);
+bool run_notify_fanotify(int dummy);
+bool run_brlock_hint(int dummy);
+bool run_locking_shards(int dummy);
 
 #endif /* __TORTURE_H__ */
@@ -0,0 +1,292 @@
+/*
+   Unix SMB/CIFS implementation.
+   Test the brlock hint shared between processes
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "torture/proto.h"
+#include "locking/proto.h"
+#include "system/filesys.h"
+#include <sys/mman.h>
+#include <sched.h>
+
+#if defined(HAVE___SYNC_FETCH_AND_ADD)
+
+#define BRLOCK_HINT_ROUNDS 2000
+
+/*
+ * Shared between the lock holder and the checker. gen is odd while
+ * the lock holder has its lock in brlock.tdb, seen counts the checks
+ * done with the lock held.
+ */
+struct brlock_hint_shared {
+	uint32_t gen;
+	uint32_t seen;
+	uint32_t done;
+};
+
+static void brlock_hint_fake_fsp(files_struct *fsp,
+				 connection_struct *conn,
+				 struct share_params *params)
+{
+	*params = (struct share_params) { .service = -1 };
+	*conn = (connection_struct) { .cnum = 1, .params = params };
+	*fsp = (files_struct) {
+		.conn = conn,
+		.fnum = 1,
+		.file_id = { .devid = 0x62726c, .inode = 0x68696e74 },
+	};
+}
+
+static bool brlock_hint_lock(files_struct *fsp, struct server_id self,
+			     enum brl_type lock_type)
+{
+	struct byte_range_lock *br_lck;
+	NTSTATUS status;
+
+	br_lck = brl_get_locks(talloc_tos(), fsp);
+	if (br_lck == NULL) {
+		fprintf(stderr, "brl_get_locks failed\n");
+		return false;
+	}
+	if (lock_type == UNLOCK_LOCK) {
+		if (!brl_unlock(NULL, br_lck, 1, self, 0, 10, POSIX_LOCK)) {
+			fprintf(stderr, "brl_unlock failed\n");
+			TALLOC_FREE(br_lck);
+			return false;
+		}
+	} else {
+		status = brl_lock(NULL, br_lck, 1, self, 0, 10, lock_type,
+				  POSIX_LOCK, false, NULL);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "brl_lock failed: %s\n",
+				nt_errstr(status));
+			TALLOC_FREE(br_lck);
+			return false;
+		}
+	}
+	/* Writes the record and adjusts the hint */
+	TALLOC_FREE(br_lck);
+	return true;
+}
+
+static void brlock_hint_holder(struct brlock_hint_shared *shared,
+			       int ready_fd, int go_fd)
+{
+	struct share_params params;
+	connection_struct conn;
+	files_struct fsp;
+	struct server_id self = {
+		.pid = getpid(),
+		.vnn = NONCLUSTER_VNN,
+		.unique_id = SERVERID_UNIQUE_ID_NOT_TO_VERIFY,
+	};
+	uint32_t seen;
+	unsigned i;
+	char c = 0;
+
+	brlock_hint_fake_fsp(&fsp, &conn, &params);
+
+	if (!locking_init()) {
+		fprintf(stderr, "holder: locking_init failed\n");
+		_exit(1);
+	}
+	if ((write(ready_fd, &c, 1) != 1) || (read(go_fd, &c, 1) != 1)) {
+		perror("holder: pipe failed");
+		_exit(1);
+	}
+
+	for (i=0; i<BRLOCK_HINT_ROUNDS; i++) {
+		if (!brlock_hint_lock(&fsp, self, WRITE_LOCK)) {
+			_exit(1);
+		}
+		__sync_fetch_and_add(&shared->gen, 1);
+		seen = __sync_fetch_and_add(&shared->seen, 0);
+
+		/* Keep the lock until the checker had a look */
+		while (__sync_fetch_and_add(&shared->seen, 0) == seen) {
+			sched_yield();
+		}
+
+		__sync_fetch_and_add(&shared->gen, 1);
+		if (!brlock_hint_lock(&fsp, self, UNLOCK_LOCK)) {
+			_exit(1);
+		}
+	}
+
+	/*
+	 * Go away without unlocking, the stale lock is left in
+	 * brlock.tdb.
+	 */
+	if (!brlock_hint_lock(&fsp, self, WRITE_LOCK)) {
+		_exit(1);
+	}
+	__sync_fetch_and_add(&shared->gen, 1);
+	__sync_fetch_and_add(&shared->done, 1);
+	_exit(0);
+}
+
+bool run_brlock_hint(int dummy)
+{
+	struct brlock_hint_shared *shared;
+	struct share_params params;
+	connection_struct conn;
+	files_struct fsp;
+	struct server_id self = {
+		.pid = getpid(),
+		.vnn = NONCLUSTER_VNN,
+		.unique_id = SERVERID_UNIQUE_ID_NOT_TO_VERIFY,
+	};
+	unsigned long checks = 0, held = 0, violations = 0;
+	int ready_pipe[2], go_pipe[2];
+	pid_t child;
+	int status;
+	bool ret = false;
+	char c = 0;
+
+	lp_set_cmdline("posix locking", "no");
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap failed");
+		return false;
+	}
+	*shared = (struct brlock_hint_shared) { .gen = 0 };
+
+	if ((pipe(ready_pipe) != 0) || (pipe(go_pipe) != 0)) {
+		perror("pipe failed");
+		return false;
+	}
+
+	/*
+	 * Fork before opening brlock.tdb, both processes have to
+	 * find the hint file themselves.
+	 */
+	child = fork();
+	if (child == -1) {
+		perror("fork failed");
+		return false;
+	}
+	if (child == 0) {
+		close(ready_pipe[0]);
+		close(go_pipe[1]);
+		brlock_hint_holder(shared, ready_pipe[1], go_pipe[0]);
+	}
+	close(ready_pipe[1]);
+	close(go_pipe[0]);
+
+	brlock_hint_fake_fsp(&fsp, &conn, &params);
+
+	if (!locking_init()) {
+		fprintf(stderr, "locking_init failed\n");
+		goto fail;
+	}
+	if ((read(ready_pipe[0], &c, 1) != 1) ||
+	    (write(go_pipe[1], &c, 1) != 1)) {
+		perror("pipe failed");
+		goto fail;
+	}
+
+	while (__sync_fetch_and_add(&shared->done, 0) == 0) {
+		uint32_t gen1, gen2;
+		bool maybe;
+
+		/*
+		 * If the generation is odd and unchanged around
+		 * brl_maybe_locked(), the lock was there all the time.
+		 */
+		gen1 = __sync_fetch_and_add(&shared->gen, 0);
+		maybe = brl_maybe_locked(&fsp);
+		gen2 = __sync_fetch_and_add(&shared->gen, 0);
+
+		checks += 1;
+		if ((gen1 != gen2) || ((gen1 % 2) == 0)) {
+			continue;
+		}
+		held += 1;
+		if (!maybe) {
+			violations += 1;
+		}
+		__sync_fetch_and_add(&shared->seen, 1);
+		sched_yield();
+	}
+
+	if (waitpid(child, &status, 0) == -1) {
+		perror("waitpid failed");
+		goto fail;
+	}
+	child = -1;
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		fprintf(stderr, "lock holder failed\n");
+		goto fail;
+	}
+
+	printf("%lu checks, %lu with the lock held, %lu violations\n",
+	       checks, held, violations);
+	if (violations != 0) {
+		fprintf(stderr, "brl_maybe_locked missed a lock\n");
+		goto fail;
+	}
+
+	if (!brl_maybe_locked(&fsp)) {
+		fprintf(stderr, "brl_maybe_locked missed a stale lock\n");
+		goto fail;
+	}
+
+	/* Our lock conflicts, this cleans up the stale one */
+	if (!brlock_hint_lock(&fsp, self, WRITE_LOCK)) {
+		goto fail;
+	}
+	if (!brl_maybe_locked(&fsp)) {
+		fprintf(stderr, "brl_maybe_locked missed our lock\n");
+		goto fail;
+	}
+	if (!brlock_hint_lock(&fsp, self, UNLOCK_LOCK)) {
+		goto fail;
+	}
+	if (brl_maybe_locked(&fsp)) {
+		/*
+		 * Without the hint, brl_maybe_locked() always
+		 * returns true and the test above checks nothing.
+		 */
+		fprintf(stderr, "brlock hint not active\n");
+		goto fail;
+	}
+
+	ret = true;
+fail:
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+	}
+	locking_end();
+	close(ready_pipe[0]);
+	close(go_pipe[1]);
+	munmap(shared, sizeof(*shared));
+	return ret;
+}
+
+#else
+
+bool run_brlock_hint(int dummy)
+{
+	printf("No atomic builtins, brlock hint not available\n");
+	return true;
+}
+
+#endif
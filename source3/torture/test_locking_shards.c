@@ -0,0 +1,273 @@
+/*
+   Unix SMB/CIFS implementation.
+   Test locking.tdb/brlock.tdb sharding across processes
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "torture/proto.h"
+#include "locking/proto.h"
+#include "system/filesys.h"
+#include "messages.h"
+#include "librpc/gen_ndr/open_files.h"
+
+#define LOCKING_SHARDS_NUM_FILES 64
+
+static struct file_id locking_shards_file_id(unsigned i)
+{
+	return (struct file_id) { .devid = 0x6c6f636b, .inode = i + 1 };
+}
+
+/*
+ * Add a share mode entry for every test file. There's no open
+ * behind it, we only look at where the records end up.
+ */
+static bool locking_shards_create(void)
+{
+	struct server_id self = messaging_server_id(
+		server_messaging_context());
+	struct timespec now = timespec_current();
+	struct smb_filename *smb_fname;
+	unsigned i;
+
+	smb_fname = synthetic_smb_fname(talloc_tos(), "file", NULL, NULL, 0);
+	if (smb_fname == NULL) {
+		fprintf(stderr, "synthetic_smb_fname failed\n");
+		return false;
+	}
+
+	for (i=0; i<LOCKING_SHARDS_NUM_FILES; i++) {
+		struct file_id id = locking_shards_file_id(i);
+		struct share_mode_lock *lck;
+		struct share_mode_data *d;
+		struct share_mode_entry *e;
+
+		lck = get_share_mode_lock(talloc_tos(), id, "/shards",
+					  smb_fname, &now);
+		if (lck == NULL) {
+			fprintf(stderr, "get_share_mode_lock failed\n");
+			return false;
+		}
+		d = lck->data;
+
+		e = talloc_zero(d, struct share_mode_entry);
+		if (e == NULL) {
+			fprintf(stderr, "talloc failed\n");
+			TALLOC_FREE(lck);
+			return false;
+		}
+		*e = (struct share_mode_entry) {
+			.pid = self,
+			.id = id,
+			.share_file_id = i,
+			.op_type = NO_OPLOCK,
+			.lease_idx = UINT32_MAX,
+		};
+		d->share_modes = e;
+		d->num_share_modes = 1;
+		d->modified = true;
+
+		TALLOC_FREE(lck);
+	}
+
+	TALLOC_FREE(smb_fname);
+	return true;
+}
+
+/*
+ * Started before the parent opens the databases, but only opens them
+ * itself once the parent has. It has to use the parent's number of
+ * shards, not its own.
+ */
+static void locking_shards_child(unsigned expected, int ready_fd,
+				 int go_fd)
+{
+	char c = 0;
+
+	lp_set_cmdline("smbd:locking shards", "2");
+
+	if (read(go_fd, &c, 1) != 1) {
+		perror("child: read failed");
+		_exit(1);
+	}
+
+	if (!locking_init()) {
+		fprintf(stderr, "child: locking_init failed\n");
+		_exit(1);
+	}
+	if (locking_num_shards() != expected) {
+		fprintf(stderr, "child: using %u shards, expected %u\n",
+			locking_num_shards(), expected);
+		_exit(1);
+	}
+	if (!locking_shards_create()) {
+		_exit(1);
+	}
+	locking_end();
+
+	if (write(ready_fd, &c, 1) != 1) {
+		perror("child: write failed");
+		_exit(1);
+	}
+	_exit(0);
+}
+
+struct locking_shards_forall_state {
+	unsigned seen[LOCKING_SHARDS_NUM_FILES];
+	unsigned others;
+};
+
+static int locking_shards_forall_fn(struct file_id fid,
+				    const struct share_mode_data *data,
+				    void *private_data)
+{
+	struct locking_shards_forall_state *state = private_data;
+	struct file_id expected;
+	uint64_t i = fid.inode - 1;
+
+	if (i >= LOCKING_SHARDS_NUM_FILES) {
+		state->others += 1;
+		return 0;
+	}
+	expected = locking_shards_file_id(i);
+	if (!file_id_equal(&fid, &expected) ||
+	    (data->num_share_modes != 1) ||
+	    (data->share_modes[0].share_file_id != i)) {
+		state->others += 1;
+		return 0;
+	}
+	state->seen[i] += 1;
+	return 0;
+}
+
+bool run_locking_shards(int dummy)
+{
+	struct locking_shards_forall_state state = { .others = 0 };
+	unsigned per_shard[LOCKING_MAX_SHARDS] = { 0 };
+	const unsigned num_shards = 4;
+	int ready_pipe[2], go_pipe[2];
+	pid_t child;
+	int status;
+	unsigned i;
+	int count;
+	bool ret = false;
+	char c = 0;
+
+	lp_set_cmdline("smbd:locking shards", "4");
+
+	if ((pipe(ready_pipe) != 0) || (pipe(go_pipe) != 0)) {
+		perror("pipe failed");
+		return false;
+	}
+
+	child = fork();
+	if (child == -1) {
+		perror("fork failed");
+		return false;
+	}
+	if (child == 0) {
+		close(ready_pipe[0]);
+		close(go_pipe[1]);
+		locking_shards_child(num_shards, ready_pipe[1], go_pipe[0]);
+	}
+	close(ready_pipe[1]);
+	close(go_pipe[0]);
+
+	if (!locking_init()) {
+		fprintf(stderr, "locking_init failed\n");
+		goto fail;
+	}
+	if (locking_num_shards() != num_shards) {
+		fprintf(stderr, "using %u shards, expected %u\n",
+			locking_num_shards(), num_shards);
+		goto fail;
+	}
+
+	for (i=0; i<LOCKING_SHARDS_NUM_FILES; i++) {
+		struct file_id id = locking_shards_file_id(i);
+		per_shard[locking_shard(&id, num_shards)] += 1;
+	}
+	for (i=0; i<num_shards; i++) {
+		if (per_shard[i] == 0) {
+			fprintf(stderr, "no test file in shard %u\n", i);
+			goto fail;
+		}
+	}
+
+	if ((write(go_pipe[1], &c, 1) != 1) ||
+	    (read(ready_pipe[0], &c, 1) != 1)) {
+		fprintf(stderr, "child failed\n");
+		goto fail;
+	}
+	if (waitpid(child, &status, 0) == -1) {
+		perror("waitpid failed");
+		goto fail;
+	}
+	child = -1;
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		fprintf(stderr, "child failed\n");
+		goto fail;
+	}
+
+	/* Every record has to be where we look for it */
+	for (i=0; i<LOCKING_SHARDS_NUM_FILES; i++) {
+		struct file_id id = locking_shards_file_id(i);
+		struct share_mode_lock *lck;
+
+		lck = fetch_share_mode_unlocked(talloc_tos(), id);
+		if ((lck == NULL) || (lck->data->num_share_modes != 1) ||
+		    (lck->data->share_modes[0].share_file_id != i)) {
+			fprintf(stderr, "share mode %u not found in shard "
+				"%u\n", i, locking_shard(&id, num_shards));
+			TALLOC_FREE(lck);
+			goto fail;
+		}
+		TALLOC_FREE(lck);
+	}
+
+	/*
+	 * The traversal covers all shards, and does not mistake the
+	 * LOCKING_SHARDS record in shard 0 for a share mode.
+	 */
+	count = share_mode_forall(locking_shards_forall_fn, &state);
+	if (count < 0) {
+		fprintf(stderr, "share_mode_forall failed\n");
+		goto fail;
+	}
+	if (state.others != 0) {
+		fprintf(stderr, "share_mode_forall found %u unexpected "
+			"records\n", state.others);
+		goto fail;
+	}
+	for (i=0; i<LOCKING_SHARDS_NUM_FILES; i++) {
+		if (state.seen[i] != 1) {
+			fprintf(stderr, "share_mode_forall found share mode "
+				"%u %u times\n", i, state.seen[i]);
+			goto fail;
+		}
+	}
+
+	ret = true;
+fail:
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+	}
+	locking_end();
+	close(ready_pipe[0]);
+	close(go_pipe[1]);
+	return ret;
+}
@@ -0,0 +1,459 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Test the fanotify sys_notify backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "torture/proto.h"
+#include "../librpc/gen_ndr/notify.h"
+#include "smbd/smbd.h"
+
+#ifdef HAVE_FANOTIFY
+
+struct fanotify_test_event {
+	uint32_t action;
+	const char *name;
+};
+
+struct fanotify_test_state {
+	struct fanotify_test_event events[8];
+	size_t num_events;
+};
+
+static void fanotify_test_callback(struct sys_notify_context *ctx,
+				   void *private_data,
+				   struct notify_event *ev,
+				   uint32_t filter)
+{
+	struct fanotify_test_state *state = private_data;
+	struct fanotify_test_event *e;
+
+	if (state->num_events == ARRAY_SIZE(state->events)) {
+		fprintf(stderr, "Too many events, dropping %s\n", ev->path);
+		return;
+	}
+
+	e = &state->events[state->num_events];
+	e->action = ev->action;
+	e->name = talloc_strdup(state, ev->path);
+	state->num_events += 1;
+}
+
+static void fanotify_test_timeout(struct tevent_context *ev,
+				  struct tevent_timer *te,
+				  struct timeval current_time,
+				  void *private_data)
+{
+	bool *timed_out = private_data;
+	*timed_out = true;
+}
+
+/*
+ * Wait for the events in "expected", in that order
+ */
+static bool fanotify_test_expect(struct tevent_context *ev,
+				 struct fanotify_test_state *state,
+				 const struct fanotify_test_event *expected,
+				 size_t num_expected)
+{
+	struct tevent_timer *te;
+	bool timed_out = false;
+	size_t i;
+
+	te = tevent_add_timer(ev, ev, timeval_current_ofs(5, 0),
+			      fanotify_test_timeout, &timed_out);
+	if (te == NULL) {
+		fprintf(stderr, "tevent_add_timer failed\n");
+		return false;
+	}
+
+	while ((state->num_events < num_expected) && !timed_out) {
+		if (tevent_loop_once(ev) != 0) {
+			fprintf(stderr, "tevent_loop_once failed\n");
+			return false;
+		}
+	}
+	if (!timed_out) {
+		TALLOC_FREE(te);
+	}
+
+	if (state->num_events != num_expected) {
+		fprintf(stderr, "Got %zu events, expected %zu\n",
+			state->num_events, num_expected);
+		return false;
+	}
+
+	for (i=0; i<num_expected; i++) {
+		const struct fanotify_test_event *e = &state->events[i];
+
+		if ((e->action != expected[i].action) ||
+		    (strcmp(e->name, expected[i].name) != 0)) {
+			fprintf(stderr, "Event %zu: Got %u/%s, "
+				"expected %u/%s\n", i,
+				(unsigned)e->action, e->name,
+				(unsigned)expected[i].action,
+				expected[i].name);
+			return false;
+		}
+	}
+
+	state->num_events = 0;
+	return true;
+}
+
+/*
+ * Count the file system and the inode marks of all fanotify fds we
+ * have open
+ */
+static bool fanotify_test_marks(size_t *num_fs, size_t *num_inode)
+{
+	DIR *d;
+	struct dirent *de;
+
+	*num_fs = 0;
+	*num_inode = 0;
+
+	d = opendir("/proc/self/fdinfo");
+	if (d == NULL) {
+		fprintf(stderr, "opendir failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		char path[PATH_MAX];
+		char line[1024];
+		FILE *f;
+
+		if (ISDOT(de->d_name) || ISDOTDOT(de->d_name)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/proc/self/fdinfo/%s",
+			 de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL) {
+			continue;
+		}
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (strncmp(line, "fanotify sdev:", 14) == 0) {
+				*num_fs += 1;
+			}
+			if (strncmp(line, "fanotify ino:", 13) == 0) {
+				*num_inode += 1;
+			}
+		}
+		fclose(f);
+	}
+
+	closedir(d);
+	return true;
+}
+
+static bool fanotify_test_check_marks(size_t expect_fs, size_t expect_inode)
+{
+	size_t num_fs, num_inode;
+
+	if (!fanotify_test_marks(&num_fs, &num_inode)) {
+		return false;
+	}
+	if ((num_fs != expect_fs) || (num_inode != expect_inode)) {
+		fprintf(stderr, "Got %zu/%zu file system/inode marks, "
+			"expected %zu/%zu\n", num_fs, num_inode,
+			expect_fs, expect_inode);
+		return false;
+	}
+	return true;
+}
+
+static bool fanotify_test_write(const char *path, bool create)
+{
+	int fd;
+
+	fd = open(path, create ? (O_WRONLY|O_CREAT|O_EXCL) : O_WRONLY,
+		  0644);
+	if (fd == -1) {
+		fprintf(stderr, "open(%s) failed: %s\n", path,
+			strerror(errno));
+		return false;
+	}
+	if (!create && (write(fd, "x", 1) != 1)) {
+		fprintf(stderr, "write(%s) failed: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+static bool fanotify_test_run(struct tevent_context *ev,
+			      struct sys_notify_context *ctx,
+			      struct fanotify_test_state *state,
+			      const char *base)
+{
+	const char *a, *b;
+	void *w1 = NULL, *w2 = NULL;
+	uint32_t filter, subdir_filter;
+	bool ok = false;
+	int ret;
+
+	a = talloc_asprintf(state, "%s/a", base);
+	b = talloc_asprintf(state, "%s/b", base);
+	if ((a == NULL) || (b == NULL)) {
+		fprintf(stderr, "talloc_asprintf failed\n");
+		return false;
+	}
+	if ((mkdir(a, 0755) == -1) || (mkdir(b, 0755) == -1)) {
+		fprintf(stderr, "mkdir failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	filter = FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_DIR_NAME|
+		FILE_NOTIFY_CHANGE_ATTRIBUTES;
+	subdir_filter = 0;
+
+	ret = fanotify_watch(state, ctx, a, &filter, &subdir_filter,
+			     fanotify_test_callback, state, &w1);
+	if ((ret == EPERM) || (ret == ENOSYS) || (ret == ENODEV) ||
+	    (ret == EXDEV) || (ret == EOPNOTSUPP)) {
+		printf("fanotify not usable here (%s), skipping\n",
+		       strerror(ret));
+		return true;
+	}
+	if (ret != 0) {
+		fprintf(stderr, "fanotify_watch failed: %s\n",
+			strerror(ret));
+		return false;
+	}
+
+	/*
+	 * One mark for the file system, FAN_MODIFY on the directory
+	 */
+	if (!fanotify_test_check_marks(1, 1)) {
+		goto done;
+	}
+
+	if (!fanotify_test_write(talloc_asprintf(state, "%s/f", a), true)) {
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_ADDED, "f" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	if (!fanotify_test_write(talloc_asprintf(state, "%s/f", a), false)) {
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_MODIFIED, "f" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	/*
+	 * Nothing for the unwatched directory
+	 */
+	if (!fanotify_test_write(talloc_asprintf(state, "%s/x", b), true) ||
+	    !fanotify_test_write(talloc_asprintf(state, "%s/x", b), false) ||
+	    !fanotify_test_write(talloc_asprintf(state, "%s/g", a), true)) {
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_ADDED, "g" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	/*
+	 * Changes on a subdirectory itself show up in its parent
+	 */
+	if (mkdir(talloc_asprintf(state, "%s/sub", a), 0755) == -1) {
+		fprintf(stderr, "mkdir failed: %s\n", strerror(errno));
+		goto done;
+	}
+	if (chmod(talloc_asprintf(state, "%s/sub", a), 0700) == -1) {
+		fprintf(stderr, "chmod failed: %s\n", strerror(errno));
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_ADDED, "sub" },
+			{ NOTIFY_ACTION_MODIFIED, "sub" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	/*
+	 * The parent of the watched directory is not watched
+	 */
+	if (chmod(a, 0700) == -1) {
+		fprintf(stderr, "chmod failed: %s\n", strerror(errno));
+		goto done;
+	}
+	if (!fanotify_test_write(talloc_asprintf(state, "%s/h", a), true)) {
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_ADDED, "h" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	if (rename(talloc_asprintf(state, "%s/f", a),
+		   talloc_asprintf(state, "%s/f2", a)) == -1) {
+		fprintf(stderr, "rename failed: %s\n", strerror(errno));
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_OLD_NAME, "f" },
+			{ NOTIFY_ACTION_NEW_NAME, "f2" },
+			{ NOTIFY_ACTION_MODIFIED, "f2" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	if (unlink(talloc_asprintf(state, "%s/f2", a)) == -1) {
+		fprintf(stderr, "unlink failed: %s\n", strerror(errno));
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_REMOVED, "f2" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	/*
+	 * A second watch without FAN_MODIFY. Once the first one is
+	 * gone, so is the mark on the directory.
+	 */
+	filter = FILE_NOTIFY_CHANGE_FILE_NAME;
+	subdir_filter = 0;
+
+	ret = fanotify_watch(state, ctx, a, &filter, &subdir_filter,
+			     fanotify_test_callback, state, &w2);
+	if (ret != 0) {
+		fprintf(stderr, "fanotify_watch failed: %s\n",
+			strerror(ret));
+		goto done;
+	}
+	TALLOC_FREE(w1);
+
+	if (!fanotify_test_check_marks(1, 0)) {
+		goto done;
+	}
+
+	if (!fanotify_test_write(talloc_asprintf(state, "%s/i", a), true)) {
+		goto done;
+	}
+	{
+		struct fanotify_test_event e[] = {
+			{ NOTIFY_ACTION_ADDED, "i" } };
+		if (!fanotify_test_expect(ev, state, e, ARRAY_SIZE(e))) {
+			goto done;
+		}
+	}
+
+	TALLOC_FREE(w2);
+
+	if (!fanotify_test_check_marks(0, 0)) {
+		goto done;
+	}
+
+	ok = true;
+done:
+	TALLOC_FREE(w1);
+	TALLOC_FREE(w2);
+	return ok;
+}
+
+static void fanotify_test_cleanup(const char *base)
+{
+	const char *names[] = {
+		"a/f", "a/f2", "a/g", "a/h", "a/i", "a/sub", "a",
+		"b/x", "b", "" };
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(names); i++) {
+		char *path = talloc_asprintf(talloc_tos(), "%s/%s",
+					     base, names[i]);
+		if ((unlink(path) == -1) && (errno == EISDIR)) {
+			rmdir(path);
+		}
+		TALLOC_FREE(path);
+	}
+}
+
+bool run_notify_fanotify(int dummy)
+{
+	struct tevent_context *ev;
+	struct sys_notify_context *ctx;
+	struct fanotify_test_state *state;
+	char *base;
+	bool ok;
+
+	ev = samba_tevent_context_init(talloc_tos());
+	if (ev == NULL) {
+		fprintf(stderr, "tevent_context_init failed\n");
+		return false;
+	}
+
+	ctx = talloc_zero(ev, struct sys_notify_context);
+	state = talloc_zero(ev, struct fanotify_test_state);
+	base = talloc_asprintf(ev, "%s/fanotify.XXXXXX", tmpdir());
+	if ((ctx == NULL) || (state == NULL) || (base == NULL)) {
+		fprintf(stderr, "talloc failed\n");
+		TALLOC_FREE(ev);
+		return false;
+	}
+	ctx->ev = ev;
+
+	if (mkdtemp(base) == NULL) {
+		fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+		TALLOC_FREE(ev);
+		return false;
+	}
+
+	ok = fanotify_test_run(ev, ctx, state, base);
+
+	fanotify_test_cleanup(base);
+	TALLOC_FREE(ev);
+	return ok;
+}
+
+#else
+
+bool run_notify_fanotify(int dummy)
+{
+	printf("fanotify not available, skipping\n");
+	return true;
+}
+
+#endif
@@ -11476,7 +11476,11 @@ static struct {
 	{ "local-tdb-writer", run_local_tdb_writer, 0 },
 	{ "LOCAL-DBWRAP-CTDB", run_local_dbwrap_ctdb, 0 },
 	{ "LOCAL-BENCH-PTHREADPOOL", run_bench_pthreadpool, 0 },
+	{ "LOCAL-BENCH-SMB2-CRYPTO", run_bench_smb2_crypto, 0 },
 	{ "LOCAL-PTHREADPOOL-TEVENT", run_pthreadpool_tevent, 0 },
+	{ "LOCAL-NOTIFY-FANOTIFY", run_notify_fanotify, 0 },
+	{ "LOCAL-BRLOCK-HINT", run_brlock_hint, 0 },
+	{ "LOCAL-LOCKING-SHARDS", run_locking_shards, 0 },
 	{ "LOCAL-CANONICALIZE-PATH", run_local_canonicalize_path, 0 },
 	{ "qpathinfo-bufsize", run_qpathinfo_bufsize, 0 },
 	{NULL, NULL, 0}};
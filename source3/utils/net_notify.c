@@ -47,6 +47,34 @@ static void net_notify_got_event(struct messaging_context *msg,
 		 event_msg->path);
 }
 
+static void net_notify_got_events(struct messaging_context *msg,
+				  void *private_data,
+				  uint32_t msg_type,
+				  struct server_id server_id,
+				  DATA_BLOB *data)
+{
+	size_t ofs = 0;
+
+	while (ofs < data->length) {
+		struct notify_event_msg event_msg;
+		size_t hdrlen = offsetof(struct notify_event_msg, path);
+		size_t len;
+
+		len = notify_event_msg_len(data->data + ofs,
+					   data->length - ofs);
+		if (len == 0) {
+			d_fprintf(stderr, "invalid event\n");
+			return;
+		}
+		memcpy(&event_msg, data->data + ofs, hdrlen);
+
+		d_printf("%u %s\n", (unsigned)event_msg.action,
+			 (const char *)data->data + ofs + hdrlen);
+
+		ofs += len;
+	}
+}
+
 static int net_notify_listen(struct net_context *c, int argc,
 			     const char **argv)
 {
@@ -94,6 +122,13 @@ static int net_notify_listen(struct net_context *c, int argc,
 			  nt_errstr(status));
 		return -1;
 	}
+	status = messaging_register(c->msg_ctx, NULL, MSG_SMB_NOTIFY_EVENTS,
+				    net_notify_got_events);
+	if (!NT_STATUS_IS_OK(status)) {
+		d_fprintf(stderr, "messaging_register failed: %s\n",
+			  nt_errstr(status));
+		return -1;
+	}
 
 	status = messaging_send_iov(
 		c->msg_ctx, notifyd, MSG_SMB_NOTIFY_REC_CHANGE,
@@ -43,7 +43,17 @@ static int nprocs;
 static int lock_failed;
 static int num_connected;
 
-enum lock_stage {LOCK_INITIAL, LOCK_LOCK, LOCK_UNLOCK};
+/*
+  Each client holds num_ranges locks, cycling through lock_span
+  offsets. With the "ranges" option every client uses its own set of
+  offsets, so the server has to search through nprocs*ranges locks
+  without any contention.
+*/
+static bool private_ranges;
+static int num_ranges;
+static int lock_span;
+
+enum lock_stage {LOCK_INITIAL, LOCK_FILL, LOCK_LOCK, LOCK_UNLOCK};
 
 struct benchlock_state {
 	struct torture_context *tctx;
@@ -86,20 +96,30 @@ static void lock_send(struct benchlock_state *state)
 		state->unlock_offset = 0;
 		lock.offset = state->lock_offset;
 		break;
+	case LOCK_FILL:
+		io.lockx.in.ulock_cnt = 0;
+		io.lockx.in.lock_cnt = 1;
+		state->lock_offset += 1;
+		lock.offset = state->lock_offset;
+		break;
 	case LOCK_LOCK:
 		io.lockx.in.ulock_cnt = 0;
 		io.lockx.in.lock_cnt = 1;
-		state->lock_offset = (state->lock_offset+1)%(nprocs+1);
+		state->lock_offset = (state->lock_offset+1)%lock_span;
 		lock.offset = state->lock_offset;
 		break;
 	case LOCK_UNLOCK:
 		io.lockx.in.ulock_cnt = 1;
 		io.lockx.in.lock_cnt = 0;
 		lock.offset = state->unlock_offset;
-		state->unlock_offset = (state->unlock_offset+1)%(nprocs+1);
+		state->unlock_offset = (state->unlock_offset+1)%lock_span;
 		break;
 	}
 
+	if (private_ranges) {
+		lock.offset += (uint64_t)state->client_num * lock_span;
+	}
+
 	lock.count = 1;
 	lock.pid = state->tree->session->pid;
 
@@ -247,7 +267,12 @@ static void lock_completion(struct smbcli_request *req)
 
 	switch (state->stage) {
 	case LOCK_INITIAL:
-		state->stage = LOCK_LOCK;
+	case LOCK_FILL:
+		if (state->lock_offset + 1 < num_ranges) {
+			state->stage = LOCK_FILL;
+		} else {
+			state->stage = LOCK_LOCK;
+		}
 		break;
 	case LOCK_LOCK:
 		state->stage = LOCK_UNLOCK;
@@ -329,11 +354,23 @@ bool torture_bench_lock(struct torture_context *torture)
 	bool progress;
 	off_t offset;
 	int initial_locks = torture_setting_int(torture, "initial_locks", 0);
+	int ranges = torture_setting_int(torture, "ranges", 0);
 
 	progress = torture_setting_bool(torture, "progress", true);
 
 	nprocs = torture_setting_int(torture, "nprocs", 4);
 
+	if (ranges > 0) {
+		printf("Each proc cycles through %d private ranges\n", ranges);
+		private_ranges = true;
+		num_ranges = ranges;
+		lock_span = ranges * 2;
+	} else {
+		private_ranges = false;
+		num_ranges = 1;
+		lock_span = nprocs + 1;
+	}
+
 	state = talloc_zero_array(mem_ctx, struct benchlock_state, nprocs);
 
 	printf("Opening %d connections\n", nprocs);
@@ -0,0 +1,352 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   test suite for the smbd directory cache
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * These tests expect a share with "smbd:directory cache = yes". They
+ * pass without the cache as well, except for the ttl test which needs
+ * "kernel change notify = no" and a "torture:localdir" pointing to
+ * the share.
+ */
+
+#include "includes.h"
+#include "libcli/smb2/smb2.h"
+#include "libcli/smb2/smb2_calls.h"
+#include "torture/torture.h"
+#include "torture/smb2/proto.h"
+#include "system/filesys.h"
+
+#define BASEDIR "test_dircache"
+
+struct dircache_entry {
+	bool found;
+	uint64_t size;
+	uint32_t attrib;
+};
+
+/*
+ * Enumerate BASEDIR on a new handle and return what it says about
+ * name.
+ */
+static bool dircache_find(struct torture_context *tctx,
+			  struct smb2_tree *tree,
+			  const char *name,
+			  struct dircache_entry *e)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(tctx);
+	struct smb2_handle h = {{0}};
+	struct smb2_find f;
+	union smb_search_data *d;
+	unsigned int count;
+	unsigned int i;
+	NTSTATUS status;
+	bool ret = true;
+
+	*e = (struct dircache_entry) { .found = false };
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"torture_smb2_testdir failed");
+
+	ZERO_STRUCT(f);
+	f.in.file.handle	= h;
+	f.in.pattern		= "*";
+	f.in.continue_flags	= SMB2_CONTINUE_FLAG_RESTART;
+	f.in.max_response_size	= 0x10000;
+	f.in.level		= SMB2_FIND_BOTH_DIRECTORY_INFO;
+
+	while (true) {
+		status = smb2_find_level(tree, mem_ctx, &f, &count, &d);
+		if (NT_STATUS_EQUAL(status, STATUS_NO_MORE_FILES)) {
+			break;
+		}
+		torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+						"smb2_find_level failed");
+
+		for (i = 0; i < count; i++) {
+			const char *found = d[i].both_directory_info.name.s;
+
+			if (strcmp(found, name) != 0) {
+				continue;
+			}
+			e->found = true;
+			e->size = d[i].both_directory_info.size;
+			e->attrib = d[i].both_directory_info.attrib;
+		}
+
+		f.in.continue_flags = 0;
+	}
+
+done:
+	if (!smb2_util_handle_empty(h)) {
+		smb2_util_close(tree, h);
+	}
+	talloc_free(mem_ctx);
+	return ret;
+}
+
+/*
+ * Changes done through another smbd reach us through notifyd, so
+ * they may take a moment. Wait for them, but not nearly as long as
+ * the cache ttl.
+ */
+static bool dircache_wait(struct torture_context *tctx,
+			  struct smb2_tree *tree,
+			  const char *name,
+			  bool found,
+			  uint64_t size,
+			  uint32_t attrib)
+{
+	struct dircache_entry e;
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		if (!dircache_find(tctx, tree, name, &e)) {
+			return false;
+		}
+		if ((e.found == found) &&
+		    (!found || ((e.size == size) &&
+				((e.attrib & attrib) == attrib)))) {
+			return true;
+		}
+		smb_msleep(100);
+	}
+
+	torture_warning(tctx, "%s: found=%d size=%ju attrib=0x%x, "
+			"expected found=%d size=%ju attrib=0x%x\n",
+			name, (int)e.found, (uintmax_t)e.size,
+			(unsigned)e.attrib, (int)found, (uintmax_t)size,
+			(unsigned)attrib);
+	return false;
+}
+
+static bool dircache_create(struct torture_context *tctx,
+			    struct smb2_tree *tree,
+			    const char *name,
+			    size_t size)
+{
+	const char *fname = talloc_asprintf(tctx, BASEDIR "\\%s", name);
+	struct smb2_handle h;
+	uint8_t *buf = NULL;
+	NTSTATUS status;
+	bool ret = true;
+
+	buf = talloc_zero_array(tctx, uint8_t, size);
+	torture_assert(tctx, buf != NULL, "talloc failed");
+
+	status = torture_smb2_testfile(tree, fname, &h);
+	torture_assert_ntstatus_ok(tctx, status,
+				   "torture_smb2_testfile failed");
+
+	status = smb2_util_write(tree, h, buf, 0, size);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"smb2_util_write failed");
+
+done:
+	smb2_util_close(tree, h);
+	talloc_free(buf);
+	return ret;
+}
+
+/*
+ * Fill the cache of the first connection, then change the directory
+ * through a second one. The first connection must see every change
+ * long before the cache ttl runs out.
+ */
+static bool test_dircache_coherence(struct torture_context *tctx,
+				    struct smb2_tree *tree1,
+				    struct smb2_tree *tree2)
+{
+	struct dircache_entry e;
+	struct smb2_handle h = {{0}};
+	union smb_setfileinfo sinfo;
+	uint8_t buf[4096] = {0};
+	NTSTATUS status;
+	bool ret = true;
+
+	smb2_deltree(tree1, BASEDIR);
+
+	status = torture_smb2_testdir(tree1, BASEDIR, &h);
+	torture_assert_ntstatus_ok(tctx, status,
+				   "torture_smb2_testdir failed");
+	smb2_util_close(tree1, h);
+	ZERO_STRUCT(h);
+
+	ret = dircache_create(tctx, tree1, "file1", 10);
+	torture_assert_goto(tctx, ret, ret, done, "create file1 failed");
+	ret = dircache_create(tctx, tree1, "file2", 20);
+	torture_assert_goto(tctx, ret, ret, done, "create file2 failed");
+
+	/* Twice, the second one is served from the cache */
+	ret = dircache_find(tctx, tree1, "file1", &e);
+	torture_assert_goto(tctx, ret, ret, done, "find failed");
+	ret = dircache_find(tctx, tree1, "file1", &e);
+	torture_assert_goto(tctx, ret, ret, done, "find failed");
+	torture_assert_goto(tctx, e.found && (e.size == 10), ret, done,
+			    "file1 not listed");
+
+	torture_comment(tctx, "create from the second connection\n");
+	ret = dircache_create(tctx, tree2, "file3", 30);
+	torture_assert_goto(tctx, ret, ret, done, "create file3 failed");
+	ret = dircache_wait(tctx, tree1, "file3", true, 30, 0);
+	torture_assert_goto(tctx, ret, ret, done, "file3 not seen");
+
+	torture_comment(tctx, "delete from the second connection\n");
+	status = smb2_util_unlink(tree2, BASEDIR "\\file2");
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"unlink failed");
+	ret = dircache_wait(tctx, tree1, "file2", false, 0, 0);
+	torture_assert_goto(tctx, ret, ret, done, "file2 still seen");
+
+	torture_comment(tctx, "delete and recreate from the second "
+			"connection\n");
+	status = smb2_util_unlink(tree2, BASEDIR "\\file3");
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"unlink failed");
+	ret = dircache_create(tctx, tree2, "file3", 300);
+	torture_assert_goto(tctx, ret, ret, done, "create file3 failed");
+	ret = dircache_wait(tctx, tree1, "file3", true, 300, 0);
+	torture_assert_goto(tctx, ret, ret, done, "new file3 not seen");
+
+	torture_comment(tctx, "rename from the second connection\n");
+	status = torture_smb2_testfile(tree2, BASEDIR "\\file1", &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"open file1 failed");
+	ZERO_STRUCT(sinfo);
+	sinfo.rename_information.level = RAW_SFILEINFO_RENAME_INFORMATION;
+	sinfo.rename_information.in.file.handle = h;
+	sinfo.rename_information.in.new_name = BASEDIR "\\renamed";
+	status = smb2_setinfo_file(tree2, &sinfo);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"rename failed");
+	smb2_util_close(tree2, h);
+	ZERO_STRUCT(h);
+	ret = dircache_wait(tctx, tree1, "file1", false, 0, 0);
+	torture_assert_goto(tctx, ret, ret, done, "file1 still seen");
+	ret = dircache_wait(tctx, tree1, "renamed", true, 10, 0);
+	torture_assert_goto(tctx, ret, ret, done, "renamed not seen");
+
+	/*
+	 * Neither a write nor an attribute change touches the
+	 * directory mtime, only the notify message invalidates.
+	 */
+	torture_comment(tctx, "write from the second connection\n");
+	status = torture_smb2_testfile(tree2, BASEDIR "\\renamed", &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"open renamed failed");
+	status = smb2_util_write(tree2, h, buf, 0, sizeof(buf));
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"write failed");
+	smb2_util_close(tree2, h);
+	ZERO_STRUCT(h);
+	ret = dircache_wait(tctx, tree1, "renamed", true, sizeof(buf), 0);
+	torture_assert_goto(tctx, ret, ret, done, "write not seen");
+
+	torture_comment(tctx, "set attributes from the second connection\n");
+	status = smb2_util_setatr(tree2, BASEDIR "\\renamed",
+				  FILE_ATTRIBUTE_HIDDEN);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"setatr failed");
+	ret = dircache_wait(tctx, tree1, "renamed", true, sizeof(buf),
+			    FILE_ATTRIBUTE_HIDDEN);
+	torture_assert_goto(tctx, ret, ret, done, "attributes not seen");
+
+done:
+	if (!smb2_util_handle_empty(h)) {
+		smb2_util_close(tree2, h);
+	}
+	smb2_deltree(tree1, BASEDIR);
+	return ret;
+}
+
+/*
+ * A local change that leaves the directory mtime alone is only
+ * picked up after "smbd:directory cache ttl" seconds, as documented
+ * in dircache.c. Check both ends of that window.
+ */
+static bool test_dircache_ttl(struct torture_context *tctx,
+			      struct smb2_tree *tree)
+{
+	const char *localdir = torture_setting_string(tctx, "localdir", NULL);
+	int ttl = torture_setting_int(tctx, "dircache_ttl", 5);
+	struct smb2_handle h = {{0}};
+	struct dircache_entry e;
+	char *localpath = NULL;
+	NTSTATUS status;
+	bool ret = true;
+	int rc;
+
+	if (localdir == NULL) {
+		torture_skip(tctx, "Need localdir for test");
+	}
+
+	smb2_deltree(tree, BASEDIR);
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	torture_assert_ntstatus_ok(tctx, status,
+				   "torture_smb2_testdir failed");
+	smb2_util_close(tree, h);
+
+	ret = dircache_create(tctx, tree, "file", 10);
+	torture_assert_goto(tctx, ret, ret, done, "create file failed");
+
+	ret = dircache_find(tctx, tree, "file", &e);
+	torture_assert_goto(tctx, ret, ret, done, "find failed");
+	torture_assert_goto(tctx, e.found && (e.size == 10), ret, done,
+			    "file not listed");
+
+	localpath = talloc_asprintf(tctx, "%s/" BASEDIR "/file", localdir);
+	torture_assert_goto(tctx, localpath != NULL, ret, done,
+			    "talloc failed");
+	rc = truncate(localpath, 1000);
+	torture_assert_goto(tctx, rc == 0, ret, done, "truncate failed");
+
+	ret = dircache_find(tctx, tree, "file", &e);
+	torture_assert_goto(tctx, ret, ret, done, "find failed");
+	torture_assert_goto(tctx, e.found && (e.size == 10), ret, done,
+			    "local change seen within the ttl, "
+			    "is the directory cache enabled?");
+
+	torture_comment(tctx, "waiting %d seconds for the ttl\n", ttl + 1);
+	smb_msleep((ttl + 1) * 1000);
+
+	ret = dircache_find(tctx, tree, "file", &e);
+	torture_assert_goto(tctx, ret, ret, done, "find failed");
+	torture_assert_goto(tctx, e.found && (e.size == 1000), ret, done,
+			    "local change not seen after the ttl");
+
+done:
+	smb2_deltree(tree, BASEDIR);
+	return ret;
+}
+
+struct torture_suite *torture_smb2_dircache_init(TALLOC_CTX *ctx)
+{
+	struct torture_suite *suite = torture_suite_create(ctx, "dircache");
+
+	torture_suite_add_2smb2_test(suite, "coherence",
+				     test_dircache_coherence);
+	torture_suite_add_1smb2_test(suite, "ttl", test_dircache_ttl);
+
+	suite->description = talloc_strdup(suite,
+		"smbd directory cache tests");
+
+	return suite;
+}
@@ -0,0 +1,207 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   test suite for the smbd case-folded name index
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * These tests expect a case insensitive share with
+ * "smbd:name index = yes". They pass without the index as well.
+ */
+
+#include "includes.h"
+#include "libcli/smb2/smb2.h"
+#include "libcli/smb2/smb2_calls.h"
+#include "torture/torture.h"
+#include "torture/smb2/proto.h"
+
+#define BASEDIR "test_name_index"
+
+/*
+ * Open name with a case that does not exist on disk, so the server
+ * has to go through get_real_filename(). If the open is expected to
+ * work, check that we got the file with its real name.
+ */
+static bool name_index_check(struct torture_context *tctx,
+			     struct smb2_tree *tree,
+			     const char *name,
+			     const char *real_name)
+{
+	struct smb2_create c;
+	union smb_fileinfo q;
+	const char *expected = NULL;
+	NTSTATUS status;
+	bool ret = true;
+
+	ZERO_STRUCT(c);
+	c.in.desired_access = SEC_FILE_READ_ATTRIBUTE;
+	c.in.share_access = NTCREATEX_SHARE_ACCESS_MASK;
+	c.in.file_attributes = FILE_ATTRIBUTE_NORMAL;
+	c.in.create_disposition = NTCREATEX_DISP_OPEN;
+	c.in.fname = talloc_asprintf(tctx, BASEDIR "\\%s", name);
+	torture_assert(tctx, c.in.fname != NULL, "talloc failed");
+
+	status = smb2_create(tree, tctx, &c);
+
+	if (real_name == NULL) {
+		if (NT_STATUS_IS_OK(status)) {
+			smb2_util_close(tree, c.out.file.handle);
+		}
+		torture_assert_ntstatus_equal(tctx, status,
+			NT_STATUS_OBJECT_NAME_NOT_FOUND,
+			talloc_asprintf(tctx, "%s still found", name));
+		return true;
+	}
+	torture_assert_ntstatus_ok(tctx, status,
+		talloc_asprintf(tctx, "%s not found", name));
+
+	ZERO_STRUCT(q);
+	q.generic.level = RAW_FILEINFO_SMB2_ALL_INFORMATION;
+	q.generic.in.file.handle = c.out.file.handle;
+	status = smb2_getinfo_file(tree, tctx, &q);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"smb2_getinfo_file failed");
+
+	expected = talloc_asprintf(tctx, "\\" BASEDIR "\\%s", real_name);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	torture_assert_str_equal_goto(tctx, q.all_info2.out.fname.s,
+				      expected, ret, done,
+				      "wrong real name");
+
+done:
+	smb2_util_close(tree, c.out.file.handle);
+	return ret;
+}
+
+/*
+ * The server only keeps the index of a directory that has not been
+ * modified within the last second. Wait for that, then build it with
+ * a lookup of a name that is not there.
+ */
+static bool name_index_prime(struct torture_context *tctx,
+			     struct smb2_tree *tree)
+{
+	smb_msleep(1500);
+	return name_index_check(tctx, tree, "NO_SUCH_NAME", NULL);
+}
+
+/*
+ * Build the index through the first connection, then create, rename
+ * and delete a name through a second one, which is served by another
+ * smbd. Every case insensitive lookup through the first connection
+ * has to see the change right away.
+ */
+static bool test_name_index_coherence(struct torture_context *tctx,
+				      struct smb2_tree *tree1,
+				      struct smb2_tree *tree2)
+{
+	struct smb2_handle h = {{0}};
+	union smb_setfileinfo sinfo;
+	NTSTATUS status;
+	bool ret = true;
+
+	smb2_deltree(tree1, BASEDIR);
+
+	status = torture_smb2_testdir(tree1, BASEDIR, &h);
+	torture_assert_ntstatus_ok(tctx, status,
+				   "torture_smb2_testdir failed");
+	smb2_util_close(tree1, h);
+	ZERO_STRUCT(h);
+
+	status = torture_smb2_testfile(tree1, BASEDIR "\\Other.txt", &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"torture_smb2_testfile failed");
+	smb2_util_close(tree1, h);
+	ZERO_STRUCT(h);
+
+	ret = name_index_prime(tctx, tree1);
+	torture_assert_goto(tctx, ret, ret, done, "prime failed");
+	ret = name_index_check(tctx, tree1, "OTHER.TXT", "Other.txt");
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+	ret = name_index_check(tctx, tree1, "NEWFILE.TXT", NULL);
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+
+	torture_comment(tctx, "create from the second connection\n");
+	status = torture_smb2_testfile(tree2, BASEDIR "\\NewFile.txt", &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"torture_smb2_testfile failed");
+	smb2_util_close(tree2, h);
+	ZERO_STRUCT(h);
+	ret = name_index_check(tctx, tree1, "newfile.TXT", "NewFile.txt");
+	torture_assert_goto(tctx, ret, ret, done, "create not seen");
+
+	ret = name_index_prime(tctx, tree1);
+	torture_assert_goto(tctx, ret, ret, done, "prime failed");
+	ret = name_index_check(tctx, tree1, "NEWFILE.TXT", "NewFile.txt");
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+	ret = name_index_check(tctx, tree1, "RENAMED.TXT", NULL);
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+
+	torture_comment(tctx, "rename from the second connection\n");
+	status = torture_smb2_testfile(tree2, BASEDIR "\\NewFile.txt", &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"open NewFile.txt failed");
+	ZERO_STRUCT(sinfo);
+	sinfo.rename_information.level = RAW_SFILEINFO_RENAME_INFORMATION;
+	sinfo.rename_information.in.file.handle = h;
+	sinfo.rename_information.in.new_name = BASEDIR "\\Renamed.txt";
+	status = smb2_setinfo_file(tree2, &sinfo);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"rename failed");
+	smb2_util_close(tree2, h);
+	ZERO_STRUCT(h);
+	ret = name_index_check(tctx, tree1, "newfile.txt", NULL);
+	torture_assert_goto(tctx, ret, ret, done, "rename not seen");
+	ret = name_index_check(tctx, tree1, "renamed.TXT", "Renamed.txt");
+	torture_assert_goto(tctx, ret, ret, done, "rename not seen");
+
+	ret = name_index_prime(tctx, tree1);
+	torture_assert_goto(tctx, ret, ret, done, "prime failed");
+	ret = name_index_check(tctx, tree1, "RENAMED.TXT", "Renamed.txt");
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+
+	torture_comment(tctx, "delete from the second connection\n");
+	status = smb2_util_unlink(tree2, BASEDIR "\\Renamed.txt");
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"unlink failed");
+	ret = name_index_check(tctx, tree1, "renamed.txt", NULL);
+	torture_assert_goto(tctx, ret, ret, done, "delete not seen");
+	ret = name_index_check(tctx, tree1, "other.TXT", "Other.txt");
+	torture_assert_goto(tctx, ret, ret, done, "lookup failed");
+
+done:
+	if (!smb2_util_handle_empty(h)) {
+		smb2_util_close(tree2, h);
+	}
+	smb2_deltree(tree1, BASEDIR);
+	return ret;
+}
+
+struct torture_suite *torture_smb2_name_index_init(TALLOC_CTX *ctx)
+{
+	struct torture_suite *suite = torture_suite_create(ctx, "name-index");
+
+	torture_suite_add_2smb2_test(suite, "coherence",
+				     test_name_index_coherence);
+
+	suite->description = talloc_strdup(suite,
+		"smbd case-folded name index tests");
+
+	return suite;
+}
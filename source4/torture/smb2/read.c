@@ -300,6 +300,113 @@ done:
 	return ret;
 }
 
+#define SEQ_CHUNK (64*1024)
+#define SEQ_NUM_CHUNKS 64
+#define SEQ_OUTSTANDING 8
+
+/*
+  read SEQ_OUTSTANDING chunks starting at chunk "first", with the
+  requests of each pair swapped, and compare them with buf
+*/
+static bool read_chunks(struct torture_context *torture,
+			struct smb2_tree *tree, struct smb2_handle h,
+			const uint8_t *buf, unsigned first)
+{
+	struct smb2_read rd[SEQ_OUTSTANDING];
+	struct smb2_request *req[SEQ_OUTSTANDING];
+	NTSTATUS status;
+	unsigned i, chunk;
+	bool ret = true;
+
+	for (i=0; i<SEQ_OUTSTANDING; i++) {
+		chunk = first + (i ^ 1);
+		ZERO_STRUCT(rd[i]);
+		rd[i].in.file.handle = h;
+		rd[i].in.length = SEQ_CHUNK;
+		rd[i].in.offset = chunk * SEQ_CHUNK;
+		req[i] = smb2_read_send(tree, &rd[i]);
+		torture_assert(torture, req[i] != NULL,
+			       "smb2_read_send failed");
+	}
+
+	for (i=0; i<SEQ_OUTSTANDING; i++) {
+		chunk = first + (i ^ 1);
+		status = smb2_read_recv(req[i], torture, &rd[i]);
+		req[i] = NULL;
+		CHECK_STATUS(status, NT_STATUS_OK);
+		CHECK_VALUE(rd[i].out.data.length, SEQ_CHUNK);
+		torture_assert_goto(torture,
+			memcmp(rd[i].out.data.data, buf + chunk * SEQ_CHUNK,
+			       SEQ_CHUNK) == 0,
+			ret, done,
+			talloc_asprintf(torture, "chunk %u differs", chunk));
+	}
+
+done:
+	for (i=0; i<SEQ_OUTSTANDING; i++) {
+		if (req[i] != NULL) {
+			smb2_read_recv(req[i], torture, &rd[i]);
+		}
+	}
+	return ret;
+}
+
+/*
+  read a file sequentially with several reads in flight, as clients
+  do, then jump around in it. With vfs_readahead the server reads
+  ahead of the sequential parts.
+*/
+static bool test_read_sequential(struct torture_context *torture,
+				 struct smb2_tree *tree)
+{
+	bool ret = true;
+	NTSTATUS status;
+	struct smb2_handle h;
+	uint8_t *buf;
+	const size_t len = SEQ_NUM_CHUNKS * SEQ_CHUNK;
+	const unsigned jumps[] = { 40, 0, 56, 8, 24 };
+	size_t i;
+	TALLOC_CTX *tmp_ctx = talloc_new(tree);
+
+	buf = talloc_array(tmp_ctx, uint8_t, len);
+	torture_assert_goto(torture, buf != NULL, ret, done, "talloc failed");
+	for (i=0; i<len; i++) {
+		buf[i] = (i + i / SEQ_CHUNK) & 0xff;
+	}
+
+	smb2_util_unlink(tree, FNAME);
+
+	status = torture_smb2_testfile(tree, FNAME, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	for (i=0; i<SEQ_NUM_CHUNKS; i++) {
+		status = smb2_util_write(tree, h, buf + i * SEQ_CHUNK,
+					 i * SEQ_CHUNK, SEQ_CHUNK);
+		CHECK_STATUS(status, NT_STATUS_OK);
+	}
+
+	for (i=0; i<SEQ_NUM_CHUNKS; i+=SEQ_OUTSTANDING) {
+		ret = read_chunks(torture, tree, h, buf, i);
+		torture_assert_goto(torture, ret, ret, done,
+				    "sequential read failed");
+	}
+
+	for (i=0; i<ARRAY_SIZE(jumps); i++) {
+		ret = read_chunks(torture, tree, h, buf, jumps[i]);
+		torture_assert_goto(torture, ret, ret, done,
+				    "random read failed");
+	}
+
+	status = smb2_util_close(tree, h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	smb2_util_unlink(tree, FNAME);
+
+done:
+	talloc_free(tmp_ctx);
+	return ret;
+}
+
 /* 
    basic testing of SMB2 read
 */
@@ -311,6 +418,7 @@ struct torture_suite *torture_smb2_read_init(TALLOC_CTX *ctx)
 	torture_suite_add_1smb2_test(suite, "position", test_read_position);
 	torture_suite_add_1smb2_test(suite, "dir", test_read_dir);
 	torture_suite_add_1smb2_test(suite, "access", test_read_access);
+	torture_suite_add_1smb2_test(suite, "sequential", test_read_sequential);
 
 	suite->description = talloc_strdup(suite, "SMB2-READ tests");
 
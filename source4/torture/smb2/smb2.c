@@ -163,6 +163,9 @@ NTSTATUS torture_smb2_init(TALLOC_CTX *ctx)
 	torture_suite_add_suite(suite,
 		torture_smb2_durable_v2_open_init(suite));
 	torture_suite_add_suite(suite, torture_smb2_dir_init(suite));
+	torture_suite_add_suite(suite, torture_smb2_dircache_init(suite));
+	torture_suite_add_suite(suite, torture_smb2_name_index_init(suite));
+	torture_suite_add_suite(suite, torture_smb2_write_gather_init(suite));
 	torture_suite_add_suite(suite, torture_smb2_lease_init(suite));
 	torture_suite_add_suite(suite, torture_smb2_compound_init(suite));
 	torture_suite_add_suite(suite, torture_smb2_compound_find_init(suite));
@@ -0,0 +1,413 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   test suite for smbd SMB2 write gathering
+
+   Copyright (C) Samba Team 2017
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * These tests expect a share with "aio write size = 1",
+ * "smbd:write gather size = 65536", "vfs objects = fake_dfq",
+ * "fake_dfq:file size limit = 1048576" and "fake_dfq:write delay = 50".
+ *
+ * All writes are sent before the first reply is read. The delay keeps
+ * the first one in flight until the others have arrived, so the server
+ * queues them and merges them. Overlapping writes have to end up in the
+ * order they were sent.
+ *
+ * They also have to pass with "fake_dfq:max write size = 4096" added.
+ * Then every merged pwrite comes back short and the server has to
+ * write the members again one by one.
+ */
+
+#include "includes.h"
+#include "libcli/smb2/smb2.h"
+#include "libcli/smb2/smb2_calls.h"
+#include "torture/torture.h"
+#include "torture/smb2/proto.h"
+
+#define FNAME "smb2_write_gather.dat"
+
+#define WRITE_GATHER_NUM 16
+#define WRITE_GATHER_LEN 1000
+#define WRITE_GATHER_LIMIT 1048576
+
+static bool write_gather_open(struct torture_context *tctx,
+			      struct smb2_tree *tree,
+			      struct smb2_handle *h)
+{
+	NTSTATUS status;
+
+	smb2_util_unlink(tree, FNAME);
+
+	status = torture_smb2_testfile(tree, FNAME, h);
+	torture_assert_ntstatus_ok(tctx, status,
+				   "torture_smb2_testfile failed");
+	return true;
+}
+
+/*
+ * Send WRITE_GATHER_NUM writes of WRITE_GATHER_LEN bytes, write i at
+ * start + i * step, filled with 'A' + i.
+ */
+static bool write_gather_send(struct torture_context *tctx,
+			      struct smb2_tree *tree,
+			      struct smb2_handle h,
+			      off_t start, off_t step,
+			      struct smb2_write *w,
+			      struct smb2_request **reqs)
+{
+	unsigned i;
+
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		ZERO_STRUCT(w[i]);
+		w[i].in.file.handle = h;
+		w[i].in.offset = start + i * step;
+		w[i].in.data = data_blob_talloc(tctx, NULL,
+						WRITE_GATHER_LEN);
+		torture_assert(tctx, w[i].in.data.data != NULL,
+			       "talloc failed");
+		memset(w[i].in.data.data, 'A' + i, WRITE_GATHER_LEN);
+
+		reqs[i] = smb2_write_send(tree, &w[i]);
+		torture_assert(tctx, reqs[i] != NULL,
+			       "smb2_write_send failed");
+	}
+	return true;
+}
+
+static bool write_gather_recv_all(struct torture_context *tctx,
+				  struct smb2_write *w,
+				  struct smb2_request **reqs)
+{
+	unsigned i;
+	bool ret = true;
+
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		NTSTATUS status = smb2_write_recv(reqs[i], &w[i]);
+
+		torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+			talloc_asprintf(tctx, "write %u failed", i));
+		torture_assert_int_equal_goto(tctx, w[i].out.nwritten,
+			WRITE_GATHER_LEN, ret, done,
+			talloc_asprintf(tctx, "write %u was short", i));
+	}
+done:
+	for (i=i+1; i<WRITE_GATHER_NUM; i++) {
+		smb2_write_recv(reqs[i], &w[i]);
+	}
+	return ret;
+}
+
+static bool write_gather_check(struct torture_context *tctx,
+			       struct smb2_tree *tree,
+			       struct smb2_handle h,
+			       off_t offset,
+			       const uint8_t *expected,
+			       size_t len)
+{
+	struct smb2_read r;
+	NTSTATUS status;
+	size_t i;
+
+	ZERO_STRUCT(r);
+	r.in.file.handle = h;
+	r.in.length = len;
+	r.in.offset = offset;
+	status = smb2_read(tree, tctx, &r);
+	torture_assert_ntstatus_ok(tctx, status, "smb2_read failed");
+	torture_assert_int_equal(tctx, r.out.data.length, len,
+				 "short read");
+
+	for (i=0; i<len; i++) {
+		if (r.out.data.data[i] != expected[i]) {
+			torture_fail(tctx, talloc_asprintf(
+				tctx, "offset %ju: got '%c', expected '%c'",
+				(uintmax_t)(offset + i),
+				r.out.data.data[i], expected[i]));
+		}
+	}
+	return true;
+}
+
+static bool test_write_gather_adjacent(struct torture_context *tctx,
+				       struct smb2_tree *tree)
+{
+	struct smb2_write w[WRITE_GATHER_NUM];
+	struct smb2_request *reqs[WRITE_GATHER_NUM];
+	const size_t len = WRITE_GATHER_NUM * WRITE_GATHER_LEN;
+	struct smb2_handle h = {{0}};
+	uint8_t *expected;
+	unsigned i;
+	bool ret = true;
+
+	ret = write_gather_open(tctx, tree, &h);
+	torture_assert(tctx, ret, "open failed");
+
+	ret = write_gather_send(tctx, tree, h, 0, WRITE_GATHER_LEN, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "send failed");
+	ret = write_gather_recv_all(tctx, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "write failed");
+
+	expected = talloc_array(tctx, uint8_t, len);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		memset(expected + i * WRITE_GATHER_LEN, 'A' + i,
+		       WRITE_GATHER_LEN);
+	}
+	ret = write_gather_check(tctx, tree, h, 0, expected, len);
+
+done:
+	smb2_util_close(tree, h);
+	smb2_util_unlink(tree, FNAME);
+	return ret;
+}
+
+/*
+ * Every write overlaps the second half of the one before. What's
+ * left of each is the first half, the last one is left completely.
+ */
+static bool test_write_gather_overlapping(struct torture_context *tctx,
+					  struct smb2_tree *tree)
+{
+	struct smb2_write w[WRITE_GATHER_NUM];
+	struct smb2_request *reqs[WRITE_GATHER_NUM];
+	const off_t step = WRITE_GATHER_LEN / 2;
+	const size_t len = (WRITE_GATHER_NUM - 1) * step + WRITE_GATHER_LEN;
+	struct smb2_handle h = {{0}};
+	uint8_t *expected;
+	unsigned i;
+	bool ret = true;
+
+	ret = write_gather_open(tctx, tree, &h);
+	torture_assert(tctx, ret, "open failed");
+
+	ret = write_gather_send(tctx, tree, h, 0, step, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "send failed");
+	ret = write_gather_recv_all(tctx, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "write failed");
+
+	expected = talloc_array(tctx, uint8_t, len);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		memset(expected + i * step, 'A' + i, WRITE_GATHER_LEN);
+	}
+	ret = write_gather_check(tctx, tree, h, 0, expected, len);
+
+done:
+	smb2_util_close(tree, h);
+	smb2_util_unlink(tree, FNAME);
+	return ret;
+}
+
+/*
+ * Adjacent writes running into the file size limit of the share. The
+ * merged pwrite comes back short, each write has to get its own
+ * result: complete below the limit, short across it, DISK_FULL
+ * beyond it.
+ */
+static bool test_write_gather_short(struct torture_context *tctx,
+				    struct smb2_tree *tree)
+{
+	struct smb2_write w[WRITE_GATHER_NUM];
+	struct smb2_request *reqs[WRITE_GATHER_NUM];
+	const unsigned num_complete = WRITE_GATHER_NUM / 2;
+	const size_t partial = WRITE_GATHER_LEN / 2;
+	const off_t start = WRITE_GATHER_LIMIT -
+		num_complete * WRITE_GATHER_LEN - partial;
+	const size_t len = num_complete * WRITE_GATHER_LEN + partial;
+	struct smb2_handle h = {{0}};
+	uint8_t *expected;
+	unsigned i;
+	bool ret = true;
+
+	ret = write_gather_open(tctx, tree, &h);
+	torture_assert(tctx, ret, "open failed");
+
+	ret = write_gather_send(tctx, tree, h, start, WRITE_GATHER_LEN,
+				w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "send failed");
+
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		NTSTATUS status = smb2_write_recv(reqs[i], &w[i]);
+		reqs[i] = NULL;
+
+		if (i > num_complete) {
+			torture_assert_ntstatus_equal_goto(tctx, status,
+				NT_STATUS_DISK_FULL, ret, done,
+				talloc_asprintf(tctx, "write %u", i));
+			continue;
+		}
+		torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+			talloc_asprintf(tctx, "write %u failed", i));
+		torture_assert_int_equal_goto(tctx, w[i].out.nwritten,
+			(i < num_complete) ? WRITE_GATHER_LEN : partial,
+			ret, done,
+			talloc_asprintf(tctx, "write %u", i));
+	}
+
+	expected = talloc_array(tctx, uint8_t, len);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	for (i=0; i<=num_complete; i++) {
+		memset(expected + i * WRITE_GATHER_LEN, 'A' + i,
+		       MIN(WRITE_GATHER_LEN, len - i * WRITE_GATHER_LEN));
+	}
+	ret = write_gather_check(tctx, tree, h, start, expected, len);
+
+done:
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		if (reqs[i] != NULL) {
+			smb2_write_recv(reqs[i], &w[i]);
+		}
+	}
+	smb2_util_close(tree, h);
+	smb2_util_unlink(tree, FNAME);
+	return ret;
+}
+
+/*
+ * A flush sent right behind a batch of writes
+ */
+static bool test_write_gather_flush(struct torture_context *tctx,
+				    struct smb2_tree *tree)
+{
+	struct smb2_write w[WRITE_GATHER_NUM];
+	struct smb2_request *reqs[WRITE_GATHER_NUM];
+	const size_t len = WRITE_GATHER_NUM * WRITE_GATHER_LEN;
+	struct smb2_handle h = {{0}};
+	struct smb2_request *freq = NULL;
+	struct smb2_flush f;
+	uint8_t *expected;
+	NTSTATUS status;
+	unsigned i;
+	bool ret = true;
+
+	ret = write_gather_open(tctx, tree, &h);
+	torture_assert(tctx, ret, "open failed");
+
+	ret = write_gather_send(tctx, tree, h, 0, WRITE_GATHER_LEN, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "send failed");
+
+	ZERO_STRUCT(f);
+	f.in.file.handle = h;
+	freq = smb2_flush_send(tree, &f);
+	torture_assert_goto(tctx, freq != NULL, ret, done,
+			    "smb2_flush_send failed");
+
+	ret = write_gather_recv_all(tctx, w, reqs);
+	status = smb2_flush_recv(freq, &f);
+	torture_assert_goto(tctx, ret, ret, done, "write failed");
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"flush failed");
+
+	expected = talloc_array(tctx, uint8_t, len);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		memset(expected + i * WRITE_GATHER_LEN, 'A' + i,
+		       WRITE_GATHER_LEN);
+	}
+	ret = write_gather_check(tctx, tree, h, 0, expected, len);
+
+done:
+	smb2_util_close(tree, h);
+	smb2_util_unlink(tree, FNAME);
+	return ret;
+}
+
+/*
+ * A close sent right behind a batch of writes. It may only be
+ * answered once all of them are written.
+ */
+static bool test_write_gather_close(struct torture_context *tctx,
+				    struct smb2_tree *tree)
+{
+	struct smb2_write w[WRITE_GATHER_NUM];
+	struct smb2_request *reqs[WRITE_GATHER_NUM];
+	const size_t len = WRITE_GATHER_NUM * WRITE_GATHER_LEN;
+	struct smb2_handle h = {{0}};
+	struct smb2_request *creq = NULL;
+	struct smb2_close c;
+	uint8_t *expected;
+	NTSTATUS status;
+	unsigned i;
+	bool ret = true;
+
+	ret = write_gather_open(tctx, tree, &h);
+	torture_assert(tctx, ret, "open failed");
+
+	ret = write_gather_send(tctx, tree, h, 0, WRITE_GATHER_LEN, w, reqs);
+	torture_assert_goto(tctx, ret, ret, done, "send failed");
+
+	ZERO_STRUCT(c);
+	c.in.file.handle = h;
+	c.in.flags = SMB2_CLOSE_FLAGS_FULL_INFORMATION;
+	creq = smb2_close_send(tree, &c);
+	torture_assert_goto(tctx, creq != NULL, ret, done,
+			    "smb2_close_send failed");
+
+	ret = write_gather_recv_all(tctx, w, reqs);
+	status = smb2_close_recv(creq, &c);
+	ZERO_STRUCT(h);
+	torture_assert_goto(tctx, ret, ret, done, "write failed");
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"close failed");
+	torture_assert_int_equal_goto(tctx, c.out.size, len, ret, done,
+				      "wrong size at close");
+
+	status = torture_smb2_testfile(tree, FNAME, &h);
+	torture_assert_ntstatus_ok_goto(tctx, status, ret, done,
+					"reopen failed");
+
+	expected = talloc_array(tctx, uint8_t, len);
+	torture_assert_goto(tctx, expected != NULL, ret, done,
+			    "talloc failed");
+	for (i=0; i<WRITE_GATHER_NUM; i++) {
+		memset(expected + i * WRITE_GATHER_LEN, 'A' + i,
+		       WRITE_GATHER_LEN);
+	}
+	ret = write_gather_check(tctx, tree, h, 0, expected, len);
+
+done:
+	if (!smb2_util_handle_empty(h)) {
+		smb2_util_close(tree, h);
+	}
+	smb2_util_unlink(tree, FNAME);
+	return ret;
+}
+
+struct torture_suite *torture_smb2_write_gather_init(TALLOC_CTX *ctx)
+{
+	struct torture_suite *suite = torture_suite_create(ctx,
+							   "write-gather");
+
+	torture_suite_add_1smb2_test(suite, "adjacent",
+				     test_write_gather_adjacent);
+	torture_suite_add_1smb2_test(suite, "overlapping",
+				     test_write_gather_overlapping);
+	torture_suite_add_1smb2_test(suite, "short", test_write_gather_short);
+	torture_suite_add_1smb2_test(suite, "flush", test_write_gather_flush);
+	torture_suite_add_1smb2_test(suite, "close", test_write_gather_close);
+
+	suite->description = talloc_strdup(suite,
+		"smbd SMB2 write gathering tests");
+
+	return suite;
+}